@@ -1,2 +1,13 @@
 #!/bin/sh
-g++ -Wall -g -o logtest logtest.cpp -std=gnu++11 -lboost_log -lpthread -lboost_thread
+g++ -Wall -O2 -o logtest logtest.cpp ../udptoserial/Log.cpp ../libhorizr/event_log.cpp -std=gnu++17 -DBOOST_ALL_DYN_LINK -lboost_log -lpthread -lboost_thread
+g++ -Wall -O2 -o logdecode logdecode.cpp ../libhorizr/event_log.cpp -std=gnu++17
+g++ -Wall -O2 -o flow_table_bench flow_table_bench.cpp -std=gnu++11
+g++ -Wall -O2 -o input_queue_bench input_queue_bench.cpp ../udptoserial/input_queue.cpp ../libhorizr/slip.cpp ../libhorizr/packet.cpp -std=gnu++11
+gcc -Wall -O2 -o uring_bench uring_bench.c ../udptoserial/uring.c ../udptoserial/queue.c ../udptoserial/serial.c ../udptoserial/serial_tune.c ../udptoserial/parser.c ../udptoserial/base64.c -I../udptoserial -std=gnu11 -lpthread
+gcc -Wall -O2 -c -o serial_tune.o ../udptoserial/serial_tune.c
+gcc -Wall -O2 -c -o uring.o ../udptoserial/uring.c -std=gnu11
+g++ -Wall -O2 -o tcp_proxy_bench tcp_proxy_bench.cpp ../udptoserial/Serial_writer.cpp ../udptoserial/Rate_controller.cpp ../udptoserial/Stream_mux.cpp ../udptoserial/Tcp_mux_handler.cpp ../udptoserial/Tcp_server_handler.cpp ../udptoserial/Tcp_client_handler.cpp ../udptoserial/Log.cpp ../udptoserial/Metrics.cpp ../udptoserial/Uring_io.cpp serial_tune.o uring.o ../libhorizr/slip.cpp ../libhorizr/link.cpp ../libhorizr/mux.cpp ../libhorizr/packet.cpp ../libhorizr/event_log.cpp ../libhorizr/metrics.cpp ../libhorizr/capture.cpp -std=gnu++17 -DBOOST_ALL_DYN_LINK -lboost_log -lboost_system -lboost_thread -lpthread -lutil
+g++ -Wall -O2 -o tcp_conn_bench tcp_conn_bench.cpp ../udptoserial/Serial_writer.cpp ../udptoserial/Rate_controller.cpp ../udptoserial/Stream_mux.cpp ../udptoserial/Tcp_mux_handler.cpp ../udptoserial/Tcp_server_handler.cpp ../udptoserial/Tcp_client_handler.cpp ../udptoserial/Log.cpp ../udptoserial/Metrics.cpp ../udptoserial/Uring_io.cpp serial_tune.o uring.o ../libhorizr/slip.cpp ../libhorizr/link.cpp ../libhorizr/mux.cpp ../libhorizr/packet.cpp ../libhorizr/event_log.cpp ../libhorizr/metrics.cpp ../libhorizr/capture.cpp -std=gnu++17 -DBOOST_ALL_DYN_LINK -lboost_log -lboost_system -lboost_thread -lpthread -lutil
+g++ -Wall -O2 -o link_emulator link_emulator.cpp -std=gnu++11 -lutil
+g++ -Wall -O2 -o link_load link_load.cpp -std=gnu++11 -lpthread
+g++ -Wall -O2 -o udp_uring_bench udp_uring_bench.cpp ../udptoserial/Udp_ports.cpp ../udptoserial/Uring_io.cpp ../udptoserial/Serial_writer.cpp ../udptoserial/Rate_controller.cpp ../udptoserial/Log.cpp ../udptoserial/Metrics.cpp serial_tune.o uring.o ../libhorizr/slip.cpp ../libhorizr/link.cpp ../libhorizr/packet.cpp ../libhorizr/event_log.cpp ../libhorizr/metrics.cpp ../libhorizr/capture.cpp -std=gnu++17 -DBOOST_ALL_DYN_LINK -lboost_log -lboost_system -lboost_thread -lpthread -lutil -ldl
@@ -0,0 +1,136 @@
+// Benchmark flow table lookups with 100k flows, against the std::map
+// and std::unordered_map that it replaces.
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "../libhorizr/flow_table.h"
+
+const size_t FLOWS = 100000;
+const size_t LOOKUPS = 10000000;
+
+struct key_less
+{
+	bool operator()(const flow_key& a, const flow_key& b) const
+	{
+		return a.addrs < b.addrs || (a.addrs == b.addrs && a.ports < b.ports);
+	}
+};
+
+struct key_hash
+{
+	size_t operator()(const flow_key& k) const { return flow_key_hash(k); }
+};
+
+// A flow's value is about the size of what the stream mux keeps.
+struct value
+{
+	void *p[4];
+};
+
+static double ns_per(std::chrono::steady_clock::time_point start, size_t n)
+{
+	auto d = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(d).count() / n;
+}
+
+int main()
+{
+	std::mt19937 rng(12345);
+	std::vector<flow_key> keys;
+	std::vector<flow_key> misses;
+	for (size_t i = 0; i < FLOWS; i++)
+	{
+		// Clients on a /16, all talking to a few servers.
+		uint32_t client = 0x0A000000 | (rng() & 0xFFFF);
+		uint16_t port = 1024 + rng() % 60000;
+		keys.push_back(flow_key_make(client, port, 0xC0A80101, 80 + rng() % 4));
+		misses.push_back(flow_key_make(client, port, 0xC0A80102, 80));
+	}
+	std::vector<uint32_t> order(LOOKUPS);
+	for (auto& o : order)
+		o = rng() % FLOWS;
+
+	flow_table<value> table(FLOWS);
+	std::map<flow_key, value, key_less> ordered;
+	std::unordered_map<flow_key, value, key_hash> unordered;
+
+	auto t = std::chrono::steady_clock::now();
+	for (auto& k : keys)
+		if (table.find(k) == FLOW_NIL)
+			table.insert(k, value{}, 300, 0);
+	printf("flow_table      insert %6.1f ns\n", ns_per(t, FLOWS));
+	t = std::chrono::steady_clock::now();
+	for (auto& k : keys)
+		ordered.emplace(k, value{});
+	printf("std::map        insert %6.1f ns\n", ns_per(t, FLOWS));
+	t = std::chrono::steady_clock::now();
+	for (auto& k : keys)
+		unordered.emplace(k, value{});
+	printf("unordered_map   insert %6.1f ns\n", ns_per(t, FLOWS));
+
+	size_t found = 0;
+	t = std::chrono::steady_clock::now();
+	for (auto o : order)
+	{
+		uint32_t h = table.find(keys[o]);
+		if (h != FLOW_NIL)
+		{
+			table.touch(h, 1);
+			found++;
+		}
+	}
+	printf("flow_table      hit    %6.1f ns (with touch)\n", ns_per(t, LOOKUPS));
+	t = std::chrono::steady_clock::now();
+	for (auto o : order)
+		found += ordered.count(keys[o]);
+	printf("std::map        hit    %6.1f ns\n", ns_per(t, LOOKUPS));
+	t = std::chrono::steady_clock::now();
+	for (auto o : order)
+		found += unordered.count(keys[o]);
+	printf("unordered_map   hit    %6.1f ns\n", ns_per(t, LOOKUPS));
+
+	t = std::chrono::steady_clock::now();
+	for (auto o : order)
+		found += table.find(misses[o]) != FLOW_NIL;
+	printf("flow_table      miss   %6.1f ns\n", ns_per(t, LOOKUPS));
+	t = std::chrono::steady_clock::now();
+	for (auto o : order)
+		found += ordered.count(misses[o]);
+	printf("std::map        miss   %6.1f ns\n", ns_per(t, LOOKUPS));
+	t = std::chrono::steady_clock::now();
+	for (auto o : order)
+		found += unordered.count(misses[o]);
+	printf("unordered_map   miss   %6.1f ns\n", ns_per(t, LOOKUPS));
+
+	// Churn: a full table where every new flow evicts the oldest one.
+	t = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < FLOWS; i++)
+	{
+		if (table.find(misses[i]) != FLOW_NIL)
+			continue;
+		table.erase(table.lru());
+		table.insert(misses[i], value{}, 300, 2);
+	}
+	printf("flow_table      evict+insert %6.1f ns\n", ns_per(t, FLOWS));
+
+	// Idle expiry: half the flows are active, the rest time out.
+	for (size_t i = 0; i < FLOWS; i += 2)
+	{
+		uint32_t h = table.find(misses[i]);
+		if (h != FLOW_NIL)
+			table.touch(h, 200);
+	}
+	std::vector<std::pair<flow_key, value>> expired;
+	t = std::chrono::steady_clock::now();
+	for (uint32_t now = 3; now <= 303; now++)
+		table.expire(now, expired);
+	printf("flow_table      expire %6.1f ns per flow, %zu expired, %zu left\n",
+		ns_per(t, FLOWS), expired.size(), table.size());
+
+	printf("(%zu found)\n", found);
+	return 0;
+}
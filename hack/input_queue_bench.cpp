@@ -0,0 +1,112 @@
+// Benchmark input_queue with bursts of 10k packets, against the vectors
+// that it replaces, which erased from the front for every packet.  Also
+// check what each overflow policy keeps when a burst won't fit.
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "../udptoserial/input_queue.h"
+
+const size_t BURST = 10000;
+const size_t ROUNDS = 5;
+
+static double ns_per(std::chrono::steady_clock::time_point start, size_t n)
+{
+	auto d = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(d).count() / n;
+}
+
+// The old queue: append, then decode one frame at a time, erasing it
+// from the front of the bytes, and copy packets out of the front too.
+class vector_queue
+{
+public:
+	void push_bytes(const uint8_t *input, size_t len)
+	{
+		raw.insert(raw.end(), input, input + len);
+		for (;;)
+		{
+			uint8_t frame[2048];
+			struct slip_decoder dec;
+			slip_decoder_init(dec, frame, sizeof(frame));
+			bool complete;
+			size_t used = slip_decoder_feed(dec, raw.data(), raw.size(), complete);
+			if (!complete)
+				break;
+			raw.erase(raw.begin(), raw.begin() + used);
+			if (dec.len > 0)
+				packets.push_back(std::vector<uint8_t>(frame, frame + dec.len));
+		}
+	}
+	bool is_packet_available() { return packets.size() > 0; }
+	std::vector<uint8_t> pop_packet()
+	{
+		std::vector<uint8_t> p = packets[0];
+		packets.erase(packets.begin(), packets.begin() + 1);
+		return p;
+	}
+
+private:
+	std::vector<uint8_t> raw;
+	std::vector<std::vector<uint8_t>> packets;
+};
+
+int main()
+{
+	// A burst as it comes off the wire: frames of 20 to 1200 bytes in
+	// reads of 4 KiB.
+	std::vector<uint8_t> wire;
+	size_t payload = 0;
+	for (size_t i = 0; i < BURST; i++)
+	{
+		std::vector<uint8_t> msg(20 + (i * 37) % 1180, (uint8_t)i);
+		slip_encode(wire, msg, i == 0);
+		payload += msg.size();
+	}
+	const size_t READ = 4096;
+	printf("burst of %zu packets, %zu bytes on the wire\n", BURST, wire.size());
+
+	packet_pool pool(2048, 32, 256);
+	size_t got = 0;
+	auto t = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < ROUNDS; r++)
+	{
+		input_queue q(pool, wire.size(), BURST);
+		for (size_t off = 0; off < wire.size(); off += READ)
+			q.push_bytes(&wire[off], std::min(READ, wire.size() - off));
+		while (q.is_packet_available())
+			got += q.pop_packet().size();
+	}
+	printf("input_queue     %8.1f ns per packet\n", ns_per(t, BURST * ROUNDS));
+
+	t = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < ROUNDS; r++)
+	{
+		vector_queue q;
+		for (size_t off = 0; off < wire.size(); off += READ)
+			q.push_bytes(&wire[off], std::min(READ, wire.size() - off));
+		while (q.is_packet_available())
+			got += q.pop_packet().size();
+	}
+	printf("vector queue    %8.1f ns per packet\n", ns_per(t, BURST * ROUNDS));
+	if (got != 2 * ROUNDS * payload)
+		printf("lost bytes: %zu of %zu\n", 2 * ROUNDS * payload - got, 2 * ROUNDS * payload);
+
+	// Overflow: room for a tenth of the burst, and nobody popping.
+	for (auto policy : { input_queue::Overflow::DROP_NEWEST, input_queue::Overflow::DROP_OLDEST })
+	{
+		input_queue q(pool, 64 * 1024, BURST / 10, policy);
+		for (size_t off = 0; off < wire.size(); off += READ)
+			q.push_bytes(&wire[off], std::min(READ, wire.size() - off));
+		const input_queue::Counters& c = q.counters();
+		q.move_bytes_to_packets();
+		size_t first = q.is_packet_available() ? q.pop_packet().data()[0] : 0;
+		printf("%s: %zu packets queued (first 0x%02zx), %zu bytes queued, "
+			"%llu bytes dropped, %llu packets dropped, %zu buffers in use\n",
+			policy == input_queue::Overflow::DROP_NEWEST ? "drop newest" : "drop oldest",
+			q.packets_queued() + 1, first, q.bytes_queued(),
+			(unsigned long long)c.bytes_dropped, (unsigned long long)c.packets_dropped,
+			pool.in_use());
+	}
+	return 0;
+}
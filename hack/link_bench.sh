@@ -0,0 +1,76 @@
+#!/bin/sh
+# Benchmark udptoserial end to end on one machine: both ends run over
+# link_emulator, the far end in a network namespace of its own, with
+# link_load serving behind it, and each of link_load's standard profiles
+# is run through the near end.  What the emulator did to the bytes is
+# printed last.
+#
+# usage: link_bench.sh [baud [seconds [link_emulator options...]]]
+#
+# for instance, at 9600 baud with 50 ms each way and a burst of noise
+# every 10 seconds:
+#
+#   sh link_bench.sh 9600 20 -l 50 -b 0.1
+#
+# Build link_emulator and link_load with build.sh first.  udptoserial is
+# taken from ../udptoserial, or from $UDPTOSERIAL.  unshare -rn needs
+# unprivileged user namespaces, or root.
+
+set -e
+baud=${1:-115200}
+seconds=${2:-10}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+hack=$(cd "$(dirname "$0")" && pwd)
+udptoserial=${UDPTOSERIAL:-$hack/../udptoserial/udptoserial}
+dir=$(mktemp -d)
+mkdir "$dir/near" "$dir/far"
+
+cleanup()
+{
+	[ -f "$dir/far/load.pid" ] && kill $(cat "$dir/far/load.pid") 2>/dev/null
+	kill $near $far $emulator 2>/dev/null
+	wait $emulator 2>/dev/null
+	cat "$dir/emulator.log"
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+"$hack/link_emulator" -r "$baud" "$@" "$dir/near.tty" "$dir/far.tty" > "$dir/emulator.log" &
+emulator=$!
+while [ ! -e "$dir/far.tty" ]; do sleep 0.1; done
+
+# The far end's own ports are out of the way of link_load's, which it
+# connects to for the near end's clients.
+for end in near far; do
+	if [ $end = near ]; then ports="port1 = 4000
+port2 = 4001"; else ports="port1 = 4100
+port2 = 4101"; fi
+	cat > "$dir/$end/udptoserial.ini" <<EOF
+[network]
+remote_ip = 127.0.0.1
+[serial port]
+name = $dir/$end.tty
+baudrate = $baud
+[udp ports]
+$ports
+[log]
+level = warning
+EOF
+done
+
+(cd "$dir/far" && exec unshare -rn sh -c '
+	ip link set lo up
+	"$1" serve & echo $! > load.pid
+	exec "$2" > udptoserial.log 2>&1' - "$hack/link_load" "$udptoserial") &
+far=$!
+(cd "$dir/near" && exec "$udptoserial" > udptoserial.log 2>&1) &
+near=$!
+# Time for the two ends to find each other, and pacing to settle.
+sleep 3
+
+echo "$baud baud, $seconds s per profile${*:+, link_emulator $*}"
+for profile in bulk interactive udp mixed; do
+	"$hack/link_load" $profile "$baud" "$seconds"
+done
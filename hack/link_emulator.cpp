@@ -0,0 +1,378 @@
+// A serial link between two pseudo-terminals, so that both ends of
+// udptoserial, or of halfduplex, can run on one machine.  Each end opens
+// the pty it is given as if it were a serial port, and bytes written at
+// one end come out at the other as they would have over a cable and a
+// pair of modems:
+//
+// - at the baud rate, one character time, 10 bits at 8N1, per byte;
+// - LATENCY milliseconds after they finish going out;
+// - with bits flipped at random, at BER, and in bursts, BURSTS times a
+//   second on average, in which each bit is wrong half the time for
+//   BURST_BITS bits on average.  A start or stop bit that is wrong loses
+//   the byte, as a framing error would;
+// - through a modem buffer of BUFFER bytes, waiting for the line.  What
+//   doesn't fit is lost, unless -F, when the sender is held up instead,
+//   as RTS/CTS would;
+// - and with -h, over a half-duplex line: an end that starts sending
+//   waits TURNAROUND milliseconds first, for its driver, and a byte on
+//   the line while the other end is sending collides, both being garbled.
+//
+// The two ptys are reached through symlinks at NEAR and FAR, which stay
+// open across the ends coming and going.  What happened to the bytes
+// each way is printed on SIGINT or SIGTERM.
+//
+// usage: link_emulator [-r baud] [-l latency] [-e ber] [-b bursts]
+//          [-B burst_bits] [-m buffer] [-F] [-h turnaround] [-s seed]
+//          NEAR FAR
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Start, 8 data bits, stop.
+const static unsigned BITS_PER_CHAR = 10;
+
+// In a burst of noise, each bit is as likely to be wrong as right.
+const static double BURST_BER = 0.5;
+
+const static size_t READ_SIZE = 4096;
+
+struct Options
+{
+	unsigned baud = 115200;
+	uint64_t latency = 0;
+	double ber = 0;
+	double bursts = 0;
+	double burst_bits = 100;
+	size_t buffer = 4096;
+	bool flow_control = false;
+	bool half_duplex = false;
+	uint64_t turnaround = 0;
+	unsigned seed = 1;
+};
+
+struct Stats
+{
+	uint64_t in = 0;
+	uint64_t out = 0;
+	uint64_t overflowed = 0;
+	uint64_t corrupted = 0;
+	uint64_t framing = 0;
+	uint64_t collided = 0;
+};
+
+// A byte on its way down the line.
+struct Wire_byte
+{
+	uint64_t end;
+	uint64_t arrive;
+	uint8_t byte;
+	bool collided;
+};
+
+// One way along the link, from the pty that FROM is the master of to the
+// one that TO is.
+struct Direction
+{
+	const char *name;
+	int from;
+	int to;
+	std::deque<uint8_t> buffer;
+	std::deque<Wire_byte> wire;
+	std::vector<uint8_t> out;
+	// When the line is next free for another byte, and, while sending,
+	// when the first byte of this burst started.
+	uint64_t free_at = 0;
+	uint64_t burst_start = 0;
+	bool sending = false;
+	uint64_t burst_bits_left = 0;
+	Stats stats;
+};
+
+static Options opt_;
+static uint64_t char_ns_;
+static double burst_p_;
+static std::mt19937_64 rng_;
+static std::uniform_real_distribution<double> uniform_(0.0, 1.0);
+static volatile sig_atomic_t stop_ = 0;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stop_handler(int)
+{
+	stop_ = 1;
+}
+
+// Open a pty pair for one end, with the slave raw and linked to from
+// PATH.  The slave is kept open, so that the master never sees the end
+// go away.
+static int open_end(const char *path)
+{
+	int master, slave;
+	struct termios tio;
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+	{
+		perror("openpty");
+		exit(1);
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	unlink(path);
+	if (symlink(ttyname(slave), path) < 0)
+	{
+		fprintf(stderr, "can't link %s to %s: %s\n", path, ttyname(slave), strerror(errno));
+		exit(1);
+	}
+	return master;
+}
+
+// Given a byte going down the line in D, pass each of its bits through
+// the noise.  Returns false if the start or stop bit was hit, and the
+// byte is lost.
+static bool add_noise(Direction& d, uint8_t& byte)
+{
+	if (opt_.ber == 0 && burst_p_ == 0)
+		return true;
+	uint8_t was = byte;
+	bool framed = true;
+	for (unsigned bit = 0; bit < BITS_PER_CHAR; bit++)
+	{
+		bool wrong;
+		if (d.burst_bits_left > 0)
+		{
+			d.burst_bits_left--;
+			wrong = uniform_(rng_) < BURST_BER;
+		}
+		else
+		{
+			if (burst_p_ > 0 && uniform_(rng_) < burst_p_)
+				d.burst_bits_left = std::geometric_distribution<uint64_t>(1.0 / opt_.burst_bits)(rng_) + 1;
+			wrong = opt_.ber > 0 && uniform_(rng_) < opt_.ber;
+		}
+		if (!wrong)
+			continue;
+		if (bit == 0 || bit == BITS_PER_CHAR - 1)
+			framed = false;
+		else
+			byte ^= 1 << (bit - 1);
+	}
+	if (!framed)
+		d.stats.framing++;
+	else if (byte != was)
+		d.stats.corrupted++;
+	return framed;
+}
+
+static void read_in(Direction& d)
+{
+	uint8_t buf[READ_SIZE];
+	size_t want = READ_SIZE;
+	if (opt_.flow_control)
+		want = std::min(want, opt_.buffer - d.buffer.size());
+	if (want == 0)
+		return;
+	ssize_t n = read(d.from, buf, want);
+	if (n <= 0)
+		return;
+	d.stats.in += n;
+	size_t room = opt_.buffer - std::min(opt_.buffer, d.buffer.size());
+	size_t keep = std::min((size_t)n, room);
+	d.buffer.insert(d.buffer.end(), buf, buf + keep);
+	d.stats.overflowed += n - keep;
+}
+
+// Put whatever of D's buffer the line has had time for onto it, as of
+// NOW.  Returns when the next byte can go, or 0 if there is none.
+static uint64_t send_out(Direction& d, Direction& other, uint64_t now)
+{
+	if (d.sending && d.buffer.empty() && d.free_at <= now)
+		d.sending = false;
+	while (!d.buffer.empty())
+	{
+		if (!d.sending)
+		{
+			d.sending = true;
+			d.burst_start = std::max(now, d.free_at) + (opt_.half_duplex ? opt_.turnaround : 0);
+			d.free_at = d.burst_start;
+		}
+		uint64_t start = d.free_at;
+		if (start > now)
+			return start;
+		uint64_t end = start + char_ns_;
+		d.free_at = end;
+		uint8_t byte = d.buffer.front();
+		d.buffer.pop_front();
+		if (!add_noise(d, byte))
+			continue;
+
+		Wire_byte w{ end, end + opt_.latency, byte, false };
+		if (opt_.half_duplex && other.sending && other.burst_start < end && start < other.free_at)
+		{
+			w.collided = true;
+			for (auto it = other.wire.rbegin(); it != other.wire.rend() && it->end > start; ++it)
+			{
+				if (!it->collided)
+				{
+					it->collided = true;
+					it->byte ^= (uint8_t)(rng_() | 1);
+					other.stats.collided++;
+				}
+			}
+			w.byte ^= (uint8_t)(rng_() | 1);
+			d.stats.collided++;
+		}
+		d.wire.push_back(w);
+	}
+	return 0;
+}
+
+// Hand the far end whatever has come down the line by NOW.  Returns when
+// the next byte arrives, or 0 if none is on the way.
+static uint64_t deliver(Direction& d, uint64_t now)
+{
+	while (!d.wire.empty() && d.wire.front().arrive <= now)
+	{
+		d.out.push_back(d.wire.front().byte);
+		d.wire.pop_front();
+	}
+	if (!d.out.empty())
+	{
+		ssize_t n = write(d.to, d.out.data(), d.out.size());
+		if (n > 0)
+		{
+			d.out.erase(d.out.begin(), d.out.begin() + n);
+			d.stats.out += n;
+		}
+	}
+	return d.wire.empty() ? 0 : d.wire.front().arrive;
+}
+
+static void print_stats(const Direction& d)
+{
+	printf("%s: %llu bytes in, %llu out, %llu lost to a full buffer, %llu corrupted, "
+		"%llu lost to framing errors, %llu collided\n", d.name,
+		(unsigned long long)d.stats.in, (unsigned long long)d.stats.out,
+		(unsigned long long)d.stats.overflowed, (unsigned long long)d.stats.corrupted,
+		(unsigned long long)d.stats.framing, (unsigned long long)d.stats.collided);
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: link_emulator [-r baud] [-l latency] [-e ber] [-b bursts]\n"
+		"         [-B burst_bits] [-m buffer] [-F] [-h turnaround] [-s seed] NEAR FAR\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "r:l:e:b:B:m:Fh:s:")) != -1)
+	{
+		switch (c)
+		{
+		case 'r': opt_.baud = atoi(optarg); break;
+		case 'l': opt_.latency = (uint64_t)(atof(optarg) * 1e6); break;
+		case 'e': opt_.ber = atof(optarg); break;
+		case 'b': opt_.bursts = atof(optarg); break;
+		case 'B': opt_.burst_bits = atof(optarg); break;
+		case 'm': opt_.buffer = atol(optarg); break;
+		case 'F': opt_.flow_control = true; break;
+		case 'h': opt_.half_duplex = true; opt_.turnaround = (uint64_t)(atof(optarg) * 1e6); break;
+		case 's': opt_.seed = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (argc - optind != 2 || opt_.baud == 0 || opt_.buffer == 0 || opt_.burst_bits < 1)
+		usage();
+	char_ns_ = 1000000000ull * BITS_PER_CHAR / opt_.baud;
+	burst_p_ = opt_.bursts / opt_.baud;
+	rng_.seed(opt_.seed);
+
+	Direction ab, ba;
+	int near = open_end(argv[optind]);
+	int far = open_end(argv[optind + 1]);
+	ab.name = "near to far";
+	ab.from = ba.to = near;
+	ba.name = "far to near";
+	ba.from = ab.to = far;
+	Direction *dirs[2] = { &ab, &ba };
+
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!stop_)
+	{
+		uint64_t now = now_ns();
+		uint64_t next = UINT64_MAX;
+		struct pollfd fds[2];
+		for (int i = 0; i < 2; i++)
+		{
+			Direction& d = *dirs[i];
+			uint64_t t = send_out(d, *dirs[1 - i], now);
+			if (t != 0)
+				next = std::min(next, t);
+			t = deliver(d, now);
+			if (t != 0)
+				next = std::min(next, t);
+		}
+		// Each pty's master is read for one direction and written for
+		// the other.
+		for (int i = 0; i < 2; i++)
+		{
+			Direction& d = *dirs[i];
+			Direction& back = *dirs[1 - i];
+			fds[i].fd = d.from;
+			fds[i].events = 0;
+			if (!opt_.flow_control || d.buffer.size() < opt_.buffer)
+				fds[i].events |= POLLIN;
+			if (!back.out.empty())
+				fds[i].events |= POLLOUT;
+		}
+
+		struct timespec ts, *timeout = NULL;
+		if (next != UINT64_MAX)
+		{
+			uint64_t wait = next > now ? next - now : 0;
+			ts.tv_sec = wait / 1000000000;
+			ts.tv_nsec = wait % 1000000000;
+			timeout = &ts;
+		}
+		if (ppoll(fds, 2, timeout, NULL) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("ppoll");
+			return 1;
+		}
+		for (int i = 0; i < 2; i++)
+			if (fds[i].revents & POLLIN)
+				read_in(*dirs[i]);
+	}
+
+	unlink(argv[optind]);
+	unlink(argv[optind + 1]);
+	print_stats(ab);
+	print_stats(ba);
+	return 0;
+}
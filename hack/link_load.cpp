@@ -0,0 +1,388 @@
+// Traffic for benchmarking a link end to end, through udptoserial at
+// both ends.  On the far side,
+//
+//   link_load serve
+//
+// echoes TCP and UDP on ECHO_PORT, and on SINK_PORT reads a TCP
+// connection to its end and answers with how many bytes that was.  On
+// the near side,
+//
+//   link_load PROFILE BAUD [SECONDS]
+//
+// runs one of the standard profiles through the near end for about
+// SECONDS, sized for a link running at BAUD, and prints a line of
+// results: bytes delivered and how fast, round trip percentiles, and how
+// much was lost.  The profiles are
+//
+//   bulk         one TCP connection sending as fast as the link allows,
+//                to the sink, for throughput;
+//   interactive  small TCP requests echoed one at a time, for latency;
+//   udp          small UDP datagrams at a steady rate, for latency and
+//                loss;
+//   mixed        bulk and interactive at once, for latency under load.
+//
+// hack/link_bench.sh runs them all over link_emulator.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const static uint16_t ECHO_PORT = 4000;
+const static uint16_t SINK_PORT = 4001;
+
+// A UART sends 10 bits per byte at 8N1.
+const static uint32_t BITS_PER_BYTE = 10;
+
+// Interactive requests and UDP datagrams.
+const static size_t REQUEST_SIZE = 64;
+const static size_t DATAGRAM_SIZE = 128;
+
+// UDP uses no more than this share of the link, and sends no more than
+// MAX_DATAGRAM_RATE a second.
+const static double UDP_LINK_SHARE = 0.2;
+const static double MAX_DATAGRAM_RATE = 50;
+
+// A reply that takes longer than this is given up on, and what is still
+// on its way when a profile ends gets this long to arrive.
+const static auto REPLY_TIMEOUT = std::chrono::seconds(5);
+
+// The bulk sender's socket buffer is kept small, so that it stops
+// sending about when the link stops taking data, not megabytes later.
+const static int BULK_SNDBUF = 16 * 1024;
+
+typedef std::chrono::steady_clock Clock;
+
+// What a profile measured.
+struct Result
+{
+	uint64_t bytes = 0;
+	double seconds = 0;
+	std::vector<double> rtt_ms;
+	uint64_t sent = 0;
+	uint64_t lost = 0;
+	// What SENT and LOST count.
+	const char *unit = "";
+};
+
+static sockaddr_in loopback(uint16_t port)
+{
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	return sin;
+}
+
+static int tcp_connect(uint16_t port, int sndbuf = 0)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sndbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	sockaddr_in sin = loopback(port);
+	if (connect(fd, (sockaddr *)&sin, sizeof(sin)) < 0)
+	{
+		perror("connect");
+		exit(1);
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int listen_on(uint16_t port, int type)
+{
+	int fd = socket(AF_INET, type, 0);
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in sin = loopback(port);
+	if (bind(fd, (sockaddr *)&sin, sizeof(sin)) < 0 || (type == SOCK_STREAM && listen(fd, 64) < 0))
+	{
+		perror("bind");
+		exit(1);
+	}
+	return fd;
+}
+
+// Wait until FD is readable, for no later than DEADLINE.
+static bool wait_readable(int fd, Clock::time_point deadline)
+{
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+	struct pollfd p{ fd, POLLIN, 0 };
+	return left > 0 && poll(&p, 1, (int)left) > 0;
+}
+
+static bool read_full(int fd, void *buf, size_t len, Clock::time_point deadline)
+{
+	uint8_t *p = static_cast<uint8_t *>(buf);
+	while (len > 0)
+	{
+		if (!wait_readable(fd, deadline))
+			return false;
+		ssize_t n = read(fd, p, len);
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void serve()
+{
+	int echo = listen_on(ECHO_PORT, SOCK_STREAM);
+	int sink = listen_on(SINK_PORT, SOCK_STREAM);
+	int udp = listen_on(ECHO_PORT, SOCK_DGRAM);
+
+	std::thread([udp]()
+	{
+		uint8_t buf[65536];
+		sockaddr_in from;
+		for (;;)
+		{
+			socklen_t len = sizeof(from);
+			ssize_t n = recvfrom(udp, buf, sizeof(buf), 0, (sockaddr *)&from, &len);
+			if (n >= 0)
+				sendto(udp, buf, n, 0, (sockaddr *)&from, len);
+		}
+	}).detach();
+	std::thread([echo]()
+	{
+		for (;;)
+		{
+			int fd = accept(echo, NULL, NULL);
+			if (fd < 0)
+				continue;
+			std::thread([fd]()
+			{
+				char buf[65536];
+				ssize_t n;
+				while ((n = read(fd, buf, sizeof(buf))) > 0)
+					if (write(fd, buf, n) != n)
+						break;
+				close(fd);
+			}).detach();
+		}
+	}).detach();
+	for (;;)
+	{
+		int fd = accept(sink, NULL, NULL);
+		if (fd < 0)
+			continue;
+		std::thread([fd]()
+		{
+			char buf[65536];
+			ssize_t n;
+			uint64_t total = 0;
+			while ((n = read(fd, buf, sizeof(buf))) > 0)
+				total += n;
+			if (write(fd, &total, sizeof(total)) != sizeof(total))
+				perror("sink");
+			close(fd);
+		}).detach();
+	}
+}
+
+// Send BYTES to the sink, and time until it says how many it got.
+static void bulk(Result& r, uint64_t bytes, double seconds)
+{
+	int fd = tcp_connect(SINK_PORT, BULK_SNDBUF);
+	r.unit = "bytes";
+	std::vector<char> buf(4096, 'x');
+	auto start = Clock::now();
+	for (uint64_t sent = 0; sent < bytes; )
+	{
+		ssize_t n = write(fd, buf.data(), std::min<uint64_t>(buf.size(), bytes - sent));
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	shutdown(fd, SHUT_WR);
+	uint64_t got = 0;
+	auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(seconds * 4)) + REPLY_TIMEOUT;
+	read_full(fd, &got, sizeof(got), deadline);
+	r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	r.bytes += got;
+	r.sent += bytes;
+	r.lost += bytes - std::min(bytes, got);
+	close(fd);
+}
+
+// Echo requests, one at a time, until STOP.  A request carries its
+// number, so that a late reply isn't taken for the next one's.
+static void interactive(Result& r, const std::atomic<bool>& stop)
+{
+	int fd = tcp_connect(ECHO_PORT);
+	r.unit = "requests";
+	uint8_t req[REQUEST_SIZE], rep[REQUEST_SIZE];
+	memset(req, 'i', sizeof(req));
+	for (uint64_t seq = 0; !stop; seq++)
+	{
+		memcpy(req, &seq, sizeof(seq));
+		auto sent = Clock::now();
+		if (write(fd, req, sizeof(req)) != sizeof(req))
+			break;
+		r.sent++;
+		bool got = false;
+		while (read_full(fd, rep, sizeof(rep), sent + REPLY_TIMEOUT))
+		{
+			if (memcmp(rep, &seq, sizeof(seq)) == 0)
+			{
+				got = true;
+				break;
+			}
+		}
+		if (!got)
+		{
+			r.lost++;
+			continue;
+		}
+		r.bytes += sizeof(req);
+		r.rtt_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - sent).count());
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	close(fd);
+}
+
+// Datagrams at RATE a second for SECONDS, each with its number and when
+// it was sent.
+static void udp(Result& r, double rate, double seconds)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in to = loopback(ECHO_PORT);
+	connect(fd, (sockaddr *)&to, sizeof(to));
+	uint64_t count = std::max<uint64_t>(1, (uint64_t)(rate * seconds));
+	std::vector<bool> seen(count);
+	r.unit = "datagrams";
+
+	std::thread receiver([&]()
+	{
+		uint8_t buf[DATAGRAM_SIZE];
+		auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(seconds)) + REPLY_TIMEOUT;
+		for (uint64_t got = 0; got < count && wait_readable(fd, deadline); )
+		{
+			ssize_t n = recv(fd, buf, sizeof(buf), 0);
+			uint64_t seq;
+			int64_t ns;
+			if (n != (ssize_t)sizeof(buf))
+				continue;
+			memcpy(&seq, buf, sizeof(seq));
+			memcpy(&ns, buf + sizeof(seq), sizeof(ns));
+			if (seq >= count || seen[seq])
+				continue;
+			seen[seq] = true;
+			got++;
+			r.bytes += n;
+			r.rtt_ms.push_back((Clock::now().time_since_epoch().count() - ns)
+				* 1e3 * Clock::period::num / Clock::period::den);
+		}
+	});
+
+	uint8_t buf[DATAGRAM_SIZE];
+	memset(buf, 'u', sizeof(buf));
+	auto start = Clock::now();
+	for (uint64_t seq = 0; seq < count; seq++)
+	{
+		std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(seq / rate)));
+		int64_t ns = Clock::now().time_since_epoch().count();
+		memcpy(buf, &seq, sizeof(seq));
+		memcpy(buf + sizeof(seq), &ns, sizeof(ns));
+		send(fd, buf, sizeof(buf), 0);
+	}
+	receiver.join();
+	r.sent = count;
+	r.lost = count - std::count(seen.begin(), seen.end(), true);
+	r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	close(fd);
+}
+
+static void print_result(const char *name, Result& r)
+{
+	printf("%-12s", name);
+	if (r.seconds > 0)
+		printf(" %8llu bytes in %5.1f s, %8.0f B/s;", (unsigned long long)r.bytes, r.seconds, r.bytes / r.seconds);
+	if (!r.rtt_ms.empty())
+	{
+		std::sort(r.rtt_ms.begin(), r.rtt_ms.end());
+		auto pct = [&](double p) { return r.rtt_ms[std::min(r.rtt_ms.size() - 1, (size_t)(p * r.rtt_ms.size()))]; };
+		printf(" rtt p50 %.1f p90 %.1f p99 %.1f max %.1f ms;", pct(0.5), pct(0.9), pct(0.99), r.rtt_ms.back());
+	}
+	printf(" lost %llu of %llu %s\n", (unsigned long long)r.lost, (unsigned long long)r.sent, r.unit);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	signal(SIGPIPE, SIG_IGN);
+	if (argc > 1 && strcmp(argv[1], "serve") == 0)
+	{
+		serve();
+		return 0;
+	}
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: link_load serve\n       link_load bulk|interactive|udp|mixed BAUD [SECONDS]\n");
+		return 2;
+	}
+	std::string profile = argv[1];
+	double bytes_per_sec = atof(argv[2]) / BITS_PER_BYTE;
+	double seconds = argc > 3 ? atof(argv[3]) : 10;
+	uint64_t bulk_bytes = (uint64_t)(bytes_per_sec * seconds);
+
+	if (profile == "bulk")
+	{
+		Result r;
+		bulk(r, bulk_bytes, seconds);
+		print_result("bulk", r);
+	}
+	else if (profile == "interactive" || profile == "mixed")
+	{
+		Result b, i;
+		std::atomic<bool> stop(false);
+		std::thread load;
+		if (profile == "mixed")
+			load = std::thread([&]() { bulk(b, bulk_bytes, seconds); stop = true; });
+		else
+			load = std::thread([&]()
+			{
+				std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+				stop = true;
+			});
+		auto start = Clock::now();
+		interactive(i, stop);
+		i.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		load.join();
+		if (profile == "mixed")
+			print_result("mixed bulk", b);
+		print_result(profile == "mixed" ? "mixed echo" : "interactive", i);
+	}
+	else if (profile == "udp")
+	{
+		Result r;
+		double rate = std::min(MAX_DATAGRAM_RATE, bytes_per_sec * UDP_LINK_SHARE / DATAGRAM_SIZE);
+		udp(r, rate, seconds);
+		print_result("udp", r);
+	}
+	else
+	{
+		fprintf(stderr, "no profile called %s\n", profile.c_str());
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,54 @@
+// Print the events that udptoserial wrote to its event_file, one line
+// each, with the time they happened, as its log would have shown them.
+//
+// usage: logdecode [event file]
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include "../libhorizr/event_log.h"
+
+static const char *const LEVEL_NAMES[] = { "trace", "debug", "info", "warning", "error", "fatal" };
+
+int main(int argc, char *argv[])
+{
+	FILE *f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	if (f == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	event_file_reader reader(f);
+	if (!reader.valid())
+	{
+		fprintf(stderr, "not an event file\n");
+		return 1;
+	}
+
+	struct event_record rec;
+	std::string msg;
+	char when[32];
+	while (reader.next(rec))
+	{
+		if (rec.site == nullptr)
+		{
+			printf("%llu events dropped here\n", (unsigned long long)rec.args[0]);
+			continue;
+		}
+		int64_t wall = reader.wall_offset() + (int64_t)rec.ns;
+		time_t secs = (time_t)(wall / 1000000000);
+		struct tm tm;
+		localtime_r(&secs, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+		msg.clear();
+		event_format(msg, rec.site->fmt, rec.args, rec.nargs);
+		const char *level = rec.site->level >= 0 && rec.site->level <= 5 ? LEVEL_NAMES[rec.site->level] : "?";
+		printf("[%s.%06lld] [%s] %s\n", when, (long long)(wall % 1000000000) / 1000, level, msg.c_str());
+	}
+	if (reader.error())
+	{
+		fprintf(stderr, "the event file is damaged after this point\n");
+		return 1;
+	}
+	return 0;
+}
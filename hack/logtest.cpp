@@ -5,21 +5,43 @@
 #endif
 // #define BOOST_ALL_DYN_LINK
 
+// What a log message costs on the forwarding path, per packet, done the
+// old way with BOOST_LOG_TRIVIAL and through LOG and LOG_EVENT: when it
+// is filtered out at run time, when it is compiled out, and when it is
+// written.  Written messages go to sample.log, and events to
+// sample.events, which hack/logdecode reads.
+//
+// usage: logtest [packets]
 
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
 #include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/sinks/text_file_backend.hpp>
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
 #include <boost/log/sources/severity_logger.hpp>
 #include <boost/log/sources/record_ostream.hpp>
+#include "../udptoserial/Log.h"
 
 namespace logging = boost::log;
 namespace src = boost::log::sources;
 namespace sinks = boost::log::sinks;
 namespace keywords = boost::log::keywords;
 
+// The log thread drains the event rings every 100 ms, so events are
+// made in bursts this big, with a rest after each, and only the bursts
+// are timed.
+const static size_t EVENT_BURST = 2000;
+const static auto EVENT_REST = std::chrono::milliseconds(120);
 
+// Packet lengths and channels, so that nothing can be worked out at
+// compile time.
+static std::vector<unsigned> lens;
 
 void init()
 {
@@ -28,20 +50,79 @@ void init()
      keywords::file_name = "sample.log"
      );
 
-  logging::core::get()->set_filter
-    (
-     logging::trivial::severity >= logging::trivial::info
-     );
+  logging::add_common_attributes();
+  log_start("info", "sample.events");
+}
+
+static void set_level(logging::trivial::severity_level level)
+{
+  log_level_.store(level);
+  logging::core::get()->set_filter(logging::trivial::severity >= level);
+}
+
+template <typename F>
+static double ns_per_packet(size_t packets, F log_one)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < packets; i++)
+    log_one(lens[i % lens.size()], i & 0xFFFF);
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / packets;
 }
 
-int main (int, char*[])
+static double events_ns_per_packet(size_t packets)
 {
+  double ns = 0;
+  for (size_t done = 0; done < packets; done += EVENT_BURST)
+    {
+      size_t n = std::min(EVENT_BURST, packets - done);
+      ns += ns_per_packet(n, [](unsigned len, unsigned channel)
+        {
+          LOG_EVENT(debug, "frame of {} bytes on channel {}", len, channel);
+        }) * n;
+      std::this_thread::sleep_for(EVENT_REST);
+    }
+  return ns / packets;
+}
+
+int main (int argc, char *argv[])
+{
+  size_t packets = argc > 1 ? atol(argv[1]) : 1000000;
   init();
-  logging::add_common_attributes();
+  for (int i = 0; i < 1024; i++)
+    lens.push_back(rand() % 1500);
 
   using namespace logging::trivial;
   src::severity_logger<severity_level> lg;
-
   BOOST_LOG_SEV(lg, warning) << "A WARNING!!!!";
-}
 
+  set_level(info);
+  printf("filtered out at run time:\n");
+  printf("  BOOST_LOG_TRIVIAL  %8.1f ns\n", ns_per_packet(packets, [](unsigned len, unsigned channel)
+    {
+      BOOST_LOG_TRIVIAL(debug) << "frame of " << len << " bytes on channel " << channel;
+    }));
+  printf("  LOG                %8.1f ns\n", ns_per_packet(packets, [](unsigned len, unsigned channel)
+    {
+      LOG(debug) << "frame of " << len << " bytes on channel " << channel;
+    }));
+  printf("  LOG_EVENT          %8.1f ns\n", ns_per_packet(packets, [](unsigned len, unsigned channel)
+    {
+      LOG_EVENT(debug, "frame of {} bytes on channel {}", len, channel);
+    }));
+  printf("compiled out, below LOG_MIN_LEVEL:\n");
+  printf("  LOG                %8.1f ns\n", ns_per_packet(packets, [](unsigned len, unsigned channel)
+    {
+      LOG(trace) << "frame of " << len << " bytes on channel " << channel;
+    }));
+
+  // Writing is slower, so fewer.
+  set_level(debug);
+  size_t written = std::max(packets / 10, EVENT_BURST);
+  printf("written:\n");
+  printf("  BOOST_LOG_TRIVIAL  %8.1f ns\n", ns_per_packet(written, [](unsigned len, unsigned channel)
+    {
+      BOOST_LOG_TRIVIAL(debug) << "frame of " << len << " bytes on channel " << channel;
+    }));
+  printf("  LOG_EVENT          %8.1f ns, formatted later\n", events_ns_per_packet(written));
+  log_stop();
+}
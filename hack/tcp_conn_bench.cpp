@@ -0,0 +1,478 @@
+// Open many idle TCP connections through the proxy, and measure what
+// each one costs and how fast they are accepted.  The near end runs in
+// this process and the far end in a child, joined by a pty pair standing
+// in for the serial line.  The clients, and the server that the far end
+// connects to, are two more children, so that no one process needs
+// more than one descriptor per connection.
+//
+// Once every connection has reached the server, both ends report how
+// much more heap they are using than before the first one, and how many
+// pooled packets they hold.  The clients then hang up, and both ends
+// report again once every flow is gone.  Some of what is left then is
+// kept for reuse, by asio as well as by us, and queues keep the size of
+// the longest they have been, so all of that is done a few times over.
+// A leak shows up as every round leaving more behind than the last.
+//
+// usage: tcp_conn_bench [connections]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include "../udptoserial/Serial_writer.h"
+#include "../udptoserial/Stream_mux.h"
+#include "../udptoserial/Tcp_server_handler.h"
+#include "../udptoserial/Tcp_client_handler.h"
+
+const static uint32_t NEAR_ADDR = 0x7F000001;
+const static uint32_t SERVER_ADDR = 0x7F000002;
+
+// A round may leave no more than this per connection behind beyond what
+// the one before it did without it counting as growth.
+const static long RECLAIMED = 16;
+const static int ROUNDS = 3;
+
+// How long the ends have to tear every connection down.
+const static auto TEARDOWN = std::chrono::seconds(20);
+
+// What an end reports about itself: heap in use past what it started
+// with, how much of that is the packet pool, which grows to fit the most
+// ever in flight and stays that size, how many packets are in use, and
+// how many flows are open.
+struct Usage
+{
+	long heap;
+	long pool;
+	size_t packets;
+	size_t flows;
+	long rss;
+};
+
+// Big blocks, such as the pool's slabs, are mapped on their own and
+// aren't counted as part of the heap proper.
+static long heap_in_use()
+{
+	struct mallinfo2 mi = mallinfo2();
+	return (long)(mi.uordblks + mi.hblkhd);
+}
+
+static long rss_bytes()
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL)
+	{
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void raise_nofile()
+{
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0)
+	{
+		nofile.rlim_cur = nofile.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+}
+
+static void put_byte(int fd)
+{
+	char c = 0;
+	if (write(fd, &c, 1) != 1)
+		_exit(1);
+}
+
+static void get_byte(int fd)
+{
+	char c;
+	if (read(fd, &c, 1) != 1)
+		_exit(1);
+}
+
+// One end of the link: a port, its writer and mux, and a read loop that
+// hands stream mux frames to the mux, as main.cpp does.
+struct End
+{
+	asio::io_service& io;
+	packet_pool pool;
+	std::shared_ptr<asio::serial_port> port;
+	std::shared_ptr<Serial_writer> writer;
+	std::shared_ptr<Stream_mux> mux;
+	struct slip_decoder dec;
+	std::vector<uint8_t> frame;
+	uint8_t buf[8192];
+
+	End(asio::io_service& io, int fd, size_t connections)
+		: io(io)
+		, pool(2048, 32, 256)
+		, port(std::make_shared<asio::serial_port>(io, fd))
+		, frame(LINK_UDP_HEADER_LEN + 65536)
+	{
+		writer = std::make_shared<Serial_writer>(io, port, 100000000, 0, false);
+		mux = std::make_shared<Stream_mux>(io, writer, pool, connections + 16, 3600);
+		slip_decoder_init(dec, frame.data(), frame.size());
+		mux->start();
+		read();
+	}
+
+	void read()
+	{
+		port->async_read_some(asio::buffer(buf), [this](system::error_code const & ec, size_t n)
+		{
+			if (ec)
+				return;
+			const uint8_t *p = buf;
+			while (n > 0)
+			{
+				bool complete;
+				size_t used = slip_decoder_feed(dec, p, n, complete);
+				p += used;
+				n -= used;
+				if (!complete)
+					break;
+				uint8_t type = link_frame_type(dec.frame, dec.len);
+				if (!dec.overflow && type >= LINK_FRAME_MUX_OPEN && type <= LINK_FRAME_MUX_CREDIT)
+					mux->dispatch(dec.frame, dec.len);
+				slip_decoder_reset(dec);
+			}
+			read();
+		});
+	}
+
+	struct Usage usage(long heap_before) const
+	{
+		return Usage{ heap_in_use() - heap_before, (long)(pool.allocated() * pool.buf_size()),
+			pool.in_use(), mux->flows(), rss_bytes() };
+	}
+
+	bool torn_down() const
+	{
+		return mux->flows() == 0 && pool.in_use() == 0;
+	}
+};
+
+// The server, each round: accept every connection, say so, and hang on
+// to them until told to let go.
+static void run_server(int listen_fd, size_t connections, int report, int control)
+{
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		std::vector<int> fds;
+		while (fds.size() < connections)
+		{
+			int fd = accept(listen_fd, NULL, NULL);
+			if (fd < 0)
+			{
+				perror("server accept");
+				_exit(1);
+			}
+			fds.push_back(fd);
+		}
+		put_byte(report);
+		get_byte(control);
+		for (int fd : fds)
+			close(fd);
+	}
+	_exit(0);
+}
+
+// The clients, each round: connect when told, say so, and hang up when
+// told.
+static void run_clients(uint16_t port, size_t connections, int report, int control)
+{
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(NEAR_ADDR);
+	to.sin_port = htons(port);
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		std::vector<int> fds;
+		get_byte(control);
+		for (size_t i = 0; i < connections; i++)
+		{
+			int fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (fd < 0 || connect(fd, (struct sockaddr *)&to, sizeof(to)) < 0)
+			{
+				perror("client connect");
+				_exit(1);
+			}
+			fds.push_back(fd);
+		}
+		put_byte(report);
+		get_byte(control);
+		for (int fd : fds)
+			close(fd);
+	}
+	_exit(0);
+}
+
+// The far end: report on what it is using whenever the parent asks, until
+// it is asked to quit.
+static void run_far(int tty, size_t connections, int report, int control)
+{
+	boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+	{
+		asio::io_service io;
+		End far(io, tty, connections);
+		long heap_before = heap_in_use() - (long)(far.pool.allocated() * far.pool.buf_size());
+		asio::posix::stream_descriptor ctl(io, control);
+		char c;
+		std::function<void(system::error_code const &, size_t)> on_ctl;
+		on_ctl = [&](system::error_code const & ec, size_t)
+		{
+			if (ec || c == 'q')
+			{
+				io.stop();
+				return;
+			}
+			struct Usage u = far.usage(heap_before);
+			if (write(report, &u, sizeof(u)) != sizeof(u))
+				_exit(1);
+			asio::async_read(ctl, asio::buffer(&c, 1), on_ctl);
+		};
+		asio::async_read(ctl, asio::buffer(&c, 1), on_ctl);
+		io.run();
+	}
+	_exit(0);
+}
+
+static struct Usage ask_far(int control, int report)
+{
+	struct Usage u;
+	char c = '?';
+	if (write(control, &c, 1) != 1)
+		_exit(1);
+	if (read(report, &u, sizeof(u)) != sizeof(u))
+		memset(&u, 0, sizeof(u));
+	return u;
+}
+
+// Everything but the pool is what the connections cost.
+static long per_connection(const struct Usage& u, size_t connections)
+{
+	return (u.heap - u.pool) / (long)connections;
+}
+
+static void print_usage(const char *who, const struct Usage& u, size_t connections)
+{
+	printf("  %s: %ld bytes per connection, %zu flows open, %zu packets in use, %ld KB of pool, RSS %.1f MB\n",
+		who, per_connection(u, connections), u.flows, u.packets, u.pool / 1024, u.rss / 1e6);
+}
+
+static void accept_next(asio::io_service& io, std::shared_ptr<asio::ip::tcp::acceptor> acceptor,
+	std::shared_ptr<Stream_mux> mux, size_t& accepted,
+	std::chrono::steady_clock::time_point& first, std::chrono::steady_clock::time_point& last)
+{
+	auto handler = std::make_shared<Tcp_server_handler>(io, mux, SERVER_ADDR);
+	acceptor->async_accept(handler->socket(), [&io, acceptor, mux, handler, &accepted, &first, &last](system::error_code const & ec)
+	{
+		if (ec)
+			return;
+		handler->start();
+		if (accepted++ == 0)
+			first = std::chrono::steady_clock::now();
+		last = std::chrono::steady_clock::now();
+		accept_next(io, acceptor, mux, accepted, first, last);
+	});
+}
+
+static void make_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+	{
+		perror("pipe");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t connections = argc > 1 ? atol(argv[1]) : 10000;
+	boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+	raise_nofile();
+	struct rlimit nofile;
+	getrlimit(RLIMIT_NOFILE, &nofile);
+	if (nofile.rlim_cur < connections + 64)
+	{
+		fprintf(stderr, "need %zu file descriptors, but may only have %ld\n", connections + 64, (long)nofile.rlim_cur);
+		return 1;
+	}
+
+	int master, slave;
+	struct termios tio;
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+	{
+		perror("openpty");
+		return 1;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	// The server listens first, on any port, and the near end takes the
+	// same port, so that the far end connects to the server.
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(SERVER_ADDR);
+	if (bind(server_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(server_fd, 4096) < 0)
+	{
+		perror("server");
+		return 1;
+	}
+	getsockname(server_fd, (struct sockaddr *)&sin, &slen);
+	uint16_t port = ntohs(sin.sin_port);
+
+	int server_report[2], server_control[2], far_report[2], far_control[2];
+	make_pipe(server_report);
+	make_pipe(server_control);
+	make_pipe(far_report);
+	make_pipe(far_control);
+
+	pid_t server = fork();
+	if (server == 0)
+	{
+		close(master);
+		close(slave);
+		run_server(server_fd, connections, server_report[1], server_control[0]);
+	}
+	close(server_fd);
+	pid_t far = fork();
+	if (far == 0)
+	{
+		close(master);
+		run_far(slave, connections, far_report[1], far_control[0]);
+	}
+	close(slave);
+	close(far_report[1]);
+	close(far_control[0]);
+
+	// Memory that is there however few connections there are, chiefly
+	// the flow table, doesn't count.
+	asio::io_service io;
+	long heap_start = heap_in_use();
+	End near(io, master, connections);
+	long heap_before = heap_in_use() - (long)(near.pool.allocated() * near.pool.buf_size());
+	printf("fixed cost of %zu connections' flow table and the like: %ld KB\n",
+		connections, (heap_before - heap_start) / 1024);
+	auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(io);
+	acceptor->open(asio::ip::tcp::v4());
+	acceptor->bind(asio::ip::tcp::endpoint(asio::ip::address_v4(NEAR_ADDR), port));
+	acceptor->listen(4096);
+	size_t accepted = 0;
+	std::chrono::steady_clock::time_point first, last;
+	accept_next(io, acceptor, near.mux, accepted, first, last);
+
+	int client_report[2], client_control[2];
+	make_pipe(client_report);
+	make_pipe(client_control);
+	pid_t clients = fork();
+	if (clients == 0)
+	{
+		close(master);
+		run_clients(port, connections, client_report[1], client_control[0]);
+	}
+
+	asio::posix::stream_descriptor server_report_pipe(io, server_report[0]);
+	struct Usage near_last {}, far_last {};
+	int near_grew = 0, far_grew = 0;
+	bool ok = true;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		printf("round %d:\n", round + 1);
+		accepted = 0;
+		auto start = std::chrono::steady_clock::now();
+		put_byte(client_control[1]);
+		char c;
+		bool up = false;
+		asio::async_read(server_report_pipe, asio::buffer(&c, 1), [&](system::error_code const & ec, size_t)
+		{
+			if (ec)
+				exit(1);
+			up = true;
+		});
+		while (!up)
+			io.run_one();
+		auto now = std::chrono::steady_clock::now();
+		double accept_secs = std::chrono::duration<double>(last - first).count();
+		double up_secs = std::chrono::duration<double>(now - start).count();
+		printf("%zu connections accepted in %.2f s, %.0f/s; all through to the server in %.2f s\n",
+			accepted, accept_secs, accepted / std::max(accept_secs, 1e-6), up_secs);
+		printf("idle:\n");
+		print_usage("near end", near.usage(heap_before), connections);
+		print_usage("far end", ask_far(far_control[1], far_report[0]), connections);
+
+		put_byte(client_control[1]);
+		put_byte(server_control[1]);
+		auto deadline = std::chrono::steady_clock::now() + TEARDOWN;
+		while (!near.torn_down() && std::chrono::steady_clock::now() < deadline)
+			io.run_for(std::chrono::milliseconds(50));
+		struct Usage far_down = ask_far(far_control[1], far_report[0]);
+		while ((far_down.flows > 0 || far_down.packets > 0) && std::chrono::steady_clock::now() < deadline)
+		{
+			usleep(50000);
+			far_down = ask_far(far_control[1], far_report[0]);
+		}
+		struct Usage near_down = near.usage(heap_before);
+		printf("after closing:\n");
+		print_usage("near end", near_down, connections);
+		print_usage("far end", far_down, connections);
+		if (near_down.flows > 0 || far_down.flows > 0 || near_down.packets > 0 || far_down.packets > 0)
+		{
+			printf("connections were not all torn down\n");
+			ok = false;
+			break;
+		}
+		if (round > 0)
+		{
+			long near_more = per_connection(near_down, connections) - per_connection(near_last, connections);
+			long far_more = per_connection(far_down, connections) - per_connection(far_last, connections);
+			printf("left behind beyond the round before: near end %ld, far end %ld bytes per connection\n",
+				near_more, far_more);
+			near_grew += near_more >= RECLAIMED;
+			far_grew += far_more >= RECLAIMED;
+		}
+		near_last = near_down;
+		far_last = far_down;
+	}
+	if (near_grew == ROUNDS - 1 || far_grew == ROUNDS - 1)
+	{
+		printf("every round left more behind\n");
+		ok = false;
+	}
+
+	char q = 'q';
+	if (write(far_control[1], &q, 1) != 1)
+		ok = false;
+	system::error_code ec;
+	acceptor->close(ec);
+	io.restart();
+	io.poll();
+	waitpid(clients, NULL, 0);
+	waitpid(server, NULL, 0);
+	waitpid(far, NULL, 0);
+	return ok ? 0 : 1;
+}
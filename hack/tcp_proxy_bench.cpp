@@ -0,0 +1,256 @@
+// Measure the throughput of one TCP connection through the proxy.  Both
+// ends of the link run in this process, on one io_service, with a pty
+// pair standing in for the serial line, unpaced.  A client thread sends
+// to the near end's listener, and a sink thread, standing in for the
+// server the far end connects to, reads until EOF.  The far end's
+// server address is 127.0.0.2, so the two listeners can share a port.
+// The client writes in WRITE-byte pieces, and with COALESCE, the ends
+// hold small reads for up to that many milliseconds.
+//
+// This is also the check that the forwarding path, from the client's
+// socket through the mux and the serial writer to the port and back out
+// to the sink, makes no heap allocations once it is warmed up.  Every
+// allocation made on the io_service's thread after the first WARMUP
+// frames is counted, and the run fails if there are any.
+//
+// usage: tcp_proxy_bench [megabytes] [write] [coalesce]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include "../udptoserial/Serial_writer.h"
+#include "../udptoserial/Stream_mux.h"
+#include "../udptoserial/Tcp_server_handler.h"
+#include "../udptoserial/Tcp_client_handler.h"
+
+const static size_t CHUNK = 64 * 1024;
+const static size_t WARMUP = 5000;
+
+// Allocations are counted on the io_service's thread, once the link has
+// carried WARMUP frames.
+static thread_local bool io_thread_ = false;
+static bool warm_ = false;
+static size_t allocations_ = 0;
+
+// Every form of new and delete is replaced, so that they all come and go
+// through these.  They aren't inlined, so the compiler never sees free()
+// called on what it takes to be new's memory.
+__attribute__((noinline)) static void *counted_alloc(size_t size)
+{
+	if (io_thread_ && warm_)
+		allocations_++;
+	void *p = malloc(size ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) static void counted_free(void *p) noexcept
+{
+	free(p);
+}
+
+void *operator new(size_t size) { return counted_alloc(size); }
+void *operator new[](size_t size) { return counted_alloc(size); }
+void operator delete(void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+
+// The pool goes first, so that it outlives packets held by handlers
+// that are still pending when the io_service goes away.
+packet_pool pool_(2048, 32, 256);
+asio::io_service io_service_;
+uint32_t coalesce_ = 0;
+
+// One end of the link: a port, its writer and mux, and a read loop that
+// hands stream mux frames to the mux, as main.cpp does.
+struct End
+{
+	std::shared_ptr<asio::serial_port> port;
+	std::shared_ptr<Serial_writer> writer;
+	std::shared_ptr<Stream_mux> mux;
+	struct slip_decoder dec;
+	std::vector<uint8_t> frame;
+	uint8_t buf[8192];
+	size_t frames;
+	Handler_pool read_pool;
+
+	explicit End(int fd)
+		: port(std::make_shared<asio::serial_port>(io_service_, fd))
+		, frame(LINK_UDP_HEADER_LEN + 65536)
+		, frames(0)
+	{
+		writer = std::make_shared<Serial_writer>(io_service_, port, 100000000, 0, false);
+		mux = std::make_shared<Stream_mux>(io_service_, writer, pool_, 16, 60, coalesce_, 512);
+		slip_decoder_init(dec, frame.data(), frame.size());
+	}
+
+	void read()
+	{
+		port->async_read_some(asio::buffer(buf), make_custom_alloc_handler(read_pool, [this](system::error_code const & ec, size_t n)
+		{
+			if (ec)
+				return;
+			const uint8_t *p = buf;
+			while (n > 0)
+			{
+				bool complete;
+				size_t used = slip_decoder_feed(dec, p, n, complete);
+				p += used;
+				n -= used;
+				if (!complete)
+					break;
+				uint8_t type = link_frame_type(dec.frame, dec.len);
+				if (!dec.overflow && type >= LINK_FRAME_MUX_OPEN && type <= LINK_FRAME_MUX_CREDIT)
+				{
+					mux->dispatch(dec.frame, dec.len);
+					frames++;
+					if (frames == WARMUP)
+						warm_ = true;
+				}
+				slip_decoder_reset(dec);
+			}
+			read();
+		}));
+	}
+};
+
+static void accept_next(std::shared_ptr<asio::ip::tcp::acceptor> acceptor, std::shared_ptr<Stream_mux> mux, uint32_t remote)
+{
+	auto handler = std::make_shared<Tcp_server_handler>(io_service_, mux, remote);
+	acceptor->async_accept(handler->socket(), [acceptor, mux, remote, handler](system::error_code const & ec)
+	{
+		if (ec)
+			return;
+		handler->start();
+		accept_next(acceptor, mux, remote);
+	});
+}
+
+static double cpu_seconds()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t total = (argc > 1 ? atol(argv[1]) : 64) << 20;
+	size_t chunk = argc > 2 ? atol(argv[2]) : CHUNK;
+	coalesce_ = argc > 3 ? atoi(argv[3]) : 0;
+	boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+	int master, slave;
+	struct termios tio;
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+	{
+		perror("openpty");
+		return 1;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	// The sink listens first, on any port, and the near end takes the
+	// same port, so that the far end connects to the sink.
+	int sink_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7F000002);
+	if (bind(sink_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(sink_fd, 1) < 0)
+	{
+		perror("sink");
+		return 1;
+	}
+	getsockname(sink_fd, (struct sockaddr *)&sin, &slen);
+	uint16_t port = ntohs(sin.sin_port);
+
+	End near(master), far(slave);
+	near.mux->start();
+	far.mux->start();
+	near.read();
+	far.read();
+	auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(io_service_,
+		asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+	accept_next(acceptor, near.mux, 0x7F000002);
+
+	size_t received = 0;
+	std::chrono::steady_clock::time_point last;
+	std::thread sink([&]()
+	{
+		int fd = accept(sink_fd, NULL, NULL);
+		std::vector<char> buf(CHUNK);
+		ssize_t n;
+		while ((n = read(fd, buf.data(), buf.size())) > 0)
+			received += n;
+		last = std::chrono::steady_clock::now();
+		close(fd);
+		io_service_.stop();
+	});
+	std::thread client([&]()
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in to = sin;
+		to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (connect(fd, (struct sockaddr *)&to, sizeof(to)) < 0)
+		{
+			perror("connect");
+			exit(1);
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		std::vector<char> buf(chunk, 'x');
+		for (size_t sent = 0; sent < total; )
+		{
+			ssize_t n = write(fd, buf.data(), std::min(chunk, total - sent));
+			if (n <= 0)
+				break;
+			sent += n;
+		}
+		close(fd);
+	});
+
+	double cpu = cpu_seconds();
+	auto start = std::chrono::steady_clock::now();
+	io_thread_ = true;
+	io_service_.run();
+	io_thread_ = false;
+	double secs = std::chrono::duration<double>(last - start).count();
+	cpu = cpu_seconds() - cpu;
+	client.join();
+	sink.join();
+
+	// Let what is still pending finish now, while logging still works.
+	system::error_code ec;
+	acceptor->close(ec);
+	io_service_.restart();
+	io_service_.poll();
+
+	printf("%zu of %zu bytes in %.2f s: %.1f MB/s, %.0f us CPU/MB, %zu frames across the link\n",
+		received, total, secs, received / secs / 1e6, cpu * 1e6 / (received / 1e6),
+		near.frames + far.frames);
+	printf("near end serial writes: %s\n", near.writer->write_summary().c_str());
+	printf("near end tcp ingress: %s\n", near.mux->ingress_summary().c_str());
+	printf("heap allocations after the first %zu frames: %zu\n", WARMUP, allocations_);
+	return received == total && allocations_ == 0 ? 0 : 1;
+}
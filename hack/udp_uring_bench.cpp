@@ -0,0 +1,347 @@
+// Compare the daemon's epoll and io_uring modes on UDP traffic.  Both
+// ends of the link run in this process, on one io_service, with a pty
+// pair standing in for the serial line, unpaced, as in tcp_proxy_bench.
+// A client thread sends SIZE-byte datagrams to the near end's port,
+// keeping WINDOW of them in flight, and an echo thread, standing in for
+// the server the far end's session talks to, sends each one back.  So
+// every path the daemon has for UDP is in use: receives on the near
+// end's port and on the far end's session, serial writes, serial reads
+// and the sends out of both ends.
+//
+// Each mode runs in a process of its own.  After the first WARMUP
+// echoes, every system call the io_service's thread makes through libc
+// is counted, along with each time a ring is entered, and so is the
+// CPU time of that thread and of the whole process, which has the
+// kernel's io_uring workers in it.  They are given per datagram
+// through the link, either way, and per MB of datagrams.
+//
+// usage: udp_uring_bench [datagrams] [size] [epoll|uring]
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include "../udptoserial/Serial_writer.h"
+#include "../udptoserial/Udp_ports.h"
+#include "../udptoserial/Uring_io.h"
+
+const static size_t WARMUP = 2000;
+const static size_t WINDOW = 32;
+const static size_t SERIAL_READ_SIZE = 8192;
+
+// System calls are counted on the io_service's thread, once warm.
+static thread_local bool io_thread_ = false;
+static bool warm_ = false;
+static size_t syscalls_ = 0;
+
+static inline void counted()
+{
+	if (io_thread_ && warm_)
+		syscalls_++;
+}
+
+// Each of the calls Asio and the daemon make is defined here, so that
+// the executable's own calls, Asio's among them, come here first.  Each
+// is counted and passed on to libc's.
+#define FORWARD(ret, name, params, args) \
+	extern "C" ret name params \
+	{ \
+		static ret (*real) params = (ret (*) params)dlsym(RTLD_NEXT, #name); \
+		counted(); \
+		return real args; \
+	}
+
+FORWARD(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+FORWARD(ssize_t, readv, (int fd, const struct iovec *iov, int n), (fd, iov, n))
+FORWARD(ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n))
+FORWARD(ssize_t, writev, (int fd, const struct iovec *iov, int n), (fd, iov, n))
+FORWARD(ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags), (fd, msg, flags))
+FORWARD(ssize_t, recvfrom, (int fd, void *buf, size_t n, int flags, struct sockaddr *from, socklen_t *len), (fd, buf, n, flags, from, len))
+FORWARD(ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags), (fd, msg, flags))
+FORWARD(ssize_t, sendto, (int fd, const void *buf, size_t n, int flags, const struct sockaddr *to, socklen_t len), (fd, buf, n, flags, to, len))
+FORWARD(ssize_t, send, (int fd, const void *buf, size_t n, int flags), (fd, buf, n, flags))
+FORWARD(int, epoll_wait, (int epfd, struct epoll_event *ev, int n, int timeout), (epfd, ev, n, timeout))
+FORWARD(int, epoll_ctl, (int epfd, int op, int fd, struct epoll_event *ev), (epfd, op, fd, ev))
+FORWARD(int, poll, (struct pollfd *fds, nfds_t n, int timeout), (fds, n, timeout))
+FORWARD(int, timerfd_settime, (int fd, int flags, const struct itimerspec *now, struct itimerspec *old), (fd, flags, now, old))
+
+extern "C" int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*real)(int, unsigned long, void *) = (int (*)(int, unsigned long, void *))dlsym(RTLD_NEXT, "ioctl");
+	va_list ap;
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+	counted();
+	return real(fd, request, arg);
+}
+
+packet_pool pool_(2048, 32, 256);
+packet_pool big_pool_(32 + 65536, 32, 4);
+asio::io_service io_service_;
+bool use_uring_ = false;
+
+// One end of the link: a port, its writer, its UDP ports and a read loop
+// that hands UDP frames to them, as main.cpp does.  In io_uring mode the
+// end has a ring of its own, as a daemon would, and reads into a pooled
+// buffer registered with it.
+struct End
+	: public Uring_handler
+{
+	std::shared_ptr<asio::serial_port> port;
+	std::shared_ptr<Serial_writer> writer;
+	std::shared_ptr<Udp_ports> udp;
+	std::shared_ptr<Uring_io> ring;
+	struct slip_decoder dec;
+	std::vector<uint8_t> frame;
+	uint8_t buf[SERIAL_READ_SIZE];
+	packet read_packet;
+	Handler_pool read_pool;
+
+	End(int fd, uint32_t remote, std::vector<uint16_t> ports)
+		: port(std::make_shared<asio::serial_port>(io_service_, fd))
+		, frame(LINK_UDP_HEADER_LEN + 65536)
+	{
+		writer = std::make_shared<Serial_writer>(io_service_, port, 100000000, 0, false);
+		udp = std::make_shared<Udp_ports>(io_service_, writer, pool_, big_pool_, remote, ports, 16, 60);
+		slip_decoder_init(dec, frame.data(), frame.size());
+		if (use_uring_)
+		{
+			ring = std::make_shared<Uring_io>(io_service_);
+			if (!ring->open())
+				exit(1);
+			ring->register_pool(big_pool_);
+			writer->use_uring(ring);
+			udp->use_uring(ring);
+		}
+		writer->start();
+		udp->open();
+		if (ring)
+		{
+			read_packet = big_pool_.alloc();
+			ring->read(port->native_handle(), read_packet.data(), SERIAL_READ_SIZE, this);
+		}
+		else
+			read();
+	}
+
+	void received(const uint8_t *p, size_t n)
+	{
+		while (n > 0)
+		{
+			bool complete;
+			size_t used = slip_decoder_feed(dec, p, n, complete);
+			p += used;
+			n -= used;
+			if (!complete)
+				break;
+			uint8_t type = link_frame_type(dec.frame, dec.len);
+			if (!dec.overflow && (type == LINK_FRAME_UDP || type == LINK_FRAME_UDP_BATCH))
+				udp->send_packet(dec.frame, dec.len);
+			slip_decoder_reset(dec);
+		}
+	}
+
+	void read()
+	{
+		port->async_read_some(asio::buffer(buf), make_custom_alloc_handler(read_pool, [this](system::error_code const & ec, size_t n)
+		{
+			if (ec)
+				return;
+			received(buf, n);
+			read();
+		}));
+	}
+
+	void completed(const struct io_uring_cqe& cqe) override
+	{
+		if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR)
+			return;
+		if (cqe.res > 0)
+			received(read_packet.data(), cqe.res);
+		ring->read(port->native_handle(), read_packet.data(), SERIAL_READ_SIZE, this);
+	}
+};
+
+// What the io_service's thread has used so far, taken on that thread.
+struct Usage
+{
+	size_t syscalls;
+	size_t enters;
+	double thread_cpu;
+	double process_cpu;
+};
+
+static double seconds(const struct timeval& tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static Usage usage(const End& near, const End& far)
+{
+	struct rusage self, thread;
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_THREAD, &thread);
+	Usage u;
+	u.syscalls = syscalls_;
+	u.enters = near.ring ? near.ring->enters() + far.ring->enters() : 0;
+	u.thread_cpu = seconds(thread.ru_utime) + seconds(thread.ru_stime);
+	u.process_cpu = seconds(self.ru_utime) + seconds(self.ru_stime);
+	return u;
+}
+
+static int run(size_t datagrams, size_t size)
+{
+	boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+	int master, slave;
+	struct termios tio;
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+	{
+		perror("openpty");
+		return 1;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	// The echo server takes any port on 127.0.0.2, and the near end
+	// takes the same port on every address, so that the far end's
+	// session reaches the server.
+	int one = 1;
+	int echo_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(echo_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7F000002);
+	if (bind(echo_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+	{
+		perror("echo");
+		return 1;
+	}
+	getsockname(echo_fd, (struct sockaddr *)&sin, &slen);
+	uint16_t port = ntohs(sin.sin_port);
+
+	io_thread_ = true;
+	End near(master, 0x7F000002, { port }), far(slave, 0, {});
+	Usage start{}, end{};
+
+	std::thread echo([&]()
+	{
+		std::vector<char> buf(65536);
+		struct sockaddr_in from;
+		socklen_t flen;
+		ssize_t n;
+		while (flen = sizeof(from), (n = recvfrom(echo_fd, buf.data(), buf.size(), 0, (struct sockaddr *)&from, &flen)) > 0)
+			sendto(echo_fd, buf.data(), n, 0, (struct sockaddr *)&from, flen);
+	});
+
+	// Datagrams that don't come back within a second are given up on.
+	std::atomic<size_t> echoed(0), lost(0);
+	std::thread client([&]()
+	{
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		struct timeval tv = { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		struct sockaddr_in to = sin;
+		to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		std::vector<char> buf(std::max<size_t>(size, 65536), 'x');
+		size_t sent = 0, in_flight = 0;
+		while (echoed + lost < datagrams)
+		{
+			while (in_flight < WINDOW && sent < datagrams)
+			{
+				sendto(fd, buf.data(), size, 0, (struct sockaddr *)&to, sizeof(to));
+				sent++;
+				in_flight++;
+			}
+			if (recv(fd, buf.data(), buf.size(), 0) == (ssize_t)size)
+				echoed++;
+			else
+				lost++;
+			in_flight--;
+			if (echoed + lost == WARMUP)
+				io_service_.post([&]() { warm_ = true; start = usage(near, far); });
+		}
+		io_service_.post([&]() { end = usage(near, far); io_service_.stop(); });
+		close(fd);
+	});
+
+	auto t0 = std::chrono::steady_clock::now();
+	io_service_.run();
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	io_thread_ = false;
+	client.join();
+	shutdown(echo_fd, SHUT_RDWR);
+	echo.join();
+
+	// Both ways through the link.
+	size_t through = 2 * (echoed - std::min<size_t>(echoed, WARMUP));
+	double mb = through * size / 1e6;
+	size_t calls = end.syscalls - start.syscalls + end.enters - start.enters;
+	printf("%-5s %zu of %zu datagrams of %zu bytes echoed in %.2f s, %zu lost\n",
+		use_uring_ ? "uring" : "epoll", (size_t)echoed, datagrams, size, secs, (size_t)lost);
+	printf("%-5s %.2f system calls per datagram (%.2f io_uring_enter), "
+		"%.0f us CPU/MB on the io thread, %.0f us CPU/MB in all\n",
+		use_uring_ ? "uring" : "epoll", (double)calls / through,
+		(double)(end.enters - start.enters) / through,
+		(end.thread_cpu - start.thread_cpu) * 1e6 / mb,
+		(end.process_cpu - start.process_cpu) * 1e6 / mb);
+	fflush(stdout);
+	// The ends and the io_service go with the process.
+	_exit(lost == 0 ? 0 : 1);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t datagrams = argc > 1 ? atol(argv[1]) : 100000;
+	size_t size = argc > 2 ? atol(argv[2]) : 512;
+	if (argc > 3)
+	{
+		use_uring_ = strcmp(argv[3], "uring") == 0;
+		return run(datagrams + WARMUP, size);
+	}
+
+	// Each mode in a process of its own, one after the other.
+	std::string n = std::to_string(datagrams), sz = std::to_string(size);
+	int status = 0;
+	for (const char *mode : { "epoll", "uring" })
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			execl("/proc/self/exe", argv[0], n.c_str(), sz.c_str(), mode, (char *)NULL);
+			_exit(127);
+		}
+		int st;
+		waitpid(pid, &st, 0);
+		status |= !WIFEXITED(st) || WEXITSTATUS(st) != 0;
+	}
+	return status;
+}
@@ -0,0 +1,294 @@
+/* Compare the gateway's epoll and io_uring loops on one UDP socket
+   feeding a pipe that stands in for the serial port, unpaced.  A
+   sender thread offers datagrams at a fixed rate and a drain thread
+   empties the pipe.  For each loop, report the system calls it made per
+   datagram and the CPU used per megabyte of payload.
+
+   usage: uring_bench [datagrams/s [bytes [count]]] */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "queue.h"
+#include "uring.h"
+
+static long rate = 50000;
+static size_t size = 256;
+static long count = 200000;
+
+static int rx_sock;
+static struct sockaddr_in rx_addr;
+static int pipe_fds[2];
+static volatile int sender_done;
+static volatile int drain_stop;
+
+static int64_t
+now_usec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Send COUNT datagrams at RATE, in bursts of 8. */
+static void *
+sender (void *arg)
+{
+  int fd = socket (AF_INET, SOCK_DGRAM, 0);
+  char *buf = calloc (1, size);
+  int64_t start = now_usec ();
+
+  for (long i = 0; i < count; i ++)
+    {
+      if (i % 8 == 0)
+	{
+	  int64_t due = start + i * 1000000 / rate;
+	  int64_t now = now_usec ();
+	  if (due > now)
+	    usleep (due - now);
+	}
+      sendto (fd, buf, size, 0, (struct sockaddr *) &rx_addr, sizeof(rx_addr));
+    }
+  free (buf);
+  close (fd);
+  sender_done = 1;
+  return NULL;
+}
+
+static void *
+drain (void *arg)
+{
+  static char buf[65536];
+
+  while (!drain_stop)
+    {
+      if (read (pipe_fds[0], buf, sizeof(buf)) <= 0)
+	usleep (100);
+    }
+  return NULL;
+}
+
+/* The epoll loop, as in main.c's run, counting each system call. */
+static size_t
+run_epoll (pkt_queue_t *queue, serial_port_t *port, size_t *calls)
+{
+  struct epoll_event ev;
+  size_t frames = 0;
+  int epfd = epoll_create1 (0);
+
+  memset (&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  epoll_ctl (epfd, EPOLL_CTL_ADD, rx_sock, &ev);
+  for (;;)
+    {
+      int n = epoll_wait (epfd, &ev, 1, 100);
+      (*calls) ++;
+      if (n == 0 && sender_done)
+	break;
+      for (;;)
+	{
+	  pkt_t *pkt = pkt_queue_reserve (queue);
+	  ssize_t got;
+	  if (pkt == NULL)
+	    break;
+	  got = recvfrom (rx_sock, pkt->data, PKT_QUEUE_PAYLOAD_MAX, 0, NULL, NULL);
+	  (*calls) ++;
+	  if (got < 0)
+	    break;
+	  pkt_queue_commit (queue, 0, 4000, got);
+	  frames ++;
+	}
+      while (pkt_queue_length (queue) > 0)
+	{
+	  pkt_queue_pack (queue, port, now_usec ());
+	  while (queue->send_off < queue->send_len)
+	    {
+	      ssize_t w = write (port->handle, queue->sendbuf + queue->send_off,
+				 queue->send_len - queue->send_off);
+	      (*calls) ++;
+	      if (w <= 0)
+		break;
+	      queue->send_off += w;
+	    }
+	}
+    }
+  close (epfd);
+  return frames;
+}
+
+#ifdef U2S_HAVE_IO_URING
+#define TAG_RECV 0
+#define TAG_WRITE 1
+#define TAG_IDLE 2
+#define RECV_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + PKT_QUEUE_PAYLOAD_MAX)
+
+/* The io_uring loop, as in main.c's run_uring. */
+static size_t
+run_uring (pkt_queue_t *queue, serial_port_t *port, size_t *calls)
+{
+  uring_t ring;
+  struct io_uring_cqe *cqe;
+  struct msghdr msg;
+  struct __kernel_timespec idle_ts = { 0, 100 * 1000000 };
+  int armed = 0, writing = 0, idle = 0, quiet = 0;
+  size_t frames = 0;
+
+  if (uring_init (&ring, 64) < 0
+      || uring_register_buffer (&ring, queue->sendbuf, PKT_QUEUE_SENDBUF_MAX) < 0
+      || uring_provide_buffers (&ring, 64, RECV_BUFFER_SIZE) < 0)
+    {
+      perror ("io_uring");
+      exit (1);
+    }
+  memset (&msg, 0, sizeof(msg));
+  for (;;)
+    {
+      if (!armed)
+	{
+	  uring_prep_recvmsg_multishot (uring_get_sqe (&ring), rx_sock, &msg, TAG_RECV);
+	  armed = 1;
+	}
+      if (!writing)
+	{
+	  pkt_queue_pack (queue, port, now_usec ());
+	  if (queue->send_len > 0)
+	    {
+	      uring_prep_write_fixed (uring_get_sqe (&ring), port->handle,
+				      queue->sendbuf, queue->send_len, TAG_WRITE);
+	      writing = 1;
+	    }
+	}
+      if (!idle && sender_done)
+	{
+	  uring_prep_timeout (uring_get_sqe (&ring), &idle_ts, TAG_IDLE);
+	  idle = 1;
+	  quiet = 1;
+	}
+      if (uring_submit_and_wait (&ring, 1) < 0 && errno != EINTR)
+	break;
+      while ((cqe = uring_peek_cqe (&ring)) != NULL)
+	{
+	  if (cqe->user_data == TAG_RECV)
+	    {
+	      if (cqe->flags & IORING_CQE_F_BUFFER)
+		{
+		  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		  struct io_uring_recvmsg_out *out
+		    = (struct io_uring_recvmsg_out *) uring_buffer (&ring, bid);
+		  if (cqe->res >= 0)
+		    {
+		      if (pkt_queue_append (queue, 0, 4000, (char *) (out + 1), out->payloadlen))
+			frames ++;
+		      quiet = 0;
+		    }
+		  uring_recycle_buffer (&ring, bid);
+		}
+	      if (!(cqe->flags & IORING_CQE_F_MORE))
+		armed = 0;
+	    }
+	  else if (cqe->user_data == TAG_WRITE)
+	    {
+	      writing = 0;
+	      queue->send_off = queue->send_len;
+	    }
+	  else if (cqe->user_data == TAG_IDLE)
+	    {
+	      idle = 0;
+	      if (quiet && !writing && pkt_queue_length (queue) == 0)
+		goto done;
+	    }
+	  uring_cqe_seen (&ring);
+	}
+    }
+ done:
+  *calls = ring.enters;
+  uring_free (&ring);
+  return frames;
+}
+#endif
+
+static void
+bench (const char *name,
+       size_t (*loop) (pkt_queue_t *, serial_port_t *, size_t *))
+{
+  pkt_queue_t *queue = pkt_queue_new (256);
+  serial_port_t port;
+  struct rusage before, after;
+  pthread_t tx, rx;
+  size_t calls = 0, frames;
+  double cpu_usec, mb;
+  socklen_t len = sizeof(rx_addr);
+  int bufsize = 4 << 20;
+
+  rx_sock = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  setsockopt (rx_sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  memset (&rx_addr, 0, sizeof(rx_addr));
+  rx_addr.sin_family = AF_INET;
+  rx_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  bind (rx_sock, (struct sockaddr *) &rx_addr, sizeof(rx_addr));
+  getsockname (rx_sock, (struct sockaddr *) &rx_addr, &len);
+
+  pipe (pipe_fds);
+  fcntl (pipe_fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (pipe_fds[1], F_SETPIPE_SZ, 1 << 20);
+  memset (&port, 0, sizeof(port));
+  port.handle = pipe_fds[1];	/* unpaced, with a baud rate of 0 */
+
+  sender_done = 0;
+  drain_stop = 0;
+  pthread_create (&rx, NULL, drain, NULL);
+  pthread_create (&tx, NULL, sender, NULL);
+  /* The whole process, so that io_uring's kernel workers count too.
+     The sender and drain threads cost the same either way. */
+  getrusage (RUSAGE_SELF, &before);
+  frames = loop (queue, &port, &calls);
+  getrusage (RUSAGE_SELF, &after);
+  pthread_join (tx, NULL);
+  drain_stop = 1;
+  pthread_join (rx, NULL);
+
+  cpu_usec = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1e6
+    + (after.ru_utime.tv_usec - before.ru_utime.tv_usec)
+    + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e6
+    + (after.ru_stime.tv_usec - before.ru_stime.tv_usec);
+  mb = (double) frames * size / 1e6;
+  printf ("%-8s %7zu of %ld datagrams, %5.2f syscalls/datagram, %7.0f us CPU/MB, %zu queue drops\n",
+	  name, frames, count, (double) calls / (frames ? frames : 1),
+	  cpu_usec / (mb > 0 ? mb : 1), queue->dropped);
+
+  close (rx_sock);
+  close (pipe_fds[0]);
+  close (pipe_fds[1]);
+  pkt_queue_free (queue);
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (argc > 1)
+    rate = atol (argv[1]);
+  if (argc > 2)
+    size = atol (argv[2]);
+  if (argc > 3)
+    count = atol (argv[3]);
+  if (size > PKT_QUEUE_PAYLOAD_MAX)
+    size = PKT_QUEUE_PAYLOAD_MAX;
+
+  printf ("%ld datagrams of %zu bytes at %ld/s\n", count, size, rate);
+  bench ("epoll", run_epoll);
+#ifdef U2S_HAVE_IO_URING
+  bench ("io_uring", run_uring);
+#endif
+  return 0;
+}
@@ -4,6 +4,7 @@
 
 #include "Half_duplex.h"
 #include <string>
+#include "../udptoserial/Usdt.h"
 
 #define LONG_TIMEOUTS
 namespace Serial
@@ -33,6 +34,11 @@ namespace Serial
 	const static char SYN = 22;
 	const static char ETB = 23;
 
+	enum Decode_error {
+		DECODE_MALFORMED,
+		DECODE_CHECKSUM,
+	};
+
 	const std::string CONTROL_CHARACTERS = "\x01\x02\x03\x04\x05\x06\x10\x15\x16\x17";
 	const std::string MSG_START_CHARACTERS = "\x01\x02\x04\x05\x06\x10\x15";
 
@@ -150,6 +156,7 @@ namespace Serial
 		, controller_(ctrl)
 		, state_(State::NEUTRAL)
 	{
+		register_metrics(device);
 		port_.set_option(asio::serial_port_base::baud_rate(_baud_rate));
 
 		// Start up the async read handler.
@@ -168,23 +175,23 @@ namespace Serial
 	// This is the public API that adds a message to the output queue.
 	void Half_duplex::enqueue_message(std::string header, std::string body)
 	{
-		BOOST_LOG_TRIVIAL(debug) << "enqueue_message called";
+		LOG_EVENT(debug, "enqueue_message called");
 
 		Msg m;
 		m.type = Msg_type::INFO;
-		m.header = header;
-		m.body = body;
+		m.header = std::move(header);
+		m.body = std::move(body);
 		io_mutex_.lock();
-		output_queue_.push_back(m);
+		output_queue_.push_back(std::move(m));
 		io_mutex_.unlock();
 
-		BOOST_LOG_TRIVIAL(debug) << "there are " << output_queue_.size() << " messages in the output queue";
+		LOG_EVENT(debug, "there are {} messages in the output queue", output_queue_.size());
 	}
 
 	// This is the public API that gets a message from the input queue.
 	bool Half_duplex::get_next_message(std::string& header, std::string& body)
 	{
-		BOOST_LOG_TRIVIAL(debug) << "get_next_message called with " << input_queue_.size() << " message(s) in the input queue";
+		LOG_EVENT(debug, "get_next_message called with {} message(s) in the input queue", input_queue_.size());
 
 		Msg g;
 		bool ret = false;
@@ -192,10 +199,10 @@ namespace Serial
 		io_mutex_.lock();
 		if (input_queue_.size() > 0)
 		{
-			g = input_queue_.front();
+			g = std::move(input_queue_.front());
 			input_queue_.pop_front();
-			header = g.header;
-			body = g.body;
+			header = std::move(g.header);
+			body = std::move(g.body);
 			ret = true;
 		}
 		io_mutex_.unlock();
@@ -210,6 +217,8 @@ namespace Serial
 			(unsigned char *)&input_raw_[0],
 			input_raw_ + bytes_transferred);
 
+		metric_add(rx_bytes_metric_, bytes_transferred);
+
 		// Receipt of any characters resets the No Activity Timer.
 		no_activity_timer_.expires_from_now(NO_ACTIVITY_TIMEOUT);
 
@@ -222,7 +231,9 @@ namespace Serial
 				// No complete message ready to go, so keep waiting.
 				break;
 
-			BOOST_LOG_TRIVIAL(debug) << "read_handler: state " << to_string(state_) << ", message " << to_string(m.type);
+			LOG(debug) << "read_handler: state " << to_string(state_) << ", message " << to_string(m.type);
+			if (m.type == Msg_type::MALFORMED)
+				metric_add(errors_metric_ + DECODE_MALFORMED);
 
 			// Otherwise, handle messages based on the current state.
 			switch (state_)
@@ -271,7 +282,7 @@ namespace Serial
 	
 	inline void Half_duplex::write_output_queue_msg()
 	{
-		last_message_ = output_queue_.front();
+		last_message_ = std::move(output_queue_.front());
 		output_queue_.pop_front();
 		std::string reply_str = to_string(last_message_);
 		asio::write(port_, asio::buffer(reply_str));
@@ -281,13 +292,13 @@ namespace Serial
 	{
 		if (output_queue_.empty())
 		{
-			BOOST_LOG_TRIVIAL(debug) << "transmit empty queue";
+			LOG_EVENT(debug, "transmit empty queue");
 			write_simple_msg(Msg_type::EOT);
 			change_state(State::NEUTRAL);
 		}
 		else
 		{
-			BOOST_LOG_TRIVIAL(debug) << "transmit, " << output_queue_.size() << " messages in queue";
+			LOG_EVENT(debug, "transmit, {} messages in queue", output_queue_.size());
 			change_state(State::MASTER_INFO_TRANSMIT);
 			write_output_queue_msg();
 			change_state(State::MASTER_INFO_ACK_RECEIVE);
@@ -340,7 +351,7 @@ namespace Serial
 			{
 				if (accepting_input_)
 				{
-					BOOST_LOG_TRIVIAL(debug) << "accepting selection by alpha";
+					LOG(debug) << "accepting selection by alpha";
 					change_state(State::SLAVE_SELECT_ACK_TRANSMIT);
 					write_simple_msg(Msg_type::ACK);
 					change_state(State::SLAVE_INFO_RECEIVE);
@@ -358,13 +369,13 @@ namespace Serial
 		{
 			if (controller_ && (m.prefix == "alpha"))
 			{
-				BOOST_LOG_TRIVIAL(debug) << "slave_select_receive ACK(alpha == me) received";
+				LOG(debug) << "slave_select_receive ACK(alpha == me) received";
 			}
 		}
 		else if (m.type == Msg_type::EOT)
 		{
 			if (controller_)
-				BOOST_LOG_TRIVIAL(debug) << "bravo rejects selection";
+				LOG(debug) << "bravo rejects selection";
 			change_state(State::NEUTRAL);
 		}
 		else
@@ -378,7 +389,7 @@ namespace Serial
 		// data.
 		if (m.type == Msg_type::ACK)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "peer accepted my selection as master";
+			LOG(debug) << "peer accepted my selection as master";
 			enq_nak_count_ = 0;
 			handle_output_queue_msg_and_state();
 		}
@@ -388,7 +399,7 @@ namespace Serial
 			// neutral, unless this has happened too many times.
 			if (controller_)
 			{
-				BOOST_LOG_TRIVIAL(debug) << "peer rejected my selection as master";
+				LOG(debug) << "peer rejected my selection as master";
 
 				enq_nak_count_++;
 				if (enq_nak_count_ < MAX_ENQ_TRIES)
@@ -397,7 +408,7 @@ namespace Serial
 				}
 				else
 				{
-					BOOST_LOG_TRIVIAL(warning) << "Exceeded max number of tries to poll " << m.prefix;
+					LOG(warning) << "Exceeded max number of tries to poll " << m.prefix;
 					change_state(State::NEUTRAL);
 				}
 			}
@@ -420,7 +431,7 @@ namespace Serial
 	// {
 	//   // I'm not expecting any messages right now.  It is supposed to
 	//   // be my turn to send INFO messages.
-	//     BOOST_LOG_TRIVIAL(debug) << "handle_message_master_transmit_state(" << (int)m.type << ")";
+	//     LOG(debug) << "handle_message_master_transmit_state(" << (int)m.type << ")";
 	//   if (m.type == Msg_type::DLE_EOT)
 	//     handle_clear_request();
 	//   else
@@ -440,14 +451,14 @@ namespace Serial
 		// I've sent an INFO message, and I'm expecting an ACK.
 		if (m.type == Msg_type::ACK)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "peer accepted my info message";
+			LOG(debug) << "peer accepted my info message";
 			no_response_timer_.cancel();
 			info_nak_count_ = 0;
 			handle_output_queue_msg_and_state();
 		}
 		else if (m.type == Msg_type::NAK)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "peer rejected my info message";
+			LOG(debug) << "peer rejected my info message";
 			// Slave wants the previous message resent
 			no_response_timer_.cancel();
 			info_nak_count_++;
@@ -473,23 +484,23 @@ namespace Serial
 	void Half_duplex::handle_message_slave_info_receive_state(Msg& m)
 	{
 		// I'm expecting for an INFO message from master.
-		BOOST_LOG_TRIVIAL(debug) << "handle_message_slave_info_receive_state(" << to_string(m.type) << ")";
+		LOG(debug) << "handle_message_slave_info_receive_state(" << to_string(m.type) << ")";
 		if (m.type == Msg_type::INFO)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "accepting valid INFO message";
+			LOG(debug) << "accepting valid INFO message";
 			// FIXME: add some sort of thresholds where I can choose to EOT
 			// if I have received too many messages.
 
 			change_state(State::SLAVE_INFO_ACK_TRANSMIT);
 			io_mutex_.lock();
-			input_queue_.push_back(m);
+			input_queue_.push_back(std::move(m));
 			io_mutex_.unlock();
 			write_simple_msg(Msg_type::ACK);
 			change_state(State::SLAVE_INFO_RECEIVE);
 		}
 		else if (m.type == Msg_type::MALFORMED)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "rejecting malformed message";
+			LOG(debug) << "rejecting malformed message";
 			change_state(State::SLAVE_INFO_ACK_TRANSMIT);
 			write_simple_msg(Msg_type::NAK);
 			change_state(State::SLAVE_INFO_RECEIVE);
@@ -507,7 +518,7 @@ namespace Serial
 
 	void Half_duplex::handle_clear_request()
 	{
-		BOOST_LOG_TRIVIAL(debug) << "clearing the channel";
+		LOG(debug) << "clearing the channel";
 		// Clear all the queues.
 		input_unprocessed_.clear();
 		io_mutex_.lock();
@@ -534,7 +545,7 @@ namespace Serial
 		{
 			if (input_unprocessed_.size() > MAX_PREFIX_LEN)
 			{
-				BOOST_LOG_TRIVIAL(debug) << "Prefix too long";
+				LOG(debug) << "Prefix too long";
 				input_unprocessed_.clear();
 				msg.type = Msg_type::MALFORMED;
 			}
@@ -546,7 +557,7 @@ namespace Serial
 			input_unprocessed_.cbegin() + pos_intro,
 			isgraph))
 		{
-			BOOST_LOG_TRIVIAL(debug) << "Prefix contains non-graphical characters";
+			LOG(debug) << "Prefix contains non-graphical characters";
 			msg.type = Msg_type::MALFORMED;
 			input_unprocessed_.clear();
 			return msg;
@@ -589,7 +600,7 @@ namespace Serial
 		// Information messages don't have prefixes
 		if (!msg.prefix.empty())
 		{
-			BOOST_LOG_TRIVIAL(debug) << "Invalid prefix for information message";
+			LOG(debug) << "Invalid prefix for information message";
 			input_unprocessed_.clear();
 			msg.type = Msg_type::MALFORMED;
 			return msg;
@@ -606,7 +617,7 @@ namespace Serial
 			// No end of message found
 			if (input_unprocessed_.size() > MAX_MESSAGE_LEN)
 			{
-				BOOST_LOG_TRIVIAL(debug) << "Info message with missing ETX";
+				LOG(debug) << "Info message with missing ETX";
 				msg.type = Msg_type::MALFORMED;
 				input_unprocessed_.clear();
 				return msg;
@@ -617,7 +628,7 @@ namespace Serial
 
 		if (pos_stx == std::string::npos || pos_stx > pos_etx)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "Info message with missing STX";
+			LOG(debug) << "Info message with missing STX";
 			input_unprocessed_.clear();
 			msg.type = Msg_type::MALFORMED;
 			return msg;
@@ -631,7 +642,7 @@ namespace Serial
 
 		if (pos_etx > MAX_MESSAGE_LEN)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "Info message too long";
+			LOG(debug) << "Info message too long";
 			msg.type = Msg_type::MALFORMED;
 			input_unprocessed_.clear();
 			return msg;
@@ -651,7 +662,8 @@ namespace Serial
 		#if 0
 		if (cksum != compute_cksum(pos_intro + 1, pos_etx + 1))
 		{
-			BOOST_LOG_TRIVIAL(debug) << "Info message checksum error";
+			LOG(debug) << "Info message checksum error";
+			metric_add(errors_metric_ + DECODE_CHECKSUM);
 			input_unprocessed_.clear();
 			msg.type = Msg_type::MALFORMED;
 			return msg;
@@ -679,20 +691,20 @@ namespace Serial
 	// needs to be a master station.
 	void Half_duplex::poll(const system::error_code& ec)
 	{
-		BOOST_LOG_TRIVIAL(debug) << "in poll()";
+		LOG(debug) << "in poll()";
 		poll_timer_.expires_from_now(POLL_TIMEOUT);
 		auto func = std::bind(&Half_duplex::poll, this, _1);
 		poll_timer_.async_wait(func);
 
 		if (state_ != State::NEUTRAL)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "not polling because state is " << to_string(state_);
+			LOG(debug) << "not polling because state is " << to_string(state_);
 			return;
 		}
 
 		if (!controller_)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "not polling because not the controlling peer";
+			LOG(debug) << "not polling because not the controlling peer";
 			return;
 		}
 
@@ -701,19 +713,19 @@ namespace Serial
 		if (!output_queue_.empty())
 		{
 			// First, send out an EOT to make sure the peer is in neutral
-			BOOST_LOG_TRIVIAL(debug) << "poll(): supervisor sends initial EOT";
+			LOG(debug) << "poll(): supervisor sends initial EOT";
 			write_simple_msg(Msg_type::EOT);
 
 			// Second, we inform us and the peer that we are becoming master station
 			{
 				change_state(State::POLL_TRANSMIT);
-				BOOST_LOG_TRIVIAL(debug) << "poll(): supervisor sends poll ENQ to alpha";
+				LOG(debug) << "poll(): supervisor sends poll ENQ to alpha";
 				write_simple_msg(Msg_type::ENQ, "alpha");
 			}
 			// Third, we query the peer if it wants to connect with us
 			{
 				change_state(State::MASTER_SELECT_TRANSMIT);
-				BOOST_LOG_TRIVIAL(debug) << "poll(): supervisor sends select ENQ to bravo";
+				LOG(debug) << "poll(): supervisor sends select ENQ to bravo";
 				write_simple_msg(Msg_type::ENQ, "bravo");
 			}
 
@@ -727,13 +739,13 @@ namespace Serial
 			// If our output queue is empty, we can ask the peer if it wants to be
 			// the master station
 			// First, send out an EOT to make sure the peer is in neutral
-			BOOST_LOG_TRIVIAL(debug) << "poll(): supervisor sends initial EOT";
+			LOG(debug) << "poll(): supervisor sends initial EOT";
 			write_simple_msg(Msg_type::EOT);
 
 			// Second, we inform the peer that they are becoming master station
 			{
 				change_state(State::POLL_TRANSMIT);
-				BOOST_LOG_TRIVIAL(debug) << "poll(): supervisor sends poll ENQ to bravo";
+				LOG(debug) << "poll(): supervisor sends poll ENQ to bravo";
 				write_simple_msg(Msg_type::ENQ, "bravo");
 			}
 			// FIXME: need a polling timeout
@@ -747,7 +759,7 @@ namespace Serial
 	//{
 	//	if (output_queue_.empty())
 	//	{
-	//		BOOST_LOG_TRIVIAL(debug) << "transmit() empty queue";
+	//		LOG(debug) << "transmit() empty queue";
 	//		Msg reply;
 	//		reply.type = Msg_type::EOT;
 	//		std::string reply_str = to_string(reply);
@@ -757,7 +769,7 @@ namespace Serial
 	//	}
 	//	else
 	//	{
-	//		BOOST_LOG_TRIVIAL(debug) << "transmit(), " << output_queue_.size() << " messages in queue";
+	//		LOG(debug) << "transmit(), " << output_queue_.size() << " messages in queue";
 	//		last_message_ = output_queue_.front();
 	//		output_queue_.pop_front();
 	//		std::string reply_str = to_string(last_message_);
@@ -775,7 +787,7 @@ namespace Serial
 	{
 		if (ec != asio::error::operation_aborted)
 		{
-			BOOST_LOG_TRIVIAL(debug) << "on_master_select_no_response_timeout";
+			LOG(debug) << "on_master_select_no_response_timeout";
 			write_simple_msg(Msg_type::EOT);
 			change_state(State::NEUTRAL);
 		}
@@ -785,6 +797,42 @@ namespace Serial
 	{
 		State old_state = state_;
 		state_ = _new;
-		BOOST_LOG_TRIVIAL(debug) << "state transition from " << to_string(old_state) << " to " << to_string(_new);
+		USDT(halfduplex, change_state, (int)old_state, (int)_new);
+		metric_add(transitions_metric_ + (uint32_t)old_state * STATE_COUNT + (uint32_t)_new);
+		LOG(debug) << "state transition from " << to_string(old_state) << " to " << to_string(_new);
+	}
+
+	void Half_duplex::register_metrics(const std::string& device)
+	{
+		std::vector<std::string> labels;
+		for (size_t from = 0; from < STATE_COUNT; from++)
+			for (size_t to = 0; to < STATE_COUNT; to++)
+			{
+				std::string l;
+				metrics_add_label(l, "device", device);
+				metrics_add_label(l, "from", to_string((State)from));
+				metrics_add_label(l, "to", to_string((State)to));
+				labels.push_back(l);
+			}
+		transitions_metric_ = metric_register("halfduplex_state_transitions_total",
+			"ISO 1745 state transitions, by the states before and after.", metric_type::COUNTER, labels);
+
+		labels.clear();
+		for (auto kind : { "malformed", "checksum" })
+		{
+			std::string l;
+			metrics_add_label(l, "device", device);
+			metrics_add_label(l, "kind", kind);
+			labels.push_back(l);
+		}
+		errors_metric_ = metric_register("halfduplex_decode_errors_total",
+			"Messages thrown away; malformed counts checksum failures too.", metric_type::COUNTER, labels);
+
+		labels.clear();
+		std::string l;
+		metrics_add_label(l, "device", device);
+		labels.push_back(l);
+		rx_bytes_metric_ = metric_register("halfduplex_received_bytes_total",
+			"Bytes read from the serial port.", metric_type::COUNTER, labels);
 	}
 }
@@ -5,7 +5,8 @@
 #include <sdkddkver.h>
 #endif
 #include <boost/asio.hpp>
-#include <boost/log/trivial.hpp>
+#include "../udptoserial/Log.h"
+#include "../libhorizr/metrics.h"
 #include <chrono>
 #include <functional>
 #include <mutex>
@@ -31,6 +32,7 @@ namespace Serial {
 		SLAVE_INFO_RECEIVE,
 		SLAVE_INFO_ACK_TRANSMIT,
 	};
+	const static size_t STATE_COUNT = (size_t)State::SLAVE_INFO_ACK_TRANSMIT + 1;
 
 	std::string to_string(State s);
 	enum class Msg_type {
@@ -90,6 +92,7 @@ namespace Serial {
 		void on_master_select_no_response_timeout(const system::error_code& ec);
 		
 		void change_state(State s);
+		void register_metrics(const std::string& device);
 
 		inline void write_simple_msg(Msg_type m);
 		inline void write_simple_msg(Msg_type m, const std::string prefix);
@@ -112,6 +115,13 @@ namespace Serial {
 		std::deque<Msg> input_queue_;
 		Msg last_message_;
 		std::deque<Msg> output_queue_;
+
+		// Counted by every state transition, from and to, and by every
+		// message thrown away: malformed ones, checksum failures
+		// included, and the checksum failures alone.
+		uint32_t transitions_metric_;
+		uint32_t errors_metric_;
+		uint32_t rx_bytes_metric_;
 	};
 }
 
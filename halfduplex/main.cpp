@@ -3,12 +3,16 @@
 #endif
 
 #include "Half_duplex.h"
+#include "../udptoserial/Metrics_server.h"
 #include <iostream>
 #include <stdexcept>
 using namespace std;
 
 std::shared_ptr<Serial::Half_duplex> com;
 
+// Where to ask for the state transition and error counts.
+const static char *METRICS_SOCKET = "halfduplex.metrics";
+
 static void timer_handler(const boost::system::error_code ec)
 {
   if (!ec)
@@ -22,13 +26,18 @@ static void timer_handler(const boost::system::error_code ec)
     }
 }
 
-int main()
+// The serial port can be given, as when running over
+// hack/link_emulator.
+int main(int argc, char *argv[])
 {
+  log_start("debug", "");
   asio::io_service service;
   try
     {
       //com = std::make_shared<Serial::Half_duplex>(service, "/dev/ttyUSB0", 115200, true);
-	  com = std::make_shared<Serial::Half_duplex>(service, "COM4", 115200, true);
+	  com = std::make_shared<Serial::Half_duplex>(service, argc > 1 ? argv[1] : "COM4", 115200, true);
+      auto metrics = std::make_shared<Metrics_server>(service, METRICS_SOCKET, metrics_write);
+      metrics->open();
 	  asio::deadline_timer timer(service);
       timer.expires_from_now(boost::posix_time::seconds(1));
       timer.async_wait(timer_handler);
@@ -38,6 +47,7 @@ int main()
     {
       cout << "There was an error: " << e.what() << endl;
     }
+  log_stop();
 
   return 0;
 }
@@ -2,6 +2,7 @@
 #define HORIZR_BYTEVECTOR
 
 #include <vector>
+#include <cstdint>
 
 int bytevector_compare(const std::vector<uint8_t>& A, const std::vector<uint8_t>& B);
 
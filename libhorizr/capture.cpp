@@ -0,0 +1,236 @@
+#include "capture.h"
+#include <mutex>
+#include <vector>
+
+// This contains the per-thread capture rings and the pcapng writer.
+//
+// A record in a ring is
+//
+//   size(4) iface(1) dir(1) pad(2) len(4) orig_len(4) ns(8) data...
+//
+// in the host's byte order, with SIZE the whole record's, padded to 8
+// bytes.  A record whose IFACE is RING_SKIP only says that the rest of
+// the ring, to its end, is empty.
+//
+// pcapng files are written in the host's byte order too, which the
+// section header's magic number tells readers.
+
+const static size_t RING_HEADER_LEN = 24;
+const static uint8_t RING_SKIP = 0xFF;
+
+const static uint32_t PCAPNG_SHB = 0x0A0D0D0A;
+const static uint32_t PCAPNG_IDB = 1;
+const static uint32_t PCAPNG_EPB = 6;
+const static uint32_t PCAPNG_BYTE_ORDER = 0x1A2B3C4D;
+const static uint16_t PCAPNG_OPT_END = 0;
+const static uint16_t PCAPNG_IF_NAME = 2;
+const static uint16_t PCAPNG_IF_TSRESOL = 9;
+const static uint16_t PCAPNG_EPB_FLAGS = 2;
+
+std::atomic<bool> capture_on_(false);
+std::atomic<uint32_t> capture_snaplen_(0);
+
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<capture_ring>> rings;
+
+static size_t align8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+static size_t align4(size_t n)
+{
+	return (n + 3) & ~(size_t)3;
+}
+
+capture_ring::capture_ring()
+	: bytes_(new uint8_t[CAPTURE_RING_SIZE])
+	, head_(0)
+	, tail_(0)
+	, peeked_(0)
+	, dropped_(0)
+{
+}
+
+bool capture_ring::push(capture_iface iface, capture_dir dir, uint64_t ns,
+	const uint8_t *data, size_t len, size_t orig_len)
+{
+	size_t need = align8(RING_HEADER_LEN + len);
+	size_t tail = tail_.load(std::memory_order_relaxed);
+	size_t head = head_.load(std::memory_order_acquire);
+	size_t off = tail % CAPTURE_RING_SIZE;
+	size_t to_end = CAPTURE_RING_SIZE - off;
+	size_t total = need > to_end ? need + to_end : need;
+	if (need > CAPTURE_RING_SIZE / 2 || tail + total - head > CAPTURE_RING_SIZE)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	if (need > to_end)
+	{
+		uint32_t size = (uint32_t)to_end;
+		memcpy(&bytes_[off], &size, 4);
+		bytes_[off + 4] = RING_SKIP;
+		off = 0;
+	}
+
+	uint8_t *p = &bytes_[off];
+	uint32_t size = (uint32_t)need;
+	uint32_t lens[2] = { (uint32_t)len, (uint32_t)orig_len };
+	memcpy(p, &size, 4);
+	p[4] = (uint8_t)iface;
+	p[5] = (uint8_t)dir;
+	p[6] = p[7] = 0;
+	memcpy(p + 8, lens, 8);
+	memcpy(p + 16, &ns, 8);
+	memcpy(p + RING_HEADER_LEN, data, len);
+	tail_.store(tail + total, std::memory_order_release);
+	return true;
+}
+
+bool capture_ring::peek(struct capture_record& rec)
+{
+	size_t head = head_.load(std::memory_order_relaxed);
+	size_t tail = tail_.load(std::memory_order_acquire);
+	while (head != tail)
+	{
+		const uint8_t *p = &bytes_[head % CAPTURE_RING_SIZE];
+		uint32_t size;
+		memcpy(&size, p, 4);
+		if (p[4] == RING_SKIP)
+		{
+			head += size;
+			head_.store(head, std::memory_order_release);
+			continue;
+		}
+		rec.iface = p[4];
+		rec.dir = p[5];
+		memcpy(&rec.len, p + 8, 4);
+		memcpy(&rec.orig_len, p + 12, 4);
+		memcpy(&rec.ns, p + 16, 8);
+		rec.data = p + RING_HEADER_LEN;
+		peeked_ = size;
+		return true;
+	}
+	return false;
+}
+
+void capture_ring::pop()
+{
+	head_.store(head_.load(std::memory_order_relaxed) + peeked_, std::memory_order_release);
+	peeked_ = 0;
+}
+
+capture_ring *capture_ring_register()
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	rings.emplace_back(new capture_ring);
+	return rings.back().get();
+}
+
+void capture_drain(const std::function<void(const struct capture_record&)>& write, uint64_t& dropped)
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (auto& r : rings)
+	{
+		struct capture_record rec;
+		while (r->peek(rec))
+		{
+			write(rec);
+			r->pop();
+		}
+		dropped += r->take_dropped();
+	}
+}
+
+static void put(std::vector<uint8_t>& dest, const void *p, size_t len)
+{
+	const uint8_t *b = static_cast<const uint8_t *>(p);
+	dest.insert(dest.end(), b, b + len);
+}
+
+template <typename T>
+static void put(std::vector<uint8_t>& dest, T val)
+{
+	put(dest, &val, sizeof(val));
+}
+
+// Given an option's CODE and value, append it onto DEST, padded to 4
+// bytes.
+static void put_option(std::vector<uint8_t>& dest, uint16_t code, const void *value, size_t len)
+{
+	put(dest, code);
+	put(dest, (uint16_t)len);
+	put(dest, value, len);
+	dest.insert(dest.end(), align4(len) - len, 0);
+}
+
+capture_file_writer::capture_file_writer(FILE *f, uint32_t snaplen)
+	: f_(f)
+	, size_(0)
+{
+	static const uint16_t LINKTYPES[CAPTURE_IFACES] = {
+		CAPTURE_LINKTYPE_USER0, CAPTURE_LINKTYPE_RAW, CAPTURE_LINKTYPE_USER1
+	};
+	static const char *const NAMES[CAPTURE_IFACES] = { "link", "ipv4", "undecodable" };
+
+	std::vector<uint8_t> body;
+	put(body, PCAPNG_BYTE_ORDER);
+	put(body, (uint16_t)1);
+	put(body, (uint16_t)0);
+	put(body, (int64_t)-1);
+	put_block(PCAPNG_SHB, body.data(), body.size());
+
+	// Timestamps are in nanoseconds.
+	const uint8_t tsresol = 9;
+	for (int i = 0; i < CAPTURE_IFACES; i++)
+	{
+		body.clear();
+		put(body, LINKTYPES[i]);
+		put(body, (uint16_t)0);
+		put(body, snaplen);
+		put_option(body, PCAPNG_IF_NAME, NAMES[i], strlen(NAMES[i]));
+		put_option(body, PCAPNG_IF_TSRESOL, &tsresol, 1);
+		put_option(body, PCAPNG_OPT_END, nullptr, 0);
+		put_block(PCAPNG_IDB, body.data(), body.size());
+	}
+}
+
+void capture_file_writer::put_block(uint32_t type, const uint8_t *body, size_t len)
+{
+	uint32_t total = (uint32_t)(12 + align4(len));
+	static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+	fwrite(&type, 4, 1, f_);
+	fwrite(&total, 4, 1, f_);
+	fwrite(body, 1, len, f_);
+	fwrite(zeros, 1, align4(len) - len, f_);
+	fwrite(&total, 4, 1, f_);
+	size_ += total;
+}
+
+// An enhanced packet block, put together around the record's data so
+// that it isn't copied again.
+void capture_file_writer::write(const struct capture_record& rec)
+{
+	static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+	const size_t fixed = 4 + 4 + 4 + 4 + 4;
+	const size_t options = 4 + 4 + 4;
+	uint32_t total = (uint32_t)(12 + fixed + align4(rec.len) + options);
+
+	uint32_t head[7] = { PCAPNG_EPB, total, rec.iface, (uint32_t)(rec.ns >> 32), (uint32_t)rec.ns,
+		rec.len, rec.orig_len };
+	fwrite(head, sizeof(head), 1, f_);
+	fwrite(rec.data, 1, rec.len, f_);
+	fwrite(zeros, 1, align4(rec.len) - rec.len, f_);
+
+	uint8_t *p = buf_;
+	uint16_t opt[2] = { PCAPNG_EPB_FLAGS, 4 };
+	uint32_t flags = rec.dir;
+	uint16_t end[2] = { PCAPNG_OPT_END, 0 };
+	memcpy(p, opt, 4);
+	memcpy(p + 4, &flags, 4);
+	memcpy(p + 8, end, 4);
+	memcpy(p + 12, &total, 4);
+	fwrite(buf_, 16, 1, f_);
+	size_ += total;
+}
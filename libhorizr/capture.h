@@ -0,0 +1,145 @@
+#ifndef HORIZR_CAPTURE
+#define HORIZR_CAPTURE
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// Capturing what crosses the serial link, frame by frame, for Wireshark.
+//
+// The forwarding path hands each decoded frame to capture_frame, which,
+// while capture is on, copies it into a byte ring of the calling thread's
+// own, and otherwise costs one relaxed load.  Some other thread drains
+// the rings into pcapng files.  A ring that is full drops what doesn't
+// fit, and counts it, so the forwarding path never waits.
+//
+// A pcapng file gives each interface one link type, so frames are filed
+// under three: IPv4 packets as raw IP, link frames of our own under
+// DLT_USER0, and the bytes of frames that couldn't be made sense of under
+// DLT_USER1.  Which way a frame went is in its direction flag.
+
+enum capture_iface
+{
+	CAPTURE_LINK,
+	CAPTURE_IPV4,
+	CAPTURE_BAD,
+	CAPTURE_IFACES
+};
+
+enum capture_dir
+{
+	CAPTURE_IN = 1,
+	CAPTURE_OUT = 2
+};
+
+// pcapng's link types for what capture_iface says.
+const uint16_t CAPTURE_LINKTYPE_RAW = 101;
+const uint16_t CAPTURE_LINKTYPE_USER0 = 147;
+const uint16_t CAPTURE_LINKTYPE_USER1 = 148;
+
+// Bytes in each thread's ring.  A serial link moves far less than this
+// between drains.
+const size_t CAPTURE_RING_SIZE = 1 << 20;
+
+// A record in a ring.  DATA points into the ring.
+struct capture_record
+{
+	uint8_t iface;
+	uint8_t dir;
+	uint32_t len;
+	uint32_t orig_len;
+	// System clock nanoseconds.
+	uint64_t ns;
+	const uint8_t *data;
+};
+
+// One thread's frames.  Only that thread pushes, and only the draining
+// thread peeks and pops, so neither takes a lock.  Records are kept
+// whole: one that won't fit before the end of the ring starts over at
+// the beginning, behind a marker that says to skip what is left.
+class capture_ring
+{
+public:
+	capture_ring();
+
+	bool push(capture_iface iface, capture_dir dir, uint64_t ns,
+		const uint8_t *data, size_t len, size_t orig_len);
+
+	// The oldest record, which stays put until it is popped.
+	bool peek(struct capture_record& rec);
+	void pop();
+
+	uint64_t take_dropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+private:
+	std::unique_ptr<uint8_t[]> bytes_;
+	// Apart, so that the two threads don't share a cache line.
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) std::atomic<size_t> tail_;
+	size_t peeked_;
+	std::atomic<uint64_t> dropped_;
+};
+
+// Whether frames are being captured, and how many bytes of each to keep,
+// or zero for all of them.
+extern std::atomic<bool> capture_on_;
+extern std::atomic<uint32_t> capture_snaplen_;
+
+// Make a ring for the calling thread and add it to those that
+// capture_drain looks at.  Rings last as long as the process.
+capture_ring *capture_ring_register();
+
+inline capture_ring& capture_ring_for_thread()
+{
+	static thread_local capture_ring *ring = nullptr;
+	if (ring == nullptr)
+		ring = capture_ring_register();
+	return *ring;
+}
+
+// Given FRAME, a decoded frame that went DIR, file it under IFACE, if
+// capture is on.
+inline void capture_frame(capture_iface iface, capture_dir dir, const uint8_t *frame, size_t len)
+{
+	if (!capture_on_.load(std::memory_order_relaxed))
+		return;
+	size_t snaplen = capture_snaplen_.load(std::memory_order_relaxed);
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	capture_ring_for_thread().push(iface, dir, ns, frame,
+		snaplen > 0 && len > snaplen ? snaplen : len, len);
+}
+
+// Hand every record waiting in every thread's ring to WRITE, oldest
+// first within each thread, and add to DROPPED the number that didn't
+// fit in their rings since the last drain.
+void capture_drain(const std::function<void(const struct capture_record&)>& write, uint64_t& dropped);
+
+// Writes records to a pcapng file: a section header and the three
+// interfaces, then a block for each record.
+class capture_file_writer
+{
+public:
+	// SNAPLEN is only for the interface descriptions; zero means
+	// frames are kept whole.
+	capture_file_writer(FILE *f, uint32_t snaplen);
+	void write(const struct capture_record& rec);
+
+	// Bytes written so far, headers included.
+	uint64_t size() const { return size_; }
+
+private:
+	void put_block(uint32_t type, const uint8_t *body, size_t len);
+
+	FILE *f_;
+	uint64_t size_;
+	uint8_t buf_[16];
+};
+
+#endif
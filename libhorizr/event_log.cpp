@@ -0,0 +1,222 @@
+#include "event_log.h"
+#include <algorithm>
+#include <mutex>
+
+// This contains the registry of per-thread event rings, the formatter,
+// and the event file format, which is:
+//
+//   "HZEVENT1", then the system clock at steady clock zero, as 8 bytes
+//   'S', site id (4), level (1), format length (2), format
+//   'R', site id (4), time (8), argument count (1), arguments (8 each)
+//   'D', count of records dropped (8)
+//
+// all big-endian, with the S for a site before its first R.
+
+static const char EVENT_FILE_MAGIC[8] = { 'H', 'Z', 'E', 'V', 'E', 'N', 'T', '1' };
+
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<event_ring>> rings;
+
+event_ring *event_ring_register()
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	rings.emplace_back(new event_ring);
+	return rings.back().get();
+}
+
+void event_drain(std::vector<struct event_record>& dest, uint64_t& dropped)
+{
+	size_t start = dest.size();
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		for (auto& r : rings)
+		{
+			struct event_record rec;
+			while (r->pop(rec))
+				dest.push_back(rec);
+			dropped += r->take_dropped();
+		}
+	}
+	// Each thread's records are in order already.
+	std::stable_sort(dest.begin() + start, dest.end(),
+		[](const struct event_record& a, const struct event_record& b) { return a.ns < b.ns; });
+}
+
+void event_format(std::string& dest, const char *fmt, const uint64_t *args, size_t nargs)
+{
+	char buf[24];
+	size_t next = 0;
+	const char *p = fmt;
+	while (*p != '\0')
+	{
+		const char *open = strchr(p, '{');
+		if (open == NULL)
+		{
+			dest.append(p);
+			break;
+		}
+		dest.append(p, open - p);
+		if (next < nargs && strncmp(open, "{}", 2) == 0)
+		{
+			snprintf(buf, sizeof(buf), "%llu", (unsigned long long)args[next++]);
+			dest.append(buf);
+			p = open + 2;
+		}
+		else if (next < nargs && strncmp(open, "{ip}", 4) == 0)
+		{
+			uint64_t a = args[next++];
+			snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (unsigned)(a >> 24) & 0xFF,
+				(unsigned)(a >> 16) & 0xFF, (unsigned)(a >> 8) & 0xFF, (unsigned)a & 0xFF);
+			dest.append(buf);
+			p = open + 4;
+		}
+		else
+		{
+			dest.push_back('{');
+			p = open + 1;
+		}
+	}
+}
+
+static void put_be(std::vector<uint8_t>& dest, uint64_t val, size_t len)
+{
+	for (size_t i = len; i > 0; i--)
+		dest.push_back((val >> (8 * (i - 1))) & 0xFF);
+}
+
+static uint64_t get_be(const uint8_t *p, size_t len)
+{
+	uint64_t val = 0;
+	for (size_t i = 0; i < len; i++)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+event_file_writer::event_file_writer(FILE *f)
+	: f_(f)
+{
+	using namespace std::chrono;
+	int64_t wall = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+	buf_.insert(buf_.end(), EVENT_FILE_MAGIC, EVENT_FILE_MAGIC + sizeof(EVENT_FILE_MAGIC));
+	put_be(buf_, (uint64_t)(wall - (int64_t)event_now()), 8);
+	flush_buf();
+}
+
+void event_file_writer::write(const struct event_record& rec)
+{
+	auto it = ids_.find(rec.site);
+	if (it == ids_.end())
+	{
+		uint32_t id = (uint32_t)ids_.size();
+		it = ids_.emplace(rec.site, id).first;
+		size_t len = std::min(strlen(rec.site->fmt), (size_t)0xFFFF);
+		buf_.push_back('S');
+		put_be(buf_, id, 4);
+		put_be(buf_, (uint8_t)rec.site->level, 1);
+		put_be(buf_, len, 2);
+		buf_.insert(buf_.end(), rec.site->fmt, rec.site->fmt + len);
+	}
+	buf_.push_back('R');
+	put_be(buf_, it->second, 4);
+	put_be(buf_, rec.ns, 8);
+	put_be(buf_, rec.nargs, 1);
+	for (uint32_t i = 0; i < rec.nargs; i++)
+		put_be(buf_, rec.args[i], 8);
+	flush_buf();
+}
+
+void event_file_writer::write_dropped(uint64_t count)
+{
+	buf_.push_back('D');
+	put_be(buf_, count, 8);
+	flush_buf();
+}
+
+// FILE buffers for us; this just saves a call per field.
+void event_file_writer::flush_buf()
+{
+	fwrite(buf_.data(), 1, buf_.size(), f_);
+	buf_.clear();
+}
+
+event_file_reader::event_file_reader(FILE *f)
+	: f_(f)
+	, valid_(false)
+	, error_(false)
+	, wall_offset_(0)
+{
+	uint8_t head[sizeof(EVENT_FILE_MAGIC) + 8];
+	if (!read_bytes(head, sizeof(head)) || memcmp(head, EVENT_FILE_MAGIC, sizeof(EVENT_FILE_MAGIC)) != 0)
+		return;
+	wall_offset_ = (int64_t)get_be(head + sizeof(EVENT_FILE_MAGIC), 8);
+	valid_ = true;
+}
+
+bool event_file_reader::read_bytes(void *p, size_t len)
+{
+	return fread(p, 1, len, f_) == len;
+}
+
+bool event_file_reader::next(struct event_record& rec)
+{
+	if (!valid_ || error_)
+		return false;
+	uint8_t b[8];
+	for (;;)
+	{
+		int tag = fgetc(f_);
+		if (tag == EOF)
+			return false;
+		if (tag == 'S')
+		{
+			uint8_t h[7];
+			if (!read_bytes(h, sizeof(h)))
+				break;
+			size_t len = get_be(h + 5, 2);
+			std::unique_ptr<std::string> fmt(new std::string(len, '\0'));
+			if (len > 0 && !read_bytes(&(*fmt)[0], len))
+				break;
+			std::unique_ptr<struct event_site> site(new event_site);
+			site->fmt = fmt->c_str();
+			site->level = h[4];
+			sites_[(uint32_t)get_be(h, 4)] = std::move(site);
+			fmts_.push_back(std::move(fmt));
+		}
+		else if (tag == 'R')
+		{
+			uint8_t h[13];
+			if (!read_bytes(h, sizeof(h)))
+				break;
+			auto it = sites_.find((uint32_t)get_be(h, 4));
+			if (it == sites_.end() || h[12] > EVENT_ARGS_MAX)
+				break;
+			rec.site = it->second.get();
+			rec.ns = get_be(h + 4, 8);
+			rec.nargs = h[12];
+			for (uint32_t i = 0; i < rec.nargs; i++)
+			{
+				if (!read_bytes(b, 8))
+				{
+					error_ = true;
+					return false;
+				}
+				rec.args[i] = get_be(b, 8);
+			}
+			return true;
+		}
+		else if (tag == 'D')
+		{
+			if (!read_bytes(b, 8))
+				break;
+			rec.site = nullptr;
+			rec.ns = 0;
+			rec.nargs = 1;
+			rec.args[0] = get_be(b, 8);
+			return true;
+		}
+		else
+			break;
+	}
+	error_ = true;
+	return false;
+}
@@ -0,0 +1,184 @@
+#ifndef HORIZR_EVENT_LOG
+#define HORIZR_EVENT_LOG
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// Binary event records, for logging on the forwarding path without doing
+// any formatting there.  A call site's format string and level live in a
+// static event_site.  A record is a pointer to its site, a timestamp and
+// up to EVENT_ARGS_MAX integers, and costs a copy into a ring of the
+// calling thread's own.  Some other thread drains the rings every so
+// often, and either formats the records or writes them to a file for
+// event_file_reader to decode later.
+//
+// In a format string, each {} stands for the next argument in decimal,
+// and each {ip} for the next argument as an IPv4 address.
+
+const size_t EVENT_ARGS_MAX = 4;
+
+// Records a thread makes faster than they are drained are dropped, and
+// counted.
+const size_t EVENT_RING_SIZE = 4096;
+
+struct event_site
+{
+	const char *fmt;
+	int level;
+};
+
+struct event_record
+{
+	// Steady clock nanoseconds.
+	uint64_t ns;
+	const struct event_site *site;
+	uint32_t nargs;
+	uint64_t args[EVENT_ARGS_MAX];
+};
+
+// One thread's records.  Only that thread pushes, and only the draining
+// thread pops, so neither takes a lock.
+class event_ring
+{
+public:
+	event_ring()
+		: head_(0)
+		, tail_(0)
+		, dropped_(0)
+	{
+	}
+
+	bool push(const struct event_record& rec)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) == EVENT_RING_SIZE)
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		slots_[tail & (EVENT_RING_SIZE - 1)] = rec;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(struct event_record& rec)
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return false;
+		rec = slots_[head & (EVENT_RING_SIZE - 1)];
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	uint64_t take_dropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+private:
+	struct event_record slots_[EVENT_RING_SIZE];
+	// Apart, so that the two threads don't share a cache line.
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) std::atomic<size_t> tail_;
+	std::atomic<uint64_t> dropped_;
+};
+
+// Make a ring for the calling thread and add it to those that
+// event_drain looks at.  Rings last as long as the process.
+event_ring *event_ring_register();
+
+inline event_ring& event_ring_for_thread()
+{
+	static thread_local event_ring *ring = nullptr;
+	if (ring == nullptr)
+		ring = event_ring_register();
+	return *ring;
+}
+
+inline uint64_t event_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename... Args>
+inline void event_add(const struct event_site& site, Args... args)
+{
+	static_assert(sizeof...(Args) <= EVENT_ARGS_MAX, "too many event arguments");
+	struct event_record rec;
+	rec.ns = event_now();
+	rec.site = &site;
+	rec.nargs = sizeof...(Args);
+	uint64_t a[] = { (uint64_t)args..., 0 };
+	memcpy(rec.args, a, sizeof(uint64_t) * sizeof...(Args));
+	event_ring_for_thread().push(rec);
+}
+
+// Take every record waiting in every thread's ring, and append them onto
+// DEST in order of time.  Add to DROPPED the number of records that
+// didn't fit in their rings since the last drain.
+void event_drain(std::vector<struct event_record>& dest, uint64_t& dropped);
+
+// Given a format string and its arguments, append the message onto DEST.
+// Arguments that FMT doesn't mention are ignored, and placeholders
+// without an argument are left as they are.
+void event_format(std::string& dest, const char *fmt, const uint64_t *args, size_t nargs);
+
+// Writes records to a file, with each site's format string the first
+// time it comes up.  The file starts with what the steady clock read
+// against the system clock, so that times can be put back into wall
+// clock time.
+class event_file_writer
+{
+public:
+	explicit event_file_writer(FILE *f);
+	void write(const struct event_record& rec);
+	void write_dropped(uint64_t count);
+
+private:
+	void flush_buf();
+
+	FILE *f_;
+	std::unordered_map<const struct event_site *, uint32_t> ids_;
+	std::vector<uint8_t> buf_;
+};
+
+// Reads back what an event_file_writer wrote.  Records come back with
+// sites of the reader's own, which last as long as it does.
+class event_file_reader
+{
+public:
+	explicit event_file_reader(FILE *f);
+
+	// False if the file doesn't start as an event file should.
+	bool valid() const { return valid_; }
+
+	// System clock nanoseconds at steady clock zero.
+	int64_t wall_offset() const { return wall_offset_; }
+
+	// The next record, or, where the writer dropped records, a record
+	// with no site and the number dropped as its one argument.  False at
+	// the end of the file, or if what is there doesn't make sense, in
+	// which case error() is true.
+	bool next(struct event_record& rec);
+	bool error() const { return error_; }
+
+private:
+	bool read_bytes(void *p, size_t len);
+
+	FILE *f_;
+	bool valid_;
+	bool error_;
+	int64_t wall_offset_;
+	std::unordered_map<uint32_t, std::unique_ptr<struct event_site>> sites_;
+	std::vector<std::unique_ptr<std::string>> fmts_;
+};
+
+#endif
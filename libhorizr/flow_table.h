@@ -0,0 +1,310 @@
+#ifndef HORIZR_FLOW_TABLE
+#define HORIZR_FLOW_TABLE
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// A table of flows -- proxied connections and sessions -- keyed by their
+// 4-tuple, with a fixed maximum size, least-recently-used eviction, and
+// idle timeouts.
+//
+// Entries live in one preallocated array and never move, so a flow can be
+// referred to by its handle, which is its index in that array.  Lookup is
+// through a separate open-addressing index of (hash, handle) pairs with
+// linear probing, kept at most half full.  A probe usually stays within
+// one cache line of the index and only touches an entry when the hash
+// matches.  Erasing uses backward-shift deletion, so there are no
+// tombstones and lookups don't slow down as flows come and go.
+//
+// Each entry is on a doubly-linked LRU list, and on one bucket of a timer
+// wheel.  Touching a flow only updates its timestamp and moves it to the
+// front of the LRU list.  When a bucket comes due, flows that turn out to
+// have been active are filed again further on, so an active flow costs
+// nothing on the wheel until its old deadline passes.
+//
+// Time is in ticks, a wrapping 32-bit counter supplied by the caller.
+
+struct flow_key
+{
+	uint64_t addrs;
+	uint32_t ports;
+};
+
+inline struct flow_key flow_key_make(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+	struct flow_key k;
+	k.addrs = ((uint64_t)saddr << 32) | daddr;
+	k.ports = ((uint32_t)sport << 16) | dport;
+	return k;
+}
+
+inline bool operator==(const struct flow_key& a, const struct flow_key& b)
+{
+	return a.addrs == b.addrs && a.ports == b.ports;
+}
+
+inline uint32_t flow_key_hash(const struct flow_key& k)
+{
+	uint64_t h = k.addrs * 0x9E3779B97F4A7C15ull;
+	h ^= (uint64_t)k.ports * 0xC2B2AE3D27D4EB4Full;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 32;
+	return (uint32_t)h;
+}
+
+const uint32_t FLOW_NIL = 0xFFFFFFFF;
+
+template <typename V>
+class flow_table
+{
+public:
+	// Handles are in the range 0 to MAX_FLOWS - 1.
+	explicit flow_table(size_t max_flows)
+		: entries_(max_flows)
+		, count_(0)
+		, free_(FLOW_NIL)
+		, lru_head_(FLOW_NIL)
+		, lru_tail_(FLOW_NIL)
+		, wheel_tick_(0)
+	{
+		size_t n = 16;
+		while (n < 2 * max_flows)
+			n *= 2;
+		index_.assign(n, slot{ 0, FLOW_NIL });
+		mask_ = (uint32_t)(n - 1);
+		for (size_t i = max_flows; i > 0; i--)
+		{
+			entries_[i - 1].lru_next = free_;
+			free_ = (uint32_t)(i - 1);
+		}
+		for (size_t i = 0; i < WHEEL_SIZE; i++)
+			wheel_[i] = FLOW_NIL;
+	}
+
+	size_t size() const { return count_; }
+	size_t capacity() const { return entries_.size(); }
+	bool full() const { return count_ == entries_.size(); }
+
+	// Return the handle of the flow with key K, or FLOW_NIL.
+	uint32_t find(const struct flow_key& k) const
+	{
+		uint32_t h = flow_key_hash(k);
+		for (uint32_t pos = h & mask_; index_[pos].handle != FLOW_NIL; pos = (pos + 1) & mask_)
+			if (index_[pos].hash == h && entries_[index_[pos].handle].key == k)
+				return index_[pos].handle;
+		return FLOW_NIL;
+	}
+
+	V& at(uint32_t handle) { return entries_[handle].value; }
+	const V& at(uint32_t handle) const { return entries_[handle].value; }
+	const struct flow_key& key_at(uint32_t handle) const { return entries_[handle].key; }
+
+	// Add a flow with key K, which must not already be in the table,
+	// that expires after IDLE_TICKS without a touch.  Returns its handle,
+	// or FLOW_NIL if the table is full.
+	uint32_t insert(const struct flow_key& k, V value, uint32_t idle_ticks, uint32_t now)
+	{
+		if (free_ == FLOW_NIL)
+			return FLOW_NIL;
+		uint32_t handle = free_;
+		entry& e = entries_[handle];
+		free_ = e.lru_next;
+
+		e.key = k;
+		e.hash = flow_key_hash(k);
+		e.value = std::move(value);
+		e.idle_ticks = idle_ticks;
+		e.last_tick = now;
+		count_++;
+
+		uint32_t pos = e.hash & mask_;
+		while (index_[pos].handle != FLOW_NIL)
+			pos = (pos + 1) & mask_;
+		index_[pos] = slot{ e.hash, handle };
+
+		lru_push_front(handle);
+		wheel_file(handle, now);
+		return handle;
+	}
+
+	// Mark a flow as active at NOW.
+	void touch(uint32_t handle, uint32_t now)
+	{
+		entries_[handle].last_tick = now;
+		if (lru_head_ != handle)
+		{
+			lru_unlink(handle);
+			lru_push_front(handle);
+		}
+	}
+
+	// Remove a flow.  Its value is reset, releasing whatever it held.
+	void erase(uint32_t handle)
+	{
+		entry& e = entries_[handle];
+		uint32_t i = e.hash & mask_;
+		while (index_[i].handle != handle)
+			i = (i + 1) & mask_;
+
+		// Backward-shift deletion: pull later members of the probe run
+		// back into the gap, unless that would move one before its home.
+		uint32_t j = i;
+		for (;;)
+		{
+			j = (j + 1) & mask_;
+			if (index_[j].handle == FLOW_NIL)
+				break;
+			uint32_t home = index_[j].hash & mask_;
+			if (((j - home) & mask_) >= ((j - i) & mask_))
+			{
+				index_[i] = index_[j];
+				i = j;
+			}
+		}
+		index_[i] = slot{ 0, FLOW_NIL };
+
+		lru_unlink(handle);
+		wheel_unlink(handle);
+		e.value = V();
+		e.lru_next = free_;
+		free_ = handle;
+		count_--;
+	}
+
+	// Return the least recently used flow, or FLOW_NIL if empty.
+	uint32_t lru() const { return lru_tail_; }
+
+	// To visit every flow, most recently used first: the most recently
+	// used flow, or FLOW_NIL if empty, and the one used before HANDLE,
+	// or FLOW_NIL after the last.
+	uint32_t mru() const { return lru_head_; }
+	uint32_t older(uint32_t handle) const { return entries_[handle].lru_next; }
+
+	// Remove every flow that has been idle for its timeout as of NOW,
+	// appending its key and value onto OUT.  Call this about once a tick.
+	void expire(uint32_t now, std::vector<std::pair<struct flow_key, V>>& out)
+	{
+		uint32_t ticks = now - wheel_tick_;
+		if (ticks > WHEEL_SIZE)
+			ticks = WHEEL_SIZE;
+		for (uint32_t t = 0; t < ticks; t++)
+		{
+			uint32_t bucket = (wheel_tick_ + 1 + t) & (WHEEL_SIZE - 1);
+			uint32_t handle = wheel_[bucket];
+			wheel_[bucket] = FLOW_NIL;
+			while (handle != FLOW_NIL)
+			{
+				entry& e = entries_[handle];
+				uint32_t next = e.wheel_next;
+				e.wheel_prev = e.wheel_next = FLOW_NIL;
+				e.wheel_bucket = FLOW_NIL;
+				if ((int32_t)(now - (e.last_tick + e.idle_ticks)) >= 0)
+				{
+					out.push_back(std::make_pair(e.key, std::move(e.value)));
+					erase(handle);
+				}
+				else
+					wheel_file(handle, now);
+				handle = next;
+			}
+		}
+		wheel_tick_ = now;
+	}
+
+private:
+	const static uint32_t WHEEL_SIZE = 256;
+
+	struct slot
+	{
+		uint32_t hash;
+		uint32_t handle;
+	};
+
+	struct entry
+	{
+		struct flow_key key;
+		uint32_t hash;
+		uint32_t last_tick;
+		uint32_t idle_ticks;
+		uint32_t lru_prev;
+		uint32_t lru_next;
+		uint32_t wheel_prev;
+		uint32_t wheel_next;
+		uint32_t wheel_bucket;
+		V value;
+	};
+
+	void lru_push_front(uint32_t handle)
+	{
+		entry& e = entries_[handle];
+		e.lru_prev = FLOW_NIL;
+		e.lru_next = lru_head_;
+		if (lru_head_ != FLOW_NIL)
+			entries_[lru_head_].lru_prev = handle;
+		lru_head_ = handle;
+		if (lru_tail_ == FLOW_NIL)
+			lru_tail_ = handle;
+	}
+
+	void lru_unlink(uint32_t handle)
+	{
+		entry& e = entries_[handle];
+		if (e.lru_prev != FLOW_NIL)
+			entries_[e.lru_prev].lru_next = e.lru_next;
+		else
+			lru_head_ = e.lru_next;
+		if (e.lru_next != FLOW_NIL)
+			entries_[e.lru_next].lru_prev = e.lru_prev;
+		else
+			lru_tail_ = e.lru_prev;
+	}
+
+	// File a flow in the bucket for its deadline, or as far out as the
+	// wheel reaches, whichever is sooner.
+	void wheel_file(uint32_t handle, uint32_t now)
+	{
+		entry& e = entries_[handle];
+		int32_t delta = (int32_t)(e.last_tick + e.idle_ticks - now);
+		if (delta < 1)
+			delta = 1;
+		if (delta > (int32_t)WHEEL_SIZE - 1)
+			delta = WHEEL_SIZE - 1;
+		uint32_t bucket = (now + delta) & (WHEEL_SIZE - 1);
+		e.wheel_bucket = bucket;
+		e.wheel_prev = FLOW_NIL;
+		e.wheel_next = wheel_[bucket];
+		if (wheel_[bucket] != FLOW_NIL)
+			entries_[wheel_[bucket]].wheel_prev = handle;
+		wheel_[bucket] = handle;
+	}
+
+	void wheel_unlink(uint32_t handle)
+	{
+		entry& e = entries_[handle];
+		if (e.wheel_bucket == FLOW_NIL)
+			return;
+		if (e.wheel_prev != FLOW_NIL)
+			entries_[e.wheel_prev].wheel_next = e.wheel_next;
+		else
+			wheel_[e.wheel_bucket] = e.wheel_next;
+		if (e.wheel_next != FLOW_NIL)
+			entries_[e.wheel_next].wheel_prev = e.wheel_prev;
+		e.wheel_bucket = FLOW_NIL;
+	}
+
+	std::vector<slot> index_;
+	uint32_t mask_;
+	std::vector<entry> entries_;
+	size_t count_;
+	uint32_t free_;
+	uint32_t lru_head_;
+	uint32_t lru_tail_;
+	uint32_t wheel_[WHEEL_SIZE];
+	uint32_t wheel_tick_;
+};
+
+#endif
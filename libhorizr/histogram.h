@@ -0,0 +1,58 @@
+#ifndef HORIZR_HISTOGRAM
+#define HORIZR_HISTOGRAM
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// A histogram with power-of-two buckets, for sizes and times where the
+// order of magnitude is what matters.  Bucket 0 counts zeros, and
+// bucket N counts values from 2^(N-1) up to 2^N - 1.  The last bucket
+// takes everything bigger.
+
+const size_t LOG2_HISTOGRAM_BUCKETS = 40;
+
+struct log2_histogram
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[LOG2_HISTOGRAM_BUCKETS];
+};
+
+inline void log2_histogram_reset(struct log2_histogram& h)
+{
+	memset(&h, 0, sizeof(h));
+}
+
+inline void log2_histogram_add(struct log2_histogram& h, uint64_t val)
+{
+	size_t b = 0;
+	while (b < LOG2_HISTOGRAM_BUCKETS - 1 && val >= ((uint64_t)1 << b))
+		b++;
+	h.buckets[b]++;
+	h.count++;
+	h.sum += val;
+}
+
+// The upper bound of the bucket that holds the Pth fraction of H's
+// values, so the Pth percentile is less than this.
+inline uint64_t log2_histogram_percentile(const struct log2_histogram& h, double p)
+{
+	uint64_t want = (uint64_t)(h.count * p);
+	uint64_t seen = 0;
+	for (size_t b = 0; b < LOG2_HISTOGRAM_BUCKETS; b++)
+	{
+		seen += h.buckets[b];
+		if (seen > want)
+			return (uint64_t)1 << b;
+	}
+	return (uint64_t)1 << (LOG2_HISTOGRAM_BUCKETS - 1);
+}
+
+inline uint64_t log2_histogram_mean(const struct log2_histogram& h)
+{
+	return h.count ? h.sum / h.count : 0;
+}
+
+#endif
@@ -4,5 +4,14 @@
 #include "bytevector.h"
 #include "slip.h"
 #include "ip.h"
+#include "link.h"
+#include "mux.h"
+#include "flow_table.h"
+#include "packet.h"
+#include "ring.h"
+#include "histogram.h"
+#include "event_log.h"
+#include "metrics.h"
+#include "capture.h"
 
 #endif
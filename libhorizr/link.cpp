@@ -0,0 +1,374 @@
+#include "link.h"
+#include <chrono>
+
+// This contains procedures that pack and unpack the control frames that
+// the two ends of the serial link send to each other.
+
+// Given FRAME, a decoded SLIP frame, return the LINK_FRAME_XXX
+// constant that describes it, or LINK_FRAME_UNKNOWN.  For stream mux
+// and UDP frames, the REPLY bit is stripped.
+uint8_t link_frame_type(const std::vector<uint8_t>& frame)
+{
+	return link_frame_type(frame.data(), frame.size());
+}
+
+uint8_t link_frame_type(const uint8_t *frame, size_t len)
+{
+	if (len == 0)
+		return LINK_FRAME_UNKNOWN;
+	uint8_t c = frame[0];
+	if ((c & 0xF0) == LINK_FRAME_IPV4)
+		return LINK_FRAME_IPV4;
+	if (c == LINK_FRAME_PROBE || c == LINK_FRAME_PROBE_ECHO || c == LINK_FRAME_RATE
+		|| c == LINK_FRAME_STAMP)
+		return c;
+	c &= ~LINK_FRAME_MUX_REPLY;
+	if (c >= LINK_FRAME_MUX_OPEN && c <= LINK_FRAME_MUX_CREDIT)
+		return c;
+	if (c == LINK_FRAME_UDP || c == LINK_FRAME_UDP_BATCH)
+		return c;
+	return LINK_FRAME_UNKNOWN;
+}
+
+void link_put_be16(std::vector<uint8_t>& dest, uint16_t val)
+{
+	dest.push_back((val >> 8) & 0xFF);
+	dest.push_back(val & 0xFF);
+}
+
+void link_put_be32(std::vector<uint8_t>& dest, uint32_t val)
+{
+	dest.push_back((val >> 24) & 0xFF);
+	dest.push_back((val >> 16) & 0xFF);
+	dest.push_back((val >> 8) & 0xFF);
+	dest.push_back(val & 0xFF);
+}
+
+void link_store_be16(uint8_t *p, uint16_t val)
+{
+	p[0] = (val >> 8) & 0xFF;
+	p[1] = val & 0xFF;
+}
+
+void link_store_be32(uint8_t *p, uint32_t val)
+{
+	p[0] = (val >> 24) & 0xFF;
+	p[1] = (val >> 16) & 0xFF;
+	p[2] = (val >> 8) & 0xFF;
+	p[3] = val & 0xFF;
+}
+
+uint16_t link_get_be16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+uint32_t link_get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+uint32_t link_now_usec()
+{
+	auto t = std::chrono::steady_clock::now().time_since_epoch();
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+}
+
+// Given PROBE, append a PROBE frame onto DEST.  PADDING extra zero bytes
+// are added so that probe trains can be sized like real traffic.
+void link_probe_encode(std::vector<uint8_t>& dest, const struct link_probe& probe, size_t padding)
+{
+	dest.push_back(LINK_FRAME_PROBE);
+	link_put_be16(dest, probe.seq);
+	link_put_be32(dest, probe.tx_usec);
+	link_put_be32(dest, probe.tx_bytes);
+	dest.insert(dest.end(), padding, 0);
+}
+
+// Given PROBE, append a PROBE_ECHO frame onto DEST.
+void link_probe_echo_encode(std::vector<uint8_t>& dest, const struct link_probe& probe)
+{
+	dest.push_back(LINK_FRAME_PROBE_ECHO);
+	link_put_be16(dest, probe.seq);
+	link_put_be32(dest, probe.tx_usec);
+	link_put_be32(dest, probe.tx_bytes);
+	link_put_be32(dest, probe.rx_usec);
+	link_put_be32(dest, probe.rx_bytes);
+	link_put_be32(dest, probe.echo_usec);
+}
+
+// Given FRAME, a decoded PROBE or PROBE_ECHO frame, unpack it into
+// PROBE.  Fields that the frame doesn't carry are set to zero.
+// Returns false if FRAME is too short.
+bool link_probe_decode(const std::vector<uint8_t>& frame, struct link_probe& probe)
+{
+	return link_probe_decode(frame.data(), frame.size(), probe);
+}
+
+bool link_probe_decode(const uint8_t *frame, size_t len, struct link_probe& probe)
+{
+	probe = link_probe{};
+	if (len < LINK_PROBE_LEN)
+		return false;
+	const uint8_t *p = frame + 1;
+	probe.seq = link_get_be16(p);
+	probe.tx_usec = link_get_be32(p + 2);
+	probe.tx_bytes = link_get_be32(p + 6);
+	if (frame[0] == LINK_FRAME_PROBE_ECHO)
+	{
+		if (len < LINK_PROBE_ECHO_SHORT_LEN)
+			return false;
+		probe.rx_usec = link_get_be32(p + 10);
+		probe.rx_bytes = link_get_be32(p + 14);
+		probe.echo_usec = len < LINK_PROBE_ECHO_LEN ? probe.rx_usec : link_get_be32(p + 18);
+	}
+	return true;
+}
+
+// Given ECHO, which arrived at NOW by our clock, update CLOCK.  With T1
+// to T4 the probe's departure, its arrival, the echo's departure and
+// its arrival, the round trip is (T4 - T1) - (T3 - T2), and the far
+// clock's offset is what makes T2 fall halfway through it:
+// (T2 - T1) - delay / 2.  The first difference is between the two
+// clocks and can be anything, but the round trip is a difference on one
+// clock at a time, so it is small.
+void link_clock_add(struct link_clock& clock, const struct link_probe& echo, uint32_t now)
+{
+	int32_t delay = (int32_t)((now - echo.tx_usec) - (echo.echo_usec - echo.rx_usec));
+	if (delay < 0)
+		return;
+	uint32_t offset = (echo.rx_usec - echo.tx_usec) - (uint32_t)delay / 2;
+
+	if (!clock.next_valid || (uint32_t)delay <= clock.next_delay)
+	{
+		clock.next_valid = true;
+		clock.next_offset = offset;
+		clock.next_delay = (uint32_t)delay;
+	}
+	if (!clock.valid || (uint32_t)delay <= clock.delay)
+	{
+		clock.valid = true;
+		clock.offset = offset;
+		clock.delay = (uint32_t)delay;
+	}
+	if (++clock.age >= LINK_CLOCK_WINDOW)
+	{
+		clock.offset = clock.next_offset;
+		clock.delay = clock.next_delay;
+		clock.next_valid = false;
+		clock.age = 0;
+	}
+}
+
+// Given USEC, store a STAMP frame's header at DEST.
+void link_stamp_encode_header(uint8_t *dest, uint32_t usec)
+{
+	dest[0] = LINK_FRAME_STAMP;
+	link_store_be32(dest + 1, usec);
+}
+
+// Given FRAME, a decoded STAMP frame, set USEC and step past the header.
+bool link_stamp_strip(const uint8_t *& frame, size_t& len, uint32_t& usec)
+{
+	if (len < LINK_STAMP_LEN)
+		return false;
+	usec = link_get_be32(frame + 1);
+	frame += LINK_STAMP_LEN;
+	len -= LINK_STAMP_LEN;
+	return true;
+}
+
+// Given RATE, append a RATE frame onto DEST.  Only an OFFER's rates are
+// sent, and a TEST or TEST_ECHO gets the test pattern.
+void link_rate_encode(std::vector<uint8_t>& dest, const struct link_rate& rate)
+{
+	dest.push_back(LINK_FRAME_RATE);
+	dest.push_back(rate.op);
+	link_put_be32(dest, rate.arg);
+	if (rate.op == LINK_RATE_OFFER)
+		for (size_t i = 0; i < rate.count && i < LINK_RATE_MAX; i++)
+			link_put_be32(dest, rate.rates[i]);
+	else if (rate.op == LINK_RATE_TEST || rate.op == LINK_RATE_TEST_ECHO)
+		for (size_t i = 0; i < LINK_RATE_PATTERN_LEN; i++)
+			dest.push_back((uint8_t)i);
+}
+
+// Given FRAME, a decoded RATE frame, unpack it into RATE.  Returns false
+// if FRAME is too short, or if a test pattern didn't arrive intact.
+bool link_rate_decode(const uint8_t *frame, size_t len, struct link_rate& rate)
+{
+	rate = link_rate{};
+	if (len < LINK_RATE_HEADER_LEN)
+		return false;
+	rate.op = frame[1];
+	rate.arg = link_get_be32(frame + 2);
+	const uint8_t *p = frame + LINK_RATE_HEADER_LEN;
+	size_t left = len - LINK_RATE_HEADER_LEN;
+	if (rate.op == LINK_RATE_OFFER)
+	{
+		for (; left >= 4 && rate.count < LINK_RATE_MAX; p += 4, left -= 4)
+			rate.rates[rate.count++] = link_get_be32(p);
+	}
+	else if (rate.op == LINK_RATE_TEST || rate.op == LINK_RATE_TEST_ECHO)
+	{
+		if (left != LINK_RATE_PATTERN_LEN)
+			return false;
+		for (size_t i = 0; i < LINK_RATE_PATTERN_LEN; i++)
+			if (p[i] != (uint8_t)i)
+				return false;
+	}
+	return true;
+}
+
+// Given DGRAM, append a UDP frame onto DEST.
+void link_udp_encode(std::vector<uint8_t>& dest, const struct link_udp& dgram)
+{
+	dest.push_back(LINK_FRAME_UDP | (dgram.reply ? LINK_FRAME_UDP_REPLY : 0));
+	link_put_be32(dest, dgram.caddr);
+	link_put_be16(dest, dgram.cport);
+	link_put_be32(dest, dgram.saddr);
+	link_put_be16(dest, dgram.sport);
+	dest.insert(dest.end(), dgram.data, dgram.data + dgram.len);
+}
+
+// Given DGRAM, store the header of a UDP frame at DEST.
+void link_udp_encode_header(uint8_t *dest, const struct link_udp& dgram)
+{
+	dest[0] = LINK_FRAME_UDP | (dgram.reply ? LINK_FRAME_UDP_REPLY : 0);
+	link_store_be32(dest + 1, dgram.caddr);
+	link_store_be16(dest + 5, dgram.cport);
+	link_store_be32(dest + 7, dgram.saddr);
+	link_store_be16(dest + 11, dgram.sport);
+}
+
+// Given FRAME, a decoded UDP frame, unpack it into DGRAM.  DGRAM's data
+// pointer points into FRAME.  Returns false if FRAME is too short.
+bool link_udp_decode(const std::vector<uint8_t>& frame, struct link_udp& dgram)
+{
+	return link_udp_decode(frame.data(), frame.size(), dgram);
+}
+
+bool link_udp_decode(const uint8_t *frame, size_t len, struct link_udp& dgram)
+{
+	dgram = link_udp{};
+	if (len < LINK_UDP_HEADER_LEN)
+		return false;
+	const uint8_t *p = frame;
+	dgram.reply = (p[0] & LINK_FRAME_UDP_REPLY) != 0;
+	dgram.caddr = link_get_be32(p + 1);
+	dgram.cport = link_get_be16(p + 5);
+	dgram.saddr = link_get_be32(p + 7);
+	dgram.sport = link_get_be16(p + 11);
+	dgram.data = p + LINK_UDP_HEADER_LEN;
+	dgram.len = len - LINK_UDP_HEADER_LEN;
+	return true;
+}
+
+// Given DGRAM, and PREV, the datagram before it in the batch or NULL,
+// store its entry's header at DEST and return its length.
+size_t link_udp_batch_encode_desc(uint8_t *dest, const struct link_udp& dgram, const struct link_udp *prev)
+{
+	uint8_t desc = 0;
+	uint8_t *p = dest + 1;
+	if (prev == nullptr || dgram.caddr != prev->caddr || dgram.saddr != prev->saddr)
+	{
+		desc |= LINK_UDP_BATCH_ADDRS;
+		link_store_be32(p, dgram.caddr);
+		link_store_be32(p + 4, dgram.saddr);
+		p += 8;
+	}
+	if (prev == nullptr || dgram.cport != prev->cport || dgram.sport != prev->sport)
+	{
+		desc |= LINK_UDP_BATCH_PORTS;
+		link_store_be16(p, dgram.cport);
+		link_store_be16(p + 2, dgram.sport);
+		p += 4;
+	}
+	if (dgram.len > 0xFF)
+	{
+		desc |= LINK_UDP_BATCH_LONG;
+		link_store_be16(p, (uint16_t)dgram.len);
+		p += 2;
+	}
+	else
+		*p++ = (uint8_t)dgram.len;
+	dest[0] = desc;
+	return p - dest;
+}
+
+// Given the COUNT datagrams at DGRAMS, append a UDP_BATCH frame onto
+// DEST.
+void link_udp_batch_encode(std::vector<uint8_t>& dest, const struct link_udp *dgrams, size_t count)
+{
+	dest.push_back(LINK_FRAME_UDP_BATCH | (count > 0 && dgrams[0].reply ? LINK_FRAME_UDP_REPLY : 0));
+	for (size_t i = 0; i < count; i++)
+	{
+		uint8_t desc[LINK_UDP_BATCH_DESC_MAX];
+		size_t n = link_udp_batch_encode_desc(desc, dgrams[i], i > 0 ? &dgrams[i - 1] : nullptr);
+		dest.insert(dest.end(), desc, desc + n);
+		dest.insert(dest.end(), dgrams[i].data, dgrams[i].data + dgrams[i].len);
+	}
+}
+
+// Given FRAME, a decoded UDP_BATCH frame, get BATCH ready to unpack it.
+void link_udp_batch_begin(struct link_udp_batch& batch, const uint8_t *frame, size_t len)
+{
+	batch = link_udp_batch{};
+	if (len == 0)
+		return;
+	batch.p = frame + 1;
+	batch.end = frame + len;
+	batch.last.reply = (frame[0] & LINK_FRAME_UDP_REPLY) != 0;
+}
+
+// Unpack BATCH's next datagram into DGRAM.  Returns false at the end of
+// the frame, or if the rest of it is malformed.
+bool link_udp_batch_next(struct link_udp_batch& batch, struct link_udp& dgram)
+{
+	if (batch.p == batch.end)
+		return false;
+	const uint8_t *p = batch.p;
+	size_t left = batch.end - p;
+	uint8_t desc = *p;
+	size_t need = 1 + ((desc & LINK_UDP_BATCH_ADDRS) ? 8 : 0)
+		+ ((desc & LINK_UDP_BATCH_PORTS) ? 4 : 0)
+		+ ((desc & LINK_UDP_BATCH_LONG) ? 2 : 1);
+	bool complete = (desc & LINK_UDP_BATCH_ADDRS) && (desc & LINK_UDP_BATCH_PORTS);
+	if (left < need || (!batch.started && !complete))
+	{
+		batch.error = true;
+		batch.p = batch.end;
+		return false;
+	}
+	p++;
+	if (desc & LINK_UDP_BATCH_ADDRS)
+	{
+		batch.last.caddr = link_get_be32(p);
+		batch.last.saddr = link_get_be32(p + 4);
+		p += 8;
+	}
+	if (desc & LINK_UDP_BATCH_PORTS)
+	{
+		batch.last.cport = link_get_be16(p);
+		batch.last.sport = link_get_be16(p + 2);
+		p += 4;
+	}
+	if (desc & LINK_UDP_BATCH_LONG)
+	{
+		batch.last.len = link_get_be16(p);
+		p += 2;
+	}
+	else
+		batch.last.len = *p++;
+	if ((size_t)(batch.end - p) < batch.last.len)
+	{
+		batch.error = true;
+		batch.p = batch.end;
+		return false;
+	}
+	batch.last.data = p;
+	batch.p = p + batch.last.len;
+	batch.started = true;
+	dgram = batch.last;
+	return true;
+}
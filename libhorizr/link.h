@@ -0,0 +1,276 @@
+#ifndef HORIZR_LINK
+#define HORIZR_LINK
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// Everything that crosses the serial link is a SLIP-encoded frame.  The
+// first byte of a decoded frame says what kind of frame it is.  IPv4
+// packets always begin with a byte whose high nibble is 4, so link
+// control frames use first bytes whose high nibble is something else.
+// Multi-byte fields in link control frames are big-endian.
+
+const uint8_t LINK_FRAME_UNKNOWN = 0x00;
+const uint8_t LINK_FRAME_IPV4 = 0x40;
+
+// A timestamped probe.  The receiver answers it with a PROBE_ECHO.
+const uint8_t LINK_FRAME_PROBE = 0x10;
+const uint8_t LINK_FRAME_PROBE_ECHO = 0x11;
+
+// Baud rate negotiation.  See Link_negotiator.h.
+const uint8_t LINK_FRAME_RATE = 0x12;
+
+// Another frame, with the sender's clock when it was handed to the
+// serial port in front of it.  See link_stamp_strip.
+const uint8_t LINK_FRAME_STAMP = 0x13;
+
+// Stream multiplexing for proxied TCP connections.  See mux.h.  The
+// REPLY bit is set on frames sent by the end that accepted the channel.
+const uint8_t LINK_FRAME_MUX_OPEN = 0x20;
+const uint8_t LINK_FRAME_MUX_DATA = 0x21;
+const uint8_t LINK_FRAME_MUX_FIN = 0x22;
+const uint8_t LINK_FRAME_MUX_RST = 0x23;
+const uint8_t LINK_FRAME_MUX_CREDIT = 0x24;
+const uint8_t LINK_FRAME_MUX_REPLY = 0x08;
+
+// A proxied UDP datagram, or a batch of them.  The REPLY bit is set on
+// datagrams going from a server back to its client.
+const uint8_t LINK_FRAME_UDP = 0x30;
+const uint8_t LINK_FRAME_UDP_BATCH = 0x31;
+const uint8_t LINK_FRAME_UDP_REPLY = 0x08;
+
+// Given FRAME, a decoded SLIP frame, return the LINK_FRAME_XXX
+// constant that describes it, or LINK_FRAME_UNKNOWN.  For stream mux
+// and UDP frames, the REPLY bit is stripped.
+uint8_t link_frame_type(const std::vector<uint8_t>& frame);
+uint8_t link_frame_type(const uint8_t *frame, size_t len);
+
+// Store big-endian integers onto the end of DEST.
+void link_put_be16(std::vector<uint8_t>& dest, uint16_t val);
+void link_put_be32(std::vector<uint8_t>& dest, uint32_t val);
+
+// Store big-endian integers at P.
+void link_store_be16(uint8_t *p, uint16_t val);
+void link_store_be32(uint8_t *p, uint32_t val);
+
+// Fetch big-endian integers from P.
+uint16_t link_get_be16(const uint8_t *p);
+uint32_t link_get_be32(const uint8_t *p);
+
+// A free-running microsecond clock that wraps, as carried in probes and
+// stamps.  Only differences between two readings mean anything.
+uint32_t link_now_usec();
+
+// A probe carries the sender's clock and the number of bytes the
+// sender has written to the serial port when the probe was queued.
+// The echo returns those, and adds the receiver's clock and the number
+// of bytes the receiver has read from the serial port when the probe
+// arrived, and then the receiver's clock again as the echo was handed
+// to its port.  Clocks are free-running microsecond counters that wrap.
+struct link_probe
+{
+	uint16_t seq;
+	uint32_t tx_usec;
+	uint32_t tx_bytes;
+	uint32_t rx_usec;
+	uint32_t rx_bytes;
+	uint32_t echo_usec;
+};
+
+const size_t LINK_PROBE_LEN = 1 + 2 + 4 + 4;
+const size_t LINK_PROBE_ECHO_LEN = LINK_PROBE_LEN + 4 + 4 + 4;
+
+// Echoes from ends that don't send ECHO_USEC are this long.  Their
+// ECHO_USEC is taken to be their RX_USEC.
+const size_t LINK_PROBE_ECHO_SHORT_LEN = LINK_PROBE_LEN + 4 + 4;
+
+// Given PROBE, append a PROBE frame onto DEST.  PADDING extra zero bytes
+// are added so that probe trains can be sized like real traffic.
+void link_probe_encode(std::vector<uint8_t>& dest, const struct link_probe& probe, size_t padding);
+
+// Given PROBE, append a PROBE_ECHO frame onto DEST.
+void link_probe_echo_encode(std::vector<uint8_t>& dest, const struct link_probe& probe);
+
+// Given FRAME, a decoded PROBE or PROBE_ECHO frame, unpack it into
+// PROBE.  Fields that the frame doesn't carry are set to zero.
+// Returns false if FRAME is too short.
+bool link_probe_decode(const std::vector<uint8_t>& frame, struct link_probe& probe);
+bool link_probe_decode(const uint8_t *frame, size_t len, struct link_probe& probe);
+
+// How far the far end's clock is ahead of ours, worked out from probes
+// and their echoes the way NTP does it.  Each echo gives an offset that
+// is wrong by no more than half its round trip, not counting the time
+// the far end sat on the probe, so the offset kept is the one from the
+// quickest round trip in the last LINK_CLOCK_WINDOW echoes or so.  The
+// clocks' drift against each other over that many echoes is well under
+// a round trip.
+const unsigned LINK_CLOCK_WINDOW = 64;
+
+struct link_clock
+{
+	bool valid;
+	// Far end's clock minus ours, mod 2^32, and the round trip it came
+	// from.
+	uint32_t offset;
+	uint32_t delay;
+	// The best since the window last turned over, which takes over when
+	// it turns over again.
+	bool next_valid;
+	uint32_t next_offset;
+	uint32_t next_delay;
+	unsigned age;
+};
+
+// Given ECHO, which arrived at NOW by our clock, update CLOCK.
+void link_clock_add(struct link_clock& clock, const struct link_probe& echo, uint32_t now);
+
+// Given USEC, a reading of the far end's clock, return the same moment
+// by ours.  CLOCK must be valid.
+inline uint32_t link_clock_to_local(const struct link_clock& clock, uint32_t usec)
+{
+	return usec - clock.offset;
+}
+
+// A STAMP frame is
+//
+//   type usec(4) frame...
+//
+// where FRAME is any other frame and USEC the sender's clock as it went
+// to the port.  It costs 5 bytes, so it is only sent when the sending
+// end is configured for it.  Nothing is negotiated: the receiving end
+// has to be a build that knows STAMP, and needs its own probes running
+// to make sense of the clock.
+const size_t LINK_STAMP_LEN = 1 + 4;
+
+// Given USEC, store a STAMP frame's header at DEST, for a frame that is
+// already in place after it.
+void link_stamp_encode_header(uint8_t *dest, uint32_t usec);
+
+// Given FRAME, a decoded STAMP frame, set USEC from it and move FRAME and
+// LEN past its header to the frame inside.  Returns false if FRAME is
+// too short.
+bool link_stamp_strip(const uint8_t *& frame, size_t& len, uint32_t& usec);
+
+// A RATE frame is
+//
+//   type op(1) arg(4) rest...
+//
+// An OFFER's ARG is a random number that decides which end leads, and
+// the rest is the rates the sender can run at, 4 bytes each.  The rest
+// of the others is empty, except that a TEST or TEST_ECHO carries the
+// test pattern.  For SWITCH, TEST and TEST_ECHO, ARG is the new rate.
+// Rates are in baud.
+const uint8_t LINK_RATE_OFFER = 0;
+const uint8_t LINK_RATE_SWITCH = 1;
+const uint8_t LINK_RATE_TEST = 2;
+const uint8_t LINK_RATE_TEST_ECHO = 3;
+
+const size_t LINK_RATE_HEADER_LEN = 1 + 1 + 4;
+const size_t LINK_RATE_MAX = 16;
+
+// Every byte value once, SLIP's END and ESC included, so that a rate
+// that mangles any bit pattern fails the test.
+const size_t LINK_RATE_PATTERN_LEN = 256;
+
+struct link_rate
+{
+	uint8_t op;
+	uint32_t arg;
+	size_t count;
+	uint32_t rates[LINK_RATE_MAX];
+};
+
+// Given RATE, append a RATE frame onto DEST.  Only an OFFER's rates are
+// sent, and a TEST or TEST_ECHO gets the test pattern.
+void link_rate_encode(std::vector<uint8_t>& dest, const struct link_rate& rate);
+
+// Given FRAME, a decoded RATE frame, unpack it into RATE.  Rates past
+// LINK_RATE_MAX are ignored.  Returns false if FRAME is too short, or
+// if it is a TEST or TEST_ECHO whose pattern didn't arrive intact.
+bool link_rate_decode(const uint8_t *frame, size_t len, struct link_rate& rate);
+
+// A UDP frame is
+//
+//   type caddr(4) cport(2) saddr(4) sport(2) data...
+//
+// in both directions: the addresses are always the client's followed by
+// the server's, and the REPLY bit says which way the datagram is going.
+// Addresses and ports are in host byte order.  DATA points at the
+// payload and doesn't own it.
+struct link_udp
+{
+	bool reply;
+	uint32_t caddr;
+	uint16_t cport;
+	uint32_t saddr;
+	uint16_t sport;
+	const uint8_t *data;
+	size_t len;
+};
+
+const size_t LINK_UDP_HEADER_LEN = 1 + 4 + 2 + 4 + 2;
+
+// Given DGRAM, append a UDP frame onto DEST.
+void link_udp_encode(std::vector<uint8_t>& dest, const struct link_udp& dgram);
+
+// Given DGRAM, store the LINK_UDP_HEADER_LEN bytes of a UDP frame's
+// header at DEST, for a payload that is already in place after it.
+// DGRAM's data pointer is ignored.
+void link_udp_encode_header(uint8_t *dest, const struct link_udp& dgram);
+
+// Given FRAME, a decoded UDP frame, unpack it into DGRAM.  DGRAM's data
+// pointer points into FRAME.  Returns false if FRAME is too short.
+bool link_udp_decode(const std::vector<uint8_t>& frame, struct link_udp& dgram);
+bool link_udp_decode(const uint8_t *frame, size_t len, struct link_udp& dgram);
+
+// A UDP_BATCH frame carries several datagrams going the same way.  It is
+//
+//   type entry entry ...
+//
+// and each entry is
+//
+//   desc(1) [caddr(4) saddr(4)] [cport(2) sport(2)] len(1 or 2) data...
+//
+// The addresses are there only if DESC has ADDRS set, and the ports
+// only if it has PORTS set.  Otherwise they are the same as the entry
+// before's, which the first entry has to have both.  The length is one
+// byte unless DESC has LONG set.  Datagrams between the same few
+// clients and servers, then, cost as little as 2 or 6 bytes of header
+// each, instead of a UDP frame's 13 and SLIP's END.
+const uint8_t LINK_UDP_BATCH_ADDRS = 0x80;
+const uint8_t LINK_UDP_BATCH_PORTS = 0x40;
+const uint8_t LINK_UDP_BATCH_LONG = 0x20;
+
+const size_t LINK_UDP_BATCH_DESC_MAX = 1 + 8 + 4 + 2;
+
+// Given DGRAM, and PREV, the datagram before it in the batch or NULL if
+// it is the first, store its entry's header at DEST, for a payload that
+// will follow it.  Returns the header's length.  DGRAM's length can't be
+// more than 65535.
+size_t link_udp_batch_encode_desc(uint8_t *dest, const struct link_udp& dgram, const struct link_udp *prev);
+
+// Given the COUNT datagrams at DGRAMS, all going the same way, append a
+// UDP_BATCH frame onto DEST.
+void link_udp_batch_encode(std::vector<uint8_t>& dest, const struct link_udp *dgrams, size_t count);
+
+// Unpacking a UDP_BATCH frame, one entry at a time.
+struct link_udp_batch
+{
+	const uint8_t *p;
+	const uint8_t *end;
+	struct link_udp last;
+	bool started;
+	bool error;
+};
+
+// Given FRAME, a decoded UDP_BATCH frame, get BATCH ready to unpack it.
+void link_udp_batch_begin(struct link_udp_batch& batch, const uint8_t *frame, size_t len);
+
+// Unpack BATCH's next datagram into DGRAM, whose data pointer points
+// into the frame.  Returns false once there are no more, and sets
+// BATCH's error if what was left didn't make sense.
+bool link_udp_batch_next(struct link_udp_batch& batch, struct link_udp& dgram);
+
+#endif
@@ -0,0 +1,243 @@
+#include "metrics.h"
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+// This contains the registry of per-thread shards, and of the metrics
+// whose slots are in them, and the Prometheus text writer.
+
+struct metric_family
+{
+	std::string name;
+	std::string help;
+	metric_type type;
+	std::vector<std::string> labels;
+	uint32_t first;
+	double scale;
+};
+
+static std::mutex shards_mutex;
+static std::vector<std::unique_ptr<struct metric_shard>> shards;
+static std::mutex families_mutex;
+static std::vector<struct metric_family> families;
+static uint32_t next_slot = 0;
+
+struct metric_shard *metric_shard_register()
+{
+	// Value-initialized, so every slot starts at zero.
+	std::unique_ptr<struct metric_shard> shard(new struct metric_shard());
+	std::lock_guard<std::mutex> lock(shards_mutex);
+	shards.push_back(std::move(shard));
+	return shards.back().get();
+}
+
+uint32_t metric_register(const char *name, const char *help, metric_type type,
+	const std::vector<std::string>& labels, double scale)
+{
+	struct metric_family f;
+	f.name = name;
+	f.help = help;
+	f.type = type;
+	f.labels = labels;
+	if (f.labels.empty())
+		f.labels.push_back(std::string());
+	f.scale = scale;
+	size_t width = type == metric_type::HISTOGRAM ? HDR_SLOTS : 1;
+
+	std::lock_guard<std::mutex> lock(families_mutex);
+	if (next_slot + f.labels.size() * width > METRIC_SLOTS)
+		return METRIC_SLOTS;
+	f.first = next_slot;
+	next_slot += (uint32_t)(f.labels.size() * width);
+	families.push_back(std::move(f));
+	return families.back().first;
+}
+
+uint64_t metric_read(uint32_t slot)
+{
+	if (slot >= METRIC_SLOTS)
+		return 0;
+	uint64_t total = 0;
+	std::lock_guard<std::mutex> lock(shards_mutex);
+	for (auto& s : shards)
+		total += s->slots[slot].load(std::memory_order_relaxed);
+	return total;
+}
+
+// Given the histogram at SLOT, fill BUCKETS with its counts, added up
+// across every thread, and return its count.
+static uint64_t hdr_read(uint32_t slot, std::vector<uint64_t>& buckets)
+{
+	buckets.assign(HDR_SLOTS, 0);
+	std::lock_guard<std::mutex> lock(shards_mutex);
+	for (auto& s : shards)
+		for (size_t i = 0; i < HDR_SLOTS; i++)
+			buckets[i] += s->slots[slot + i].load(std::memory_order_relaxed);
+	return buckets[HDR_BUCKETS];
+}
+
+uint64_t metric_hdr_percentile(uint32_t slot, double p)
+{
+	if (slot > METRIC_SLOTS - HDR_SLOTS)
+		return 0;
+	std::vector<uint64_t> buckets;
+	uint64_t count = hdr_read(slot, buckets);
+	if (count == 0)
+		return 0;
+	uint64_t want = (uint64_t)std::ceil(p * count);
+	if (want == 0)
+		want = 1;
+	uint64_t seen = 0;
+	for (size_t b = 0; b < HDR_BUCKETS; b++)
+	{
+		seen += buckets[b];
+		if (seen >= want)
+			return hdr_bucket_high(b);
+	}
+	return hdr_bucket_high(HDR_BUCKETS - 1);
+}
+
+// Given a series' labels and one more label, which may be empty, append
+// them in braces onto DEST, or nothing if there are none.
+static void append_labels(std::string& dest, const std::string& labels, const std::string& extra)
+{
+	if (labels.empty() && extra.empty())
+		return;
+	dest.push_back('{');
+	dest.append(labels);
+	if (!labels.empty() && !extra.empty())
+		dest.push_back(',');
+	dest.append(extra);
+	dest.push_back('}');
+}
+
+static void append_number(std::string& dest, double value)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.15g", value);
+	dest.append(buf);
+}
+
+static void append_count(std::string& dest, uint64_t value)
+{
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+	dest.append(buf);
+}
+
+void metrics_write_header(std::string& dest, const char *name, const char *help, const char *type)
+{
+	dest.append("# HELP ");
+	dest.append(name);
+	dest.push_back(' ');
+	// HELP text escapes only backslashes and newlines.
+	for (const char *p = help; *p != '\0'; p++)
+	{
+		if (*p == '\\')
+			dest.append("\\\\");
+		else if (*p == '\n')
+			dest.append("\\n");
+		else
+			dest.push_back(*p);
+	}
+	dest.append("\n# TYPE ");
+	dest.append(name);
+	dest.push_back(' ');
+	dest.append(type);
+	dest.push_back('\n');
+}
+
+void metrics_write_sample(std::string& dest, const char *name, const std::string& labels, double value)
+{
+	dest.append(name);
+	append_labels(dest, labels, std::string());
+	dest.push_back(' ');
+	append_number(dest, value);
+	dest.push_back('\n');
+}
+
+void metrics_add_label(std::string& labels, const char *key, const std::string& value)
+{
+	if (!labels.empty())
+		labels.push_back(',');
+	labels.append(key);
+	labels.append("=\"");
+	for (char c : value)
+	{
+		if (c == '\\')
+			labels.append("\\\\");
+		else if (c == '"')
+			labels.append("\\\"");
+		else if (c == '\n')
+			labels.append("\\n");
+		else
+			labels.push_back(c);
+	}
+	labels.push_back('"');
+}
+
+static void write_histogram(std::string& dest, const struct metric_family& f, const std::string& labels, uint32_t slot)
+{
+	std::vector<uint64_t> buckets;
+	uint64_t count = hdr_read(slot, buckets);
+	std::string name = f.name + "_bucket";
+	std::string le;
+	uint64_t seen = 0;
+	for (size_t b = 0; b < HDR_BUCKETS; b++)
+	{
+		if (buckets[b] == 0)
+			continue;
+		seen += buckets[b];
+		le = "le=\"";
+		append_number(le, (double)hdr_bucket_high(b) * f.scale);
+		le.push_back('"');
+		dest.append(name);
+		append_labels(dest, labels, le);
+		dest.push_back(' ');
+		append_count(dest, seen);
+		dest.push_back('\n');
+	}
+	dest.append(name);
+	append_labels(dest, labels, "le=\"+Inf\"");
+	dest.push_back(' ');
+	append_count(dest, count);
+	dest.push_back('\n');
+
+	dest.append(f.name);
+	dest.append("_sum");
+	append_labels(dest, labels, std::string());
+	dest.push_back(' ');
+	append_number(dest, (double)buckets[HDR_BUCKETS + 1] * f.scale);
+	dest.push_back('\n');
+
+	dest.append(f.name);
+	dest.append("_count");
+	append_labels(dest, labels, std::string());
+	dest.push_back(' ');
+	append_count(dest, count);
+	dest.push_back('\n');
+}
+
+void metrics_write(std::string& dest)
+{
+	std::lock_guard<std::mutex> lock(families_mutex);
+	for (auto& f : families)
+	{
+		bool histogram = f.type == metric_type::HISTOGRAM;
+		metrics_write_header(dest, f.name.c_str(), f.help.c_str(), histogram ? "histogram" : "counter");
+		for (size_t i = 0; i < f.labels.size(); i++)
+		{
+			if (histogram)
+			{
+				write_histogram(dest, f, f.labels[i], f.first + (uint32_t)(i * HDR_SLOTS));
+				continue;
+			}
+			dest.append(f.name);
+			append_labels(dest, f.labels[i], std::string());
+			dest.push_back(' ');
+			append_count(dest, metric_read(f.first + (uint32_t)i));
+			dest.push_back('\n');
+		}
+	}
+}
@@ -0,0 +1,140 @@
+#ifndef HORIZR_METRICS
+#define HORIZR_METRICS
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// Counters and histograms that the forwarding path can bump for the cost
+// of a load and a store.  Every thread has its own array of slots, which
+// only it writes to, and which are only added up when someone asks for
+// them, in Prometheus's text format.
+//
+// A metric is registered once, with a series for each set of labels.
+// A counter's series each take a slot, and a histogram's series take
+// HDR_SLOTS each.
+
+const size_t METRIC_SLOTS = 4096;
+
+struct metric_shard
+{
+	std::atomic<uint64_t> slots[METRIC_SLOTS];
+};
+
+// Make a zeroed shard for the calling thread, and add it to those that
+// metric_read adds up.  Shards last as long as the process.
+struct metric_shard *metric_shard_register();
+
+inline struct metric_shard& metric_shard_for_thread()
+{
+	static thread_local struct metric_shard *shard = nullptr;
+	if (shard == nullptr)
+		shard = metric_shard_register();
+	return *shard;
+}
+
+// Histograms are HDR-style: values below twice HDR_SUB each have a bucket
+// of their own, and above that, every power of two is split into HDR_SUB
+// buckets, so a bucket is never more than about 6% wide.  Values of 2^32
+// and up all go in the last bucket.  A histogram's slots are its
+// buckets, then its count, then the sum of its values.
+const unsigned HDR_SUB_BITS = 4;
+const size_t HDR_SUB = (size_t)1 << HDR_SUB_BITS;
+const size_t HDR_BUCKETS = (32 - HDR_SUB_BITS + 1) * HDR_SUB;
+const size_t HDR_SLOTS = HDR_BUCKETS + 2;
+
+inline unsigned hdr_msb(uint64_t v)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(v);
+#else
+	unsigned b = 0;
+	while (v >>= 1)
+		b++;
+	return b;
+#endif
+}
+
+inline size_t hdr_bucket(uint64_t v)
+{
+	if (v < 2 * HDR_SUB)
+		return (size_t)v;
+	if (v > 0xFFFFFFFFull)
+		v = 0xFFFFFFFFull;
+	unsigned shift = hdr_msb(v) - HDR_SUB_BITS;
+	return (shift + 1) * HDR_SUB + (size_t)(v >> shift) - HDR_SUB;
+}
+
+// The largest value that goes in bucket B.
+inline uint64_t hdr_bucket_high(size_t b)
+{
+	if (b < 2 * HDR_SUB)
+		return b;
+	size_t shift = b / HDR_SUB - 1;
+	uint64_t top = b % HDR_SUB + HDR_SUB;
+	return ((top + 1) << shift) - 1;
+}
+
+enum class metric_type
+{
+	COUNTER,
+	HISTOGRAM
+};
+
+// Register a metric called NAME, with a series for each of LABELS, each
+// something like `link="ttyUSB0",direction="tx"`, or one series with no
+// labels if there are none.  A histogram's values are multiplied by
+// SCALE on the way out, so that microseconds can be shown as seconds, as
+// Prometheus prefers.  Returns the first series' first slot, or
+// METRIC_SLOTS if there aren't enough slots left, in which case adding
+// to it does nothing.
+uint32_t metric_register(const char *name, const char *help, metric_type type,
+	const std::vector<std::string>& labels = std::vector<std::string>(), double scale = 1);
+
+inline void metric_add(uint32_t slot, uint64_t n = 1)
+{
+	if (slot >= METRIC_SLOTS)
+		return;
+	std::atomic<uint64_t>& s = metric_shard_for_thread().slots[slot];
+	s.store(s.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void metric_hdr_add(uint32_t slot, uint64_t v)
+{
+	if (slot > METRIC_SLOTS - HDR_SLOTS)
+		return;
+	struct metric_shard& shard = metric_shard_for_thread();
+	std::atomic<uint64_t>& bucket = shard.slots[slot + hdr_bucket(v)];
+	std::atomic<uint64_t>& count = shard.slots[slot + HDR_BUCKETS];
+	std::atomic<uint64_t>& sum = shard.slots[slot + HDR_BUCKETS + 1];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	sum.store(sum.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// SLOT, added up across every thread.
+uint64_t metric_read(uint32_t slot);
+
+// The value below which the Pth fraction of the histogram at SLOT falls,
+// as the top of the bucket it is in, unscaled.
+uint64_t metric_hdr_percentile(uint32_t slot, double p);
+
+// Given every registered metric, append its HELP and TYPE lines and its
+// samples onto DEST.  Histograms only list the buckets that aren't
+// empty, as their upper bounds.
+void metrics_write(std::string& dest);
+
+// For what isn't a registered metric, such as gauges and per-flow
+// counts that their owners keep: append a HELP and TYPE line for NAME,
+// where TYPE is "counter" or "gauge", and then its samples.
+void metrics_write_header(std::string& dest, const char *name, const char *help, const char *type);
+void metrics_write_sample(std::string& dest, const char *name, const std::string& labels, double value);
+
+// Append KEY="VALUE" onto LABELS, after a comma if need be, with VALUE
+// escaped.
+void metrics_add_label(std::string& labels, const char *key, const std::string& value);
+
+#endif
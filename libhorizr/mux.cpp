@@ -0,0 +1,131 @@
+#include "mux.h"
+
+// This contains procedures that pack and unpack stream multiplexer frames.
+
+// Given MSG, append an encoded stream mux frame onto DEST.
+void mux_encode(std::vector<uint8_t>& dest, const struct mux_msg& msg)
+{
+	size_t start = dest.size();
+	dest.resize(start + mux_header_len(msg));
+	mux_encode_header(dest.data() + start, msg);
+
+	if ((msg.type == LINK_FRAME_MUX_OPEN || msg.type == LINK_FRAME_MUX_DATA) && msg.len > 0)
+		dest.insert(dest.end(), msg.data, msg.data + msg.len);
+}
+
+// Given MSG, return the length of its frame's header.
+size_t mux_header_len(const struct mux_msg& msg)
+{
+	size_t len = 1 + (msg.channel < 0x80 ? 1 : 2);
+	if (msg.type == LINK_FRAME_MUX_OPEN)
+		len += 12;
+	else if (msg.type == LINK_FRAME_MUX_RST)
+		len += 1;
+	else if (msg.type == LINK_FRAME_MUX_CREDIT)
+		len += 2;
+	return len;
+}
+
+// Given MSG, store its frame's header at DEST.
+void mux_encode_header(uint8_t *dest, const struct mux_msg& msg)
+{
+	*dest++ = msg.type | (msg.reply ? LINK_FRAME_MUX_REPLY : 0);
+	if (msg.channel < 0x80)
+		*dest++ = (uint8_t)msg.channel;
+	else
+	{
+		*dest++ = 0x80 | ((msg.channel >> 8) & 0x7F);
+		*dest++ = msg.channel & 0xFF;
+	}
+	if (msg.type == LINK_FRAME_MUX_OPEN)
+	{
+		link_store_be32(dest, msg.saddr);
+		link_store_be16(dest + 4, msg.sport);
+		link_store_be32(dest + 6, msg.daddr);
+		link_store_be16(dest + 10, msg.dport);
+	}
+	else if (msg.type == LINK_FRAME_MUX_RST)
+		*dest = msg.reason;
+	else if (msg.type == LINK_FRAME_MUX_CREDIT)
+		link_store_be16(dest, msg.credit);
+}
+
+// Given FRAME, a decoded stream mux frame, unpack it into MSG.  MSG's
+// data pointer points into FRAME.  Returns false if FRAME is malformed.
+bool mux_decode(const std::vector<uint8_t>& frame, struct mux_msg& msg)
+{
+	return mux_decode(frame.data(), frame.size(), msg);
+}
+
+bool mux_decode(const uint8_t *frame, size_t size, struct mux_msg& msg)
+{
+	msg = mux_msg{};
+	size_t i = 0;
+
+	if (size < 2)
+		return false;
+	msg.type = frame[i] & ~LINK_FRAME_MUX_REPLY;
+	msg.reply = (frame[i] & LINK_FRAME_MUX_REPLY) != 0;
+	i++;
+	if (msg.type < LINK_FRAME_MUX_OPEN || msg.type > LINK_FRAME_MUX_CREDIT)
+		return false;
+
+	if (frame[i] & 0x80)
+	{
+		if (i + 1 >= size)
+			return false;
+		msg.channel = (uint16_t)(((frame[i] & 0x7F) << 8) | frame[i + 1]);
+		i += 2;
+	}
+	else
+		msg.channel = frame[i++];
+
+	if (msg.type == LINK_FRAME_MUX_OPEN)
+	{
+		if (i + 12 > size)
+			return false;
+		msg.saddr = link_get_be32(&frame[i]);
+		msg.sport = link_get_be16(&frame[i + 4]);
+		msg.daddr = link_get_be32(&frame[i + 6]);
+		msg.dport = link_get_be16(&frame[i + 10]);
+		i += 12;
+	}
+	else if (msg.type == LINK_FRAME_MUX_RST)
+	{
+		if (i >= size)
+			return false;
+		msg.reason = frame[i++];
+	}
+	else if (msg.type == LINK_FRAME_MUX_CREDIT)
+	{
+		if (i + 2 > size)
+			return false;
+		msg.credit = link_get_be16(&frame[i]);
+		i += 2;
+	}
+
+	if (msg.type == LINK_FRAME_MUX_OPEN || msg.type == LINK_FRAME_MUX_DATA)
+	{
+		msg.data = frame + i;
+		msg.len = size - i;
+	}
+	return true;
+}
+
+const char *mux_rst_reason_string(uint8_t reason)
+{
+	if (reason == MUX_RST_RESET)
+		return "connection reset";
+	else if (reason == MUX_RST_REFUSED)
+		return "connection refused";
+	else if (reason == MUX_RST_UNREACHABLE)
+		return "server unreachable";
+	else if (reason == MUX_RST_UNKNOWN_CHANNEL)
+		return "unknown channel";
+	else if (reason == MUX_RST_NO_CHANNELS)
+		return "no free channels";
+	else if (reason == MUX_RST_TIMEOUT)
+		return "connection timed out";
+	else
+		return "unknown reason";
+}
@@ -0,0 +1,88 @@
+#ifndef HORIZR_MUX
+#define HORIZR_MUX
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "link.h"
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// Proxied TCP connections are carried over the serial link as channels
+// of a stream multiplexer.  The end that accepted the TCP connection
+// from its client opens a channel; the other end makes the matching
+// connection to the server.  The 4-tuple is only sent once, in OPEN.
+//
+//   OPEN  type chan saddr(4) sport(2) daddr(4) dport(2) data...
+//   DATA  type chan data...
+//   FIN   type chan
+//   RST   type chan reason(1)
+//   CREDIT type chan increment(2)
+//
+// TYPE is one of the LINK_FRAME_MUX_XXX constants, with the REPLY bit
+// set when the frame is sent by the end that did not open the channel.
+// Each end allocates channel numbers for the channels it opens, so the
+// REPLY bit is also what keeps the two ends' channel numbers apart.
+//
+// CHAN is one byte for channels 0 to 127, and two bytes, high bit set,
+// for channels 128 to 32767.
+//
+// Each direction of a channel is flow controlled.  A sender starts out
+// allowed MUX_INITIAL_WINDOW bytes of OPEN and DATA payload.  As the
+// receiver hands data on to its TCP socket, it returns CREDIT for those
+// bytes, and the sender may send that many more.  A sender out of credit
+// stops reading from its TCP socket, so the backpressure reaches the
+// application on the far side of it.
+
+const uint32_t MUX_INITIAL_WINDOW = 8192;
+
+const uint16_t MUX_CHANNEL_MAX = 0x7FFF;
+
+// Reasons carried by RST.
+const uint8_t MUX_RST_RESET = 0;
+const uint8_t MUX_RST_REFUSED = 1;
+const uint8_t MUX_RST_UNREACHABLE = 2;
+const uint8_t MUX_RST_UNKNOWN_CHANNEL = 3;
+const uint8_t MUX_RST_NO_CHANNELS = 4;
+const uint8_t MUX_RST_TIMEOUT = 5;
+
+// Addresses and ports are in host byte order.  DATA points at the
+// payload and doesn't own it.
+struct mux_msg
+{
+	uint8_t type;
+	bool reply;
+	uint16_t channel;
+	uint32_t saddr;
+	uint16_t sport;
+	uint32_t daddr;
+	uint16_t dport;
+	uint8_t reason;
+	uint16_t credit;
+	const uint8_t *data;
+	size_t len;
+};
+
+// Given MSG, append an encoded stream mux frame onto DEST.
+void mux_encode(std::vector<uint8_t>& dest, const struct mux_msg& msg);
+
+// The largest header a stream mux frame can have: an OPEN on a two-byte
+// channel.
+const size_t MUX_HEADER_MAX = 1 + 2 + 12;
+
+// Given MSG, return the length of its frame's header, which is
+// everything but the payload.
+size_t mux_header_len(const struct mux_msg& msg);
+
+// Given MSG, store its frame's header, mux_header_len(MSG) bytes, at
+// DEST, for a payload that is already in place after it.  MSG's data
+// pointer is ignored.
+void mux_encode_header(uint8_t *dest, const struct mux_msg& msg);
+
+// Given FRAME, a decoded stream mux frame, unpack it into MSG.  MSG's
+// data pointer points into FRAME.  Returns false if FRAME is malformed.
+bool mux_decode(const std::vector<uint8_t>& frame, struct mux_msg& msg);
+bool mux_decode(const uint8_t *frame, size_t size, struct mux_msg& msg);
+
+const char *mux_rst_reason_string(uint8_t reason);
+
+#endif
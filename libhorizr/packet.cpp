@@ -0,0 +1,34 @@
+#include "packet.h"
+
+// This contains the slab allocator behind packet buffers.
+
+packet_pool::packet_pool(size_t buf_size, size_t headroom, size_t bufs_per_slab)
+	: buf_size_(buf_size)
+	, headroom_(headroom)
+	, bufs_per_slab_(bufs_per_slab > 0 ? bufs_per_slab : 1)
+	, free_(nullptr)
+	, in_use_(0)
+{
+	// Keep each buffer's header and bytes aligned for whatever gets
+	// written into them.
+	const size_t align = alignof(std::max_align_t);
+	stride_ = (sizeof(packet_buf) + buf_size_ + align - 1) / align * align;
+}
+
+// Add a slab's worth of buffers onto the free list.
+void packet_pool::grow()
+{
+	std::unique_ptr<uint8_t[]> slab(new uint8_t[stride_ * bufs_per_slab_ + alignof(std::max_align_t)]);
+	uintptr_t base = reinterpret_cast<uintptr_t>(slab.get());
+	base = (base + alignof(std::max_align_t) - 1) & ~(uintptr_t)(alignof(std::max_align_t) - 1);
+	for (size_t i = bufs_per_slab_; i > 0; i--)
+	{
+		packet_buf *b = reinterpret_cast<packet_buf *>(base + (i - 1) * stride_);
+		b->pool = this;
+		b->refs = 0;
+		b->size = (uint32_t)buf_size_;
+		b->next_free = free_;
+		free_ = b;
+	}
+	slabs_.push_back(std::move(slab));
+}
@@ -0,0 +1,193 @@
+#ifndef HORIZR_PACKET
+#define HORIZR_PACKET
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// Packet buffers, handed out by a pool so that moving a frame from a
+// socket to the serial port doesn't touch the heap.
+//
+// A pool carves fixed-size buffers out of big slabs, and keeps the free
+// ones on a list threaded through the buffers themselves.  When the list
+// runs dry the pool adds another slab, so it grows to whatever the
+// traffic needs and after that neither allocates nor frees.
+//
+// A packet is a refcounted view of part of one buffer.  Each buffer
+// starts with some headroom, so that link headers can be prepended onto
+// a payload that was read straight into the buffer, and whatever is past
+// the end of the data is tailroom.  Copying a packet makes another view
+// of the same buffer; the buffer goes back to its pool when the last view
+// is gone.  Only a packet that is the buffer's sole view may grow into
+// its headroom or tailroom.
+//
+// Refcounts are not atomic.  A pool and its packets belong to one thread.
+
+class packet_pool;
+
+struct packet_buf
+{
+	packet_pool *pool;
+	packet_buf *next_free;
+	uint32_t refs;
+	uint32_t size;
+	// When the data came in, by link_now_usec, or zero if no one said.
+	uint32_t stamp;
+
+	uint8_t *bytes() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
+
+class packet
+{
+public:
+	packet() : buf_(nullptr), off_(0), len_(0) {}
+	packet(const packet& p) : buf_(p.buf_), off_(p.off_), len_(p.len_)
+	{
+		if (buf_)
+			buf_->refs++;
+	}
+	packet(packet&& p) : buf_(p.buf_), off_(p.off_), len_(p.len_)
+	{
+		p.buf_ = nullptr;
+		p.off_ = p.len_ = 0;
+	}
+	packet& operator=(packet p)
+	{
+		std::swap(buf_, p.buf_);
+		std::swap(off_, p.off_);
+		std::swap(len_, p.len_);
+		return *this;
+	}
+	~packet() { release(); }
+
+	explicit operator bool() const { return buf_ != nullptr; }
+
+	uint8_t *data() const { return buf_->bytes() + off_; }
+	size_t size() const { return len_; }
+	bool empty() const { return len_ == 0; }
+
+	size_t headroom() const { return off_; }
+	size_t tailroom() const { return buf_->size - off_ - len_; }
+
+	// Where the next put() will go, for reading into the tailroom.
+	uint8_t *tail() const { return data() + len_; }
+
+	// Grow the packet by N bytes at the front, into the headroom, and
+	// return where the new bytes begin.
+	uint8_t *push(size_t n)
+	{
+		off_ -= (uint32_t)n;
+		len_ += (uint32_t)n;
+		return data();
+	}
+
+	// Grow the packet by N bytes at the end, into the tailroom, and
+	// return where the new bytes begin.
+	uint8_t *put(size_t n)
+	{
+		uint8_t *p = tail();
+		len_ += (uint32_t)n;
+		return p;
+	}
+
+	// Drop N bytes from the front.
+	void pull(size_t n)
+	{
+		off_ += (uint32_t)n;
+		len_ -= (uint32_t)n;
+	}
+
+	// Drop everything past the first LEN bytes.
+	void trim(size_t len) { len_ = (uint32_t)len; }
+
+	// When the first of the packet's data came in, for latency
+	// measurements.  Shared by every view of the buffer.
+	uint32_t stamp() const { return buf_->stamp; }
+	void set_stamp(uint32_t usec) { buf_->stamp = usec; }
+
+	// True if no other packet shares this one's buffer.
+	bool unique() const { return buf_ && buf_->refs == 1; }
+
+	void reset() { release(); }
+
+private:
+	friend class packet_pool;
+
+	packet(packet_buf *buf, uint32_t headroom) : buf_(buf), off_(headroom), len_(0) {}
+	inline void release();
+
+	packet_buf *buf_;
+	uint32_t off_;
+	uint32_t len_;
+};
+
+class packet_pool
+{
+public:
+	// Each buffer holds BUF_SIZE bytes, HEADROOM of which are kept free
+	// at the front of a new packet.  The pool grows BUFS_PER_SLAB
+	// buffers at a time.
+	// Every packet must be gone before its pool is.
+	packet_pool(size_t buf_size, size_t headroom, size_t bufs_per_slab);
+
+	// Return an empty packet with the pool's headroom.
+	packet alloc()
+	{
+		if (free_ == nullptr)
+			grow();
+		packet_buf *b = free_;
+		free_ = b->next_free;
+		b->refs = 1;
+		b->stamp = 0;
+		in_use_++;
+		return packet(b, (uint32_t)headroom_);
+	}
+
+	size_t buf_size() const { return buf_size_; }
+	size_t headroom() const { return headroom_; }
+
+	// The most a new packet can hold without using its headroom.
+	size_t capacity() const { return buf_size_ - headroom_; }
+
+	size_t in_use() const { return in_use_; }
+	size_t allocated() const { return slabs_.size() * bufs_per_slab_; }
+
+	// The slabs the buffers are carved from, each SLAB_BYTES long, so
+	// that they can be registered with the kernel for I/O.  A slab stays
+	// where it is until the pool is gone.
+	size_t slabs() const { return slabs_.size(); }
+	uint8_t *slab(size_t i) const { return slabs_[i].get(); }
+	size_t slab_bytes() const { return stride_ * bufs_per_slab_ + alignof(std::max_align_t); }
+
+private:
+	friend class packet;
+
+	void grow();
+	void give_back(packet_buf *b)
+	{
+		b->next_free = free_;
+		free_ = b;
+		in_use_--;
+	}
+
+	size_t buf_size_;
+	size_t headroom_;
+	size_t bufs_per_slab_;
+	size_t stride_;
+	std::vector<std::unique_ptr<uint8_t[]>> slabs_;
+	packet_buf *free_;
+	size_t in_use_;
+};
+
+inline void packet::release()
+{
+	if (buf_ && --buf_->refs == 0)
+		buf_->pool->give_back(buf_);
+	buf_ = nullptr;
+	off_ = len_ = 0;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef HORIZR_RING
+#define HORIZR_RING
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+//-------1---------2---------3---------4---------5---------6---------7---------8
+
+// A double-ended queue in one power-of-two array.  Unlike std::deque,
+// which allocates and frees a block every few hundred pushes even when
+// its length holds steady, a ring only allocates when it has to grow
+// past the longest it has ever been.  One made with a capacity of zero
+// allocates nothing until something is first pushed onto it.
+
+template <typename T>
+class ring
+{
+public:
+	explicit ring(size_t capacity = 16)
+		: head_(0)
+		, count_(0)
+	{
+		if (capacity == 0)
+			return;
+		size_t n = 1;
+		while (n < capacity)
+			n *= 2;
+		slots_.resize(n);
+	}
+
+	size_t size() const { return count_; }
+	bool empty() const { return count_ == 0; }
+	size_t capacity() const { return slots_.size(); }
+
+	T& front() { return slots_[head_]; }
+	T& back() { return slots_[(head_ + count_ - 1) & mask()]; }
+	T& operator[](size_t i) { return slots_[(head_ + i) & mask()]; }
+
+	void push_back(T value)
+	{
+		if (count_ == slots_.size())
+			grow();
+		slots_[(head_ + count_) & mask()] = std::move(value);
+		count_++;
+	}
+
+	void push_front(T value)
+	{
+		if (count_ == slots_.size())
+			grow();
+		head_ = (head_ - 1) & mask();
+		slots_[head_] = std::move(value);
+		count_++;
+	}
+
+	// The slot is reset, releasing whatever it held.
+	void pop_front()
+	{
+		slots_[head_] = T();
+		head_ = (head_ + 1) & mask();
+		count_--;
+	}
+
+	void clear()
+	{
+		while (count_ > 0)
+			pop_front();
+		head_ = 0;
+	}
+
+private:
+	size_t mask() const { return slots_.size() - 1; }
+
+	void grow()
+	{
+		std::vector<T> bigger(slots_.empty() ? 4 : slots_.size() * 2);
+		for (size_t i = 0; i < count_; i++)
+			bigger[i] = std::move(slots_[(head_ + i) & mask()]);
+		slots_.swap(bigger);
+		head_ = 0;
+	}
+
+	std::vector<T> slots_;
+	size_t head_;
+	size_t count_;
+};
+
+#endif
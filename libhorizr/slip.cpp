@@ -156,3 +156,127 @@ size_t slip_encode(std::vector<uint8_t>& dest, const std::vector<uint8_t>& sourc
 	dest.push_back(SLIP_END);
 	return i;
 }
+
+// Given SOURCE, a LEN-byte message, this procedure encodes it like
+// slip_encode, but into DEST, which must have room for
+// slip_encoded_max(LEN) bytes.
+// The return value is the number of bytes written to DEST.
+size_t slip_encode_buf(uint8_t *dest, const uint8_t *source, size_t len, bool introduce)
+{
+	uint8_t *d = dest;
+
+	if (len == 0)
+	{
+		*d++ = SLIP_END;
+		return 1;
+	}
+
+	if (introduce)
+		*d++ = SLIP_END;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t x = source[i];
+		if (x == SLIP_END)
+		{
+			*d++ = SLIP_ESC;
+			*d++ = SLIP_ESC_END;
+		}
+		else if (x == SLIP_ESC)
+		{
+			*d++ = SLIP_ESC;
+			*d++ = SLIP_ESC_ESC;
+		}
+		else
+			*d++ = x;
+	}
+	*d++ = SLIP_END;
+	return d - dest;
+}
+
+// The delimiter and escape sequences that segments refer to.
+static const uint8_t slip_end_seq[1] = { SLIP_END };
+static const uint8_t slip_esc_end_seq[2] = { SLIP_ESC, SLIP_ESC_END };
+static const uint8_t slip_esc_esc_seq[2] = { SLIP_ESC, SLIP_ESC_ESC };
+
+size_t slip_encode_segments(std::vector<struct slip_segment>& dest, const uint8_t *source, size_t len, bool introduce)
+{
+	size_t total = 0;
+
+	if (introduce && len > 0)
+	{
+		dest.push_back(slip_segment{ slip_end_seq, 1 });
+		total++;
+	}
+
+	size_t run = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t x = source[i];
+		if (x != SLIP_END && x != SLIP_ESC)
+			continue;
+		if (i > run)
+			dest.push_back(slip_segment{ source + run, i - run });
+		if (x == SLIP_END)
+			dest.push_back(slip_segment{ slip_esc_end_seq, 2 });
+		else
+			dest.push_back(slip_segment{ slip_esc_esc_seq, 2 });
+		total += i - run + 2;
+		run = i + 1;
+	}
+	if (len > run)
+		dest.push_back(slip_segment{ source + run, len - run });
+	total += len - run;
+
+	dest.push_back(slip_segment{ slip_end_seq, 1 });
+	return total + 1;
+}
+
+void slip_decoder_init(struct slip_decoder& dec, uint8_t *frame, size_t capacity)
+{
+	dec.frame = frame;
+	dec.capacity = capacity;
+	slip_decoder_reset(dec);
+}
+
+void slip_decoder_reset(struct slip_decoder& dec)
+{
+	dec.len = 0;
+	dec.escaped = false;
+	dec.overflow = false;
+}
+
+// Given SOURCE, LEN bytes of SLIP-encoded input, decode onto DEC's
+// message until an END terminates it or SOURCE runs out.
+size_t slip_decoder_feed(struct slip_decoder& dec, const uint8_t *source, size_t len, bool& complete)
+{
+	complete = false;
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t c = source[i];
+		if (dec.escaped)
+		{
+			dec.escaped = false;
+			if (c == SLIP_ESC_END)
+				c = SLIP_END;
+			else if (c == SLIP_ESC_ESC)
+				c = SLIP_ESC;
+		}
+		else if (c == SLIP_END)
+		{
+			complete = true;
+			return i + 1;
+		}
+		else if (c == SLIP_ESC)
+		{
+			dec.escaped = true;
+			continue;
+		}
+
+		if (dec.len < dec.capacity)
+			dec.frame[dec.len++] = c;
+		else
+			dec.overflow = true;
+	}
+	return len;
+}
@@ -2,6 +2,7 @@
 #define HORIZR_SLIP
 
 #include <vector>
+#include <cstddef>
 #include <cstdint>
 //-------1---------2---------3---------4---------5---------6---------7---------8
 
@@ -24,4 +25,60 @@ size_t slip_decode(std::vector<uint8_t>& dest, const std::vector<uint8_t>& sourc
 // The return value is the length of SOURCE.
 size_t slip_encode(std::vector<uint8_t>& dest, const std::vector<uint8_t>& source, bool introduce);
 
+// The most bytes that a LEN-byte message can take once SLIP-encoded,
+// delimiters included.
+inline size_t slip_encoded_max(size_t len) { return 2 * len + 2; }
+
+// Given SOURCE, a LEN-byte message, this procedure encodes it like
+// slip_encode, but into DEST, which must have room for
+// slip_encoded_max(LEN) bytes.
+// The return value is the number of bytes written to DEST.
+size_t slip_encode_buf(uint8_t *dest, const uint8_t *source, size_t len, bool introduce);
+
+// A piece of a SLIP-encoded message, for gathered writes: either a run
+// of bytes from the message itself, or a delimiter or escape sequence
+// in static storage.
+struct slip_segment
+{
+	const uint8_t *data;
+	size_t len;
+};
+
+// Given SOURCE, a LEN-byte message, this procedure describes its SLIP
+// encoding, like slip_encode_buf, as segments appended onto DEST.
+// Nothing is copied: the runs of SOURCE that need no escaping are
+// referred to where they are, so SOURCE has to stay put until the
+// segments have been written.
+// The return value is the length of the encoding.
+size_t slip_encode_segments(std::vector<struct slip_segment>& dest, const uint8_t *source, size_t len, bool introduce);
+
+// The state of a SLIP decoder that is fed its input as it arrives,
+// rather than searching a buffer for a whole message each time.  The
+// message is decoded into FRAME, a buffer of CAPACITY bytes provided by
+// the caller, and LEN is how much of it is filled so far.  OVERFLOW is
+// set when a message doesn't fit; the rest of it is discarded.
+struct slip_decoder
+{
+	uint8_t *frame;
+	size_t capacity;
+	size_t len;
+	bool escaped;
+	bool overflow;
+};
+
+// Set up DEC to decode into FRAME, which holds CAPACITY bytes.
+void slip_decoder_init(struct slip_decoder& dec, uint8_t *frame, size_t capacity);
+
+// Given SOURCE, LEN bytes of SLIP-encoded input, decode onto DEC's
+// message until an END terminates it or SOURCE runs out.  Invalid
+// escape sequences are passed through, as RFC 1055 recommends.
+// The return value is the number of bytes from SOURCE that were
+// processed.  COMPLETE is set if a message was terminated; DEC then
+// holds it until slip_decoder_reset is called.  An END with nothing
+// before it also terminates a message, of length zero.
+size_t slip_decoder_feed(struct slip_decoder& dec, const uint8_t *source, size_t len, bool& complete);
+
+// Get DEC ready for the next message.
+void slip_decoder_reset(struct slip_decoder& dec);
+
 #endif
@@ -0,0 +1,73 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	TEST_CLASS(capture)
+	{
+	public:
+		TEST_METHOD(CaptureRingAndPcapng)
+		{
+			// Records that don't fit are dropped, and one that won't fit
+			// before the end of the ring starts over at the beginning.
+			capture_ring ring;
+			std::vector<uint8_t> big(100 * 1024);
+			int pushed = 0;
+			for (int i = 0; i < 12; i++)
+			{
+				big[0] = (uint8_t)i;
+				if (ring.push(CAPTURE_LINK, CAPTURE_OUT, i, big.data(), big.size(), big.size() + 1))
+					pushed++;
+			}
+			Assert::IsTrue(pushed == 10 && ring.take_dropped() == 2);
+			struct capture_record rec;
+			for (int i = 0; i < 3; i++)
+			{
+				Assert::IsTrue(ring.peek(rec) && rec.data[0] == i && rec.ns == (uint64_t)i);
+				ring.pop();
+			}
+			for (int i = 10; i < 13; i++)
+			{
+				big[0] = (uint8_t)i;
+				Assert::IsTrue(ring.push(CAPTURE_IPV4, CAPTURE_IN, i, big.data(), big.size(), big.size()));
+			}
+			for (int i = 3; i < 13; i++)
+			{
+				Assert::IsTrue(ring.peek(rec) && rec.data[0] == i && rec.len == big.size());
+				Assert::IsTrue(rec.iface == (i < 10 ? CAPTURE_LINK : CAPTURE_IPV4));
+				ring.pop();
+			}
+			Assert::IsTrue(!ring.peek(rec));
+
+			// A section header and three interfaces, then an enhanced
+			// packet block of 8 + 20 + 8 + 12 + 4 bytes.
+			FILE *f = tmpfile();
+			capture_file_writer writer(f, 0);
+			uint64_t headers = writer.size();
+			const uint8_t frame[5] = { LINK_FRAME_UDP, 1, 2, 3, 4 };
+			rec = capture_record{ CAPTURE_LINK, CAPTURE_IN, 5, 9, 0x123456789ull, frame };
+			writer.write(rec);
+			Assert::IsTrue(writer.size() == headers + 52);
+			fflush(f);
+			Assert::IsTrue(ftell(f) == (long)writer.size());
+			std::vector<uint8_t> bytes(writer.size());
+			rewind(f);
+			Assert::IsTrue(fread(bytes.data(), 1, bytes.size(), f) == bytes.size());
+			fclose(f);
+			uint32_t w[13];
+			memcpy(w, bytes.data() + headers, sizeof(w));
+			Assert::IsTrue(w[0] == 6 && w[1] == 52 && w[2] == CAPTURE_LINK);
+			Assert::IsTrue(w[3] == 1 && w[4] == 0x23456789 && w[5] == 5 && w[6] == 9);
+			Assert::IsTrue(memcmp(&w[7], frame, 5) == 0 && w[10] == CAPTURE_IN && w[12] == 52);
+			uint32_t shb[3];
+			memcpy(shb, bytes.data(), sizeof(shb));
+			Assert::IsTrue(shb[0] == 0x0A0D0D0A && shb[2] == 0x1A2B3C4D);
+		}
+	};
+}
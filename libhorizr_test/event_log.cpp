@@ -0,0 +1,59 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	TEST_CLASS(event_log)
+	{
+	public:
+		TEST_METHOD(EventRecords)
+		{
+			static const struct event_site site = { "{} bytes from {ip}, {} left {x}", 1 };
+			event_add(site, 1500, 0x0A000001, 7);
+			std::vector<struct event_record> recs;
+			uint64_t dropped = 0;
+			event_drain(recs, dropped);
+			Assert::IsTrue(recs.size() == 1 && dropped == 0);
+			std::string msg;
+			event_format(msg, recs[0].site->fmt, recs[0].args, recs[0].nargs);
+			Assert::IsTrue(msg == "1500 bytes from 10.0.0.1, 7 left {x}");
+
+			// Through a file and back, with the site written only once.
+			FILE *f = tmpfile();
+			{
+				event_file_writer w(f);
+				w.write(recs[0]);
+				w.write(recs[0]);
+				w.write_dropped(3);
+			}
+			rewind(f);
+			event_file_reader r(f);
+			Assert::IsTrue(r.valid());
+			struct event_record got;
+			for (int i = 0; i < 2; i++)
+			{
+				Assert::IsTrue(r.next(got));
+				Assert::IsTrue(got.ns == recs[0].ns && got.nargs == 3 && got.args[1] == 0x0A000001);
+				Assert::IsTrue(strcmp(got.site->fmt, site.fmt) == 0 && got.site->level == 1);
+			}
+			Assert::IsTrue(r.next(got) && got.site == nullptr && got.args[0] == 3);
+			Assert::IsTrue(!r.next(got) && !r.error());
+			fclose(f);
+
+			// A ring that fills up drops the newest.
+			for (size_t i = 0; i < EVENT_RING_SIZE + 2; i++)
+				event_add(site, i);
+			recs.clear();
+			event_drain(recs, dropped);
+			Assert::IsTrue(recs.size() == EVENT_RING_SIZE && dropped == 2);
+			Assert::IsTrue(recs.back().args[0] == EVENT_RING_SIZE - 1);
+		}
+	};
+}
@@ -0,0 +1,139 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+
+#include <utility>
+#include <vector>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	// Given I, a flow number, a key of its own.
+	static struct flow_key test_key(uint32_t i)
+	{
+		return flow_key_make(0x0A000001, (uint16_t)(1024 + i), 0x0A000002 + (i >> 16), 80);
+	}
+
+	TEST_CLASS(flow_tables)
+	{
+	public:
+		TEST_METHOD(InsertFindEraseAcrossWraparound)
+		{
+			const uint32_t start = 0xFFFFFFF0;
+			flow_table<int> table(1000);
+			for (uint32_t i = 0; i < 1000; i++)
+			{
+				uint32_t h = table.insert(test_key(i), (int)i, 32, start + i / 100);
+				Assert::IsTrue(h != FLOW_NIL);
+			}
+			Assert::IsTrue(table.full());
+			Assert::IsTrue(table.insert(test_key(1000), 1000, 32, start) == FLOW_NIL);
+
+			// Every other flow is erased.  The rest are still found where
+			// they are, whatever was taken out of their probe runs.
+			for (uint32_t i = 0; i < 1000; i += 2)
+				table.erase(table.find(test_key(i)));
+			Assert::IsTrue(table.size() == 500);
+			for (uint32_t i = 0; i < 1000; i++)
+			{
+				uint32_t h = table.find(test_key(i));
+				if (i % 2 == 0)
+					Assert::IsTrue(h == FLOW_NIL);
+				else
+					Assert::IsTrue(h != FLOW_NIL && table.at(h) == (int)i && table.key_at(h) == test_key(i));
+			}
+			Assert::IsTrue(table.find(test_key(1000)) == FLOW_NIL);
+
+			// Flows go back in after the tick counter has wrapped.
+			for (uint32_t i = 0; i < 1000; i += 2)
+				Assert::IsTrue(table.insert(test_key(i), (int)i, 32, start + 20) != FLOW_NIL);
+			Assert::IsTrue(table.full());
+			for (uint32_t i = 0; i < 1000; i++)
+			{
+				uint32_t h = table.find(test_key(i));
+				Assert::IsTrue(h != FLOW_NIL && table.at(h) == (int)i);
+			}
+
+			// Nothing is idle for 32 ticks until the counter has wrapped.
+			// Then the flows put in at START go, but not the ones put back
+			// in after it wrapped.
+			std::vector<std::pair<struct flow_key, int>> expired;
+			for (uint32_t now = start; now != start + 32; now++)
+				table.expire(now, expired);
+			Assert::IsTrue(expired.empty());
+			table.expire(start + 32, expired);
+			Assert::IsTrue(expired.size() == 50);
+			for (auto& e : expired)
+				Assert::IsTrue(e.second % 2 == 1 && e.second < 100 && e.first == test_key(e.second));
+			Assert::IsTrue(table.size() == 950);
+			Assert::IsTrue(table.find(test_key(1)) == FLOW_NIL);
+			Assert::IsTrue(table.find(test_key(0)) != FLOW_NIL);
+		}
+
+		TEST_METHOD(LruEvictionWhenFull)
+		{
+			flow_table<int> table(4);
+			Assert::IsTrue(table.lru() == FLOW_NIL && table.mru() == FLOW_NIL);
+			uint32_t h[4];
+			for (uint32_t i = 0; i < 4; i++)
+				h[i] = table.insert(test_key(i), (int)i, 100, 0);
+			Assert::IsTrue(table.full());
+			Assert::IsTrue(table.lru() == h[0]);
+
+			// Touching a flow makes it the most recently used.
+			table.touch(h[0], 1);
+			Assert::IsTrue(table.lru() == h[1]);
+			const int order[] = { 0, 3, 2, 1 };
+			uint32_t handle = table.mru();
+			for (int i : order)
+			{
+				Assert::IsTrue(handle == h[i]);
+				handle = table.older(handle);
+			}
+			Assert::IsTrue(handle == FLOW_NIL);
+
+			// A full table makes room by evicting its least recently used
+			// flow.
+			Assert::IsTrue(table.insert(test_key(4), 4, 100, 2) == FLOW_NIL);
+			table.erase(table.lru());
+			uint32_t h4 = table.insert(test_key(4), 4, 100, 2);
+			Assert::IsTrue(h4 == h[1]);
+			Assert::IsTrue(table.find(test_key(1)) == FLOW_NIL);
+			Assert::IsTrue(table.mru() == h4 && table.lru() == h[2]);
+
+			table.erase(table.lru());
+			table.erase(table.lru());
+			Assert::IsTrue(table.lru() == h[0] && table.size() == 2);
+		}
+
+		TEST_METHOD(ExpiryAfterManyTicks)
+		{
+			flow_table<int> table(8);
+			uint32_t h_short = table.insert(test_key(0), 0, 10, 100);
+			uint32_t h_long = table.insert(test_key(1), 1, 1000, 100);
+			uint32_t h_touched = table.insert(test_key(2), 2, 10, 100);
+			Assert::IsTrue(h_short != FLOW_NIL && h_long != FLOW_NIL && h_touched != FLOW_NIL);
+
+			// More than a turn of the wheel goes by at once.  The short
+			// flow that was touched late is filed again, not expired.
+			table.touch(h_touched, 395);
+			std::vector<std::pair<struct flow_key, int>> expired;
+			table.expire(400, expired);
+			Assert::IsTrue(expired.size() == 1 && expired[0].second == 0);
+			Assert::IsTrue(table.find(test_key(0)) == FLOW_NIL);
+			Assert::IsTrue(table.size() == 2);
+
+			table.expire(404, expired);
+			Assert::IsTrue(expired.size() == 1);
+			table.expire(405, expired);
+			Assert::IsTrue(expired.size() == 2 && expired[1].second == 2);
+
+			// A timeout longer than the wheel goes round it more than once.
+			table.expire(1099, expired);
+			Assert::IsTrue(expired.size() == 2 && table.find(test_key(1)) == h_long);
+			table.expire(1100, expired);
+			Assert::IsTrue(expired.size() == 3 && expired[2].second == 1);
+			Assert::IsTrue(table.size() == 0 && table.lru() == FLOW_NIL);
+		}
+	};
+}
@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+#include "../udptoserial/input_queue.h"
+
+#include <vector>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	// Given ID, a frame number, push LEN bytes of it onto Q as one SLIP
+	// message, with an END in front if INTRODUCE.  Returns how many
+	// bytes were kept.
+	static size_t push_frame(input_queue& q, uint8_t id, size_t len, bool introduce = true)
+	{
+		std::vector<uint8_t> msg(len, id), wire;
+		slip_encode(wire, msg, introduce);
+		return q.push_bytes(wire.data(), wire.size());
+	}
+
+	// Given P, a packet popped off a queue, whether it is all of frame ID.
+	static bool is_frame(const packet& p, uint8_t id, size_t len)
+	{
+		if (!p || p.size() != len)
+			return false;
+		for (size_t i = 0; i < len; i++)
+			if (p.data()[i] != id)
+				return false;
+		return true;
+	}
+
+	TEST_CLASS(input_queues)
+	{
+	public:
+		TEST_METHOD(DropNewestBacksUpThenDrops)
+		{
+			// Each frame is 12 bytes on the wire.
+			packet_pool pool(64, 0, 8);
+			input_queue q(pool, 64, 2, input_queue::Overflow::DROP_NEWEST);
+			for (uint8_t id = 1; id <= 4; id++)
+				Assert::IsTrue(push_frame(q, id, 10) == 12);
+
+			// Decoding stops once two packets wait, and the rest of the
+			// bytes wait behind them.
+			Assert::IsTrue(q.move_bytes_to_packets() == 2);
+			Assert::IsTrue(q.packets_queued() == 2);
+			Assert::IsTrue(q.bytes_queued() == 24);
+
+			// The byte ring fills up.  Frame 8 is cut after 4 bytes, and
+			// frame 9 is dropped whole.
+			for (uint8_t id = 5; id <= 7; id++)
+				Assert::IsTrue(push_frame(q, id, 10) == 12);
+			Assert::IsTrue(push_frame(q, 8, 10) == 4);
+			Assert::IsTrue(push_frame(q, 9, 10) == 0);
+			Assert::IsTrue(q.bytes_queued() == 64);
+
+			// The oldest frames were kept.
+			for (uint8_t id = 1; id <= 7; id++)
+				Assert::IsTrue(is_frame(q.pop_packet(), id, 10));
+			Assert::IsTrue(!q.is_packet_available());
+			Assert::IsTrue(q.bytes_queued() == 0);
+
+			// What is left of frame 8 is skipped, up to the END of the next
+			// frame, which starts with one.
+			Assert::IsTrue(push_frame(q, 10, 10) == 12);
+			Assert::IsTrue(is_frame(q.pop_packet(), 10, 10));
+			Assert::IsTrue(!q.is_packet_available());
+
+			const input_queue::Counters& c = q.counters();
+			Assert::IsTrue(c.bytes_in == 10 * 12);
+			Assert::IsTrue(c.bytes_dropped == 8 + 12);
+			Assert::IsTrue(c.packets_in == 8);
+			Assert::IsTrue(c.packets_dropped == 0);
+			Assert::IsTrue(c.packets_oversize == 0);
+		}
+
+		TEST_METHOD(DropOldestKeepsDecoding)
+		{
+			packet_pool pool(64, 0, 8);
+			input_queue q(pool, 256, 2, input_queue::Overflow::DROP_OLDEST);
+			for (uint8_t id = 1; id <= 5; id++)
+				Assert::IsTrue(push_frame(q, id, 10) == 12);
+
+			// Every frame is decoded, and the newest two survive.
+			Assert::IsTrue(q.move_bytes_to_packets() == 5);
+			Assert::IsTrue(q.packets_queued() == 2);
+			Assert::IsTrue(q.bytes_queued() == 0);
+			Assert::IsTrue(is_frame(q.pop_packet(), 4, 10));
+			Assert::IsTrue(is_frame(q.pop_packet(), 5, 10));
+			Assert::IsTrue(!q.is_packet_available());
+
+			const input_queue::Counters& c = q.counters();
+			Assert::IsTrue(c.bytes_in == 5 * 12);
+			Assert::IsTrue(c.bytes_dropped == 0);
+			Assert::IsTrue(c.packets_in == 5);
+			Assert::IsTrue(c.packets_dropped == 3);
+		}
+
+		TEST_METHOD(GapSkipsToNextEnd)
+		{
+			packet_pool pool(64, 0, 8);
+			input_queue q(pool, 16, 8, input_queue::Overflow::DROP_NEWEST);
+
+			// Frame 1 is decoded to make room for frame 2, which still
+			// doesn't fit: 16 of its 22 bytes are kept.
+			Assert::IsTrue(push_frame(q, 1, 6) == 8);
+			Assert::IsTrue(push_frame(q, 2, 20) == 16);
+			Assert::IsTrue(q.bytes_queued() == 16);
+
+			// Making room for frame 3 takes the decoder up to the gap.
+			// Frame 3 has no END in front, so it runs on from the broken
+			// frame 2 and is skipped with it.  Frame 4 is whole.
+			Assert::IsTrue(push_frame(q, 3, 4, false) == 5);
+			Assert::IsTrue(push_frame(q, 4, 4) == 6);
+			Assert::IsTrue(is_frame(q.pop_packet(), 1, 6));
+			Assert::IsTrue(is_frame(q.pop_packet(), 4, 4));
+			Assert::IsTrue(!q.is_packet_available());
+			Assert::IsTrue(q.bytes_queued() == 0);
+
+			const input_queue::Counters& c = q.counters();
+			Assert::IsTrue(c.bytes_in == 8 + 22 + 5 + 6);
+			Assert::IsTrue(c.bytes_dropped == 6);
+			Assert::IsTrue(c.packets_in == 2);
+			Assert::IsTrue(c.packets_dropped == 0);
+			Assert::IsTrue(c.packets_oversize == 0);
+		}
+	};
+}
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+
+#include <cstring>
+#include <vector>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	TEST_CLASS(link)
+	{
+	public:
+		TEST_METHOD(RateFrames)
+		{
+			struct link_rate offer {};
+			offer.op = LINK_RATE_OFFER;
+			offer.arg = 0xDEADBEEF;
+			offer.count = 3;
+			offer.rates[0] = 115200;
+			offer.rates[1] = 1000000;
+			offer.rates[2] = 3000000;
+			std::vector<uint8_t> frame;
+			link_rate_encode(frame, offer);
+			Assert::IsTrue(link_frame_type(frame) == LINK_FRAME_RATE);
+
+			struct link_rate got;
+			Assert::IsTrue(link_rate_decode(frame.data(), frame.size(), got));
+			Assert::IsTrue(got.op == LINK_RATE_OFFER && got.arg == 0xDEADBEEF);
+			Assert::IsTrue(got.count == 3 && got.rates[2] == 3000000);
+
+			// A test pattern with one bit flipped fails.
+			struct link_rate test {};
+			test.op = LINK_RATE_TEST;
+			test.arg = 1000000;
+			frame.clear();
+			link_rate_encode(frame, test);
+			Assert::IsTrue(link_rate_decode(frame.data(), frame.size(), got));
+			Assert::IsTrue(got.arg == 1000000);
+			frame[LINK_RATE_HEADER_LEN + 0x55] ^= 0x04;
+			Assert::IsTrue(!link_rate_decode(frame.data(), frame.size(), got));
+			Assert::IsTrue(!link_rate_decode(frame.data(), frame.size() - 1, got));
+		}
+
+		TEST_METHOD(UdpBatchFrames)
+		{
+			std::vector<uint8_t> big(300, 'b');
+			struct link_udp d[4] = {
+				{ true, 0x0A000001, 5000, 0x0A000002, 4000, (const uint8_t *)"one", 3 },
+				{ true, 0x0A000001, 5000, 0x0A000002, 4000, (const uint8_t *)"two", 3 },
+				{ true, 0x0A000001, 5001, 0x0A000002, 4001, big.data(), big.size() },
+				{ true, 0x0A000003, 5001, 0x0A000002, 4001, (const uint8_t *)"", 0 },
+			};
+			std::vector<uint8_t> frame;
+			link_udp_batch_encode(frame, d, 4);
+			Assert::IsTrue(link_frame_type(frame) == LINK_FRAME_UDP_BATCH);
+			// Full, same flow, new ports and a long length, new addresses.
+			Assert::IsTrue(frame.size() == 1 + (1 + 12 + 1 + 3) + (2 + 3) + (1 + 4 + 2 + 300) + (1 + 8 + 1));
+
+			struct link_udp_batch batch;
+			struct link_udp got;
+			link_udp_batch_begin(batch, frame.data(), frame.size());
+			for (int i = 0; i < 4; i++)
+			{
+				Assert::IsTrue(link_udp_batch_next(batch, got));
+				Assert::IsTrue(got.reply && got.caddr == d[i].caddr && got.cport == d[i].cport);
+				Assert::IsTrue(got.saddr == d[i].saddr && got.sport == d[i].sport);
+				Assert::IsTrue(got.len == d[i].len && memcmp(got.data, d[i].data, got.len) == 0);
+			}
+			Assert::IsTrue(!link_udp_batch_next(batch, got) && !batch.error);
+
+			// Cut short in the middle of a payload.
+			link_udp_batch_begin(batch, frame.data(), frame.size() - 12);
+			int n = 0;
+			while (link_udp_batch_next(batch, got))
+				n++;
+			Assert::IsTrue(n == 2 && batch.error);
+
+			// The first entry has to say who it is from and to.
+			frame[1] = 0;
+			link_udp_batch_begin(batch, frame.data(), frame.size());
+			Assert::IsTrue(!link_udp_batch_next(batch, got) && batch.error);
+		}
+
+		TEST_METHOD(StampsAndClockOffset)
+		{
+			uint8_t frame[LINK_STAMP_LEN + 3] = { 0, 0, 0, 0, 0, LINK_FRAME_UDP, 'h', 'i' };
+			link_stamp_encode_header(frame, 0xFFFFFFF0);
+			Assert::IsTrue(link_frame_type(frame, sizeof(frame)) == LINK_FRAME_STAMP);
+			const uint8_t *inner = frame;
+			size_t len = sizeof(frame);
+			uint32_t usec;
+			Assert::IsTrue(link_stamp_strip(inner, len, usec));
+			Assert::IsTrue(usec == 0xFFFFFFF0 && inner == frame + LINK_STAMP_LEN && len == 3);
+			inner = frame;
+			len = LINK_STAMP_LEN - 1;
+			Assert::IsTrue(!link_stamp_strip(inner, len, usec));
+
+			// The far clock is ahead by 0x80000010, across a wrap.  Going
+			// takes 100us and coming back 300us, then 50us and 50us, and
+			// the far end holds each probe 1000us.
+			const uint32_t ahead = 0x80000010;
+			struct link_clock clock {};
+			struct link_probe echo {};
+			echo.tx_usec = 0xFFFFFF00;
+			echo.rx_usec = echo.tx_usec + 100 + ahead;
+			echo.echo_usec = echo.rx_usec + 1000;
+			link_clock_add(clock, echo, echo.tx_usec + 100 + 1000 + 300);
+			Assert::IsTrue(clock.valid && clock.delay == 400 && clock.offset == ahead - 100);
+			echo.tx_usec += 5000;
+			echo.rx_usec = echo.tx_usec + 50 + ahead;
+			echo.echo_usec = echo.rx_usec + 1000;
+			link_clock_add(clock, echo, echo.tx_usec + 50 + 1000 + 50);
+			Assert::IsTrue(clock.delay == 100 && clock.offset == ahead);
+			Assert::IsTrue(link_clock_to_local(clock, 12345 + ahead) == 12345);
+
+			// An old echo, without ECHO_USEC, is taken to have been sent
+			// straight back.
+			echo.echo_usec = 0;
+			std::vector<uint8_t> bytes;
+			link_probe_echo_encode(bytes, echo);
+			Assert::IsTrue(bytes.size() == LINK_PROBE_ECHO_LEN);
+			struct link_probe got;
+			Assert::IsTrue(link_probe_decode(bytes.data(), LINK_PROBE_ECHO_SHORT_LEN, got));
+			Assert::IsTrue(got.echo_usec == got.rx_usec);
+			Assert::IsTrue(!link_probe_decode(bytes.data(), LINK_PROBE_ECHO_SHORT_LEN - 1, got));
+
+			// The best round trip gives way to the best of the next
+			// window once it is a window old.
+			for (unsigned i = 0; i < 2 * LINK_CLOCK_WINDOW; i++)
+			{
+				echo.tx_usec += 5000;
+				echo.rx_usec = echo.tx_usec + 150 + ahead + 20;
+				echo.echo_usec = echo.rx_usec;
+				link_clock_add(clock, echo, echo.tx_usec + 300);
+			}
+			Assert::IsTrue(clock.delay == 300 && clock.offset == ahead + 20);
+		}
+	};
+}
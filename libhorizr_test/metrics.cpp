@@ -0,0 +1,58 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+
+#include <string>
+#include <thread>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	TEST_CLASS(metrics)
+	{
+	public:
+		TEST_METHOD(MetricsAddUpAcrossThreads)
+		{
+			// Every value falls in the bucket whose range holds it, and the
+			// buckets are contiguous.
+			for (uint64_t v = 0; v < 100000; v++)
+			{
+				size_t b = hdr_bucket(v);
+				Assert::IsTrue(hdr_bucket_high(b) >= v && (b == 0 || hdr_bucket_high(b - 1) < v));
+			}
+			Assert::IsTrue(hdr_bucket(~0ull) == HDR_BUCKETS - 1);
+
+			std::string tx, rx;
+			metrics_add_label(tx, "link", "tty\"0");
+			metrics_add_label(tx, "direction", "tx");
+			metrics_add_label(rx, "link", "tty\"0");
+			metrics_add_label(rx, "direction", "rx");
+			Assert::IsTrue(tx == "link=\"tty\\\"0\",direction=\"tx\"");
+			uint32_t bytes = metric_register("test_bytes_total", "Bytes.", metric_type::COUNTER, { tx, rx });
+			uint32_t wait = metric_register("test_wait_seconds", "Wait.", metric_type::HISTOGRAM, {}, 1e-6);
+			metric_add(bytes, 100);
+			metric_add(bytes + 1, 7);
+			metric_hdr_add(wait, 3);
+			std::thread other([=]
+				{
+					metric_add(bytes, 20);
+					for (int i = 0; i < 99; i++)
+						metric_hdr_add(wait, 1000);
+				});
+			other.join();
+			Assert::IsTrue(metric_read(bytes) == 120 && metric_read(bytes + 1) == 7);
+			Assert::IsTrue(metric_hdr_percentile(wait, 0.01) == 3);
+			uint64_t p50 = metric_hdr_percentile(wait, 0.5);
+			Assert::IsTrue(p50 >= 1000 && p50 < 1070);
+
+			std::string text;
+			metrics_write(text);
+			Assert::IsTrue(text.find("# TYPE test_bytes_total counter\n") != std::string::npos);
+			Assert::IsTrue(text.find("test_bytes_total{link=\"tty\\\"0\",direction=\"tx\"} 120\n") != std::string::npos);
+			Assert::IsTrue(text.find("test_wait_seconds_bucket{le=\"3e-06\"} 1\n") != std::string::npos);
+			Assert::IsTrue(text.find("test_wait_seconds_bucket{le=\"+Inf\"} 100\n") != std::string::npos);
+			Assert::IsTrue(text.find("test_wait_seconds_sum 0.099003\n") != std::string::npos);
+			Assert::IsTrue(text.find("test_wait_seconds_count 100\n") != std::string::npos);
+		}
+	};
+}
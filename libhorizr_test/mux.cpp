@@ -0,0 +1,155 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../libhorizr/libhorizr.h"
+
+#include <cstring>
+#include <vector>
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libhorizr_test
+{
+	TEST_CLASS(mux)
+	{
+	public:
+		TEST_METHOD(MuxRoundTrip)
+		{
+			const uint8_t payload[] = { 'h', 'e', 'l', 'l', 'o' };
+
+			// An OPEN with its payload, on a one-byte channel.
+			struct mux_msg open {};
+			open.type = LINK_FRAME_MUX_OPEN;
+			open.channel = 0x7F;
+			open.saddr = 0xC0A80001;
+			open.sport = 40000;
+			open.daddr = 0x0A000002;
+			open.dport = 443;
+			open.data = payload;
+			open.len = sizeof payload;
+			std::vector<uint8_t> frame;
+			mux_encode(frame, open);
+			Assert::IsTrue(mux_header_len(open) == 14);
+			Assert::IsTrue(frame.size() == 14 + sizeof payload);
+			Assert::IsTrue(frame[0] == LINK_FRAME_MUX_OPEN && frame[1] == 0x7F);
+			Assert::IsTrue(link_frame_type(frame) == LINK_FRAME_MUX_OPEN);
+
+			struct mux_msg got;
+			Assert::IsTrue(mux_decode(frame, got));
+			Assert::IsTrue(got.type == LINK_FRAME_MUX_OPEN && !got.reply && got.channel == 0x7F);
+			Assert::IsTrue(got.saddr == 0xC0A80001 && got.sport == 40000);
+			Assert::IsTrue(got.daddr == 0x0A000002 && got.dport == 443);
+			Assert::IsTrue(got.len == sizeof payload && memcmp(got.data, payload, sizeof payload) == 0);
+			Assert::IsTrue(got.data == frame.data() + 14);
+
+			// DATA from the end that didn't open the channel, on a two-byte
+			// channel.
+			struct mux_msg data {};
+			data.type = LINK_FRAME_MUX_DATA;
+			data.reply = true;
+			data.channel = 0x80;
+			data.data = payload;
+			data.len = sizeof payload;
+			frame.clear();
+			mux_encode(frame, data);
+			Assert::IsTrue(mux_header_len(data) == 3);
+			Assert::IsTrue(frame[0] == (LINK_FRAME_MUX_DATA | LINK_FRAME_MUX_REPLY));
+			Assert::IsTrue(frame[1] == 0x80 && frame[2] == 0x80);
+			Assert::IsTrue(mux_decode(frame, got));
+			Assert::IsTrue(got.type == LINK_FRAME_MUX_DATA && got.reply && got.channel == 0x80);
+			Assert::IsTrue(got.len == sizeof payload && memcmp(got.data, payload, sizeof payload) == 0);
+
+			// The largest channel, with no payload.
+			data.channel = MUX_CHANNEL_MAX;
+			data.len = 0;
+			frame.clear();
+			mux_encode(frame, data);
+			Assert::IsTrue(frame.size() == 3 && frame[1] == 0xFF && frame[2] == 0xFF);
+			Assert::IsTrue(mux_decode(frame, got));
+			Assert::IsTrue(got.channel == MUX_CHANNEL_MAX && got.len == 0);
+
+			struct mux_msg fin {};
+			fin.type = LINK_FRAME_MUX_FIN;
+			fin.channel = 5;
+			frame.clear();
+			mux_encode(frame, fin);
+			Assert::IsTrue(frame.size() == 2);
+			Assert::IsTrue(mux_decode(frame, got));
+			Assert::IsTrue(got.type == LINK_FRAME_MUX_FIN && !got.reply && got.channel == 5);
+			Assert::IsTrue(got.data == nullptr && got.len == 0);
+
+			struct mux_msg rst {};
+			rst.type = LINK_FRAME_MUX_RST;
+			rst.reply = true;
+			rst.channel = 300;
+			rst.reason = MUX_RST_UNREACHABLE;
+			frame.clear();
+			mux_encode(frame, rst);
+			Assert::IsTrue(frame.size() == 4);
+			Assert::IsTrue(mux_decode(frame, got));
+			Assert::IsTrue(got.type == LINK_FRAME_MUX_RST && got.reply && got.channel == 300);
+			Assert::IsTrue(got.reason == MUX_RST_UNREACHABLE);
+			Assert::IsTrue(strcmp(mux_rst_reason_string(got.reason), "server unreachable") == 0);
+			Assert::IsTrue(strcmp(mux_rst_reason_string(200), "unknown reason") == 0);
+
+			struct mux_msg credit {};
+			credit.type = LINK_FRAME_MUX_CREDIT;
+			credit.channel = 1;
+			credit.credit = 0xBEEF;
+			frame.clear();
+			mux_encode(frame, credit);
+			Assert::IsTrue(frame.size() == 4 && frame[2] == 0xBE && frame[3] == 0xEF);
+			Assert::IsTrue(mux_decode(frame, got));
+			Assert::IsTrue(got.type == LINK_FRAME_MUX_CREDIT && got.channel == 1 && got.credit == 0xBEEF);
+
+			// A header written in front of a payload already in place reads
+			// back the same as one from mux_encode.
+			uint8_t buf[MUX_HEADER_MAX + sizeof payload];
+			size_t hlen = mux_header_len(open);
+			memcpy(buf + hlen, payload, sizeof payload);
+			mux_encode_header(buf, open);
+			frame.clear();
+			mux_encode(frame, open);
+			Assert::IsTrue(frame.size() == hlen + sizeof payload);
+			Assert::IsTrue(memcmp(buf, frame.data(), frame.size()) == 0);
+			Assert::IsTrue(mux_decode(buf, hlen + sizeof payload, got));
+			Assert::IsTrue(got.data == buf + hlen && got.len == sizeof payload);
+		}
+
+		TEST_METHOD(MuxMalformed)
+		{
+			struct mux_msg got;
+			const uint8_t one[] = { LINK_FRAME_MUX_FIN };
+			Assert::IsTrue(!mux_decode(one, sizeof one, got));
+			Assert::IsTrue(!mux_decode(one, 0, got));
+
+			// Not a stream mux frame type.
+			const uint8_t before[] = { LINK_FRAME_MUX_OPEN - 1, 1 };
+			Assert::IsTrue(!mux_decode(before, sizeof before, got));
+			const uint8_t past[] = { LINK_FRAME_MUX_CREDIT + 1, 1 };
+			Assert::IsTrue(!mux_decode(past, sizeof past, got));
+
+			// A two-byte channel cut after its first byte.
+			const uint8_t chan[] = { LINK_FRAME_MUX_FIN, 0x81 };
+			Assert::IsTrue(!mux_decode(chan, sizeof chan, got));
+
+			// Every frame that stops short of its header fails, whatever its
+			// type and channel size.
+			const uint8_t types[] = { LINK_FRAME_MUX_OPEN, LINK_FRAME_MUX_RST, LINK_FRAME_MUX_CREDIT };
+			const uint16_t channels[] = { 3, 0x1234 };
+			for (uint8_t type : types)
+				for (uint16_t channel : channels)
+				{
+					struct mux_msg msg {};
+					msg.type = type;
+					msg.reply = true;
+					msg.channel = channel;
+					std::vector<uint8_t> frame;
+					mux_encode(frame, msg);
+					Assert::IsTrue(frame.size() == mux_header_len(msg));
+					for (size_t len = 0; len < frame.size(); len++)
+						Assert::IsTrue(!mux_decode(frame.data(), len, got));
+					Assert::IsTrue(mux_decode(frame, got));
+					Assert::IsTrue(got.type == type && got.reply && got.channel == channel);
+				}
+		}
+	};
+}
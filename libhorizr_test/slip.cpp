@@ -51,5 +51,80 @@ namespace libhorizr_test
 			Assert::IsTrue(bytevector_compare(dest, expected) == 0);
 		}
 #endif
+
+		TEST_METHOD(SlipDecoderAcrossReads)
+		{
+			// With an END and an ESC in the middle.
+			std::vector<uint8_t> msg = { 'a', 0xC0, 'b', 0xDB, 'c' };
+			std::vector<uint8_t> wire;
+			slip_encode(wire, msg, true);
+			slip_encode(wire, msg, false);
+
+			uint8_t frame[16];
+			struct slip_decoder dec;
+			slip_decoder_init(dec, frame, sizeof(frame));
+			std::vector<std::vector<uint8_t>> got;
+			// One byte at a time, so that every escape is split.
+			for (size_t i = 0; i < wire.size(); i++)
+			{
+				bool complete;
+				Assert::IsTrue(slip_decoder_feed(dec, &wire[i], 1, complete) == 1);
+				if (complete)
+				{
+					if (dec.len > 0)
+						got.push_back(std::vector<uint8_t>(frame, frame + dec.len));
+					slip_decoder_reset(dec);
+				}
+			}
+			Assert::IsTrue(got.size() == 2);
+			Assert::IsTrue(got[0] == msg);
+			Assert::IsTrue(got[1] == msg);
+		}
+
+		TEST_METHOD(SlipDecoderOverflow)
+		{
+			std::vector<uint8_t> msg(20, 'a');
+			std::vector<uint8_t> wire;
+			slip_encode(wire, msg, false);
+
+			uint8_t frame[16];
+			struct slip_decoder dec;
+			slip_decoder_init(dec, frame, sizeof(frame));
+			bool complete;
+			Assert::IsTrue(slip_decoder_feed(dec, wire.data(), wire.size(), complete) == wire.size());
+			Assert::IsTrue(complete);
+			Assert::IsTrue(dec.overflow);
+		}
+
+		TEST_METHOD(SlipSegmentsMatchEncodeBuf)
+		{
+			// Escapes at the start, the end, back to back, and none.
+			std::vector<std::vector<uint8_t>> msgs = {
+				{ 0xC0, 'a', 'b', 0xDB },
+				{ 'a', 0xC0, 0xC0, 0xDB, 'b' },
+				{ 'a', 'b', 'c' },
+				{ 0xDB },
+				{},
+			};
+			for (size_t i = 0; i < msgs.size(); i++)
+			{
+				const std::vector<uint8_t>& msg = msgs[i];
+				std::vector<uint8_t> expected(slip_encoded_max(msg.size()));
+				expected.resize(slip_encode_buf(expected.data(), msg.data(), msg.size(), i % 2 == 0));
+
+				std::vector<struct slip_segment> segs;
+				size_t n = slip_encode_segments(segs, msg.data(), msg.size(), i % 2 == 0);
+				std::vector<uint8_t> got;
+				for (auto& seg : segs)
+				{
+					// Runs of the message are referred to, not copied.
+					if (seg.len > 2)
+						Assert::IsTrue(seg.data >= msg.data() && seg.data + seg.len <= msg.data() + msg.size());
+					got.insert(got.end(), seg.data, seg.data + seg.len);
+				}
+				Assert::IsTrue(n == got.size());
+				Assert::IsTrue(got == expected);
+			}
+		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "Capture.h"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "Log.h"
+
+// The capture thread drains the rings this often.  A ring holds
+// CAPTURE_RING_SIZE bytes, which is a lot longer than this at any rate a
+// serial port runs at.
+const static auto DRAIN_INTERVAL = std::chrono::milliseconds(50);
+
+static std::thread capture_thread_;
+static std::mutex capture_mutex_;
+static std::condition_variable capture_wake_;
+static bool capture_stopping_ = false;
+static bool capture_started_ = false;
+// Only the capture thread touches these, once it is running.
+static std::string path_;
+static uint64_t max_bytes_;
+static unsigned files_;
+static uint32_t snaplen_;
+static FILE *file_ = nullptr;
+static std::unique_ptr<capture_file_writer> writer_;
+
+static std::string rotated_name(unsigned n)
+{
+	return n == 0 ? path_ : path_ + "." + std::to_string(n);
+}
+
+static void capture_close()
+{
+	if (file_ == nullptr)
+		return;
+	writer_.reset();
+	fclose(file_);
+	file_ = nullptr;
+}
+
+// With the current file full, or none open yet, start a new one.  A full
+// file moves up one place, and whatever was in the last place goes.
+static bool capture_open()
+{
+	if (file_ != nullptr)
+	{
+		capture_close();
+		if (files_ > 1)
+		{
+			for (unsigned n = files_ - 1; n > 0; n--)
+				rename(rotated_name(n - 1).c_str(), rotated_name(n).c_str());
+		}
+	}
+	file_ = fopen(path_.c_str(), "wb");
+	if (file_ == nullptr)
+	{
+		LOG(error) << "can't open capture file " << path_ << ": " << strerror(errno);
+		capture_on_.store(false, std::memory_order_relaxed);
+		return false;
+	}
+	writer_.reset(new capture_file_writer(file_, snaplen_));
+	return true;
+}
+
+static void capture_drain_all()
+{
+	uint64_t dropped = 0;
+	capture_drain([](const struct capture_record& rec)
+	{
+		if (file_ == nullptr || writer_->size() >= max_bytes_)
+			if (!capture_open())
+				return;
+		writer_->write(rec);
+	}, dropped);
+	if (file_ != nullptr)
+		fflush(file_);
+	if (dropped > 0)
+		LOG(warning) << dropped << " frames not captured, for want of room in the capture ring";
+}
+
+static void capture_thread_run()
+{
+	std::unique_lock<std::mutex> lock(capture_mutex_);
+	while (!capture_stopping_)
+	{
+		capture_wake_.wait_for(lock, DRAIN_INTERVAL);
+		lock.unlock();
+		capture_drain_all();
+		lock.lock();
+	}
+}
+
+void capture_start(const std::string& path, uint64_t max_bytes, unsigned files, uint32_t snaplen, bool on)
+{
+	path_ = path;
+	max_bytes_ = max_bytes;
+	files_ = files;
+	snaplen_ = snaplen;
+	capture_snaplen_.store(snaplen, std::memory_order_relaxed);
+	capture_started_ = true;
+	capture_thread_ = std::thread(capture_thread_run);
+	if (on)
+		capture_set(true);
+}
+
+void capture_set(bool on)
+{
+	if (!capture_started_)
+	{
+		LOG(warning) << "no capture file is configured, so frames can't be captured";
+		return;
+	}
+	capture_on_.store(on, std::memory_order_relaxed);
+	LOG(info) << "capture " << (on ? "on, to " : "off, in ") << path_;
+}
+
+void capture_stop()
+{
+	if (!capture_thread_.joinable())
+		return;
+	capture_on_.store(false, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(capture_mutex_);
+		capture_stopping_ = true;
+	}
+	capture_wake_.notify_one();
+	capture_thread_.join();
+	capture_drain_all();
+	capture_close();
+}
@@ -0,0 +1,44 @@
+#pragma once
+// CAPTURE - records the frames that cross the serial link into pcapng
+// files, for Wireshark.  See libhorizr/capture.h for how frames get from
+// the forwarding path to the capture thread.
+//
+// Frames are captured as they were before SLIP encoding, and after SLIP
+// decoding.  A frame we send is captured as it goes to the port, STAMP
+// and all.  A frame we receive that is too long for the decoder, or
+// whose type we don't know, goes under the "undecodable" interface, so
+// line noise can be told apart from real traffic.
+//
+// The file is only opened once capture is first turned on, and when it
+// reaches its size limit it is renamed to FILE.1, FILE.1 to FILE.2, and
+// so on, the oldest going once there are FILES of them.
+
+#include <cstdint>
+#include <string>
+#include "../libhorizr/capture.h"
+#include "../libhorizr/link.h"
+
+// Start the capture thread, writing to PATH, with each file kept under
+// MAX_BYTES and at most FILES of them, and each frame cut to SNAPLEN
+// bytes, or kept whole if zero.  Capture starts turned ON or off.
+void capture_start(const std::string& path, uint64_t max_bytes, unsigned files, uint32_t snaplen, bool on);
+
+// Turn capture on or off, as when asked to by a signal.  Does nothing,
+// having said why, if capture_start wasn't called.
+void capture_set(bool on);
+
+inline bool capture_is_on()
+{
+	return capture_on_.load(std::memory_order_relaxed);
+}
+
+// Write whatever is still waiting, close the file, and stop the thread.
+void capture_stop();
+
+// Given FRAME, a whole link frame that went DIR, capture it as an IPv4
+// packet or as a frame of our own.
+inline void capture_link_frame(capture_dir dir, const uint8_t *frame, size_t len)
+{
+	capture_frame(link_frame_type(frame, len) == LINK_FRAME_IPV4 ? CAPTURE_IPV4 : CAPTURE_LINK,
+		dir, frame, len);
+}
@@ -3,20 +3,50 @@
 
 #include "Configuration.h"
 #include "ini.h"
+#include <cstdlib>
 #include <cstring>
 #include <exception>
 #include <stdexcept>
 
 #define CONFIG_UDP_PORT_COUNT_MAX (5)
+#define CONFIG_RATE_COUNT_MAX (16)
 typedef struct
 {
 	int baud_rate;
+	int negotiate;
+	int rate_count;
+	unsigned rate[CONFIG_RATE_COUNT_MAX];
 	int throttle_baud_rate;
+	int auto_pacing;
+	serial_tune_t serial_tune;
+	int tty_queue;
+	int cts_flow;
+	int busy_poll;
+	int busy_poll_idle;
+	realtime_t realtime;
+	int io_uring;
 	const char* serial_port_name;
 	int udp_port_count;
 	int udp_port[CONFIG_UDP_PORT_COUNT_MAX];
 	const char *localIP;
 	const char *remoteIP;
+	int max_connections;
+	int idle_timeout;
+	int coalesce_delay;
+	int coalesce_bytes;
+	int udp_max_sessions;
+	int udp_idle_timeout;
+	int udp_batch_delay;
+	int udp_batch_bytes;
+	const char *log_level;
+	const char *event_file;
+	const char *metrics_socket;
+	int timestamps;
+	const char *capture_file;
+	int capture_size;
+	int capture_files;
+	int capture_snaplen;
+	int capture_start;
 } configuration_tmp;
 
 static int handler(void* user, const char* section, const char* name,
@@ -28,9 +58,64 @@ static int handler(void* user, const char* section, const char* name,
 	if (MATCH("serial port", "baudrate")) {
 		pconfig->baud_rate = atoi(value);
 	}
-	if (MATCH("serial port", "throttle")) {
+	else if (MATCH("serial port", "negotiate")) {
+		pconfig->negotiate = (strcmp(value, "on") == 0);
+	}
+	// A comma-separated list of baud rates.
+	else if (MATCH("serial port", "rates")) {
+		const char *p = value;
+		char *end;
+		pconfig->rate_count = 0;
+		while (*p != '\0' && pconfig->rate_count < CONFIG_RATE_COUNT_MAX) {
+			unsigned long rate = strtoul(p, &end, 10);
+			if (end == p)
+				break;
+			if (rate > 0)
+				pconfig->rate[pconfig->rate_count++] = (unsigned)rate;
+			p = end;
+			while (*p == ',' || *p == ' ')
+				p++;
+		}
+	}
+	else if (MATCH("serial port", "throttle")) {
 		pconfig->throttle_baud_rate = atoi(value);
 	}
+	else if (MATCH("serial port", "pacing")) {
+		pconfig->auto_pacing = (strcmp(value, "auto") == 0);
+	}
+	else if (MATCH("serial port", "vmin")) {
+		pconfig->serial_tune.vmin = atoi(value);
+	}
+	else if (MATCH("serial port", "vtime")) {
+		pconfig->serial_tune.vtime = atoi(value);
+	}
+	else if (MATCH("serial port", "low_latency")) {
+		pconfig->serial_tune.low_latency = (strcmp(value, "on") == 0);
+	}
+	else if (MATCH("serial port", "latency_timer")) {
+		pconfig->serial_tune.latency_timer = atoi(value);
+	}
+	else if (MATCH("serial port", "tty_queue")) {
+		pconfig->tty_queue = atoi(value);
+	}
+	else if (MATCH("serial port", "cts_flow")) {
+		pconfig->cts_flow = (strcmp(value, "on") == 0);
+	}
+	else if (MATCH("serial port", "busy_poll")) {
+		pconfig->busy_poll = (strcmp(value, "on") == 0);
+	}
+	else if (MATCH("serial port", "busy_poll_idle")) {
+		pconfig->busy_poll_idle = atoi(value);
+	}
+	else if (MATCH("serial port", "busy_poll_cpu")) {
+		pconfig->realtime.cpu = atoi(value);
+	}
+	else if (MATCH("serial port", "busy_poll_priority")) {
+		pconfig->realtime.priority = atoi(value);
+	}
+	else if (MATCH("serial port", "io_uring")) {
+		pconfig->io_uring = (strcmp(value, "on") == 0);
+	}
 	else if (MATCH("serial port", "name")) {
 #ifdef WIN32
 		pconfig->serial_port_name = _strdup(value);
@@ -44,6 +129,57 @@ static int handler(void* user, const char* section, const char* name,
 	else if (MATCH("network", "remote_ip")) {
 		pconfig->remoteIP = strdup(value);
 	}
+	else if (MATCH("network", "max_connections")) {
+		pconfig->max_connections = atoi(value);
+	}
+	else if (MATCH("network", "idle_timeout")) {
+		pconfig->idle_timeout = atoi(value);
+	}
+	else if (MATCH("network", "coalesce_delay")) {
+		pconfig->coalesce_delay = atoi(value);
+	}
+	else if (MATCH("network", "coalesce_bytes")) {
+		pconfig->coalesce_bytes = atoi(value);
+	}
+	else if (MATCH("network", "udp_max_sessions")) {
+		pconfig->udp_max_sessions = atoi(value);
+	}
+	else if (MATCH("network", "udp_idle_timeout")) {
+		pconfig->udp_idle_timeout = atoi(value);
+	}
+	else if (MATCH("network", "udp_batch_delay")) {
+		pconfig->udp_batch_delay = atoi(value);
+	}
+	else if (MATCH("network", "udp_batch_bytes")) {
+		pconfig->udp_batch_bytes = atoi(value);
+	}
+	else if (MATCH("log", "level")) {
+		pconfig->log_level = strdup(value);
+	}
+	else if (MATCH("log", "event_file")) {
+		pconfig->event_file = strdup(value);
+	}
+	else if (MATCH("metrics", "socket")) {
+		pconfig->metrics_socket = strdup(value);
+	}
+	else if (MATCH("metrics", "timestamps")) {
+		pconfig->timestamps = (strcmp(value, "on") == 0);
+	}
+	else if (MATCH("capture", "file")) {
+		pconfig->capture_file = strdup(value);
+	}
+	else if (MATCH("capture", "size")) {
+		pconfig->capture_size = atoi(value);
+	}
+	else if (MATCH("capture", "files")) {
+		pconfig->capture_files = atoi(value);
+	}
+	else if (MATCH("capture", "snaplen")) {
+		pconfig->capture_snaplen = atoi(value);
+	}
+	else if (MATCH("capture", "start")) {
+		pconfig->capture_start = (strcmp(value, "on") == 0);
+	}
 	// This matches any line that begins with "port"
 	else if (strcmp(section, "udp ports") == 0 && strncmp(name, "port", 4) == 0) {
 		if (pconfig->udp_port_count < CONFIG_UDP_PORT_COUNT_MAX)
@@ -59,11 +195,47 @@ static int handler(void* user, const char* section, const char* name,
 Configuration::Configuration(const char* filename)
 	: serial_port_name{},
 	baud_rate{ 9600 },
+	negotiate{ false },
 	throttle_baud_rate{ 0 },
-	port_numbers{}
+	auto_pacing{ true },
+	tty_queue{ 512 },
+	cts_flow{ false },
+	busy_poll{ false },
+	busy_poll_idle{ 100 },
+	io_uring{ false },
+	port_numbers{},
+	max_connections{ 1024 },
+	idle_timeout{ 7200 },
+	coalesce_delay{ 20 },
+	coalesce_bytes{ 512 },
+	udp_max_sessions{ 4096 },
+	udp_idle_timeout{ 120 },
+	udp_batch_delay{ 10 },
+	udp_batch_bytes{ 512 },
+	log_level{ "info" },
+	timestamps{ false },
+	capture_size{ 16 },
+	capture_files{ 4 },
+	capture_snaplen{ 0 },
+	capture_start{ false }
 {
 	configuration_tmp config;
 	memset(&config, 0, sizeof(config));
+	config.auto_pacing = auto_pacing;
+	serial_tune_init(&config.serial_tune);
+	config.tty_queue = tty_queue;
+	config.busy_poll_idle = busy_poll_idle;
+	realtime_init(&config.realtime);
+	config.realtime.priority = 50;
+	config.realtime.lock_memory = 1;
+	config.max_connections = max_connections;
+	config.idle_timeout = idle_timeout;
+	config.coalesce_delay = coalesce_delay;
+	config.coalesce_bytes = coalesce_bytes;
+	config.udp_batch_delay = udp_batch_delay;
+	config.udp_batch_bytes = udp_batch_bytes;
+	config.capture_size = capture_size;
+	config.capture_files = capture_files;
 	if (ini_parse(filename, handler, &config) < 0) {
 		std::string err = "Can't load or parse INI file '" + std::string(filename) + "':" + std::string(strerror(errno));
 		throw std::runtime_error(err.c_str());
@@ -76,13 +248,62 @@ Configuration::Configuration(const char* filename)
 	if (config.remoteIP != NULL)
 		remote_ip = config.remoteIP;
 	baud_rate = config.baud_rate;
+	negotiate = config.negotiate;
+	for (int i = 0; i < config.rate_count; i++)
+		rates.push_back(config.rate[i]);
 	throttle_baud_rate = config.throttle_baud_rate;
+	auto_pacing = config.auto_pacing;
+	serial_tune = config.serial_tune;
+	if (config.tty_queue >= 0)
+		tty_queue = config.tty_queue;
+	cts_flow = config.cts_flow;
+	busy_poll = config.busy_poll;
+	if (config.busy_poll_idle >= 0)
+		busy_poll_idle = config.busy_poll_idle;
+	realtime = config.realtime;
+	io_uring = config.io_uring;
+	if (config.max_connections > 0)
+		max_connections = config.max_connections;
+	if (config.idle_timeout > 0)
+		idle_timeout = config.idle_timeout;
+	if (config.coalesce_delay >= 0)
+		coalesce_delay = config.coalesce_delay;
+	if (config.coalesce_bytes > 0)
+		coalesce_bytes = config.coalesce_bytes;
+	if (config.udp_max_sessions > 0)
+		udp_max_sessions = config.udp_max_sessions;
+	if (config.udp_idle_timeout > 0)
+		udp_idle_timeout = config.udp_idle_timeout;
+	if (config.udp_batch_delay >= 0)
+		udp_batch_delay = config.udp_batch_delay;
+	if (config.udp_batch_bytes > 0)
+		udp_batch_bytes = config.udp_batch_bytes;
 	for (int i = 0; i < config.udp_port_count; i++)
 		port_numbers.push_back(config.udp_port[i]);
+	if (config.log_level != NULL)
+		log_level = config.log_level;
+	if (config.event_file != NULL)
+		event_file = config.event_file;
+	if (config.metrics_socket != NULL)
+		metrics_socket = config.metrics_socket;
+	timestamps = config.timestamps;
+	if (config.capture_file != NULL)
+		capture_file = config.capture_file;
+	if (config.capture_size > 0)
+		capture_size = config.capture_size;
+	if (config.capture_files > 0)
+		capture_files = config.capture_files;
+	if (config.capture_snaplen >= 0)
+		capture_snaplen = config.capture_snaplen;
+	capture_start = config.capture_start;
 
 	free((void *)config.serial_port_name);
 	free((void *)config.localIP);
 	free((void *)config.remoteIP);
+	free((void *)config.log_level);
+	free((void *)config.event_file);
+	free((void *)config.metrics_socket);
+	free((void *)config.capture_file);
 }
 
 Configuration::~Configuration()
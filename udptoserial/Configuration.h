@@ -2,6 +2,8 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <vector>
 #include <string>
+#include "serial_tune.h"
+#include "realtime.h"
 
 class Configuration
 {
@@ -10,10 +12,78 @@ public:
 	~Configuration();
 
 	std::string serial_port_name;
+	// Any rate at all where the driver allows it, not just the standard
+	// ones.  With negotiate on, this is the safe rate that both ends
+	// start at, and the link moves up to the fastest of RATES that both
+	// ends have and that tests clean.
 	uint32_t baud_rate;
+	bool negotiate;
+	std::vector<uint32_t> rates;
 	uint32_t throttle_baud_rate;
+	// If true, the output rate is measured continuously and
+	// throttle_baud_rate is only the starting point.
+	bool auto_pacing;
+	// Latency settings for the serial port.  Anything not given in the
+	// INI file is left as the driver has it.
+	serial_tune_t serial_tune;
+	// At most this many bytes are let into the kernel's tty output
+	// queue at a time, or any number if zero.
+	uint32_t tty_queue;
+	// If true, the port uses RTS/CTS flow control and the writer
+	// stops while the modem holds CTS low.
+	bool cts_flow;
+	// If true, one pinned real-time thread spins on the serial port
+	// instead of sleeping in the reactor, and falls back to sleeping
+	// after busy_poll_idle milliseconds with nothing to do.
+	bool busy_poll;
+	uint32_t busy_poll_idle;
+	realtime_t realtime;
+	// If true, the serial port and the UDP sockets are read and written
+	// through an io_uring, where the kernel can do it, instead of
+	// through the reactor.
+	bool io_uring;
 	std::vector<uint16_t> port_numbers;
 	std::string local_ip;
 	std::string remote_ip;
+	// Proxied TCP connections: how many there can be at once, and how
+	// many seconds one can be idle before it is reset.
+	uint32_t max_connections;
+	uint32_t idle_timeout;
+	// Small reads from a proxied connection are held for up to
+	// coalesce_delay milliseconds, while the link is busy, to go out
+	// together once there are coalesce_bytes of them.  Zero turns this
+	// off.
+	uint32_t coalesce_delay;
+	uint32_t coalesce_bytes;
+	// Proxied UDP sessions on the far end, likewise.
+	uint32_t udp_max_sessions;
+	uint32_t udp_idle_timeout;
+	// While the link is busy, small datagrams are packed into batches of
+	// up to udp_batch_bytes, held for at most udp_batch_delay
+	// milliseconds.  Zero turns this off.
+	uint32_t udp_batch_delay;
+	uint32_t udp_batch_bytes;
+	// The least severe messages logged: trace, debug, info, warning,
+	// error or fatal.  If event_file is given, events from the
+	// forwarding path are written there, for hack/logdecode, instead of
+	// being logged.
+	std::string log_level;
+	std::string event_file;
+	// If given, the path of a Unix socket that answers with every
+	// metric, in Prometheus's text format.
+	std::string metrics_socket;
+	// If true, data frames carry the time they were handed to the serial
+	// port, so the far end can tell how long they took to cross.
+	bool timestamps;
+	// If capture_file is given, the frames that cross the serial link
+	// can be written there, in pcapng, from the start if capture_start
+	// is true, or once SIGUSR1 says to.  Files are kept under
+	// capture_size MB, capture_files of them, each frame cut to
+	// capture_snaplen bytes unless that is zero.
+	std::string capture_file;
+	uint32_t capture_size;
+	uint32_t capture_files;
+	uint32_t capture_snaplen;
+	bool capture_start;
 };
 
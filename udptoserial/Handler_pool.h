@@ -0,0 +1,205 @@
+#pragma once
+// HANDLER_POOL - memory for the operations that Asio starts for us over
+// and over, such as a socket's next read or write, so that a steady
+// stream of frames doesn't go to the heap for each one.  Asio keeps only
+// a couple of blocks per thread for reuse, which is never enough once
+// several connections and the serial port are busy at once.
+//
+// A handler wrapped with make_custom_alloc_handler takes its operation's
+// memory from POOL.  Blocks are made as needed and kept for reuse, so
+// the pool grows to the most operations that are ever pending at once.
+// There are small blocks, for the waits that idle connections leave
+// pending, and big ones, for writes.  An operation bigger than a big
+// block goes to the heap.  A pool is only used from the thread that
+// runs the io_service.
+//
+// Buffer_list is for handing a gathered write a vector of buffers.
+// Asio copies the buffer sequence into the operation, and copying the
+// vector would go to the heap too.
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+
+class Handler_pool
+{
+public:
+	Handler_pool()
+		: small_(nullptr)
+		, big_(nullptr)
+	{
+	}
+	Handler_pool(const Handler_pool&) = delete;
+	Handler_pool& operator=(const Handler_pool&) = delete;
+
+	~Handler_pool()
+	{
+		release(small_);
+		release(big_);
+	}
+
+	void *allocate(std::size_t size)
+	{
+		if (size > BIG_SIZE)
+			return ::operator new(size);
+		Block *&free = size > SMALL_SIZE ? big_ : small_;
+		if (free == nullptr)
+			return ::operator new(size > SMALL_SIZE ? BIG_SIZE : SMALL_SIZE);
+		Block *b = free;
+		free = b->next;
+		return b;
+	}
+
+	void deallocate(void *p, std::size_t size)
+	{
+		if (size > BIG_SIZE)
+		{
+			::operator delete(p);
+			return;
+		}
+		Block *&free = size > SMALL_SIZE ? big_ : small_;
+		Block *b = static_cast<Block *>(p);
+		b->next = free;
+		free = b;
+	}
+
+	// Enough for a socket's wait, 128 bytes with Boost 1.74 on x86-64,
+	// and for a gathered write to a socket, the biggest operation we
+	// start.  A wait is what every idle connection has pending, so the
+	// small blocks are no bigger than that.
+	const static std::size_t SMALL_SIZE = 128;
+	const static std::size_t BIG_SIZE = 512;
+
+private:
+	struct Block {
+		Block *next;
+	};
+
+	static void release(Block *free)
+	{
+		while (free != nullptr)
+		{
+			Block *next = free->next;
+			::operator delete(free);
+			free = next;
+		}
+	}
+
+	Block *small_;
+	Block *big_;
+};
+
+// The allocator that Asio finds on a custom alloc handler.
+template <typename T>
+class Handler_allocator
+{
+public:
+	using value_type = T;
+
+	explicit Handler_allocator(Handler_pool& pool)
+		: pool_(pool)
+	{
+	}
+
+	template <typename U>
+	Handler_allocator(const Handler_allocator<U>& other) noexcept
+		: pool_(other.pool_)
+	{
+	}
+
+	bool operator==(const Handler_allocator& other) const noexcept
+	{
+		return &pool_ == &other.pool_;
+	}
+
+	bool operator!=(const Handler_allocator& other) const noexcept
+	{
+		return &pool_ != &other.pool_;
+	}
+
+	T *allocate(std::size_t n) const
+	{
+		return static_cast<T *>(pool_.allocate(sizeof(T) * n));
+	}
+
+	void deallocate(T *p, std::size_t n) const
+	{
+		pool_.deallocate(p, sizeof(T) * n);
+	}
+
+private:
+	template <typename> friend class Handler_allocator;
+
+	Handler_pool& pool_;
+};
+
+template <typename Handler>
+class Custom_alloc_handler
+{
+public:
+	using allocator_type = Handler_allocator<Handler>;
+
+	Custom_alloc_handler(Handler_pool& pool, Handler handler)
+		: pool_(pool)
+		, handler_(std::move(handler))
+	{
+	}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return allocator_type(pool_);
+	}
+
+	template <typename ...Args>
+	void operator()(Args&&... args)
+	{
+		handler_(std::forward<Args>(args)...);
+	}
+
+	// A strand finds the memory for the handlers it runs through these
+	// hooks, not the allocator, so a handler wrapped by a strand should
+	// be a custom alloc handler itself.
+	friend void *asio_handler_allocate(std::size_t size, Custom_alloc_handler *handler)
+	{
+		return handler->pool_.allocate(size);
+	}
+
+	friend void asio_handler_deallocate(void *p, std::size_t size, Custom_alloc_handler *handler)
+	{
+		handler->pool_.deallocate(p, size);
+	}
+
+private:
+	Handler_pool& pool_;
+	Handler handler_;
+};
+
+template <typename Handler>
+inline Custom_alloc_handler<Handler> make_custom_alloc_handler(Handler_pool& pool, Handler handler)
+{
+	return Custom_alloc_handler<Handler>(pool, std::move(handler));
+}
+
+// The buffers in BUFS, which must stay as they are until the write is
+// done.
+class Buffer_list
+{
+public:
+	using value_type = boost::asio::const_buffer;
+	using const_iterator = const boost::asio::const_buffer *;
+
+	explicit Buffer_list(const std::vector<boost::asio::const_buffer>& bufs)
+		: begin_(bufs.data())
+		, end_(bufs.data() + bufs.size())
+	{
+	}
+
+	const_iterator begin() const { return begin_; }
+	const_iterator end() const { return end_; }
+
+private:
+	const_iterator begin_;
+	const_iterator end_;
+};
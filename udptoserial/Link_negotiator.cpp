@@ -0,0 +1,342 @@
+#include "Link_negotiator.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include "Log.h"
+#include "Metrics.h"
+
+// At the safe rate, an OFFER goes out this often until the ends agree.
+const static auto OFFER_INTERVAL = std::chrono::seconds(2);
+
+// After changing rate, the leader gives the far end this long to catch
+// up before the first TEST, and sends another this often after that.
+// A rate that hasn't passed a test by TEST_TIMEOUT is given up.
+const static auto SWITCH_GUARD = std::chrono::milliseconds(100);
+const static auto TEST_INTERVAL = std::chrono::milliseconds(250);
+const static auto TEST_TIMEOUT = std::chrono::seconds(3);
+
+// At a negotiated rate, every ERROR_WINDOW, at least GOOD_PERCENT_MIN of
+// the bytes read have to have been in frames that made sense.  Fewer
+// bytes than ERROR_MIN_BYTES are too few to judge.
+const static auto ERROR_WINDOW = std::chrono::seconds(2);
+const static size_t ERROR_MIN_BYTES = 16;
+const static size_t GOOD_PERCENT_MIN = 80;
+
+// The leader sends a TEST every ERROR_WINDOW, and every TESTS_PER_CHECK
+// of them, at least TEST_PASS_PERCENT_MIN have to have come back.  Any
+// bit error spoils a test, so this catches noise that leaves frames
+// looking sensible.  The other end expects one every TEST_SILENCE.
+const static unsigned TESTS_PER_CHECK = 5;
+const static unsigned TEST_PASS_PERCENT_MIN = 60;
+const static auto TEST_SILENCE = 4 * ERROR_WINDOW;
+
+Link_negotiator::Link_negotiator(asio::io_service& service, std::shared_ptr<Serial_writer> writer,
+	packet_pool& pool, uint32_t safe_rate, const std::vector<uint32_t>& rates,
+	std::function<bool(uint32_t)> set_rate)
+	: service_(service)
+	, serial_writer_(writer)
+	, pool_(pool)
+	, set_rate_(set_rate)
+	, timer_(service)
+	, safe_rate_(safe_rate)
+	, rates_(rates)
+	, nonce_(std::random_device()() | 1)
+	, peer_nonce_(0)
+	, state_(State::OFFERING)
+	, rate_(safe_rate)
+	, leading_(false)
+	, window_bytes_(0)
+	, window_good_(0)
+	, tests_sent_(0)
+	, tests_passed_(0)
+{
+	// Fastest first, so that the offer lists them in order of preference.
+	std::sort(rates_.begin(), rates_.end(), std::greater<uint32_t>());
+	rates_.erase(std::unique(rates_.begin(), rates_.end()), rates_.end());
+	if (rates_.size() > LINK_RATE_MAX)
+		rates_.resize(LINK_RATE_MAX);
+}
+
+void Link_negotiator::start()
+{
+	LOG(info) << "negotiating the serial link's rate, starting at " << safe_rate_ << " baud";
+	send_offer();
+	start_timer(OFFER_INTERVAL);
+}
+
+void Link_negotiator::start_timer(std::chrono::steady_clock::duration after)
+{
+	timer_.expires_from_now(after);
+	timer_.async_wait(std::bind(&Link_negotiator::timer_handler, shared_from_this(), std::placeholders::_1));
+}
+
+packet Link_negotiator::make_frame(const struct link_rate& msg)
+{
+	frame_.clear();
+	link_rate_encode(frame_, msg);
+	packet p = pool_.alloc();
+	memcpy(p.put(frame_.size()), frame_.data(), frame_.size());
+	return p;
+}
+
+void Link_negotiator::send_frame(const struct link_rate& msg)
+{
+	serial_writer_->send(make_frame(msg));
+}
+
+// Rates that have failed are left out, so the far end won't pick them.
+void Link_negotiator::send_offer()
+{
+	struct link_rate offer {};
+	offer.op = LINK_RATE_OFFER;
+	offer.arg = nonce_;
+	for (uint32_t r : rates_)
+		if (failed_.count(r) == 0)
+			offer.rates[offer.count++] = r;
+	send_frame(offer);
+}
+
+// The fastest rate on both lists that is faster than the safe rate and
+// hasn't failed, or zero if there isn't one.
+uint32_t Link_negotiator::best_rate(const struct link_rate& offer) const
+{
+	for (uint32_t r : rates_)
+	{
+		if (r <= safe_rate_ || failed_.count(r) > 0)
+			continue;
+		if (std::find(offer.rates, offer.rates + offer.count, r) != offer.rates + offer.count)
+			return r;
+	}
+	return 0;
+}
+
+void Link_negotiator::handle_frame(const uint8_t *frame, size_t len)
+{
+	struct link_rate msg;
+	if (!link_rate_decode(frame, len, msg))
+	{
+		LOG_EVENT(debug, "bad RATE frame of {} bytes", len);
+		metric_add(link_metrics_.decode_errors + DECODE_BAD_RATE);
+		return;
+	}
+
+	// Only an end still at the safe rate can take up a new one.
+	bool at_safe_rate = state_ == State::OFFERING
+		|| (state_ == State::RUNNING && rate_ == safe_rate_);
+	switch (msg.op)
+	{
+	case LINK_RATE_OFFER:
+		if (at_safe_rate)
+			handle_offer(msg);
+		break;
+	case LINK_RATE_SWITCH:
+		if (at_safe_rate && msg.arg != safe_rate_ && failed_.count(msg.arg) == 0
+			&& std::find(rates_.begin(), rates_.end(), msg.arg) != rates_.end())
+			switch_to(msg.arg, false);
+		break;
+	case LINK_RATE_TEST:
+		// Echo every test, in case an earlier echo was lost.
+		if (msg.arg == rate_ && (state_ == State::TESTING || state_ == State::RUNNING))
+		{
+			last_test_ = std::chrono::steady_clock::now();
+			struct link_rate echo {};
+			echo.op = LINK_RATE_TEST_ECHO;
+			echo.arg = rate_;
+			send_frame(echo);
+			if (state_ == State::TESTING)
+				settle();
+		}
+		break;
+	case LINK_RATE_TEST_ECHO:
+		if (msg.arg != rate_ || !leading_)
+			break;
+		if (state_ == State::TESTING)
+			settle();
+		else if (state_ == State::RUNNING)
+			tests_passed_++;
+		break;
+	}
+}
+
+void Link_negotiator::handle_offer(const struct link_rate& offer)
+{
+	// The far end's first offer, or its first since it restarted, gets
+	// ours straight back, so that it doesn't have to wait for one.
+	if (offer.arg != peer_nonce_)
+	{
+		peer_nonce_ = offer.arg;
+		send_offer();
+	}
+	if (offer.arg == nonce_)
+	{
+		// A tie.  Draw again.
+		nonce_ = std::random_device()() | 1;
+		send_offer();
+		return;
+	}
+
+	uint32_t best = best_rate(offer);
+	if (best == 0)
+	{
+		if (state_ == State::OFFERING)
+		{
+			LOG(info) << "no rate faster than " << safe_rate_ << " baud in common with the far end";
+			settle();
+		}
+		return;
+	}
+	// The far end leads, and will send SWITCH.
+	if (nonce_ < offer.arg)
+		return;
+	switch_to(best, true);
+}
+
+// Everything already queued goes out at the old rate, and the leader's
+// SWITCH last of all.
+void Link_negotiator::switch_to(uint32_t rate, bool leading)
+{
+	LOG(info) << (leading ? "asking the far end to switch to " : "the far end asked to switch to ")
+		<< rate << " baud";
+	state_ = State::SWITCHING;
+	leading_ = leading;
+	timer_.cancel();
+
+	packet frame;
+	if (leading)
+	{
+		struct link_rate sw {};
+		sw.op = LINK_RATE_SWITCH;
+		sw.arg = rate;
+		frame = make_frame(sw);
+	}
+	serial_writer_->hold(std::move(frame), [me = shared_from_this(), rate]()
+	{
+		me->port_drained(rate);
+	});
+}
+
+void Link_negotiator::port_drained(uint32_t rate)
+{
+	if (!set_rate_(rate))
+	{
+		LOG(warning) << "serial port can't run at " << rate << " baud";
+		failed_.insert(rate);
+		if (rate != safe_rate_)
+		{
+			port_drained(safe_rate_);
+			return;
+		}
+	}
+	rate_ = rate;
+	serial_writer_->release(rate);
+	window_bytes_ = 0;
+	window_good_ = 0;
+
+	if (rate == safe_rate_)
+	{
+		state_ = State::OFFERING;
+		send_offer();
+		start_timer(OFFER_INTERVAL);
+		return;
+	}
+	state_ = State::TESTING;
+	test_deadline_ = std::chrono::steady_clock::now() + TEST_TIMEOUT;
+	start_timer(leading_ ? SWITCH_GUARD : TEST_TIMEOUT);
+}
+
+void Link_negotiator::fall_back(const char *why)
+{
+	LOG(warning) << rate_ << " baud " << why << ", going back to " << safe_rate_ << " baud";
+	failed_.insert(rate_);
+	state_ = State::SWITCHING;
+	timer_.cancel();
+	serial_writer_->hold(packet(), [me = shared_from_this()]()
+	{
+		me->port_drained(me->safe_rate_);
+	});
+}
+
+void Link_negotiator::settle()
+{
+	LOG(info) << "serial link running at " << rate_ << " baud";
+	state_ = State::RUNNING;
+	window_bytes_ = 0;
+	window_good_ = 0;
+	tests_sent_ = 0;
+	tests_passed_ = 0;
+	last_test_ = std::chrono::steady_clock::now();
+	start_timer(ERROR_WINDOW);
+}
+
+void Link_negotiator::timer_handler(system::error_code const & error)
+{
+	if (error)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	switch (state_)
+	{
+	case State::OFFERING:
+		send_offer();
+		start_timer(OFFER_INTERVAL);
+		break;
+	case State::SWITCHING:
+		break;
+	case State::TESTING:
+		if (now >= test_deadline_)
+		{
+			fall_back(leading_ ? "didn't pass its test" : "wasn't tested");
+			break;
+		}
+		if (leading_)
+		{
+			struct link_rate test {};
+			test.op = LINK_RATE_TEST;
+			test.arg = rate_;
+			send_frame(test);
+			start_timer(TEST_INTERVAL);
+		}
+		else
+			start_timer(test_deadline_ - now);
+		break;
+	case State::RUNNING:
+		if (rate_ == safe_rate_)
+			break;
+		if (window_bytes_ >= ERROR_MIN_BYTES && window_good_ * 100 < window_bytes_ * GOOD_PERCENT_MIN)
+		{
+			LOG(info) << "only " << window_good_ << " of " << window_bytes_
+				<< " bytes read made sense";
+			fall_back("is too noisy");
+			break;
+		}
+		window_bytes_ = 0;
+		window_good_ = 0;
+		if (leading_)
+		{
+			if (tests_sent_ >= TESTS_PER_CHECK)
+			{
+				if (tests_passed_ * 100 < tests_sent_ * TEST_PASS_PERCENT_MIN)
+				{
+					LOG(info) << "only " << tests_passed_ << " of " << tests_sent_
+						<< " tests came back";
+					fall_back("is failing its tests");
+					break;
+				}
+				tests_sent_ = 0;
+				tests_passed_ = 0;
+			}
+			struct link_rate test {};
+			test.op = LINK_RATE_TEST;
+			test.arg = rate_;
+			send_frame(test);
+			tests_sent_++;
+		}
+		else if (now - last_test_ > TEST_SILENCE)
+		{
+			fall_back("is no longer being tested");
+			break;
+		}
+		start_timer(ERROR_WINDOW);
+		break;
+	}
+}
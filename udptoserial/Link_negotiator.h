@@ -0,0 +1,116 @@
+#pragma once
+// LINK_NEGOTIATOR - moves the serial link up to the fastest rate that
+// both ends can run at, and back down if that rate doesn't hold up.
+//
+// Both ends start at the configured baud rate, which ought to be one
+// that always works, and send OFFER frames listing the rates they can
+// run at.  The end whose OFFER carried the larger random number leads.
+// It picks the fastest rate on both lists and sends SWITCH, and once
+// that has left the port it changes rate.  The other end changes rate
+// as soon as SWITCH arrives and it has sent what it already had.  The
+// leader then sends TEST frames, each a pattern of every byte value,
+// and the new rate stands once one comes back intact as a TEST_ECHO.
+// If none does in time, both ends go back to the safe rate, cross that
+// rate off, and start offering again.
+//
+// At a negotiated rate, the leader goes on sending a TEST every couple
+// of seconds, and gives the rate up, the same way, when too few of them
+// come back intact.  The other end gives it up when the tests stop
+// arriving.  Either end also gives it up when too few of the bytes it
+// reads make up frames it understands, which is what a far end that
+// has already fallen back looks like.
+//
+// Frames on their way when the rate changes may be lost, so this is
+// meant to settle the rate at startup, before there is traffic.  A rate
+// that has been crossed off isn't tried again until a restart.
+
+#ifdef WIN32
+#include <sdkddkver.h>
+#endif
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <set>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "../libhorizr/link.h"
+#include "../libhorizr/packet.h"
+#include "Serial_writer.h"
+
+using namespace boost;
+
+class Link_negotiator
+	: public std::enable_shared_from_this<Link_negotiator>
+{
+public:
+	// SAFE_RATE is where both ends start, and come back to.  RATES are
+	// the rates, in baud, that this end's port can run at.  SET_RATE
+	// changes the port's rate, and returns false if it can't.  Frames
+	// are built in packets from POOL.
+	Link_negotiator(asio::io_service& service, std::shared_ptr<Serial_writer> writer,
+		packet_pool& pool, uint32_t safe_rate, const std::vector<uint32_t>& rates,
+		std::function<bool(uint32_t)> set_rate);
+
+	// Start offering.
+	void start();
+
+	// The serial read handler passes RATE frames here.
+	void handle_frame(const uint8_t *frame, size_t len);
+
+	// The serial read handler reports every byte it reads, and how many
+	// of those belonged to frames that made sense.
+	void count_received(size_t bytes) { window_bytes_ += bytes; }
+	void count_good(size_t bytes) { window_good_ += bytes; }
+
+	// The rate the port is at now.
+	uint32_t rate() const { return rate_; }
+
+private:
+	enum class State {
+		OFFERING,	// at the safe rate, looking for a better one
+		SWITCHING,	// draining the port before changing rate
+		TESTING,	// at a new rate, not yet shown to work
+		RUNNING	// settled
+	};
+
+	void send_offer();
+	packet make_frame(const struct link_rate& msg);
+	void send_frame(const struct link_rate& msg);
+	void handle_offer(const struct link_rate& offer);
+	uint32_t best_rate(const struct link_rate& offer) const;
+	void switch_to(uint32_t rate, bool leading);
+	void port_drained(uint32_t rate);
+	void fall_back(const char *why);
+	void settle();
+	void start_timer(std::chrono::steady_clock::duration after);
+	void timer_handler(system::error_code const & error);
+
+	asio::io_service& service_;
+	std::shared_ptr<Serial_writer> serial_writer_;
+	packet_pool& pool_;
+	std::function<bool(uint32_t)> set_rate_;
+	asio::steady_timer timer_;
+	std::vector<uint8_t> frame_;
+
+	uint32_t safe_rate_;
+	std::vector<uint32_t> rates_;
+	std::set<uint32_t> failed_;
+	uint32_t nonce_;
+	uint32_t peer_nonce_;
+
+	State state_;
+	uint32_t rate_;
+	bool leading_;
+	std::chrono::steady_clock::time_point test_deadline_;
+
+	// Bytes read, and bytes of sensible frames, since the timer last ran.
+	size_t window_bytes_;
+	size_t window_good_;
+
+	// Tests sent and passed since the last check, on the leader, and
+	// when the last good test arrived, on the other end.
+	unsigned tests_sent_;
+	unsigned tests_passed_;
+	std::chrono::steady_clock::time_point last_test_;
+};
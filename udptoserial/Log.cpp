@@ -0,0 +1,113 @@
+#include "Log.h"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+// The log thread drains the event rings this often.  A ring holds
+// EVENT_RING_SIZE records, so a thread can make that many in this time
+// before any are dropped.
+const static auto DRAIN_INTERVAL = std::chrono::milliseconds(100);
+
+static const char *const LEVEL_NAMES[] = { "trace", "debug", "info", "warning", "error", "fatal" };
+
+std::atomic<int> log_level_(LOG_LEVEL_info);
+
+static std::thread log_thread_;
+static std::mutex log_mutex_;
+static std::condition_variable log_wake_;
+static bool log_stopping_ = false;
+static FILE *event_file_ = nullptr;
+static std::unique_ptr<event_file_writer> event_writer_;
+// Only the log thread touches these.
+static std::vector<struct event_record> drained_;
+static std::string message_;
+
+static void log_drain()
+{
+	uint64_t dropped = 0;
+	drained_.clear();
+	event_drain(drained_, dropped);
+	if (event_writer_)
+	{
+		for (auto& rec : drained_)
+			event_writer_->write(rec);
+		if (dropped > 0)
+			event_writer_->write_dropped(dropped);
+		fflush(event_file_);
+		return;
+	}
+	for (auto& rec : drained_)
+	{
+		message_.clear();
+		event_format(message_, rec.site->fmt, rec.args, rec.nargs);
+		BOOST_LOG_SEV(boost::log::trivial::logger::get(), (boost::log::trivial::severity_level)rec.site->level)
+			<< message_;
+	}
+	if (dropped > 0)
+		LOG(warning) << dropped << " log events dropped";
+}
+
+static void log_thread_run()
+{
+	std::unique_lock<std::mutex> lock(log_mutex_);
+	while (!log_stopping_)
+	{
+		log_wake_.wait_for(lock, DRAIN_INTERVAL);
+		lock.unlock();
+		log_drain();
+		lock.lock();
+	}
+}
+
+void log_start(const std::string& level, const std::string& event_file)
+{
+	int lvl = -1;
+	for (int i = 0; i < (int)(sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0])); i++)
+		if (level == LEVEL_NAMES[i])
+			lvl = i;
+	bool known = lvl >= 0;
+	if (!known)
+		lvl = LOG_LEVEL_info;
+	log_level_.store(lvl, std::memory_order_relaxed);
+	boost::log::core::get()->set_filter(boost::log::trivial::severity >= (boost::log::trivial::severity_level)lvl);
+	if (!known)
+		LOG(warning) << "unknown log level '" << level << "', logging at info";
+	if (lvl < LOG_MIN_LEVEL)
+		LOG(warning) << "messages below " << LEVEL_NAMES[LOG_MIN_LEVEL] << " weren't compiled in";
+
+	if (!event_file.empty())
+	{
+		event_file_ = fopen(event_file.c_str(), "wb");
+		if (event_file_ != nullptr)
+			event_writer_.reset(new event_file_writer(event_file_));
+		else
+			LOG(warning) << "can't open event file " << event_file << ": " << strerror(errno);
+	}
+	log_thread_ = std::thread(log_thread_run);
+}
+
+void log_stop()
+{
+	if (!log_thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(log_mutex_);
+		log_stopping_ = true;
+	}
+	log_wake_.notify_one();
+	log_thread_.join();
+	if (event_file_ != nullptr)
+	{
+		event_writer_.reset();
+		fclose(event_file_);
+		event_file_ = nullptr;
+	}
+}
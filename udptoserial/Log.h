@@ -0,0 +1,64 @@
+#pragma once
+// LOG - what everything in udptoserial logs through.
+//
+//   LOG(info) << "serial link running at " << rate << " baud";
+//
+// works like BOOST_LOG_TRIVIAL, but a message below the configured
+// level costs one comparison: nothing after the << is evaluated.  A
+// message below LOG_MIN_LEVEL isn't compiled in at all; build with
+// -DLOG_MIN_LEVEL=2 to leave out everything below info.
+//
+//   LOG_EVENT(debug, "frame of {} bytes on channel {}", len, channel);
+//
+// is for the forwarding path.  It takes a literal format string, as
+// event_format describes, and up to four integers, and only copies them
+// into a binary record in a ring of the calling thread's own.  The log
+// thread turns those into ordinary log messages a little later, or, with
+// an event file, writes them there as they are, for hack/logdecode.
+
+#include <atomic>
+#include <string>
+#include <boost/log/trivial.hpp>
+#include "../libhorizr/event_log.h"
+
+#define LOG_LEVEL_trace 0
+#define LOG_LEVEL_debug 1
+#define LOG_LEVEL_info 2
+#define LOG_LEVEL_warning 3
+#define LOG_LEVEL_error 4
+#define LOG_LEVEL_fatal 5
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_debug
+#endif
+
+extern std::atomic<int> log_level_;
+
+inline bool log_enabled(int level)
+{
+	return level >= log_level_.load(std::memory_order_relaxed);
+}
+
+// A loop that runs once or not at all, rather than an if, so that an
+// else after it can't be taken as belonging to it.
+#define LOG(lvl) \
+	for (bool log_on_ = LOG_LEVEL_##lvl >= LOG_MIN_LEVEL && log_enabled(LOG_LEVEL_##lvl); \
+		log_on_; log_on_ = false) \
+		BOOST_LOG_TRIVIAL(lvl)
+
+#define LOG_EVENT(lvl, fmt, ...) \
+	do { \
+		if (LOG_LEVEL_##lvl >= LOG_MIN_LEVEL && log_enabled(LOG_LEVEL_##lvl)) \
+		{ \
+			static const struct event_site log_site_ = { fmt, LOG_LEVEL_##lvl }; \
+			event_add(log_site_, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+// Set the level, by name, and start the log thread.  With EVENT_FILE,
+// events are written there instead of being logged.  An unknown LEVEL
+// is taken as info, and an EVENT_FILE that can't be opened as none.
+void log_start(const std::string& level, const std::string& event_file);
+
+// Log or write whatever events are still waiting, and stop the thread.
+void log_stop();
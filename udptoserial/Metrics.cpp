@@ -0,0 +1,134 @@
+#include "Metrics.h"
+#include <cstdio>
+#include "../libhorizr/link.h"
+
+struct Link_metrics link_metrics_;
+
+static const char *const DIRECTION_NAMES[METRIC_DIRECTIONS] = { "tx", "rx" };
+static const char *const FRAME_KIND_NAMES[FRAME_KINDS] = { "mux", "udp", "udp_batch", "control", "ipv4" };
+static const char *const LATENCY_STAGE_NAMES[LATENCY_STAGES] = { "queue", "write", "link" };
+static const char *const FLOW_CLASS_NAMES[FLOW_CLASSES] = { "tcp", "udp" };
+static const char *const DECODE_ERROR_NAMES[DECODE_ERRORS] = {
+	"slip_overflow", "unknown_frame", "bad_mux", "bad_udp", "bad_rate"
+};
+
+void link_metrics_register(const std::string& link)
+{
+	std::vector<std::string> labels;
+	for (auto dir : DIRECTION_NAMES)
+	{
+		std::string l;
+		metrics_add_label(l, "link", link);
+		metrics_add_label(l, "direction", dir);
+		labels.push_back(l);
+	}
+	link_metrics_.bytes = metric_register("udptoserial_link_bytes_total",
+		"Bytes on the serial line, SLIP framing included.", metric_type::COUNTER, labels);
+
+	labels.clear();
+	for (auto dir : DIRECTION_NAMES)
+		for (auto kind : FRAME_KIND_NAMES)
+		{
+			std::string l;
+			metrics_add_label(l, "link", link);
+			metrics_add_label(l, "direction", dir);
+			metrics_add_label(l, "kind", kind);
+			labels.push_back(l);
+		}
+	link_metrics_.frames = metric_register("udptoserial_link_frames_total",
+		"Frames on the serial line, by kind.", metric_type::COUNTER, labels);
+
+	labels.clear();
+	for (auto kind : DECODE_ERROR_NAMES)
+	{
+		std::string l;
+		metrics_add_label(l, "link", link);
+		metrics_add_label(l, "kind", kind);
+		labels.push_back(l);
+	}
+	link_metrics_.decode_errors = metric_register("udptoserial_link_decode_errors_total",
+		"Frames read from the serial line and thrown away.", metric_type::COUNTER, labels);
+
+	labels.clear();
+	std::string l;
+	metrics_add_label(l, "link", link);
+	labels.push_back(l);
+	link_metrics_.queue_sojourn = metric_register("udptoserial_serial_queue_sojourn_seconds",
+		"How long data frames waited for the serial port.", metric_type::HISTOGRAM, labels, 1e-6);
+
+	labels.clear();
+	for (auto stage : LATENCY_STAGE_NAMES)
+		for (auto cls : FLOW_CLASS_NAMES)
+		{
+			std::string l;
+			metrics_add_label(l, "link", link);
+			metrics_add_label(l, "stage", stage);
+			metrics_add_label(l, "class", cls);
+			labels.push_back(l);
+		}
+	link_metrics_.latency = metric_register("udptoserial_latency_seconds",
+		"Time data spent in each stage on its way across the link.", metric_type::HISTOGRAM, labels, 1e-6);
+}
+
+Metric_frame_kind link_frame_kind(const uint8_t *frame, size_t len)
+{
+	uint8_t type = link_frame_type(frame, len);
+	if (type >= LINK_FRAME_MUX_OPEN && type <= LINK_FRAME_MUX_CREDIT)
+		return FRAME_KIND_MUX;
+	if (type == LINK_FRAME_UDP)
+		return FRAME_KIND_UDP;
+	if (type == LINK_FRAME_UDP_BATCH)
+		return FRAME_KIND_UDP_BATCH;
+	if (type == LINK_FRAME_PROBE || type == LINK_FRAME_PROBE_ECHO || type == LINK_FRAME_RATE
+		|| type == LINK_FRAME_STAMP)
+		return FRAME_KIND_CONTROL;
+	return FRAME_KIND_IPV4;
+}
+
+Metric_flow_class link_flow_class(const uint8_t *frame, size_t len)
+{
+	switch (link_frame_kind(frame, len))
+	{
+	case FRAME_KIND_MUX:
+		return FLOW_CLASS_TCP;
+	case FRAME_KIND_UDP:
+	case FRAME_KIND_UDP_BATCH:
+		return FLOW_CLASS_UDP;
+	default:
+		return FLOW_CLASS_NONE;
+	}
+}
+
+static std::string flow_label(const struct Flow_stats& f, int dir)
+{
+	char buf[64];
+	uint32_t saddr = (uint32_t)(f.key.addrs >> 32);
+	uint32_t daddr = (uint32_t)f.key.addrs;
+	snprintf(buf, sizeof(buf), "%u.%u.%u.%u:%u->%u.%u.%u.%u:%u",
+		saddr >> 24, (saddr >> 16) & 0xFF, (saddr >> 8) & 0xFF, saddr & 0xFF, f.key.ports >> 16,
+		daddr >> 24, (daddr >> 16) & 0xFF, (daddr >> 8) & 0xFF, daddr & 0xFF, f.key.ports & 0xFFFF);
+	std::string l;
+	metrics_add_label(l, "proto", f.proto);
+	metrics_add_label(l, "flow", buf);
+	metrics_add_label(l, "direction", DIRECTION_NAMES[dir]);
+	return l;
+}
+
+void flow_metrics_write(std::string& dest, const std::vector<struct Flow_stats>& flows)
+{
+	std::vector<std::string> labels;
+	for (auto& f : flows)
+		for (int dir = 0; dir < METRIC_DIRECTIONS; dir++)
+			labels.push_back(flow_label(f, dir));
+
+	metrics_write_header(dest, "udptoserial_flow_bytes_total",
+		"Payload bytes carried for each open connection or session.", "counter");
+	for (size_t i = 0; i < flows.size(); i++)
+		for (int dir = 0; dir < METRIC_DIRECTIONS; dir++)
+			metrics_write_sample(dest, "udptoserial_flow_bytes_total", labels[i * 2 + dir], (double)flows[i].counts.bytes[dir]);
+	metrics_write_header(dest, "udptoserial_flow_frames_total",
+		"Link frames carried for each open connection or session.", "counter");
+	for (size_t i = 0; i < flows.size(); i++)
+		for (int dir = 0; dir < METRIC_DIRECTIONS; dir++)
+			metrics_write_sample(dest, "udptoserial_flow_frames_total", labels[i * 2 + dir], (double)flows[i].counts.frames[dir]);
+}
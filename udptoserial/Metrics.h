@@ -0,0 +1,134 @@
+#pragma once
+// METRICS - what udptoserial counts about its link and its flows, for the
+// metrics socket.  See libhorizr/metrics.h for how counting works.
+//
+// The link's counters are registered once, under the serial port's
+// name, and bumped from wherever frames pass: the serial writer for what
+// goes out, the serial read handler and the frame handlers for what
+// comes in.  Until they are registered, bumping them does nothing.
+//
+// Counts for each proxied connection and UDP session are kept by its
+// owner, alongside the flow itself, since flows come and go and slots
+// are never given back.  They are read out as the metrics are written.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../libhorizr/metrics.h"
+#include "../libhorizr/flow_table.h"
+
+enum Metric_direction
+{
+	METRIC_TX,
+	METRIC_RX,
+	METRIC_DIRECTIONS
+};
+
+enum Metric_frame_kind
+{
+	FRAME_KIND_MUX,
+	FRAME_KIND_UDP,
+	FRAME_KIND_UDP_BATCH,
+	FRAME_KIND_CONTROL,
+	FRAME_KIND_IPV4,
+	FRAME_KINDS
+};
+
+// Frames that were thrown away, by why.  Bad frames are ones whose type
+// was known but which didn't make sense as that type.
+enum Metric_decode_error
+{
+	DECODE_SLIP_OVERFLOW,
+	DECODE_UNKNOWN_FRAME,
+	DECODE_BAD_MUX,
+	DECODE_BAD_UDP,
+	DECODE_BAD_RATE,
+	DECODE_ERRORS
+};
+
+// Where a data frame's time goes, from when its first byte came in to
+// when it was read off the serial line at the far end: waiting to be
+// handed to the serial port, being written to it, and crossing the link,
+// tty queues and all.  The last is only known at the far end, and only
+// with STAMP frames and a clock offset from probes.
+enum Metric_latency_stage
+{
+	LATENCY_QUEUE,
+	LATENCY_WRITE,
+	LATENCY_LINK,
+	LATENCY_STAGES
+};
+
+// Latency is kept for proxied TCP and UDP apart, since one is paced by
+// credit and coalescing and the other by batching.
+enum Metric_flow_class
+{
+	FLOW_CLASS_TCP,
+	FLOW_CLASS_UDP,
+	FLOW_CLASSES,
+	FLOW_CLASS_NONE = FLOW_CLASSES
+};
+
+struct Link_metrics
+{
+	// By direction.
+	uint32_t bytes = METRIC_SLOTS;
+	// By direction, then by kind.
+	uint32_t frames = METRIC_SLOTS;
+	// By Metric_decode_error.
+	uint32_t decode_errors = METRIC_SLOTS;
+	// How long each data frame waited in the serial writer's queue, in
+	// microseconds.
+	uint32_t queue_sojourn = METRIC_SLOTS;
+	// By stage, then by class, in microseconds.
+	uint32_t latency = METRIC_SLOTS;
+};
+
+extern struct Link_metrics link_metrics_;
+
+// Register the link's counters, labelled with LINK.
+void link_metrics_register(const std::string& link);
+
+// Which kind of frame a link frame is, by its first byte.
+Metric_frame_kind link_frame_kind(const uint8_t *frame, size_t len);
+
+inline void link_count_frame(Metric_direction dir, const uint8_t *frame, size_t len)
+{
+	metric_add(link_metrics_.frames + dir * FRAME_KINDS + link_frame_kind(frame, len));
+}
+
+// Which class of flow a link frame belongs to, by its first byte.
+Metric_flow_class link_flow_class(const uint8_t *frame, size_t len);
+
+// USEC is a difference between two clock readings, so anything negative
+// is clock error and is counted as zero.
+inline void link_count_latency(Metric_latency_stage stage, Metric_flow_class cls, int32_t usec)
+{
+	if (cls == FLOW_CLASS_NONE)
+		return;
+	metric_hdr_add(link_metrics_.latency + (stage * FLOW_CLASSES + cls) * HDR_SLOTS, usec < 0 ? 0 : usec);
+}
+
+// What one connection or session has carried.  TX is what went over the
+// link to the far end, RX what came from it.
+struct Flow_counts
+{
+	uint64_t bytes[METRIC_DIRECTIONS] = { 0, 0 };
+	uint64_t frames[METRIC_DIRECTIONS] = { 0, 0 };
+
+	void count(Metric_direction dir, size_t len)
+	{
+		bytes[dir] += len;
+		frames[dir]++;
+	}
+};
+
+struct Flow_stats
+{
+	const char *proto;
+	struct flow_key key;
+	struct Flow_counts counts;
+};
+
+// Given FLOWS, append the per-flow counters onto DEST.
+void flow_metrics_write(std::string& dest, const std::vector<struct Flow_stats>& flows);
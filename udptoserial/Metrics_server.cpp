@@ -0,0 +1,103 @@
+#include "Metrics_server.h"
+#ifndef WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "Log.h"
+
+// How long to wait after a failed accept before trying again.
+const static auto ACCEPT_RETRY = std::chrono::milliseconds(100);
+
+Metrics_server::Metrics_server(asio::io_service& service, const std::string& path,
+	std::function<void(std::string&)> write)
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	: acceptor_(service)
+	, retry_timer_(service)
+	, path_(path)
+#else
+	: path_(path)
+#endif
+	, write_(write)
+	, bound_(false)
+{
+}
+
+Metrics_server::~Metrics_server()
+{
+#ifndef WIN32
+	if (bound_)
+		unlink(path_.c_str());
+#endif
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+bool Metrics_server::open()
+{
+	// Only a socket is taken to be ours to replace.
+	struct stat st;
+	if (stat(path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path_.c_str());
+
+	system::error_code ec;
+	asio::local::stream_protocol::endpoint endpoint(path_);
+	acceptor_.open(endpoint.protocol(), ec);
+	if (!ec)
+		acceptor_.bind(endpoint, ec);
+	if (!ec)
+		bound_ = true;
+	if (!ec)
+		acceptor_.listen(asio::socket_base::max_connections, ec);
+	if (ec)
+	{
+		LOG(error) << "metrics socket " << path_ << ": " << ec.message();
+		return false;
+	}
+	LOG(info) << "metrics on " << path_;
+	accept_next();
+	return true;
+}
+
+void Metrics_server::accept_next()
+{
+	auto sock = std::make_shared<Socket>(acceptor_.get_executor());
+	acceptor_.async_accept(*sock, std::bind(&Metrics_server::accept_handler,
+		shared_from_this(), sock, std::placeholders::_1));
+}
+
+void Metrics_server::accept_handler(std::shared_ptr<Socket> sock, const system::error_code& ec)
+{
+	if (ec == asio::error::operation_aborted)
+		return;
+	if (ec)
+	{
+		// Trying again straight away would fail the same way, for as long
+		// as whatever it is lasts.
+		LOG(warning) << "metrics socket " << path_ << ": " << ec.message();
+		retry_timer_.expires_from_now(ACCEPT_RETRY);
+		retry_timer_.async_wait(std::bind(&Metrics_server::retry_handler,
+			shared_from_this(), std::placeholders::_1));
+		return;
+	}
+	auto text = std::make_shared<std::string>();
+	write_(*text);
+	asio::async_write(*sock, asio::buffer(*text), [sock, text](const system::error_code&, size_t)
+	{
+		system::error_code ignored;
+		sock->shutdown(asio::socket_base::shutdown_both, ignored);
+		sock->close(ignored);
+	});
+	accept_next();
+}
+
+void Metrics_server::retry_handler(const system::error_code& ec)
+{
+	if (!ec)
+		accept_next();
+}
+#else
+bool Metrics_server::open()
+{
+	LOG(warning) << "metrics socket " << path_ << ": Unix sockets aren't supported here";
+	return false;
+}
+#endif
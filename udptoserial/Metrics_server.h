@@ -0,0 +1,51 @@
+#pragma once
+// METRICS_SERVER - answers on a Unix socket with every metric, in
+// Prometheus's text format.
+//
+// A client connects, is sent the whole lot, and the connection closes,
+// so `socat - UNIX-CONNECT:udptoserial.metrics` prints them.  The text is
+// put together on the io_service's thread, which is the one that owns
+// the flows, and costs the forwarding path nothing between scrapes.
+
+#ifdef WIN32
+#include <sdkddkver.h>
+#endif
+#include <functional>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+using namespace boost;
+
+class Metrics_server
+	: public std::enable_shared_from_this<Metrics_server>
+{
+public:
+	// WRITE appends everything there is to report onto its argument.
+	Metrics_server(asio::io_service& service, const std::string& path,
+		std::function<void(std::string&)> write);
+	~Metrics_server();
+
+	// Listen at the path, replacing a socket left there by an earlier
+	// run, and start answering.  Returns false, having said why, if it
+	// can't.
+	bool open();
+
+private:
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	typedef asio::local::stream_protocol::socket Socket;
+
+	void accept_next();
+	void accept_handler(std::shared_ptr<Socket> sock, const system::error_code& ec);
+	void retry_handler(const system::error_code& ec);
+
+	asio::local::stream_protocol::acceptor acceptor_;
+	// After a failed accept, such as for want of file descriptors, the
+	// next one waits on this.
+	asio::steady_timer retry_timer_;
+#endif
+	std::string path_;
+	std::function<void(std::string&)> write_;
+	bool bound_;
+};
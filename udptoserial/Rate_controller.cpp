@@ -0,0 +1,191 @@
+#include "Rate_controller.h"
+#include <algorithm>
+#include <cstring>
+
+// Gains are applied to the bottleneck rate estimate to get the pacing rate.
+// In STARTUP we ramp quickly, and then DRAIN whatever queue the ramp built.
+const static double STARTUP_GAIN = 2.89;
+const static double DRAIN_GAIN = 1.0 / 2.89;
+
+// In PROBE_BW we spend one phase sending a little faster than the estimate
+// to find out if the link got faster, then one phase a little slower to
+// drain what that probe queued up, then cruise.
+const static double PROBE_BW_GAINS[] = { 1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+
+const static uint32_t MIN_RTT_WINDOW_USEC = 10 * 1000 * 1000;
+const static uint32_t BASE_OWD_WINDOW_USEC = 60 * 1000 * 1000;
+const static uint32_t MIN_CYCLE_USEC = 100 * 1000;
+
+// Rate samples over very short intervals are mostly noise from the
+// way the UART driver batches reads.
+const static uint32_t MIN_SAMPLE_INTERVAL_USEC = 2000;
+
+// How much queueing in the modem we tolerate: a floor, or enough time to
+// serialize a couple of full-size frames at the current rate.
+const static uint32_t TARGET_DELAY_MIN_USEC = 25 * 1000;
+const static uint32_t TARGET_DELAY_FRAME_BYTES = 2 * 300;
+
+const char *to_string(Rate_controller::Mode m)
+{
+	if (m == Rate_controller::Mode::STARTUP)
+		return "STARTUP";
+	else if (m == Rate_controller::Mode::DRAIN)
+		return "DRAIN";
+	else if (m == Rate_controller::Mode::PROBE_BW)
+		return "PROBE_BW";
+	else
+		return "UNKNOWN_MODE";
+}
+
+Rate_controller::Rate_controller(uint32_t line_rate, uint32_t initial_rate)
+	: line_rate_(line_rate)
+	, pacing_rate_(0)
+	, btl_rate_((uint32_t)(std::min(initial_rate, line_rate) / STARTUP_GAIN))
+	, mode_(Mode::STARTUP)
+	, rate_sample_pos_(0)
+	, full_rate_(0)
+	, full_rate_count_(0)
+	, min_rtt_usec_(UINT32_MAX)
+	, min_rtt_stamp_(0)
+	, base_owd_usec_(0)
+	, base_owd_stamp_(0)
+	, queue_delay_usec_(0)
+	, have_delay_(false)
+	, cycle_pos_(0)
+	, cycle_stamp_(0)
+	, last_echo_{}
+	, have_last_echo_(false)
+{
+	memset(rate_samples_, 0, sizeof(rate_samples_));
+	memset(app_limited_, 0, sizeof(app_limited_));
+	update_pacing_rate();
+}
+
+void Rate_controller::on_probe_sent(uint16_t seq, bool app_limited)
+{
+	app_limited_[seq % PROBE_HISTORY] = app_limited;
+}
+
+void Rate_controller::on_probe_echo(uint32_t now_usec, const struct link_probe& echo)
+{
+	// Round-trip time.  The echo is sent as soon as the probe arrives,
+	// so this is two one-way trips and almost no processing.
+	uint32_t rtt = now_usec - echo.tx_usec;
+	if (rtt < min_rtt_usec_ || (uint32_t)(now_usec - min_rtt_stamp_) > MIN_RTT_WINDOW_USEC)
+	{
+		min_rtt_usec_ = rtt;
+		min_rtt_stamp_ = now_usec;
+	}
+
+	// One-way delay.  The clocks at the two ends are unrelated, but the
+	// offset is constant, so growth above the baseline is queueing.
+	int32_t owd = (int32_t)(echo.rx_usec - echo.tx_usec);
+	if (!have_delay_ || owd < base_owd_usec_
+		|| (uint32_t)(now_usec - base_owd_stamp_) > BASE_OWD_WINDOW_USEC)
+	{
+		base_owd_usec_ = owd;
+		base_owd_stamp_ = now_usec;
+		have_delay_ = true;
+	}
+	queue_delay_usec_ = (uint32_t)(owd - base_owd_usec_);
+
+	// Delivery rate: bytes that arrived at the far end between two echoes,
+	// over the longer of the send and receive intervals, so that a burst
+	// that got bunched up on one side isn't mistaken for a fast link.
+	if (!have_last_echo_)
+	{
+		last_echo_ = echo;
+		have_last_echo_ = true;
+	}
+	else if ((int16_t)(echo.seq - last_echo_.seq) > 0)
+	{
+		uint32_t rx_interval = echo.rx_usec - last_echo_.rx_usec;
+		uint32_t tx_interval = echo.tx_usec - last_echo_.tx_usec;
+		uint32_t interval = std::max(rx_interval, tx_interval);
+		if (interval >= MIN_SAMPLE_INTERVAL_USEC)
+		{
+			uint32_t delivered = echo.rx_bytes - last_echo_.rx_bytes;
+			uint32_t sample = (uint32_t)((uint64_t)delivered * 1000000u / interval);
+			update_bottleneck_rate(sample, app_limited_[echo.seq % PROBE_HISTORY]);
+			last_echo_ = echo;
+		}
+	}
+
+	uint32_t target = TARGET_DELAY_MIN_USEC;
+	if (btl_rate_ > 0)
+		target = std::max(target, (uint32_t)((uint64_t)TARGET_DELAY_FRAME_BYTES * 1000000u / btl_rate_));
+
+	if (mode_ == Mode::STARTUP)
+	{
+		if (full_rate_count_ >= 3 || btl_rate_ >= line_rate_ || queue_delay_usec_ > target)
+			mode_ = Mode::DRAIN;
+	}
+	if (mode_ == Mode::DRAIN)
+	{
+		if (queue_delay_usec_ <= target / 2)
+		{
+			mode_ = Mode::PROBE_BW;
+			cycle_pos_ = 0;
+			cycle_stamp_ = now_usec;
+		}
+	}
+	else if (mode_ == Mode::PROBE_BW)
+	{
+		uint32_t cycle_len = std::max(min_rtt_usec_, MIN_CYCLE_USEC);
+		if ((uint32_t)(now_usec - cycle_stamp_) > cycle_len)
+		{
+			cycle_pos_ = (cycle_pos_ + 1) % CYCLE_LEN;
+			cycle_stamp_ = now_usec;
+		}
+	}
+
+	update_pacing_rate();
+
+	// LEDBAT-style backoff.  If a standing queue has formed anyway, slow
+	// down in proportion to how far over the target it is.
+	if (mode_ == Mode::PROBE_BW && queue_delay_usec_ > target)
+	{
+		double over = std::min(1.0, (double)(queue_delay_usec_ - target) / target);
+		double limit = btl_rate_ * (1.0 - 0.5 * over);
+		if (pacing_rate_ > limit)
+			pacing_rate_ = std::max((uint32_t)limit, line_rate_ / 64 + 1);
+	}
+}
+
+void Rate_controller::update_bottleneck_rate(uint32_t sample, bool app_limited)
+{
+	// An app-limited sample only tells us the link is at least that fast.
+	if (app_limited && sample < btl_rate_)
+		return;
+
+	rate_samples_[rate_sample_pos_] = std::min(sample, line_rate_);
+	rate_sample_pos_ = (rate_sample_pos_ + 1) % RATE_WINDOW;
+	btl_rate_ = *std::max_element(rate_samples_, rate_samples_ + RATE_WINDOW);
+
+	if (mode_ == Mode::STARTUP && !app_limited)
+	{
+		if (btl_rate_ >= full_rate_ + full_rate_ / 4)
+		{
+			full_rate_ = btl_rate_;
+			full_rate_count_ = 0;
+		}
+		else
+			full_rate_count_++;
+	}
+}
+
+void Rate_controller::update_pacing_rate()
+{
+	double gain;
+	if (mode_ == Mode::STARTUP)
+		gain = STARTUP_GAIN;
+	else if (mode_ == Mode::DRAIN)
+		gain = DRAIN_GAIN;
+	else
+		gain = PROBE_BW_GAINS[cycle_pos_];
+
+	double rate = gain * btl_rate_;
+	rate = std::min(rate, (double)line_rate_);
+	rate = std::max(rate, (double)(line_rate_ / 64 + 1));
+	pacing_rate_ = (uint32_t)rate;
+}
@@ -0,0 +1,94 @@
+#pragma once
+// RATE_CONTROLLER - estimates how fast the serial link can actually
+// deliver bytes, so that the serial writer can pace its output.
+//
+// The configured baud rate is only an upper bound.  A radio modem's
+// air rate moves around with signal strength, and the modem quietly
+// buffers whatever we send faster than that.  Once data is sitting in
+// the modem's buffer, every packet behind it waits.  So, like BBR, we
+// keep a running estimate of the bottleneck rate and of the minimum
+// round-trip time, and pace at about the bottleneck rate.  Like LEDBAT,
+// we also watch for one-way delay growing above its baseline, which
+// means a queue is forming in the modem, and back off when it does.
+//
+// All of the measurements come from in-band PROBE frames that the far
+// end echoes back.  Times are microseconds on a wrapping 32-bit clock.
+
+#include <cstddef>
+#include <cstdint>
+#include "../libhorizr/link.h"
+
+class Rate_controller
+{
+public:
+	enum class Mode {
+		STARTUP,
+		DRAIN,
+		PROBE_BW
+	};
+
+	// LINE_RATE is the fastest the UART can go, in bytes per second.
+	// INITIAL_RATE is where pacing starts before any measurements.  It
+	// ought to be on the low side: anything sent faster than the link
+	// can carry just queues up in the modem, and hides the echoes that
+	// would tell us to slow down behind that queue.
+	Rate_controller(uint32_t line_rate, uint32_t initial_rate);
+
+	// Call when a PROBE is about to be written.  APP_LIMITED is true if
+	// there wasn't anything queued behind it, which means rate samples
+	// that end at this probe can only underestimate the link.
+	void on_probe_sent(uint16_t seq, bool app_limited);
+
+	// Call when a PROBE_ECHO arrives at NOW_USEC.
+	void on_probe_echo(uint32_t now_usec, const struct link_probe& echo);
+
+	// The rate at which the serial writer should send, in bytes per second.
+	uint32_t pacing_rate() const { return pacing_rate_; }
+
+	// The current estimate of the deliverable rate, in bytes per second.
+	uint32_t bottleneck_rate() const { return btl_rate_; }
+	uint32_t min_rtt_usec() const { return min_rtt_usec_; }
+	uint32_t queue_delay_usec() const { return queue_delay_usec_; }
+	Mode mode() const { return mode_; }
+
+private:
+	void update_bottleneck_rate(uint32_t sample, bool app_limited);
+	void update_pacing_rate();
+
+	const static size_t RATE_WINDOW = 10;
+	const static size_t PROBE_HISTORY = 32;
+	const static size_t CYCLE_LEN = 8;
+
+	uint32_t line_rate_;
+	uint32_t pacing_rate_;
+	uint32_t btl_rate_;
+	Mode mode_;
+
+	// Windowed maximum of the delivery rate samples.
+	uint32_t rate_samples_[RATE_WINDOW];
+	size_t rate_sample_pos_;
+
+	// STARTUP ends when the rate stops growing.
+	uint32_t full_rate_;
+	int full_rate_count_;
+
+	// Windowed minimums of RTT and of one-way delay.  The one-way delay
+	// includes an unknown clock offset, so only its growth means anything.
+	uint32_t min_rtt_usec_;
+	uint32_t min_rtt_stamp_;
+	int32_t base_owd_usec_;
+	uint32_t base_owd_stamp_;
+	uint32_t queue_delay_usec_;
+	bool have_delay_;
+
+	// PROBE_BW gain cycling.
+	size_t cycle_pos_;
+	uint32_t cycle_stamp_;
+
+	// The previous echo, to take deltas against.
+	struct link_probe last_echo_;
+	bool have_last_echo_;
+	bool app_limited_[PROBE_HISTORY];
+};
+
+const char *to_string(Rate_controller::Mode m);
@@ -0,0 +1,57 @@
+#include "Serial_read_stats.h"
+#include <sstream>
+
+// Reads further apart than this are separate bursts, and the gap
+// between them says nothing about the driver.
+const static auto IDLE_GAP = std::chrono::milliseconds(100);
+
+Serial_read_stats::Serial_read_stats(uint32_t baud_rate)
+	: char_usec_(baud_rate > 0 ? 10.0e6 / baud_rate : 0.0)
+{
+	reset();
+}
+
+void Serial_read_stats::reset()
+{
+	have_last_ = false;
+	log2_histogram_reset(sizes_);
+	log2_histogram_reset(gaps_);
+	log2_histogram_reset(holds_);
+	log2_histogram_reset(routes_);
+}
+
+void Serial_read_stats::on_read(std::chrono::steady_clock::time_point now, size_t bytes)
+{
+	if (bytes == 0)
+		return;
+	log2_histogram_add(sizes_, bytes);
+	log2_histogram_add(holds_, (uint64_t)((bytes - 1) * char_usec_));
+	if (have_last_ && now - last_ < IDLE_GAP)
+		log2_histogram_add(gaps_, std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count());
+	last_ = now;
+	have_last_ = true;
+}
+
+void Serial_read_stats::on_frame(std::chrono::steady_clock::duration since_read)
+{
+	log2_histogram_add(routes_, std::chrono::duration_cast<std::chrono::microseconds>(since_read).count());
+}
+
+std::string Serial_read_stats::summary() const
+{
+	std::ostringstream s;
+	s << reads() << " reads, " << bytes() << " bytes";
+	if (reads() == 0)
+		return s.str();
+	s << ", bytes/read p50 <" << log2_histogram_percentile(sizes_, 0.5)
+		<< " p99 <" << log2_histogram_percentile(sizes_, 0.99)
+		<< ", hold p50 <" << log2_histogram_percentile(holds_, 0.5)
+		<< " p99 <" << log2_histogram_percentile(holds_, 0.99) << " us";
+	if (gaps_.count > 0)
+		s << ", gap p50 <" << log2_histogram_percentile(gaps_, 0.5)
+			<< " p99 <" << log2_histogram_percentile(gaps_, 0.99) << " us";
+	if (routes_.count > 0)
+		s << ", route p50 <" << log2_histogram_percentile(routes_, 0.5)
+			<< " p99 <" << log2_histogram_percentile(routes_, 0.99) << " us";
+	return s.str();
+}
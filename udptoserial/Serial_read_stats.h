@@ -0,0 +1,49 @@
+#pragma once
+// SERIAL_READ_STATS - what each read from the serial port looked like,
+// so that latency settings can be compared.
+//
+// A read returns whatever the driver and the adapter have collected
+// since the one before.  While data is arriving, how many bytes come
+// back per read and how far apart the reads are show how long they sit
+// on it.  With an FTDI adapter's default 16 ms latency timer, reads
+// come every 16 ms; at 1 ms they come far more often, with fewer bytes.
+//
+// A read's hold time is the least time its first byte can have waited:
+// how long the rest of the read took to arrive at the line rate.  A
+// frame's route time is how long after the read it had been handed on.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "../libhorizr/histogram.h"
+
+class Serial_read_stats
+{
+public:
+	// BAUD_RATE sets the time each character takes on the line, taken
+	// to be ten bits.
+	explicit Serial_read_stats(uint32_t baud_rate);
+
+	// For when the link changes rate.
+	void set_baud_rate(uint32_t baud_rate) { char_usec_ = baud_rate > 0 ? 10.0e6 / baud_rate : 0.0; }
+
+	void on_read(std::chrono::steady_clock::time_point now, size_t bytes);
+	void on_frame(std::chrono::steady_clock::duration since_read);
+
+	uint64_t reads() const { return sizes_.count; }
+	uint64_t bytes() const { return sizes_.sum; }
+
+	// One line, for the logs.
+	std::string summary() const;
+	void reset();
+
+private:
+	double char_usec_;
+	bool have_last_;
+	std::chrono::steady_clock::time_point last_;
+	struct log2_histogram sizes_;
+	struct log2_histogram gaps_;
+	struct log2_histogram holds_;
+	struct log2_histogram routes_;
+};
@@ -0,0 +1,653 @@
+#include "Serial_writer.h"
+#include <algorithm>
+#include <cerrno>
+#include <sstream>
+#include <thread>
+#include "Log.h"
+#include "Metrics.h"
+#include "Usdt.h"
+#include "Capture.h"
+#include "../libhorizr/slip.h"
+#include "serial_tune.h"
+
+// A UART sends 10 bits per byte at 8N1.
+const static uint32_t BITS_PER_BYTE = 10;
+
+// Probes are sent no more often than this, and not so often that they
+// use more than about 1% of the line.
+const static auto PROBE_INTERVAL_MIN = std::chrono::milliseconds(250);
+const static uint32_t PROBE_OVERHEAD_PERCENT = 1;
+
+// Without a throttle setting, auto pacing starts at this fraction of the
+// line rate and ramps up from there.
+const static uint32_t STARTUP_FRACTION = 8;
+
+// A train of back-to-back padded probes measures the link even when there
+// is no real traffic.  We send one at startup and then every so often
+// while the link is idle.
+const static size_t PROBE_TRAIN_LEN = 8;
+const static size_t PROBE_TRAIN_PADDING = 48;
+const static unsigned PROBE_TRAIN_EVERY_TICKS = 40;
+
+// A write gathers frames until it has this many bytes, or until the
+// kernel's tty queue would be over its limit.
+const static size_t WRITE_BUDGET = 8 * 1024;
+
+// With the tty queue at its limit, we look again once it has had time to
+// drain by half, but not sooner than this.
+const static auto TTY_DRAIN_MIN = std::chrono::milliseconds(1);
+
+// While CTS is low, the watcher thread tells us when it comes back.  In
+// case that is missed, we look again this often.
+const static auto CTS_RECHECK = std::chrono::seconds(1);
+
+// While holding, the kernel's queue is looked at this often until it is
+// empty.  Then we wait as long as the UART's FIFO takes to empty too.
+const static auto HOLD_POLL = std::chrono::milliseconds(2);
+const static uint32_t UART_FIFO = 64;
+
+// Under pacing, a frame can join a write this far ahead of its slot.
+// The rate still holds, since the next slot is pushed out just as far.
+const static auto PACE_BURST = std::chrono::milliseconds(5);
+
+// After a failed write, the queue waits this long before going on, so
+// that a port that keeps failing doesn't keep us spinning.
+const static auto WRITE_ERROR_RETRY = std::chrono::milliseconds(100);
+
+// Enough for a whole probe train, SLIP-encoded.
+const static size_t CONTROL_BUFFER_SIZE = 2048;
+
+Serial_writer::Serial_writer(asio::io_service& service, std::shared_ptr<asio::serial_port> sport,
+	uint32_t baud_rate, uint32_t throttle, bool auto_pacing,
+	size_t tty_queue, bool watch_cts, bool stamp_frames)
+	: service_(service)
+	, serial_port_(sport)
+	, write_strand_(service)
+	, pace_timer_(service)
+	, probe_timer_(service)
+	, hold_timer_(service)
+	, queued_bytes_(0)
+	, control_(CONTROL_BUFFER_SIZE)
+	, control_len_(0)
+	, write_in_progress_(false)
+	, pace_wait_in_progress_(false)
+	, holding_(false)
+	, next_send_time_(std::chrono::steady_clock::now())
+	, tty_queue_limit_(tty_queue)
+	, watch_cts_(watch_cts)
+	, cts_up_(true)
+	, stamp_frames_(stamp_frames)
+	, far_clock_()
+	, auto_pacing_(auto_pacing)
+	, throttle_(throttle)
+	, fixed_rate_(throttle / BITS_PER_BYTE)
+	, rate_(0, 0)
+	, probe_ticks_(0)
+	, busy_since_last_train_(false)
+	, logged_rate_(0)
+	, logged_mode_(Rate_controller::Mode::STARTUP)
+	, tx_bytes_(0)
+	, rx_bytes_(0)
+	, probe_seq_(0)
+{
+	set_line_rate(baud_rate);
+	reset_write_stats();
+}
+
+// Measurements taken at one rate say nothing about another, so the
+// rate controller starts over.
+void Serial_writer::set_line_rate(uint32_t baud_rate)
+{
+	line_rate_ = baud_rate / BITS_PER_BYTE;
+	rate_ = Rate_controller(line_rate_, throttle_ ? throttle_ / BITS_PER_BYTE : line_rate_ / STARTUP_FRACTION);
+
+	// Size a probe as it appears on the wire, SLIP delimiters included.
+	uint32_t probe_wire_bytes = LINK_PROBE_ECHO_LEN + 2;
+	auto interval = std::chrono::microseconds(1000000ull * probe_wire_bytes * 100
+		/ PROBE_OVERHEAD_PERCENT / std::max(line_rate_, 1u));
+	probe_interval_ = std::max<std::chrono::microseconds>(interval, PROBE_INTERVAL_MIN);
+}
+
+void Serial_writer::start()
+{
+	if (watch_cts_)
+		watch_cts();
+	if (!auto_pacing_)
+		return;
+
+	LOG(info) << "auto pacing on, line rate " << line_rate_ << " B/s, probing every "
+		<< probe_interval_.count() / 1000 << " ms";
+	send_probe_train(PROBE_TRAIN_LEN, PROBE_TRAIN_PADDING);
+	probe_timer_.expires_from_now(probe_interval_);
+	probe_timer_.async_wait(std::bind(&Serial_writer::probe_timer_handler, shared_from_this(), std::placeholders::_1));
+}
+
+#ifdef U2S_HAVE_IO_URING
+void Serial_writer::use_uring(std::shared_ptr<Uring_io> ring)
+{
+	uring_ = ring;
+	uring_write_.reset(new Uring_write([this](int res)
+	{
+		write_strand_.dispatch(make_custom_alloc_handler(handler_pool_, [me = shared_from_this(), res]()
+		{
+			me->uring_write_done(res);
+		}));
+	}));
+}
+
+void Serial_writer::uring_write_done(int res)
+{
+	system::error_code ec;
+	if (res < 0)
+		ec = system::error_code(-res, system::system_category());
+	packet_send_done(ec, res < 0 ? 0 : res);
+}
+#endif
+
+uint32_t Serial_writer::pacing_rate() const
+{
+	if (auto_pacing_)
+		return rate_.pacing_rate();
+	return fixed_rate_;
+}
+
+std::chrono::microseconds Serial_writer::backlog() const
+{
+	size_t queued = queued_bytes_;
+	if (queued == 0)
+		return std::chrono::microseconds(0);
+	uint32_t rate = pacing_rate();
+	if (rate == 0)
+		rate = line_rate_;
+	return std::chrono::microseconds(1000000ull * queued / std::max(rate, 1u));
+}
+
+uint32_t Serial_writer::now_usec()
+{
+	return link_now_usec();
+}
+
+void Serial_writer::send(packet frame, std::shared_ptr<Send_listener> listener, size_t len)
+{
+	// The stamp's time is filled in as the frame goes to the port.
+	if (stamp_frames_ && frame.headroom() >= LINK_STAMP_LEN
+		&& link_flow_class(frame.data(), frame.size()) != FLOW_CLASS_NONE)
+		link_stamp_encode_header(frame.push(LINK_STAMP_LEN), 0);
+	USDT(udptoserial, frame_enqueued, frame.data(), frame.size());
+	queued_bytes_ += frame.size();
+	bool first;
+	{
+		std::lock_guard<std::mutex> lock(incoming_mutex_);
+		first = incoming_.empty();
+		incoming_.push_back(Entry{ Entry_type::DATA, std::move(frame), 0, link_probe{}, std::move(listener), len,
+			std::chrono::steady_clock::now() });
+	}
+	if (first)
+		service_.post(write_strand_.wrap(make_custom_alloc_handler(handler_pool_, [me = shared_from_this()]()
+		{
+			me->take_incoming();
+		})));
+}
+
+// Everything send has queued since the last time joins the queue at once.
+void Serial_writer::take_incoming()
+{
+	{
+		std::lock_guard<std::mutex> lock(incoming_mutex_);
+		while (!incoming_.empty())
+		{
+			send_packet_queue_.push_back(std::move(incoming_.front()));
+			incoming_.pop_front();
+		}
+	}
+	if (!send_packet_queue_.empty() && !write_in_progress_ && !pace_wait_in_progress_)
+		start_packet_send();
+}
+
+void Serial_writer::hold(packet frame, std::function<void()> done)
+{
+	queued_bytes_ += frame.size();
+	service_.post(write_strand_.wrap([me = shared_from_this(), frame = std::move(frame), done = std::move(done)]() mutable
+	{
+		// FRAME goes first and the marker right behind it, so nothing
+		// else gets in between.
+		me->hold_done_ = std::move(done);
+		me->send_packet_queue_.push_front(Entry{ Entry_type::HOLD });
+		if (frame)
+			me->send_packet_queue_.push_front(Entry{ Entry_type::DATA, std::move(frame), 0, link_probe{},
+				nullptr, 0, std::chrono::steady_clock::now() });
+		if (!me->write_in_progress_ && !me->pace_wait_in_progress_)
+			me->start_packet_send();
+		else if (me->pace_wait_in_progress_)
+			me->pace_timer_.cancel();
+	}));
+}
+
+void Serial_writer::release(uint32_t baud_rate)
+{
+	service_.post(write_strand_.wrap([me = shared_from_this(), baud_rate]()
+	{
+		if (!me->holding_)
+			return;
+		me->holding_ = false;
+		me->set_line_rate(baud_rate);
+		me->next_send_time_ = std::chrono::steady_clock::now();
+		LOG(info) << "serial writer going again at " << baud_rate << " baud";
+		if (!me->write_in_progress_ && !me->pace_wait_in_progress_ && !me->send_packet_queue_.empty())
+			me->start_packet_send();
+	}));
+}
+
+// With the last write before a hold complete, wait for the kernel and
+// the UART to send what they have.
+void Serial_writer::wait_for_drain()
+{
+	int queued = tty_queued();
+	std::chrono::microseconds wait = HOLD_POLL;
+	if (queued <= 0)
+		wait = std::chrono::milliseconds(1) + std::chrono::microseconds(1000000ull * UART_FIFO / std::max(line_rate_, 1u));
+	hold_timer_.expires_from_now(wait);
+	hold_timer_.async_wait(write_strand_.wrap([me = shared_from_this(), queued](system::error_code const & error)
+	{
+		if (error)
+			return;
+		if (queued > 0)
+		{
+			me->wait_for_drain();
+			return;
+		}
+		auto done = std::move(me->hold_done_);
+		me->hold_done_ = nullptr;
+		if (done)
+			done();
+	}));
+}
+
+void Serial_writer::handle_probe(const uint8_t *frame, size_t len)
+{
+	struct link_probe probe;
+	if (!link_probe_decode(frame, len, probe))
+		return;
+
+	// Answer right away, ahead of any queued data, so that the far end's
+	// RTT measurement isn't inflated by our own queue.
+	probe.rx_usec = now_usec();
+	probe.rx_bytes = rx_bytes_;
+	Entry e{ Entry_type::PROBE_ECHO, packet(), 0, probe };
+	service_.post(write_strand_.wrap([me = shared_from_this(), e = std::move(e)]() mutable
+	{
+		me->queue_entry(std::move(e));
+	}));
+}
+
+void Serial_writer::handle_probe_echo(const uint8_t *frame, size_t len)
+{
+	struct link_probe echo;
+	if (!auto_pacing_ || !link_probe_decode(frame, len, echo))
+		return;
+	uint32_t now = now_usec();
+	link_clock_add(far_clock_, echo, now);
+	rate_.on_probe_echo(now, echo);
+	log_rate_if_changed();
+}
+
+void Serial_writer::log_rate_if_changed()
+{
+	uint32_t rate = rate_.pacing_rate();
+	if (rate_.mode() != logged_mode_
+		|| rate > logged_rate_ + logged_rate_ / 10
+		|| rate < logged_rate_ - logged_rate_ / 10)
+	{
+		LOG(info) << "pacing at " << rate << " B/s, bottleneck "
+			<< rate_.bottleneck_rate() << " B/s, min rtt " << rate_.min_rtt_usec() / 1000
+			<< " ms, queue delay " << rate_.queue_delay_usec() / 1000 << " ms, "
+			<< to_string(rate_.mode());
+		logged_rate_ = rate;
+		logged_mode_ = rate_.mode();
+	}
+}
+
+void Serial_writer::send_probe_train(size_t count, size_t padding)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		Entry e{ Entry_type::PROBE, packet(), padding };
+		service_.post(write_strand_.wrap([me = shared_from_this(), e = std::move(e)]() mutable
+		{
+			me->queue_entry(std::move(e));
+		}));
+	}
+}
+
+void Serial_writer::probe_timer_handler(system::error_code const & error)
+{
+	if (error)
+		return;
+
+	probe_ticks_++;
+	if (probe_ticks_ % PROBE_TRAIN_EVERY_TICKS == 0 && !busy_since_last_train_)
+		send_probe_train(PROBE_TRAIN_LEN, PROBE_TRAIN_PADDING);
+	else
+		send_probe_train(1, 0);
+	if (probe_ticks_ % PROBE_TRAIN_EVERY_TICKS == 0)
+		busy_since_last_train_ = false;
+
+	probe_timer_.expires_from_now(probe_interval_);
+	probe_timer_.async_wait(std::bind(&Serial_writer::probe_timer_handler, shared_from_this(), std::placeholders::_1));
+}
+
+void Serial_writer::queue_entry(Entry e)
+{
+	bool urgent = (e.type == Entry_type::PROBE_ECHO);
+	if (urgent)
+		send_packet_queue_.push_front(std::move(e));
+	else
+		send_packet_queue_.push_back(std::move(e));
+	if (!write_in_progress_ && !pace_wait_in_progress_)
+		start_packet_send();
+	else if (urgent && pace_wait_in_progress_)
+		// Cutting in line: the pace timer handler will pick this up.
+		pace_timer_.cancel();
+}
+
+void Serial_writer::start_packet_send()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	// Everything ahead of a hold has been written.
+	if (holding_)
+		return;
+	if (send_packet_queue_.front().type == Entry_type::HOLD)
+	{
+		send_packet_queue_.pop_front();
+		holding_ = true;
+		wait_for_drain();
+		return;
+	}
+
+	// Data waits its turn under the pacing rate.  Echoes and probe trains
+	// go out as soon as the port is free.
+	if (send_packet_queue_.front().type == Entry_type::DATA && now < next_send_time_)
+	{
+		wait_to_send(next_send_time_);
+		return;
+	}
+
+	// Anything written while CTS is low just sits in the kernel, so
+	// everything waits here until cts_changed says it's back.
+	if (!cts_up_)
+	{
+		wait_to_send(now + CTS_RECHECK);
+		return;
+	}
+
+	// Only top the kernel's queue up to its limit.
+	size_t budget = WRITE_BUDGET;
+	int queued = tty_queued();
+	if (queued >= 0 && tty_queue_limit_ > 0)
+	{
+		if ((size_t)queued >= tty_queue_limit_)
+		{
+			size_t drain = queued - tty_queue_limit_ / 2;
+			auto t = std::chrono::microseconds(1000000ull * drain / std::max(line_rate_, 1u));
+			wait_to_send(now + std::max<std::chrono::microseconds>(t, TTY_DRAIN_MIN));
+			return;
+		}
+		budget = std::min(budget, tty_queue_limit_ - queued);
+	}
+	if (queued >= 0)
+	{
+		log2_histogram_add(tty_queue_depth_, queued);
+		tty_queue_max_ = std::max(tty_queue_max_, (size_t)queued);
+	}
+
+	// Gather whatever can go now.  Only the first frame needs a leading
+	// END, since each one ends with an END.
+	uint32_t rate = pacing_rate();
+	uint32_t now_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+	size_t frames = 0;
+	size_t bytes = 0;
+	segments_.clear();
+	control_len_ = 0;
+	while (!send_packet_queue_.empty() && bytes < budget)
+	{
+		Entry& e = send_packet_queue_.front();
+		size_t n;
+		if (e.type == Entry_type::HOLD)
+			break;
+		if (e.type == Entry_type::DATA)
+		{
+			if (frames > 0 && now + PACE_BURST < next_send_time_)
+				break;
+			uint8_t *inner = e.frame.data();
+			size_t inner_len = e.frame.size();
+			if (inner_len > LINK_STAMP_LEN && inner[0] == LINK_FRAME_STAMP)
+			{
+				link_stamp_encode_header(inner, now_us);
+				inner += LINK_STAMP_LEN;
+				inner_len -= LINK_STAMP_LEN;
+			}
+			Metric_flow_class cls = link_flow_class(inner, inner_len);
+			if (e.frame.stamp() != 0)
+				link_count_latency(LATENCY_QUEUE, cls, (int32_t)(now_us - e.frame.stamp()));
+			in_flight_classes_.push_back(cls);
+			USDT(udptoserial, frame_dequeued, e.frame.data(), e.frame.size(), (int)cls);
+			capture_link_frame(CAPTURE_OUT, e.frame.data(), e.frame.size());
+
+			n = slip_encode_segments(segments_, e.frame.data(), e.frame.size(), frames == 0);
+			queued_bytes_ -= e.frame.size();
+			link_count_frame(METRIC_TX, inner, inner_len);
+			metric_hdr_add(link_metrics_.queue_sojourn,
+				std::chrono::duration_cast<std::chrono::microseconds>(now - e.queued).count());
+			in_flight_.push_back(std::move(e.frame));
+			if (e.listener)
+				in_flight_listeners_.push_back(std::make_pair(std::move(e.listener), e.listener_len));
+			busy_since_last_train_ = true;
+		}
+		else
+		{
+			size_t room = slip_encoded_max(e.type == Entry_type::PROBE
+				? LINK_PROBE_LEN + e.padding : LINK_PROBE_ECHO_LEN);
+			if (control_len_ + room > control_.size())
+			{
+				if (frames > 0)
+					break;
+				control_.resize(room);
+			}
+
+			probe_frame_.clear();
+			if (e.type == Entry_type::PROBE)
+			{
+				// Probes are stamped as they are handed to the port, not
+				// when they were queued.
+				struct link_probe probe {};
+				probe.seq = probe_seq_++;
+				probe.tx_usec = now_usec();
+				probe.tx_bytes = tx_bytes_;
+				rate_.on_probe_sent(probe.seq, send_packet_queue_.size() == 1);
+				link_probe_encode(probe_frame_, probe, e.padding);
+			}
+			else
+			{
+				e.probe.echo_usec = now_us;
+				link_probe_echo_encode(probe_frame_, e.probe);
+			}
+			capture_frame(CAPTURE_LINK, CAPTURE_OUT, probe_frame_.data(), probe_frame_.size());
+			uint8_t *dest = control_.data() + control_len_;
+			n = slip_encode_buf(dest, probe_frame_.data(), probe_frame_.size(), frames == 0);
+			segments_.push_back(slip_segment{ dest, n });
+			control_len_ += n;
+			metric_add(link_metrics_.frames + METRIC_TX * FRAME_KINDS + FRAME_KIND_CONTROL);
+		}
+		send_packet_queue_.pop_front();
+		frames++;
+		bytes += n;
+		tx_bytes_ += (uint32_t)n;
+		if (rate > 0)
+		{
+			auto cost = std::chrono::microseconds(1000000ull * n / rate);
+			next_send_time_ = std::max(next_send_time_, now) + cost;
+		}
+	}
+
+	log2_histogram_add(frames_per_write_, frames);
+	log2_histogram_add(bytes_per_write_, bytes);
+	metric_add(link_metrics_.bytes + METRIC_TX, bytes);
+
+	write_in_progress_ = true;
+	write_started_ = now;
+	USDT(udptoserial, write_submitted, frames, bytes);
+#ifdef U2S_HAVE_IO_URING
+	if (uring_)
+	{
+		uring_write_->start(*uring_, serial_port_->native_handle(), segments_);
+		return;
+	}
+#endif
+	write_bufs_.clear();
+	for (auto& seg : segments_)
+		write_bufs_.push_back(asio::const_buffer(seg.data, seg.len));
+	async_write(*serial_port_
+		, Buffer_list(write_bufs_)
+		, write_strand_.wrap(make_custom_alloc_handler(handler_pool_, [me = shared_from_this()]
+		(system::error_code const & ec
+			, std::size_t bytes_xfer)
+	{
+		me->packet_send_done(ec, bytes_xfer);
+	}
+	)));
+}
+
+void Serial_writer::packet_send_done(system::error_code const & error, std::size_t bytes_transferred)
+{
+	write_in_progress_ = false;
+	USDT(udptoserial, write_completed, bytes_transferred, error.value());
+	int32_t took = (int32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - write_started_).count();
+	for (auto cls : in_flight_classes_)
+		link_count_latency(LATENCY_WRITE, cls, took);
+	in_flight_classes_.clear();
+	in_flight_.clear();
+	for (auto& l : in_flight_listeners_)
+		l.first->frame_sent(l.second);
+	in_flight_listeners_.clear();
+	// The frames in a failed write are lost, but the rest of the queue,
+	// and any hold waiting in it, carries on after a pause.
+	if (error)
+	{
+		LOG(error) << "serial write: " << error.message();
+		if (!send_packet_queue_.empty() && !pace_wait_in_progress_)
+			wait_to_send(std::chrono::steady_clock::now() + WRITE_ERROR_RETRY);
+		return;
+	}
+	if (!send_packet_queue_.empty() && !pace_wait_in_progress_)
+		start_packet_send();
+}
+
+void Serial_writer::wait_to_send(std::chrono::steady_clock::time_point when)
+{
+	pace_wait_in_progress_ = true;
+	pace_timer_.expires_at(when);
+	pace_timer_.async_wait(write_strand_.wrap(make_custom_alloc_handler(handler_pool_, [me = shared_from_this()]
+	(system::error_code const &)
+	{
+		me->pace_wait_in_progress_ = false;
+		if (!me->write_in_progress_ && !me->send_packet_queue_.empty())
+			me->start_packet_send();
+	})));
+}
+
+// Bytes in the kernel's tty output queue, or -1 if the port can't say.
+int Serial_writer::tty_queued()
+{
+#ifdef WIN32
+	return -1;
+#else
+	return serial_tty_outq(serial_port_->native_handle());
+#endif
+}
+
+// TIOCMIWAIT blocks, so CTS is watched from a thread of its own, which
+// hands each change to the strand.
+void Serial_writer::watch_cts()
+{
+#ifdef WIN32
+	LOG(warning) << "CTS can't be watched on this platform";
+#else
+	int fd = serial_port_->native_handle();
+	int cts = serial_cts(fd);
+	if (cts < 0)
+	{
+		LOG(warning) << "serial port can't report CTS, so it isn't watched";
+		return;
+	}
+	cts_changed(cts != 0);
+	std::thread([me = shared_from_this(), fd]()
+	{
+		for (;;)
+		{
+			int cts = serial_cts_wait(fd);
+			if (cts < 0 && errno == EINTR)
+				continue;
+			if (cts < 0)
+				break;
+			me->service_.post(me->write_strand_.wrap([me, cts]()
+			{
+				me->cts_changed(cts != 0);
+			}));
+		}
+		LOG(warning) << "stopped watching CTS";
+	}).detach();
+#endif
+}
+
+void Serial_writer::cts_changed(bool up)
+{
+	if (up == cts_up_)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	cts_up_ = up;
+	if (!up)
+	{
+		cts_down_since_ = now;
+		cts_stalls_++;
+		return;
+	}
+	cts_stalled_ += now - cts_down_since_;
+	if (pace_wait_in_progress_)
+		pace_timer_.cancel();
+	else if (!write_in_progress_ && !send_packet_queue_.empty())
+		start_packet_send();
+}
+
+std::string Serial_writer::write_summary() const
+{
+	std::ostringstream s;
+	s << frames_per_write_.count << " writes";
+	if (frames_per_write_.count == 0)
+		return s.str();
+	s << ", frames/write mean " << log2_histogram_mean(frames_per_write_)
+		<< " p50 <" << log2_histogram_percentile(frames_per_write_, 0.5)
+		<< " p99 <" << log2_histogram_percentile(frames_per_write_, 0.99)
+		<< ", bytes/write mean " << log2_histogram_mean(bytes_per_write_)
+		<< " p50 <" << log2_histogram_percentile(bytes_per_write_, 0.5)
+		<< " p99 <" << log2_histogram_percentile(bytes_per_write_, 0.99);
+	if (tty_queue_depth_.count > 0)
+		s << ", tty queue p50 <" << log2_histogram_percentile(tty_queue_depth_, 0.5)
+			<< " p99 <" << log2_histogram_percentile(tty_queue_depth_, 0.99)
+			<< " max " << tty_queue_max_;
+	if (cts_stalls_ > 0)
+		s << ", CTS low " << cts_stalls_ << " times for "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(cts_stalled_).count() << " ms";
+	return s.str();
+}
+
+void Serial_writer::reset_write_stats()
+{
+	log2_histogram_reset(frames_per_write_);
+	log2_histogram_reset(bytes_per_write_);
+	log2_histogram_reset(tty_queue_depth_);
+	tty_queue_max_ = 0;
+	cts_stalls_ = 0;
+	cts_stalled_ = std::chrono::steady_clock::duration::zero();
+}
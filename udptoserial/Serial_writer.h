@@ -0,0 +1,244 @@
+#pragma once
+// SERIAL_WRITER - the one place where frames are written to the serial port.
+//
+// Everything bound for the far end goes through here, so that frames from
+// different connections don't interleave on the wire and so that output can
+// be paced.  With auto pacing on, the pacing rate comes from a
+// Rate_controller fed by PROBE frames that the writer sends on its own.
+//
+// Frames wait in pooled packets.  Queuing one only posts to the write
+// strand when nothing else is waiting to be taken, and the port's writes
+// take their handlers' memory from a Handler_pool, so that a steady
+// stream of frames doesn't go to the heap.  Each write gathers every frame that is
+// ready to go, up to a byte budget, and hands the port their SLIP
+// encoding as a list of buffers: runs of the packets themselves, with
+// the delimiters and escapes in between, so nothing is copied.
+//
+// Once frames are in the kernel's tty output queue they can't be
+// reordered or dropped, so the writer only lets a little into it at a
+// time, checked with TIOCOUTQ, and everything else waits in our queue.
+// With RTS/CTS flow control it also stops while the modem holds CTS low.
+//
+// Data frames are timed on their way through: from the stamp their packet
+// got when its data came in to when the writer hands them to the port,
+// and from then until the write completes.  With stamping on, each also
+// goes out inside a STAMP frame that says when it was handed over, and
+// the probes' echoes give the offset between the two ends' clocks that
+// the far end needs to make sense of it.
+//
+// In io_uring mode the gathered writes go through the ring instead, as
+// one WRITEV each, and everything else is the same.
+
+#ifdef WIN32
+#include <sdkddkver.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/serial_port.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "../libhorizr/packet.h"
+#include "../libhorizr/ring.h"
+#include "../libhorizr/histogram.h"
+#include "../libhorizr/slip.h"
+#include "Rate_controller.h"
+#include "Metrics.h"
+#include "Handler_pool.h"
+#include "Uring_io.h"
+
+using namespace boost;
+
+// Something that wants to hear when a frame it queued has been written
+// to the port, so that it can keep track of what is still queued.
+class Send_listener
+{
+public:
+	virtual ~Send_listener() {}
+
+	// LEN is whatever was passed to Serial_writer::send with the frame.
+	virtual void frame_sent(size_t len) = 0;
+};
+
+class Serial_writer
+	: public std::enable_shared_from_this<Serial_writer>
+{
+public:
+	// BAUD_RATE is the UART's rate.  If AUTO_PACING is false, output is
+	// paced at THROTTLE baud, or not paced at all if THROTTLE is zero.
+	// If AUTO_PACING is true, THROTTLE is just the starting guess.
+	// At most TTY_QUEUE bytes are let into the kernel's output queue,
+	// or any number if zero.  If WATCH_CTS is true, writing stops while
+	// CTS is low.  If STAMP_FRAMES is true, TCP and UDP frames go out
+	// inside STAMP frames.
+	Serial_writer(asio::io_service& service, std::shared_ptr<asio::serial_port> sport,
+		uint32_t baud_rate, uint32_t throttle, bool auto_pacing,
+		size_t tty_queue = 0, bool watch_cts = false, bool stamp_frames = false);
+
+	// Start probing the link and watching CTS.  Call once the serial
+	// port is open.
+	void start();
+
+#ifdef U2S_HAVE_IO_URING
+	// Write to the port through RING instead of through the reactor.
+	// Call before start.
+	void use_uring(std::shared_ptr<Uring_io> ring);
+#endif
+
+	// Queue FRAME, a decoded link frame, to be SLIP-encoded and sent.
+	// LISTENER, if given, is told once the frame has been written to the
+	// port, and is handed LEN back.
+	void send(packet frame, std::shared_ptr<Send_listener> listener = nullptr, size_t len = 0);
+
+	// Send FRAME, if any, ahead of everything queued, then stop writing,
+	// and once the port has finished sending, kernel queue included, call
+	// DONE.
+	// Anything queued meanwhile waits for release.  This is how the
+	// port's rate is changed without garbling bytes already on the way.
+	void hold(packet frame, std::function<void()> done);
+
+	// Go again after a hold, with the port now at BAUD_RATE.  Pacing
+	// starts over at the new rate.
+	void release(uint32_t baud_rate);
+
+	// The serial read handler reports every byte it reads, because the
+	// echoes we send back carry a running count.
+	void count_received(size_t bytes) { rx_bytes_ += (uint32_t)bytes; }
+
+	// The serial read handler passes PROBE and PROBE_ECHO frames here.
+	void handle_probe(const uint8_t *frame, size_t len);
+	void handle_probe_echo(const uint8_t *frame, size_t len);
+
+	// Current output rate in bytes per second, or zero if unpaced.
+	uint32_t pacing_rate() const;
+
+	// Bytes of data frames waiting to be written.
+	size_t queued_bytes() const { return queued_bytes_; }
+
+	// About how long a frame queued now would wait behind the frames
+	// already queued, or zero if there are none.
+	std::chrono::microseconds backlog() const;
+	const Rate_controller& rate_controller() const { return rate_; }
+
+	// How far the far end's clock is from ours, once an echo has come
+	// back.  Only kept while auto pacing, which is what sends probes.
+	const struct link_clock& far_clock() const { return far_clock_; }
+
+	// How many frames, and how many bytes, went in each write, and how
+	// deep the kernel's output queue was before each one.
+	const struct log2_histogram& frames_per_write() const { return frames_per_write_; }
+	const struct log2_histogram& bytes_per_write() const { return bytes_per_write_; }
+	const struct log2_histogram& tty_queue_depth() const { return tty_queue_depth_; }
+	std::string write_summary() const;
+	void reset_write_stats();
+
+private:
+	enum class Entry_type {
+		DATA,
+		PROBE_ECHO,
+		PROBE,
+		HOLD
+	};
+
+	// Probes and echoes are only encoded as they go out, since probes are
+	// stamped then.
+	struct Entry {
+		Entry_type type;
+		packet frame;
+		size_t padding;
+		struct link_probe probe;
+		std::shared_ptr<Send_listener> listener;
+		size_t listener_len;
+		// When a data frame was queued, for its sojourn time.
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	void queue_entry(Entry e);
+	void take_incoming();
+	void start_packet_send();
+	void packet_send_done(system::error_code const & error, std::size_t bytes_transferred);
+#ifdef U2S_HAVE_IO_URING
+	void uring_write_done(int res);
+#endif
+	void wait_to_send(std::chrono::steady_clock::time_point when);
+	void wait_for_drain();
+	void set_line_rate(uint32_t baud_rate);
+	int tty_queued();
+	void watch_cts();
+	void cts_changed(bool up);
+	void send_probe_train(size_t count, size_t padding);
+	void probe_timer_handler(system::error_code const & error);
+	void log_rate_if_changed();
+	static uint32_t now_usec();
+
+	asio::io_service& service_;
+	std::shared_ptr<asio::serial_port> serial_port_;
+	asio::io_service::strand write_strand_;
+	asio::steady_timer pace_timer_;
+	asio::steady_timer probe_timer_;
+	asio::steady_timer hold_timer_;
+	ring<Entry> send_packet_queue_;
+	// Data frames queued by send and not yet taken onto the strand.
+	std::mutex incoming_mutex_;
+	ring<Entry> incoming_;
+	// Bytes of data frames queued, counted from whichever thread queues
+	// them.
+	std::atomic<size_t> queued_bytes_;
+
+	// What the write in progress is made of.  The packets are held until
+	// it completes, since the buffers point into them.  Probes and echoes
+	// are encoded into CONTROL_, which never grows while a write is using
+	// it.
+	std::vector<struct slip_segment> segments_;
+	std::vector<asio::const_buffer> write_bufs_;
+	std::vector<packet> in_flight_;
+	std::vector<std::pair<std::shared_ptr<Send_listener>, size_t>> in_flight_listeners_;
+	std::vector<Metric_flow_class> in_flight_classes_;
+	std::chrono::steady_clock::time_point write_started_;
+	Handler_pool handler_pool_;
+#ifdef U2S_HAVE_IO_URING
+	std::shared_ptr<Uring_io> uring_;
+	std::unique_ptr<Uring_write> uring_write_;
+#endif
+	std::vector<uint8_t> control_;
+	size_t control_len_;
+	std::vector<uint8_t> probe_frame_;
+	struct log2_histogram frames_per_write_;
+	struct log2_histogram bytes_per_write_;
+	struct log2_histogram tty_queue_depth_;
+	size_t tty_queue_max_;
+	bool write_in_progress_;
+	bool pace_wait_in_progress_;
+	bool holding_;
+	std::function<void()> hold_done_;
+	std::chrono::steady_clock::time_point next_send_time_;
+
+	size_t tty_queue_limit_;
+	bool watch_cts_;
+	bool cts_up_;
+	std::chrono::steady_clock::time_point cts_down_since_;
+	unsigned cts_stalls_;
+	std::chrono::steady_clock::duration cts_stalled_;
+
+	bool stamp_frames_;
+	struct link_clock far_clock_;
+
+	bool auto_pacing_;
+	uint32_t throttle_;
+	uint32_t line_rate_;
+	uint32_t fixed_rate_;
+	Rate_controller rate_;
+	std::chrono::microseconds probe_interval_;
+	unsigned probe_ticks_;
+	bool busy_since_last_train_;
+	uint32_t logged_rate_;
+	Rate_controller::Mode logged_mode_;
+
+	uint32_t tx_bytes_;
+	uint32_t rx_bytes_;
+	uint16_t probe_seq_;
+};
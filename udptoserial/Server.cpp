@@ -3,7 +3,7 @@
 #include <functional>
 using namespace std::placeholders;
 
-#include <boost/log/trivial.hpp>
+#include "Log.h"
 
 
 // Given a local PORT on which to listen, this
@@ -11,7 +11,7 @@ using namespace std::placeholders;
 // a HANDLER to stand by to receive the next connection.
 void asio_generic_server::add_tcp_server_port(uint16_t port)
 {
-	BOOST_LOG_TRIVIAL(debug) << "Adding new TCP server port " << port;
+	LOG(debug) << "Adding new TCP server port " << port;
 
 	// Let's set up the ASIO acceptor to listen on the TCP server port.
 	// There is only one acceptor per port.
@@ -59,7 +59,7 @@ void asio_generic_server::add_tcp_server_port(uint16_t port)
 	// is why you can't just pair up a port and a handler.
 	//auto handler
 	//	= std::make_shared<Tcp_server_handler>(io_service_);
-	BOOST_LOG_TRIVIAL(debug) << "Adding first handler to new TCP server port " << port;
+	LOG(debug) << "Adding first handler to new TCP server port " << port;
 
 	// Kick off a new handler to stand by to receive the next new
 	// TCP client connection.
@@ -94,7 +94,7 @@ void asio_generic_server::add_tcp_server_port(uint16_t port)
 // a HANDLER to stand by to receive the next connection.
 void asio_generic_server::add_tcp_server_port(uint16_t port)
 {
-	BOOST_LOG_TRIVIAL(debug) << "Adding new TCP server port " << port;
+	LOG(debug) << "Adding new TCP server port " << port;
 
 	// Let's set up the ASIO acceptor to listen on the TCP server port.
 	// There is only one acceptor per port.
@@ -126,7 +126,7 @@ void asio_generic_server::add_tcp_server_port(uint16_t port)
 	// is why you can't just pair up a port and a handler.
 	auto handler
 		= std::make_shared<Tcp_server_handler>(io_service_);
-	BOOST_LOG_TRIVIAL(debug) << "Adding first handler to new TCP server port " << port;
+	LOG(debug) << "Adding first handler to new TCP server port " << port;
 
 	// Kick off a new handler to stand by to receive the next new
 	// TCP client connection.
@@ -159,7 +159,7 @@ void asio_generic_server::serial_read_handler(
   std::size_t bytes_transferred           // Number of bytes read.
 )
 {
-	BOOST_LOG_TRIVIAL(debug) << "serial port got " << bytes_transferred << " bytes";
+	LOG(debug) << "serial port got " << bytes_transferred << " bytes";
 
 	// And queue up the next async read
 	auto handler = std::bind(&asio_generic_server::serial_read_handler, this,
@@ -173,7 +173,7 @@ void asio_generic_server::serial_read_handler(
 void asio_generic_server::add_serial_port (std::string port)
 {
 	using namespace std::placeholders;
-	BOOST_LOG_TRIVIAL(debug) << "Adding new serial port port " << port;
+	LOG(debug) << "Adding new serial port port " << port;
 
 	serial_port_.open(port);
 	serial_port_.set_option(asio::serial_port_base::baud_rate(115200));
@@ -188,7 +188,7 @@ void asio_generic_server::add_serial_port (std::string port)
 #if 0
 void asio_generic_server::add_serial_port(std::string port)
 {
-	BOOST_LOG_TRIVIAL(debug) << "Adding new serial port port " << port;
+	LOG(debug) << "Adding new serial port port " << port;
 
 	asio::serial_port sport(io_service_);
 
@@ -220,7 +220,7 @@ boost::asio::placeholders::bytes_transferred));
 
 void asio_generic_server::start_server()
 {
-	BOOST_LOG_TRIVIAL(debug) << "Calling I/O Service run.";
+	LOG(debug) << "Calling I/O Service run.";
 	io_service_.run();
 }
 
@@ -234,12 +234,12 @@ void asio_generic_server::handle_new_tcp_server_connection(Tcp_server_handler& h
 {
 	if (error)
 	{ 
-		BOOST_LOG_TRIVIAL(error) << error.message();
+		LOG(error) << error.message();
 		return;
 	}
 
 	// Start up the waiting handler.
-	// BOOST_LOG_TRIVIAL(debug) << "Starting handler on TCP server " << handler.socket().remote_endpoint().port() << " -> " << handler.socket().local_endpoint().port();
+	// LOG(debug) << "Starting handler on TCP server " << handler.socket().remote_endpoint().port() << " -> " << handler.socket().local_endpoint().port();
 	// handler.start();
 
 
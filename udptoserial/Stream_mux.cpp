@@ -0,0 +1,357 @@
+#include "Stream_mux.h"
+#include <algorithm>
+#include <sstream>
+#include "Log.h"
+#include "Tcp_server_handler.h"
+#include "Tcp_client_handler.h"
+#include "Usdt.h"
+
+// Channel numbers below this fit in one byte.  New channels go round
+// this range so that a number isn't reused while frames for its last
+// connection might still be crossing the link.
+const static uint16_t SHORT_CHANNELS = 0x80;
+
+// How long a server that failed to connect is assumed to still be dead,
+// and how many such servers to remember.
+const static auto DEAD_ENDPOINT_TIME = std::chrono::seconds(5);
+const static size_t DEAD_ENDPOINT_MAX = 256;
+
+// Flow table ticks are seconds.
+const static auto EXPIRE_INTERVAL = std::chrono::seconds(1);
+
+Stream_mux::Stream_mux(asio::io_service& service, std::shared_ptr<Serial_writer> writer,
+	packet_pool& pool, size_t max_flows, uint32_t idle_timeout,
+	uint32_t coalesce_delay, size_t coalesce_bytes)
+	: service_(service)
+	, serial_writer_(writer)
+	, pool_(pool)
+	, flows_(max_flows)
+	, idle_ticks_(idle_timeout)
+	, expire_timer_(service)
+	, epoch_(std::chrono::steady_clock::now())
+	, opened_count_(0)
+	, next_channel_(0)
+	, coalesce_max_(std::chrono::milliseconds(coalesce_delay))
+	, coalesce_bytes_(coalesce_bytes)
+{
+	log2_histogram_reset(ingress_bytes_);
+	log2_histogram_reset(ingress_reads_);
+}
+
+void Stream_mux::start()
+{
+	expire_timer_.expires_from_now(EXPIRE_INTERVAL);
+	expire_timer_.async_wait(std::bind(&Stream_mux::expire_timer_handler, shared_from_this(), std::placeholders::_1));
+}
+
+std::chrono::microseconds Stream_mux::coalesce_delay(size_t held) const
+{
+	if (coalesce_max_.count() == 0 || held >= coalesce_bytes_)
+		return std::chrono::microseconds(0);
+	return std::min(serial_writer_->backlog(), coalesce_max_);
+}
+
+std::string Stream_mux::ingress_summary() const
+{
+	std::ostringstream s;
+	s << ingress_bytes_.count << " frames, bytes/frame mean " << log2_histogram_mean(ingress_bytes_)
+		<< " p50 <" << log2_histogram_percentile(ingress_bytes_, 0.5)
+		<< " p99 <" << log2_histogram_percentile(ingress_bytes_, 0.99)
+		<< ", reads/frame mean " << log2_histogram_mean(ingress_reads_)
+		<< " p99 <" << log2_histogram_percentile(ingress_reads_, 0.99);
+	return s.str();
+}
+
+void Stream_mux::reset_ingress_stats()
+{
+	log2_histogram_reset(ingress_bytes_);
+	log2_histogram_reset(ingress_reads_);
+}
+
+uint32_t Stream_mux::now_tick() const
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - epoch_).count();
+}
+
+void Stream_mux::expire_timer_handler(system::error_code const & error)
+{
+	if (error)
+		return;
+
+	std::vector<std::pair<struct flow_key, Flow>> expired;
+	flows_.expire(now_tick(), expired);
+	for (auto& e : expired)
+	{
+		Flow& f = e.second;
+		LOG(info) << "stream mux channel " << f.channel << " idle, resetting";
+		forget_channel(f);
+		if (f.server)
+			f.server->reset(MUX_RST_TIMEOUT);
+		else if (f.client)
+			f.client->reset(MUX_RST_TIMEOUT);
+	}
+
+	expire_timer_.expires_from_now(EXPIRE_INTERVAL);
+	expire_timer_.async_wait(std::bind(&Stream_mux::expire_timer_handler, shared_from_this(), std::placeholders::_1));
+}
+
+void Stream_mux::flow_stats(std::vector<struct Flow_stats>& out) const
+{
+	for (uint32_t h = flows_.mru(); h != FLOW_NIL; h = flows_.older(h))
+		out.push_back(Flow_stats{ "tcp", flows_.key_at(h), flows_.at(h).counts });
+}
+
+uint32_t Stream_mux::find_flow(uint16_t channel, bool reply) const
+{
+	const std::vector<uint32_t>& channels = reply ? accepted_ : opened_;
+	if (channel >= channels.size())
+		return FLOW_NIL;
+	return channels[channel];
+}
+
+// Put FLOW in the table under KEY, making room if need be.  A connection
+// already there with the same 4-tuple is stale, since its client has
+// since made a new one from the same port.
+uint32_t Stream_mux::add_flow(const struct flow_key& key, Flow flow)
+{
+	uint32_t old = flows_.find(key);
+	if (old != FLOW_NIL)
+		drop_flow(old, MUX_RST_RESET, true);
+	else if (flows_.full())
+	{
+		LOG(info) << "too many connections, resetting the least recently used";
+		drop_flow(flows_.lru(), MUX_RST_RESET, true);
+	}
+
+	std::vector<uint32_t>& channels = flow.reply ? accepted_ : opened_;
+	uint16_t channel = flow.channel;
+	uint32_t handle = flows_.insert(key, std::move(flow), idle_ticks_, now_tick());
+	if (channel >= channels.size())
+		channels.resize(channel + 1, FLOW_NIL);
+	channels[channel] = handle;
+	return handle;
+}
+
+// Take a flow out of the table and close its connection.  If NOTIFY is
+// true, the far end is sent an RST with REASON.
+void Stream_mux::drop_flow(uint32_t handle, uint8_t reason, bool notify)
+{
+	Flow f = std::move(flows_.at(handle));
+	flows_.erase(handle);
+	forget_channel(f);
+	if (f.server)
+	{
+		if (notify)
+			f.server->reset(reason);
+		else
+			f.server->peer_reset(reason);
+	}
+	else if (f.client)
+	{
+		if (notify)
+			f.client->reset(reason);
+		else
+			f.client->peer_reset(reason);
+	}
+}
+
+// Every way a connection's channel goes away comes through here, so this
+// is where the tcp_close probe fires.
+void Stream_mux::forget_channel(const Flow& flow)
+{
+	USDT(udptoserial, tcp_close, flow.channel, (int)flow.reply);
+	if (flow.reply)
+		accepted_[flow.channel] = FLOW_NIL;
+	else
+	{
+		opened_[flow.channel] = FLOW_NIL;
+		opened_count_--;
+	}
+}
+
+bool Stream_mux::open_channel(std::shared_ptr<Tcp_server_handler> handler, const struct flow_key& key, uint16_t& channel)
+{
+	uint32_t range = opened_count_ < SHORT_CHANNELS ? SHORT_CHANNELS : MUX_CHANNEL_MAX + 1u;
+	if (opened_count_ >= range)
+		return false;
+
+	uint16_t c = next_channel_ % range;
+	while (find_flow(c, false) != FLOW_NIL)
+		c = (c + 1) % range;
+	next_channel_ = (c + 1) % range;
+	channel = c;
+
+	Flow f{ c, false, handler, nullptr };
+	add_flow(key, std::move(f));
+	opened_count_++;
+	return true;
+}
+
+void Stream_mux::close_channel(uint16_t channel, bool reply)
+{
+	uint32_t handle = find_flow(channel, reply);
+	if (handle == FLOW_NIL)
+		return;
+	forget_channel(flows_.at(handle));
+	flows_.erase(handle);
+}
+
+void Stream_mux::send(const struct mux_msg& msg, packet payload, std::shared_ptr<Send_listener> listener)
+{
+	if (!payload)
+		payload = pool_.alloc();
+	size_t len = payload.size();
+	uint32_t handle = find_flow(msg.channel, msg.reply);
+	if (handle != FLOW_NIL)
+	{
+		flows_.touch(handle, now_tick());
+		flows_.at(handle).counts.count(METRIC_TX, len);
+	}
+	mux_encode_header(payload.push(mux_header_len(msg)), msg);
+	serial_writer_->send(std::move(payload), std::move(listener), len);
+}
+
+void Stream_mux::send_rst(uint16_t channel, bool reply, uint8_t reason)
+{
+	struct mux_msg msg {};
+	msg.type = LINK_FRAME_MUX_RST;
+	msg.reply = reply;
+	msg.channel = channel;
+	msg.reason = reason;
+	send(msg);
+}
+
+void Stream_mux::consumed(uint16_t channel, bool reply, struct Mux_flow& flow, size_t len)
+{
+	flow.owed += (uint32_t)len;
+	if (flow.owed < MUX_INITIAL_WINDOW / 2)
+		return;
+
+	struct mux_msg msg {};
+	msg.type = LINK_FRAME_MUX_CREDIT;
+	msg.reply = reply;
+	msg.channel = channel;
+	while (flow.owed > 0)
+	{
+		msg.credit = (uint16_t)std::min<uint32_t>(flow.owed, 0xFFFF);
+		flow.owed -= msg.credit;
+		send(msg);
+	}
+}
+
+void Stream_mux::dispatch(const uint8_t *frame, size_t len)
+{
+	struct mux_msg msg;
+	if (!mux_decode(frame, len, msg))
+	{
+		LOG_EVENT(debug, "Invalid stream mux frame of {} bytes", len);
+		metric_add(link_metrics_.decode_errors + DECODE_BAD_MUX);
+		return;
+	}
+
+	if (msg.reply)
+	{
+		// The far end is answering on a channel we opened.
+		uint32_t handle = find_flow(msg.channel, false);
+		if (handle == FLOW_NIL)
+		{
+			if (msg.type != LINK_FRAME_MUX_RST)
+				send_rst(msg.channel, false, MUX_RST_UNKNOWN_CHANNEL);
+			return;
+		}
+		flows_.touch(handle, now_tick());
+		flows_.at(handle).counts.count(METRIC_RX, msg.len);
+
+		// Hold a reference, since the handler may close its channel.
+		std::shared_ptr<Tcp_server_handler> handler = flows_.at(handle).server;
+
+		if (msg.type == LINK_FRAME_MUX_DATA)
+			handler->deliver(msg.data, msg.len);
+		else if (msg.type == LINK_FRAME_MUX_FIN)
+			handler->peer_fin();
+		else if (msg.type == LINK_FRAME_MUX_RST)
+			handler->peer_reset(msg.reason);
+		else if (msg.type == LINK_FRAME_MUX_CREDIT)
+			handler->peer_credit(msg.credit);
+		else
+		{
+			// Only the opening end may send OPEN.
+			handler->peer_reset(MUX_RST_RESET);
+			send_rst(msg.channel, false, MUX_RST_RESET);
+		}
+	}
+	else if (msg.type == LINK_FRAME_MUX_OPEN)
+		handle_open(msg);
+	else
+	{
+		uint32_t handle = find_flow(msg.channel, true);
+		if (handle == FLOW_NIL)
+		{
+			if (msg.type != LINK_FRAME_MUX_RST)
+				send_rst(msg.channel, true, MUX_RST_UNKNOWN_CHANNEL);
+			return;
+		}
+		flows_.touch(handle, now_tick());
+		flows_.at(handle).counts.count(METRIC_RX, msg.len);
+
+		std::shared_ptr<Tcp_client_handler> handler = flows_.at(handle).client;
+		if (msg.type == LINK_FRAME_MUX_DATA)
+			handler->deliver(msg.data, msg.len);
+		else if (msg.type == LINK_FRAME_MUX_FIN)
+			handler->peer_fin();
+		else if (msg.type == LINK_FRAME_MUX_RST)
+			handler->peer_reset(msg.reason);
+		else if (msg.type == LINK_FRAME_MUX_CREDIT)
+			handler->peer_credit(msg.credit);
+	}
+}
+
+void Stream_mux::endpoint_failed(const asio::ip::tcp::endpoint& server, uint8_t reason)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (dead_endpoints_.size() >= DEAD_ENDPOINT_MAX)
+	{
+		for (auto it = dead_endpoints_.begin(); it != dead_endpoints_.end(); )
+		{
+			if (it->second.until <= now)
+				it = dead_endpoints_.erase(it);
+			else
+				++it;
+		}
+		if (dead_endpoints_.size() >= DEAD_ENDPOINT_MAX)
+			return;
+	}
+	dead_endpoints_[server] = Dead_endpoint{ now + DEAD_ENDPOINT_TIME, reason };
+}
+
+void Stream_mux::handle_open(const struct mux_msg& msg)
+{
+	uint32_t old = find_flow(msg.channel, true);
+	if (old != FLOW_NIL)
+	{
+		// The far end has reused a channel we thought was still open, so
+		// it must have lost track of the old connection.
+		LOG(warning) << "stream mux channel " << msg.channel << " reopened";
+		drop_flow(old, MUX_RST_RESET, false);
+	}
+
+	asio::ip::tcp::endpoint client(asio::ip::address_v4(msg.saddr), msg.sport);
+	asio::ip::tcp::endpoint server(asio::ip::address_v4(msg.daddr), msg.dport);
+
+	auto dead = dead_endpoints_.find(server);
+	if (dead != dead_endpoints_.end())
+	{
+		if (dead->second.until > std::chrono::steady_clock::now())
+		{
+			LOG(debug) << "Not connecting to " << server.address().to_string() << ":" << server.port()
+				<< ", it failed recently: " << mux_rst_reason_string(dead->second.reason);
+			send_rst(msg.channel, true, dead->second.reason);
+			return;
+		}
+		dead_endpoints_.erase(dead);
+	}
+	auto handler = std::make_shared<Tcp_client_handler>(service_, shared_from_this(), msg.channel, client, server);
+	uint32_t handle = add_flow(flow_key_make(msg.saddr, msg.sport, msg.daddr, msg.dport), Flow{ msg.channel, true, nullptr, handler });
+	flows_.at(handle).counts.count(METRIC_RX, msg.len);
+	handler->start(msg.data, msg.len);
+}
@@ -0,0 +1,178 @@
+#pragma once
+// STREAM_MUX - carries proxied TCP connections over the serial link as
+// channels.  See libhorizr/mux.h for the frame format.
+//
+// On the near end, a Tcp_server_handler has accepted a connection from a
+// client and opens a channel for it.  On the far end, the OPEN makes a
+// Tcp_client_handler that connects to the real server.  Channels opened
+// by this end and channels opened by the far end are kept apart, since
+// both ends number their own channels from zero.
+//
+// Every connection, whichever end opened it, is also in a flow table
+// keyed by its 4-tuple.  The table limits how many connections there can
+// be, evicting the least recently used one to make room, and resets
+// connections that have been idle for too long.
+
+#ifdef WIN32
+#include <sdkddkver.h>
+#endif
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "../libhorizr/mux.h"
+#include "../libhorizr/flow_table.h"
+#include "../libhorizr/histogram.h"
+#include "../libhorizr/packet.h"
+#include "Serial_writer.h"
+#include "Handler_pool.h"
+#include "Metrics.h"
+
+using namespace boost;
+
+class Tcp_server_handler;
+class Tcp_client_handler;
+
+// Flow control state for one channel, kept by its handler.
+struct Mux_flow
+{
+	// Bytes the far end will still accept from us.
+	uint32_t send_credit = MUX_INITIAL_WINDOW;
+	// Bytes of ours still waiting for the serial port.
+	size_t queued = 0;
+	// Bytes from the far end that we have passed on but not yet
+	// returned as credit.
+	uint32_t owed = 0;
+};
+
+class Stream_mux
+	: public std::enable_shared_from_this<Stream_mux>
+{
+public:
+	// At most MAX_FLOWS connections are kept, and a connection is reset
+	// after IDLE_TIMEOUT seconds with no traffic either way.  Frames are
+	// built in packets from POOL, which must have at least
+	// MUX_HEADER_MAX bytes of headroom.  Handlers hold small reads for
+	// up to COALESCE_DELAY milliseconds, or until they have
+	// COALESCE_BYTES; see coalesce_delay.
+	Stream_mux(asio::io_service& service, std::shared_ptr<Serial_writer> writer,
+		packet_pool& pool, size_t max_flows, uint32_t idle_timeout,
+		uint32_t coalesce_delay = 0, size_t coalesce_bytes = 0);
+
+	// Handlers read into and queue packets from here too, and take the
+	// memory for their sockets' operations from here.
+	packet_pool& pool() { return pool_; }
+	Handler_pool& handler_pool() { return handler_pool_; }
+
+	// Start the idle timer.
+	void start();
+
+	// Allocate a channel for HANDLER, whose connection is KEY.  Returns
+	// false if all channels are in use.
+	bool open_channel(std::shared_ptr<Tcp_server_handler> handler, const struct flow_key& key, uint16_t& channel);
+
+	// Forget a channel once both directions are finished or it has been
+	// reset.  REPLY says whose channel it is, as in mux_msg.
+	void close_channel(uint16_t channel, bool reply);
+
+	// How many connections are open, either way, and what each has
+	// carried.
+	size_t flows() const { return flows_.size(); }
+	void flow_stats(std::vector<struct Flow_stats>& out) const;
+
+	// Frame MSG and queue it on the serial link.  The header goes in
+	// front of PAYLOAD, which must come from our pool and not be shared;
+	// MSG's data pointer is ignored.  LISTENER, if given, is told the
+	// payload's length once the frame has been written to the port.
+	void send(const struct mux_msg& msg, packet payload = packet(),
+		std::shared_ptr<Send_listener> listener = nullptr);
+	void send_rst(uint16_t channel, bool reply, uint8_t reason);
+
+	// A handler calls this after passing LEN bytes from the far end on
+	// to its TCP socket.  Credit goes back in batches of half a window.
+	void consumed(uint16_t channel, bool reply, struct Mux_flow& flow, size_t len);
+
+	// A handler should stop reading from its TCP socket while it may
+	// not send, or while it already has this much waiting for the port.
+	static bool can_send(const struct Mux_flow& flow)
+	{
+		return flow.send_credit > 0 && flow.queued < QUEUE_LIMIT;
+	}
+	const static size_t QUEUE_LIMIT = 2048;
+
+	// How much longer a handler holding HELD bytes read from its socket
+	// should wait for more before sending them.  Nothing is held while
+	// the serial writer's queue is empty, since a frame sent then goes
+	// out at once.  Otherwise a frame sent now would only wait behind
+	// the queue anyway, so the handler holds on about as long as that,
+	// which is when the link would go idle, up to the configured delay.
+	std::chrono::microseconds coalesce_delay(size_t held) const;
+
+	// A handler calls this as it sends each frame of data it read: LEN
+	// bytes, from READS reads of its socket.
+	void count_ingress(size_t len, size_t reads)
+	{
+		log2_histogram_add(ingress_bytes_, len);
+		log2_histogram_add(ingress_reads_, reads);
+	}
+	std::string ingress_summary() const;
+	const struct log2_histogram& ingress_bytes() const { return ingress_bytes_; }
+	void reset_ingress_stats();
+
+	// The serial read handler passes every stream mux frame here.
+	void dispatch(const uint8_t *frame, size_t len);
+
+	// A Tcp_client_handler calls this when it can't reach SERVER.  For a
+	// while after that, OPENs for SERVER are refused straight away with
+	// the same REASON, rather than each waiting out its own connect.
+	void endpoint_failed(const asio::ip::tcp::endpoint& server, uint8_t reason);
+
+private:
+	struct Flow {
+		uint16_t channel;
+		bool reply;
+		std::shared_ptr<Tcp_server_handler> server;
+		std::shared_ptr<Tcp_client_handler> client;
+		struct Flow_counts counts;
+	};
+
+	void handle_open(const struct mux_msg& msg);
+	uint32_t find_flow(uint16_t channel, bool reply) const;
+	uint32_t add_flow(const struct flow_key& key, Flow flow);
+	void drop_flow(uint32_t handle, uint8_t reason, bool notify);
+	void forget_channel(const Flow& flow);
+	void expire_timer_handler(system::error_code const & error);
+	uint32_t now_tick() const;
+
+	struct Dead_endpoint {
+		std::chrono::steady_clock::time_point until;
+		uint8_t reason;
+	};
+
+	asio::io_service& service_;
+	std::shared_ptr<Serial_writer> serial_writer_;
+	packet_pool& pool_;
+	Handler_pool handler_pool_;
+
+	flow_table<Flow> flows_;
+	uint32_t idle_ticks_;
+	asio::steady_timer expire_timer_;
+	std::chrono::steady_clock::time_point epoch_;
+
+	// Flow handles of the channels this end opened, and of the channels
+	// the far end opened, indexed by channel.
+	std::vector<uint32_t> opened_;
+	std::vector<uint32_t> accepted_;
+	size_t opened_count_;
+	uint16_t next_channel_;
+
+	std::map<asio::ip::tcp::endpoint, Dead_endpoint> dead_endpoints_;
+
+	std::chrono::microseconds coalesce_max_;
+	size_t coalesce_bytes_;
+	struct log2_histogram ingress_bytes_;
+	struct log2_histogram ingress_reads_;
+};
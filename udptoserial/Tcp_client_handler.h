@@ -3,66 +3,50 @@
 #include <sdkddkver.h>
 #endif
 #include <memory>
-#include <deque>
-#include <vector>
 #include <boost/asio.hpp>
 #include <boost/asio/error.hpp>
-#include <boost/log/trivial.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "Log.h"
+#include "Stream_mux.h"
+#include "Tcp_mux_handler.h"
 
 
 using namespace boost;
 using namespace boost::asio::ip;
 
 
+// Handles the far end of a stream mux channel: the connection to the real
+// server, made on behalf of a client on the near end.  Nothing here
+// blocks, so a slow or dead server only holds up its own channel.
 class Tcp_client_handler
-	: public std::enable_shared_from_this<Tcp_client_handler>
+	: public Tcp_mux_handler
 {
 public:
 	Tcp_client_handler(asio::io_service& service,
-        asio::ip::tcp::endpoint& _source,
-        asio::ip::tcp::endpoint& _dest);
+		std::shared_ptr<Stream_mux> mux,
+		uint16_t channel,
+		const asio::ip::tcp::endpoint& _source,
+		const asio::ip::tcp::endpoint& _dest);
 	~Tcp_client_handler();
 
-    // An op so can we match some input packet from the serial
-    // port to this connection. 
-    bool endpoints_match(const asio::ip::tcp::endpoint& _source,
-        const asio::ip::tcp::endpoint& _dest)
-    {
-        return (endpoint_source_orig_ == _source) && (endpoint_dest_orig_ == _dest);
-    }
-    // If we match, send a message to the server.
-    void send_to_server(const std::string& msg);
+	// Start connecting to the server.  DATA, the data that came with the
+	// OPEN, is sent once the connection is up.  If the connection fails,
+	// the near end is sent an RST.
+	void start(const uint8_t *data, size_t len);
 
-    // The async read handler.
-    void read_from_server();
+	// The stream mux calls this when the near end resets the channel.
+	void peer_reset(uint8_t reason);
 
 private:
-
-	boost::asio::ip::tcp::socket& socket()
-	{
-		return socket_;
-	}
-	void start()
+	std::shared_ptr<Tcp_client_handler> self()
 	{
-		read_packet();
+		return std::static_pointer_cast<Tcp_client_handler>(shared_from_this());
 	}
-	void read_packet();
-	void read_packet_done(system::error_code const & error, std::size_t bytes_transferred);
-	void send(std::string msg);
-	void packet_send_done(system::error_code const & error);
-	void start_packet_send();
+	void connect_done(system::error_code const & error);
+	void connect_timer_handler(system::error_code const & error);
+	bool connected() const override { return connected_; }
 
-private:
-
-	void queue_message(std::string message);
-
-	asio::io_service& service_;
-    asio::ip::tcp::endpoint endpoint_source_orig_;
-    asio::ip::tcp::endpoint endpoint_dest_orig_;
-	asio::ip::tcp::socket socket_;
-	asio::io_service::strand write_strand_;
-	asio::streambuf in_packet_;
-	std::deque<std::string> send_packet_queue_;
-	std::shared_ptr<asio::serial_port> serial_port_;
+	asio::ip::tcp::endpoint endpoint_source_orig_;
+	asio::ip::tcp::endpoint endpoint_dest_orig_;
+	bool connected_;
 };
-
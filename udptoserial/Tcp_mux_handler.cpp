@@ -0,0 +1,323 @@
+#include "Tcp_mux_handler.h"
+#include <algorithm>
+#include <cstring>
+
+// The most that one gathered write to the socket takes from the queue.
+const static size_t WRITE_BUDGET = 64 * 1024;
+
+Tcp_mux_handler::Tcp_mux_handler(asio::io_service& service, std::shared_ptr<Stream_mux> mux, uint16_t channel, bool reply)
+	: socket_(service)
+	, mux_(mux)
+	, channel_(channel)
+	, reply_(reply)
+	, fin_sent_(false)
+	, fin_received_(false)
+	, closed_(false)
+	, held_reads_(0)
+	, coalescing_(false)
+	, read_in_progress_(false)
+	, send_packet_queue_(0)
+	, writing_(0)
+	, send_queued_bytes_(0)
+{
+}
+
+void Tcp_mux_handler::start_io()
+{
+	if (!send_packet_queue_.empty())
+		start_packet_send();
+	else if (fin_received_)
+	{
+		system::error_code ec;
+		socket_.shutdown(tcp::socket::shutdown_send, ec);
+	}
+	read();
+}
+
+// Reading stops while the other end has no room for more, or while what
+// we have already read is still waiting for the serial port.  The
+// socket's TCP window then fills up and its sender has to wait.
+//
+// Each read goes straight into a pooled packet, as much as fits behind
+// the headroom.  The stream mux header is pushed in front of it, and the
+// serial writer SLIP-encodes it from there, so the payload is never
+// copied on its way to the port.  The exception is a small read made
+// while an earlier one is being held, which is copied onto the end of
+// that one to go out with it.
+//
+// The socket is read without blocking, and only waited on once it has
+// nothing more, so that a connection waiting for its peer to speak
+// doesn't tie up a packet.
+void Tcp_mux_handler::read()
+{
+	while (!closed_ && connected() && !fin_sent_ && !read_in_progress_ && Stream_mux::can_send(flow_))
+	{
+		in_packet_ = mux_->pool().alloc();
+		size_t len = std::min<size_t>(in_packet_.tailroom(), flow_.send_credit - held_.size());
+		system::error_code ec;
+		size_t n = socket_.read_some(asio::buffer(in_packet_.tail(), len), ec);
+		if (ec == asio::error::would_block)
+		{
+			in_packet_.reset();
+			read_in_progress_ = true;
+			socket_.async_wait(tcp::socket::wait_read, make_custom_alloc_handler(mux_->handler_pool(),
+				[me = shared_from_this()](system::error_code const & ec)
+			{
+				me->read_in_progress_ = false;
+				if (ec && !me->closed_)
+					me->read_done(ec, 0);
+				else
+					me->read();
+			}));
+			return;
+		}
+		read_done(ec, n);
+	}
+}
+
+void Tcp_mux_handler::read_done(system::error_code const & error, std::size_t bytes_transferred)
+{
+	if (closed_)
+		return;
+	if (error == asio::error::eof)
+	{
+		// The socket has finished sending.  It may still want a reply.
+		send_held();
+		in_packet_.reset();
+		send_fin();
+		return;
+	}
+	if (error)
+	{
+		LOG(error) << error.message();
+		reset(MUX_RST_RESET);
+		return;
+	}
+	in_packet_.put(bytes_transferred);
+	if (held_ && held_.tailroom() >= bytes_transferred)
+	{
+		memcpy(held_.put(bytes_transferred), in_packet_.data(), bytes_transferred);
+		in_packet_.reset();
+	}
+	else
+	{
+		send_held();
+		in_packet_.set_stamp(link_now_usec());
+		held_ = std::move(in_packet_);
+	}
+	held_reads_++;
+
+	// What was read is held while the link is busy, until the packet or
+	// the other end's window is full.
+	auto delay = coalesce_delay();
+	if (delay.count() == 0 || held_.tailroom() == 0 || held_.size() >= flow_.send_credit)
+		send_held();
+	else if (!coalescing_)
+	{
+		coalescing_ = true;
+		timer().expires_from_now(delay);
+		timer().async_wait(make_custom_alloc_handler(mux_->handler_pool(),
+			std::bind(&Tcp_mux_handler::coalesce_timer_handler, shared_from_this(), std::placeholders::_1)));
+	}
+}
+
+std::chrono::microseconds Tcp_mux_handler::coalesce_delay() const
+{
+	return mux_->coalesce_delay(held_.size());
+}
+
+void Tcp_mux_handler::send_held()
+{
+	if (coalescing_)
+	{
+		coalescing_ = false;
+		timer_->cancel();
+	}
+	if (!held_)
+		return;
+	mux_->count_ingress(held_.size(), held_reads_);
+	held_reads_ = 0;
+	send_data(std::move(held_));
+}
+
+asio::steady_timer& Tcp_mux_handler::timer()
+{
+	if (!timer_)
+		timer_.reset(new asio::steady_timer(socket_.get_executor()));
+	return *timer_;
+}
+
+void Tcp_mux_handler::release_timer()
+{
+	timer_.reset();
+}
+
+void Tcp_mux_handler::coalesce_timer_handler(system::error_code const & error)
+{
+	if (error || !coalescing_ || closed_)
+		return;
+	coalescing_ = false;
+	send_held();
+	read();
+}
+
+void Tcp_mux_handler::send_data(packet payload)
+{
+	struct mux_msg msg {};
+	msg.type = LINK_FRAME_MUX_DATA;
+	msg.reply = reply_;
+	msg.channel = channel_;
+	send_payload(msg, std::move(payload));
+}
+
+void Tcp_mux_handler::send_fin()
+{
+	struct mux_msg msg {};
+	msg.type = LINK_FRAME_MUX_FIN;
+	msg.reply = reply_;
+	msg.channel = channel_;
+	mux_->send(msg);
+	fin_sent_ = true;
+	maybe_close();
+}
+
+void Tcp_mux_handler::send_payload(struct mux_msg& msg, packet payload)
+{
+	size_t len = payload ? payload.size() : 0;
+	flow_.send_credit -= std::min<uint32_t>(flow_.send_credit, (uint32_t)len);
+	flow_.queued += len;
+	mux_->send(msg, std::move(payload), shared_from_this());
+}
+
+void Tcp_mux_handler::frame_sent(size_t len)
+{
+	flow_.queued -= len;
+	read();
+}
+
+void Tcp_mux_handler::peer_credit(uint16_t credit)
+{
+	flow_.send_credit += credit;
+	read();
+}
+
+// Credit only goes back once the socket has taken what was sent, so the
+// queue can't grow past one window unless the other end ignores its
+// credit, and then the channel is reset.  Anything that arrives before
+// the socket is connected waits in the queue.  DATA is in the serial read
+// buffer, which is reused for the next frame, so it is copied into
+// packets of our own.
+void Tcp_mux_handler::deliver(const uint8_t *data, size_t len)
+{
+	if (closed_ || fin_received_)
+		return;
+	if (send_queued_bytes_ + len > MUX_INITIAL_WINDOW)
+	{
+		LOG(error) << "stream mux channel " << channel_ << " overran its window";
+		reset(MUX_RST_RESET);
+		return;
+	}
+	bool write_in_progress = !send_packet_queue_.empty();
+	send_queued_bytes_ += len;
+	while (len > 0)
+	{
+		packet p = mux_->pool().alloc();
+		size_t n = std::min(len, p.tailroom());
+		memcpy(p.put(n), data, n);
+		data += n;
+		len -= n;
+		send_packet_queue_.push_back(std::move(p));
+	}
+	if (connected() && !write_in_progress)
+		start_packet_send();
+}
+
+// Everything queued goes in one gathered write, straight from the
+// packets, up to WRITE_BUDGET bytes.
+void Tcp_mux_handler::start_packet_send()
+{
+	size_t bytes = 0;
+	write_bufs_.clear();
+	for (writing_ = 0; writing_ < send_packet_queue_.size() && bytes < WRITE_BUDGET; writing_++)
+	{
+		packet& p = send_packet_queue_[writing_];
+		write_bufs_.push_back(asio::const_buffer(p.data(), p.size()));
+		bytes += p.size();
+	}
+	asio::async_write(socket_
+		, Buffer_list(write_bufs_)
+		, make_custom_alloc_handler(mux_->handler_pool(), [me = shared_from_this()]
+		(system::error_code const & ec
+			, std::size_t)
+	{
+		me->packet_send_done(ec);
+	}));
+}
+
+void Tcp_mux_handler::packet_send_done(system::error_code const & error)
+{
+	if (closed_)
+		return;
+	if (error)
+	{
+		LOG(error) << error.message();
+		reset(MUX_RST_RESET);
+		return;
+	}
+	size_t len = 0;
+	for (; writing_ > 0; writing_--)
+	{
+		len += send_packet_queue_.front().size();
+		send_packet_queue_.pop_front();
+	}
+	send_queued_bytes_ -= len;
+	mux_->consumed(channel_, reply_, flow_, len);
+	if (!send_packet_queue_.empty())
+		start_packet_send();
+	else if (fin_received_)
+	{
+		system::error_code ec;
+		socket_.shutdown(tcp::socket::shutdown_send, ec);
+		maybe_close();
+	}
+}
+
+void Tcp_mux_handler::peer_fin()
+{
+	if (closed_)
+		return;
+	fin_received_ = true;
+	if (connected() && send_packet_queue_.empty())
+	{
+		system::error_code ec;
+		socket_.shutdown(tcp::socket::shutdown_send, ec);
+	}
+	maybe_close();
+}
+
+void Tcp_mux_handler::reset(uint8_t reason)
+{
+	if (closed_)
+		return;
+	mux_->send_rst(channel_, reply_, reason);
+	close();
+}
+
+void Tcp_mux_handler::close()
+{
+	closed_ = true;
+	if (timer_)
+		timer_->cancel();
+	system::error_code ec;
+	socket_.close(ec);
+	mux_->close_channel(channel_, reply_);
+}
+
+// Both directions are finished once we have sent FIN and received one,
+// and what the other end sent has all been written to the socket.
+void Tcp_mux_handler::maybe_close()
+{
+	if (closed_ || !fin_sent_ || !fin_received_ || !send_packet_queue_.empty())
+		return;
+	close();
+}
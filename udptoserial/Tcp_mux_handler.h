@@ -0,0 +1,127 @@
+#pragma once
+#ifdef WIN32
+#include <sdkddkver.h>
+#endif
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "Log.h"
+#include "../libhorizr/packet.h"
+#include "../libhorizr/ring.h"
+#include "Stream_mux.h"
+#include "Handler_pool.h"
+
+using namespace boost;
+using namespace boost::asio::ip;
+
+
+// One end of a proxied TCP connection, tied to a stream mux channel: a
+// Tcp_server_handler on the near end, or a Tcp_client_handler on the far
+// end.  Both move data the same way, which is done here.
+//
+// What the socket sends is read straight into pooled packets, leaving
+// room in front for the stream mux header.  A connection that has nothing
+// in flight holds no packets at all, so that tens of thousands of mostly
+// idle ones are cheap.  While the link is busy, several small reads may
+// go into one packet before it is sent; see Stream_mux::coalesce_delay.
+//
+// What the other end sends is queued and written to the socket as it
+// takes it, and credit for it only goes back once it has been written.
+//
+// The socket's reads and writes, and the timer's waits, take their
+// handlers' memory from the stream mux's Handler_pool.
+//
+// A connection has one timer, made when it is first needed: while the
+// connection is being set up, for the subclass, and once it is open, for
+// coalescing.  Set-up lets it go again, so that a connection that has
+// never been busy has no timer at all.
+class Tcp_mux_handler
+	: public std::enable_shared_from_this<Tcp_mux_handler>
+	, public Send_listener
+{
+public:
+	// The stream mux calls these with what the other end sends.
+	void deliver(const uint8_t *data, size_t len);
+	void peer_fin();
+	void peer_credit(uint16_t credit);
+
+	// Close the connection and send the other end an RST with REASON.
+	virtual void reset(uint8_t reason);
+
+	// The serial writer calls this as our frames go out.
+	void frame_sent(size_t len) override;
+
+protected:
+	// REPLY is as in mux_msg: whether the channel was opened by the
+	// other end.
+	Tcp_mux_handler(asio::io_service& service, std::shared_ptr<Stream_mux> mux, uint16_t channel, bool reply);
+	virtual ~Tcp_mux_handler() {}
+
+	// Start moving data both ways, once the socket is connected.
+	void start_io();
+
+	// Send what has been read and held, now.
+	void send_held();
+
+	// Send PAYLOAD as MSG, taking it from the other end's credit.
+	void send_payload(struct mux_msg& msg, packet payload);
+
+	// The connection's timer, made if need be, and letting it go, which
+	// cancels whatever wait it has.
+	asio::steady_timer& timer();
+	void release_timer();
+
+	// Close the socket and forget the channel, without telling the other
+	// end.
+	virtual void close();
+
+	// Whether the socket is connected yet.  Nothing is read or written
+	// before it is.
+	virtual bool connected() const { return true; }
+
+	// How long to hold what has been read before sending it.
+	virtual std::chrono::microseconds coalesce_delay() const;
+
+	// Send PAYLOAD, read from the socket, to the other end, and, once the
+	// socket reaches EOF, FIN.
+	virtual void send_data(packet payload);
+	virtual void send_fin();
+
+	asio::ip::tcp::socket socket_;
+	std::shared_ptr<Stream_mux> mux_;
+	uint16_t channel_;
+	bool reply_;
+	// What has been read and not yet sent.
+	packet held_;
+	struct Mux_flow flow_;
+
+	bool fin_sent_;
+	bool fin_received_;
+	bool closed_;
+
+private:
+	void read();
+	void read_done(system::error_code const & error, std::size_t bytes_transferred);
+	void coalesce_timer_handler(system::error_code const & error);
+	void start_packet_send();
+	void packet_send_done(system::error_code const & error);
+	void maybe_close();
+
+	// The packet being read into, only for as long as the read takes, and
+	// how many reads have gone into what is held.
+	packet in_packet_;
+	size_t held_reads_;
+	std::unique_ptr<asio::steady_timer> timer_;
+	bool coalescing_;
+	bool read_in_progress_;
+
+	// What the other end has sent that the socket hasn't taken yet.
+	ring<packet> send_packet_queue_;
+	// The packets at the front of the queue that are being written.
+	std::vector<asio::const_buffer> write_bufs_;
+	size_t writing_;
+	size_t send_queued_bytes_;
+};
@@ -1,142 +1,117 @@
 #include "Tcp_server_handler.h"
-#include "IPv4.h"
-#include "../libhorizr/slip.h"
+#include "Usdt.h"
 
-void serial_port_send(std::string binary_string);
+// The OPEN for a new connection carries the client's first data.  If the
+// client doesn't say anything for this long, the OPEN goes without it, so
+// that protocols where the server speaks first still work.
+const static auto OPEN_DELAY = std::chrono::milliseconds(100);
 
-Tcp_server_handler::Tcp_server_handler(asio::io_service & service, std::shared_ptr<asio::serial_port> sport)
-	: service_(service)
-	, socket_(service)
-	, write_strand_(service)
-	, serial_port_(sport)
+Tcp_server_handler::Tcp_server_handler(asio::io_service & service, std::shared_ptr<Stream_mux> mux, uint32_t remote_addr)
+	: Tcp_mux_handler(service, mux, 0, false)
+	, remote_addr_(remote_addr)
+	, open_sent_(false)
 {
-	BOOST_LOG_TRIVIAL(debug) << "tcp server handler constructed";
+	LOG_EVENT(debug, "tcp server handler constructed");
 }
 
 Tcp_server_handler::~Tcp_server_handler()
 {
-	puts("tcp server handler destructed");
+	LOG_EVENT(debug, "tcp server handler destructed");
 }
 
-void Tcp_server_handler::read_packet()
+// The client may already have gone by the time we get here, in which case
+// there is nothing to do.
+void Tcp_server_handler::start()
 {
-	BOOST_LOG_TRIVIAL(debug) << "read_packet called";
-	asio::async_read_until(socket_,
-		in_packet_,
-		"",  // Not waiting on any specific delimiter: send what you got.
-		[me = shared_from_this()]
-	(system::error_code const & ec
-		, std::size_t bytes_xfer)
+	system::error_code ec;
+	auto client = socket_.remote_endpoint(ec);
+	auto local = ec ? asio::ip::tcp::endpoint() : socket_.local_endpoint(ec);
+	if (!ec)
+		socket_.non_blocking(true, ec);
+	if (ec)
 	{
-
-		me->read_packet_done(ec, bytes_xfer);
-	});
-}
-
-
-
-void Tcp_server_handler::read_packet_done(system::error_code const & error, std::size_t bytes_transferred)
-{
-	if (error)
-	{ 
-		BOOST_LOG_TRIVIAL(error) << error.message();
+		closed_ = true;
+		socket_.close(ec);
 		return;
 	}
-	std::istream stream(&in_packet_);
-	std::string packet_string;
-	stream >> packet_string;
-	BOOST_LOG_TRIVIAL(debug) << "received packet "<< socket_.remote_endpoint().address() << ":" << socket_.remote_endpoint().port() << " -> " << socket_.local_endpoint().address() << ":" << socket_.local_endpoint().port();
-
-	// Now we prep this for transmission, using the following mapping.
-	// From our point of view, this socket is local_address:server_port.
-	// It is a forwarder for a server on destination_address:server_port.
-	// It received a packet from remote_address:client_port.
-	// The packet's SOURCE is remote_address:client_port.
-	// The packet's DEST is local_address:server_port.
-
-	// When we construct a forwarding packet
-	// That packet's SOURCE is remote_address:client_port
-	// That packet's DEST is destination_address:server_port
-
-	// destination_address is from the .ini file 
-	struct ip4_hdr iphdr;
-	struct tcp_hdr tcphdr;
-	ip4_tcp_headers_default_set(&iphdr, &tcphdr,
-		htonl(socket_.remote_endpoint().address().to_v4().to_ulong()),
-		htons(socket_.remote_endpoint().port()),
-		htonl(remote_addr_BE_),
-		htons(socket_.local_endpoint().port()),
-		(uint8_t *)packet_string.c_str(), packet_string.size());
-	uint8_t *binary_msg = (uint8_t *)malloc(sizeof (iphdr) + sizeof(tcphdr) + packet_string.size());
-	memcpy(binary_msg, &iphdr, sizeof(iphdr));
-	memcpy(binary_msg + sizeof(iphdr), &tcphdr, sizeof(tcphdr));
-	memcpy(binary_msg + sizeof(iphdr) + sizeof(tcphdr), packet_string.c_str(), packet_string.size());
-	std::string binary_str((char *)binary_msg, sizeof(iphdr) + sizeof(tcphdr) + packet_string.size());
-	free(binary_msg);
-	printf("----\n");
-	for (auto c : binary_str)
-	{
-		printf("%02x ", (unsigned)c);
-	}
-	printf("\n");
-	for (auto c : binary_str)
+	key_ = flow_key_make(client.address().to_v4().to_ulong(), client.port(), remote_addr_, local.port());
+	if (!mux_->open_channel(self(), key_, channel_))
 	{
-		if (c < 32)
-			printf("^%c",c+64);
-		else
-			printf("%c", c);
+		LOG(error) << "no free stream mux channels, dropping connection from "
+			<< client.address() << ":" << client.port();
+		closed_ = true;
+		socket_.close(ec);
+		return;
 	}
-	printf("\n");
-	std::vector<uint8_t> source;
-	for (auto x: binary_str)
-		source.push_back((uint8_t)x);
-	std::vector<uint8_t> dest;
-    slip_encode(dest, source, true);	
-	std::string dest_str;
-	for (auto x: dest)
-		dest_str.push_back(x);
-	send(dest_str);
-	read_packet();
+	USDT(udptoserial, tcp_accept, channel_, (uint32_t)client.address().to_v4().to_ulong(), client.port(), local.port());
+	timer().expires_from_now(OPEN_DELAY);
+	timer().async_wait(std::bind(&Tcp_server_handler::open_timer_handler, self(), std::placeholders::_1));
+	start_io();
 }
 
-void Tcp_server_handler::send(std::string msg)
+// The client's first data goes with the OPEN straight away.  After that,
+// it is held while the link is busy.
+std::chrono::microseconds Tcp_server_handler::coalesce_delay() const
 {
-	service_.post(write_strand_.wrap([me = shared_from_this(), msg]()
-	{
-		me->queue_message(msg);
-	}));
+	return open_sent_ ? Tcp_mux_handler::coalesce_delay() : std::chrono::microseconds(0);
 }
 
+void Tcp_server_handler::send_data(packet payload)
+{
+	if (!open_sent_)
+		send_open(std::move(payload));
+	else
+		Tcp_mux_handler::send_data(std::move(payload));
+}
 
-void Tcp_server_handler::packet_send_done(system::error_code const & error)
+// A client that finishes without saying anything still gets its OPEN,
+// since it may want a reply.
+void Tcp_server_handler::send_fin()
 {
-	if (!error)
-	{
-		send_packet_queue_.pop_front();
-		if (!send_packet_queue_.empty()) { start_packet_send(); }
-	}
+	if (!open_sent_)
+		send_open(packet());
+	Tcp_mux_handler::send_fin();
 }
 
-void Tcp_server_handler::start_packet_send()
+// The channel is mapped onto a 4-tuple once, here.  From our point of
+// view, this socket is local_address:server_port, and it is a forwarder
+// for a server on remote_address:server_port, where remote_address is
+// from the .ini file.  The far end connects there on the client's behalf.
+void Tcp_server_handler::send_open(packet payload)
 {
-	send_packet_queue_.front() += "\0";
-	async_write(*serial_port_
-		, asio::buffer(send_packet_queue_.front())
-		, write_strand_.wrap([me = shared_from_this()]
-		(system::error_code const & ec
-			, std::size_t)
-	{
-		me->packet_send_done(ec);
-	}
-	));
+	release_timer();
+	struct mux_msg msg {};
+	msg.type = LINK_FRAME_MUX_OPEN;
+	msg.channel = channel_;
+	msg.saddr = (uint32_t)(key_.addrs >> 32);
+	msg.sport = (uint16_t)(key_.ports >> 16);
+	msg.daddr = remote_addr_;
+	msg.dport = (uint16_t)key_.ports;
+	send_payload(msg, std::move(payload));
+	open_sent_ = true;
 }
 
-void Tcp_server_handler::queue_message(std::string message)
+void Tcp_server_handler::open_timer_handler(system::error_code const & error)
 {
-	bool write_in_progress = !send_packet_queue_.empty();
-	send_packet_queue_.push_back(std::move(message));
-	if (!write_in_progress)
-	{
-		start_packet_send();
-	}
-}
\ No newline at end of file
+	if (error || open_sent_ || closed_)
+		return;
+	send_open(packet());
+}
+
+void Tcp_server_handler::peer_reset(uint8_t reason)
+{
+	if (closed_)
+		return;
+	LOG(info) << "stream mux channel " << channel_ << " reset by far end: " << mux_rst_reason_string(reason);
+	close();
+}
+
+void Tcp_server_handler::reset(uint8_t reason)
+{
+	if (closed_)
+		return;
+	if (open_sent_)
+		Tcp_mux_handler::reset(reason);
+	else
+		close();
+}
@@ -3,46 +3,53 @@
 #include <sdkddkver.h>
 #endif
 #include <memory>
-#include <deque>
 #include <boost/asio.hpp>
-#include <boost/asio/error.hpp>
-#include <boost/log/trivial.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "Log.h"
+#include "../libhorizr/packet.h"
+#include "Stream_mux.h"
+#include "Tcp_mux_handler.h"
 
 using namespace boost;
 using namespace boost::asio::ip;
 
 
+// Handles a connection from a client on the near end.  What the client
+// sends goes over the link on a stream mux channel, to be forwarded to
+// the server at REMOTE_ADDR on the far end.  The channel is opened by the
+// OPEN that carries the client's first data.
 class Tcp_server_handler
-	: public std::enable_shared_from_this<Tcp_server_handler>
+	: public Tcp_mux_handler
 {
 public:
-	Tcp_server_handler(asio::io_service& service, std::shared_ptr<asio::serial_port> sport) ;
+	Tcp_server_handler(asio::io_service& service, std::shared_ptr<Stream_mux> mux, uint32_t remote_addr) ;
 	~Tcp_server_handler();
 
 	boost::asio::ip::tcp::socket& socket()
 	{
 		return socket_;
 	}
-	void start()
-	{
-		read_packet();
-	}
-	void read_packet();
-	void read_packet_done(system::error_code const & error, std::size_t bytes_transferred);
-	void send(std::string msg);
-	void packet_send_done(system::error_code const & error);
-	void start_packet_send();
+	void start();
 
-private:
+	// The stream mux calls this when the far end resets the channel.
+	void peer_reset(uint8_t reason);
 
-	void queue_message(std::string message);
+	// Close the connection and, if the far end knows of it, send an RST
+	// with REASON.
+	void reset(uint8_t reason) override;
 
-	asio::io_service& service_;
-	asio::ip::tcp::socket socket_;
-	asio::io_service::strand write_strand_;
-	asio::streambuf in_packet_;
-	std::deque<std::string> send_packet_queue_;
-	uint32_t remote_addr_BE_;
-	std::shared_ptr<asio::serial_port> serial_port_;
+private:
+	std::shared_ptr<Tcp_server_handler> self()
+	{
+		return std::static_pointer_cast<Tcp_server_handler>(shared_from_this());
+	}
+	void send_open(packet payload);
+	void open_timer_handler(system::error_code const & error);
+	std::chrono::microseconds coalesce_delay() const override;
+	void send_data(packet payload) override;
+	void send_fin() override;
+
+	uint32_t remote_addr_;
+	struct flow_key key_;
+	bool open_sent_;
 };
-
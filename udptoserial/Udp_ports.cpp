@@ -1,140 +1,502 @@
 #include "Udp_ports.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "Log.h"
 
+// The largest datagram we will forward.
+const static size_t UDP_PACKET_MAX = 65536;
 
-Udp_ports::Udp_ports()
-	: port_map{}
+// Read at most this many datagrams from one socket before letting others
+// have a turn.
+const static int READS_PER_WAKEUP = 16;
+
+// Flow table ticks are seconds.
+const static auto EXPIRE_INTERVAL = std::chrono::seconds(1);
+
+#ifdef U2S_HAVE_IO_URING
+// In io_uring mode, datagrams are received into this many of the ring's
+// buffers, each big enough for the largest after the header the kernel
+// puts in front and the sender's address.
+const static unsigned URING_RECV_BUFFERS = 16;
+const static size_t URING_RECV_BUFFER_SIZE = sizeof(struct io_uring_recvmsg_out)
+	+ sizeof(struct sockaddr_in) + UDP_PACKET_MAX;
+
+// A socket's multishot receive on the ring.  The ring only knows it by
+// a plain pointer, so while it is there it holds on to itself, and so to
+// the Udp_ports, until its last completion.
+class Udp_ports::Ring_receiver
+	: public Uring_handler
+	, public std::enable_shared_from_this<Ring_receiver>
 {
-	hostent* localHost;
+public:
+	Ring_receiver(std::shared_ptr<Udp_ports> ports, Socket_ptr sock, uint16_t port, struct flow_key key, bool session)
+		: ports_(ports)
+		, sock_(sock)
+		, port_(port)
+		, key_(key)
+		, session_(session)
+	{
+	}
 
-	localHost = gethostbyname("");
-	//localIP = inet_ntoa(*(struct in_addr *)*localHost->h_addr_list);
-}
+	void start()
+	{
+		self_ = shared_from_this();
+		ports_->uring_->recvmsg_multishot(sock_->native_handle(), this);
+	}
+
+	void stop()
+	{
+		if (self_)
+			ports_->uring_->cancel(this);
+	}
 
-Udp_ports::Udp_ports(std::string _local_ip, std::string _remote_ip, std::vector<uint16_t> _port_numbers)
-	: port_map{},
-	default_local_ip{ _local_ip }
-	//default_remove_ip{ _remote_ip }
+	void completed(const struct io_uring_cqe& cqe) override;
+
+private:
+	std::shared_ptr<Udp_ports> ports_;
+	Socket_ptr sock_;
+	uint16_t port_;
+	struct flow_key key_;
+	bool session_;
+	std::shared_ptr<Ring_receiver> self_;
+};
+
+void Udp_ports::Ring_receiver::completed(const struct io_uring_cqe& cqe)
 {
-	for (auto n : _port_numbers)
-		port_map.emplace(n, 0);
+	Uring_io& ring = *ports_->uring_;
+	Uring_io::Datagram d;
+	if (ring.datagram(cqe, d))
+	{
+		if (session_)
+		{
+			uint32_t handle = ports_->sessions_.find(key_);
+			if (handle != FLOW_NIL)
+				ports_->sessions_.touch(handle, ports_->now_tick());
+			ports_->session_received(key_, handle, d.data, d.len);
+		}
+		else if (d.from->sin_family == AF_INET)
+			ports_->port_received(port_, ntohl(d.from->sin_addr.s_addr), ntohs(d.from->sin_port), d.data, d.len);
+	}
+	ring.recycle(cqe);
+	if (cqe.flags & IORING_CQE_F_MORE)
+		return;
+
+	// The receive is over.  It starts again unless the socket is being
+	// closed, or the kernel can't do it, in which case the socket goes
+	// back to waiting in the reactor.  Most other errors are an ICMP
+	// port unreachable from an earlier send.
+	auto me = std::move(self_);
+	if (cqe.res == -ECANCELED || !sock_->is_open())
+		return;
+	if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)
+	{
+		LOG(warning) << "UDP port " << port_ << " can't receive through io_uring, so it waits instead: "
+			<< strerror(-cqe.res);
+		if (session_)
+			ports_->wait_session(sock_, key_);
+		else
+			ports_->wait_port(sock_, port_);
+		return;
+	}
+	if (cqe.res < 0 && cqe.res != -ENOBUFS)
+		LOG(debug) << "UDP " << (session_ ? "session" : "port") << ": " << strerror(-cqe.res);
+	start();
 }
+#endif
 
+Udp_ports::Udp_ports(asio::io_service& service, std::shared_ptr<Serial_writer> writer,
+	packet_pool& pool, packet_pool& big_pool,
+	uint32_t remote_addr, std::vector<uint16_t> port_numbers,
+	size_t max_sessions, uint32_t idle_timeout,
+	uint32_t batch_delay, size_t batch_bytes)
+	: service_(service)
+	, serial_writer_(writer)
+	, pool_(pool)
+	, big_pool_(big_pool)
+	, remote_addr_(remote_addr)
+	, port_numbers_(port_numbers)
+	, sessions_(max_sessions)
+	, idle_ticks_(idle_timeout)
+	, expire_timer_(service)
+	, epoch_(std::chrono::steady_clock::now())
+	, recv_buffer_(UDP_PACKET_MAX)
+	, batch_delay_(std::chrono::milliseconds(batch_delay))
+	, batch_bytes_(std::min(batch_bytes, pool.capacity()))
+	, batch_count_(0)
+	, batch_timer_(service)
+	, batch_waiting_(false)
+{
+}
 
 Udp_ports::~Udp_ports()
 {
-	for (auto& s : port_map)
-		closesocket(s.second);
-	port_map.clear();
+	close();
 }
 
-static void throw_win32_sock_error(const char *func_name)
+#ifdef U2S_HAVE_IO_URING
+void Udp_ports::use_uring(std::shared_ptr<Uring_io> ring)
 {
-	// Retrieve the system error message for the last-error code
-	// and throw an exception.
+	if (ring->provide_buffers(URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE))
+		uring_ = ring;
+}
+#endif
 
-	const size_t message_len_max = 8 * 1024;
-	char system_message[message_len_max];
-	char output_message[message_len_max];
-	int dw = WSAGetLastError();
+void Udp_ports::open()
+{
+	for (auto port : port_numbers_)
+	{
+		LOG(debug) << "Adding new UDP port " << port;
+		auto sock = std::make_shared<asio::ip::udp::socket>(service_);
+		sock->open(asio::ip::udp::v4());
+		sock->set_option(asio::ip::udp::socket::reuse_address(true));
+		sock->bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), port));
+		sock->non_blocking(true);
+		ports_[port] = sock;
+		receive_port(sock, port);
+	}
 
-	FormatMessageA(
-		FORMAT_MESSAGE_FROM_SYSTEM |
-		FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL,
-		dw,
-		MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-		system_message,
-		message_len_max, NULL);
+	expire_timer_.expires_from_now(EXPIRE_INTERVAL);
+	expire_timer_.async_wait(std::bind(&Udp_ports::expire_timer_handler, shared_from_this(), std::placeholders::_1));
+}
 
-	// Display the error message and exit the process
-	snprintf(output_message, message_len_max, "%s failed with error %d: %s", func_name, dw, system_message);
-	throw std::exception(output_message);
+void Udp_ports::close()
+{
+	system::error_code ec;
+#ifdef U2S_HAVE_IO_URING
+	for (auto& r : port_receivers_)
+		r->stop();
+	port_receivers_.clear();
+#endif
+	for (auto& p : ports_)
+		p.second->close(ec);
+	ports_.clear();
+	while (sessions_.lru() != FLOW_NIL)
+		close_session(sessions_.lru());
+	expire_timer_.cancel(ec);
+	batch_timer_.cancel(ec);
+	batch_.reset();
 }
 
-void Udp_ports::open()
+uint32_t Udp_ports::now_tick() const
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - epoch_).count();
+}
+
+// Start taking datagrams from one of our ports, through the ring if
+// there is one.
+void Udp_ports::receive_port(Socket_ptr sock, uint16_t port)
+{
+#ifdef U2S_HAVE_IO_URING
+	if (uring_)
+	{
+		auto r = std::make_shared<Ring_receiver>(shared_from_this(), sock, port, flow_key{}, false);
+		port_receivers_.push_back(r);
+		r->start();
+		return;
+	}
+#endif
+	wait_port(sock, port);
+}
+
+void Udp_ports::wait_port(Socket_ptr sock, uint16_t port)
+{
+	sock->async_wait(asio::ip::udp::socket::wait_read,
+		std::bind(&Udp_ports::port_readable, shared_from_this(), sock, port, std::placeholders::_1));
+}
+
+void Udp_ports::port_readable(Socket_ptr sock, uint16_t port, system::error_code const & error)
 {
-	for (auto p : port_map)
+	if (error)
+		return;
+
+	for (int i = 0; i < READS_PER_WAKEUP; i++)
 	{
-		SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-		if (sock == INVALID_SOCKET)
+		asio::ip::udp::endpoint sender;
+		system::error_code ec;
+		size_t len = sock->receive_from(asio::buffer(recv_buffer_), sender, 0, ec);
+		if (ec == asio::error::would_block)
+			break;
+		if (ec)
 		{
-			std::string errmsg = "Opening socket for port " + p.first;
-			throw_win32_sock_error(errmsg.c_str());
+			LOG(debug) << "UDP port " << port << ": " << ec.message();
+			continue;
 		}
+		if (!sender.address().is_v4())
+			continue;
+		port_received(port, sender.address().to_v4().to_ulong(), sender.port(), recv_buffer_.data(), len);
+	}
+	wait_port(sock, port);
+}
+
+// A client on this end has sent to one of our ports.
+void Udp_ports::port_received(uint16_t port, uint32_t caddr, uint16_t cport, const uint8_t *data, size_t len)
+{
+	struct link_udp dgram {};
+	dgram.caddr = caddr;
+	dgram.cport = cport;
+	dgram.saddr = remote_addr_;
+	dgram.sport = port;
+	dgram.data = data;
+	dgram.len = len;
+	send_frame(dgram);
+}
 
-		unsigned long mode = 1;
-		int result = ioctlsocket(sock, FIONBIO, &mode);
-		if (result == SOCKET_ERROR)
+// A datagram that would leave too little room in a batch for another
+// goes on its own, and so does one that would have to wait for nothing.
+void Udp_ports::send_frame(const struct link_udp& dgram)
+{
+	if (batch_delay_.count() == 0 || 1 + LINK_UDP_BATCH_DESC_MAX + dgram.len > batch_bytes_ / 2)
+	{
+		send_batch();
+		send_single(dgram);
+		return;
+	}
+	if (batch_ && (batch_last_.reply != dgram.reply
+		|| batch_.size() + LINK_UDP_BATCH_DESC_MAX + dgram.len > batch_bytes_))
+		send_batch();
+	if (!batch_)
+	{
+		auto delay = std::min(serial_writer_->backlog(), batch_delay_);
+		if (delay.count() == 0)
 		{
-			std::string errmsg = "Setting non-blocking mode for for port " + p.first;
-			throw_win32_sock_error(errmsg.c_str());
+			send_single(dgram);
+			return;
 		}
-		struct sockaddr_in name;
-		memset(&name, 0, sizeof(struct sockaddr_in));
-		name.sin_family = AF_INET;
-		name.sin_port = htons(p.first);
-		name.sin_addr.s_addr = htonl(INADDR_ANY);
-
-		int bound = bind(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in));
-		if (bound == SOCKET_ERROR)
+		batch_ = pool_.alloc();
+		batch_.set_stamp(link_now_usec());
+		*batch_.put(1) = LINK_FRAME_UDP_BATCH | (dgram.reply ? LINK_FRAME_UDP_REPLY : 0);
+		batch_count_ = 0;
+		batch_waiting_ = true;
+		batch_timer_.expires_from_now(delay);
+		batch_timer_.async_wait(std::bind(&Udp_ports::batch_timer_handler, shared_from_this(), std::placeholders::_1));
+	}
+
+	size_t n = link_udp_batch_encode_desc(batch_.tail(), dgram, batch_count_ > 0 ? &batch_last_ : nullptr);
+	batch_.put(n);
+	memcpy(batch_.put(dgram.len), dgram.data, dgram.len);
+	batch_last_ = dgram;
+	batch_count_++;
+	if (batch_.size() + LINK_UDP_BATCH_DESC_MAX >= batch_bytes_)
+		send_batch();
+}
+
+void Udp_ports::send_batch()
+{
+	if (batch_waiting_)
+	{
+		batch_waiting_ = false;
+		batch_timer_.cancel();
+	}
+	if (batch_)
+		serial_writer_->send(std::move(batch_));
+}
+
+void Udp_ports::batch_timer_handler(system::error_code const & error)
+{
+	if (error || !batch_waiting_)
+		return;
+	batch_waiting_ = false;
+	send_batch();
+}
+
+void Udp_ports::send_single(const struct link_udp& dgram)
+{
+	packet frame = (dgram.len <= pool_.capacity() ? pool_ : big_pool_).alloc();
+	frame.set_stamp(link_now_usec());
+	memcpy(frame.put(dgram.len), dgram.data, dgram.len);
+	link_udp_encode_header(frame.push(LINK_UDP_HEADER_LEN), dgram);
+	serial_writer_->send(std::move(frame));
+}
+
+void Udp_ports::send_packet(const uint8_t *frame, size_t len)
+{
+	struct link_udp dgram;
+	if (link_frame_type(frame, len) == LINK_FRAME_UDP_BATCH)
+	{
+		struct link_udp_batch batch;
+		link_udp_batch_begin(batch, frame, len);
+		while (link_udp_batch_next(batch, dgram))
+			forward(dgram);
+		if (batch.error)
 		{
-			std::string errmsg = "Binding socket for port " + p.first;
-			throw_win32_sock_error(errmsg.c_str());
+			LOG_EVENT(debug, "Invalid UDP batch frame of {} bytes", len);
+			metric_add(link_metrics_.decode_errors + DECODE_BAD_UDP);
 		}
+		return;
+	}
+	if (!link_udp_decode(frame, len, dgram))
+	{
+		LOG_EVENT(debug, "Invalid UDP frame of {} bytes", len);
+		metric_add(link_metrics_.decode_errors + DECODE_BAD_UDP);
+		return;
+	}
+	forward(dgram);
+}
+
+void Udp_ports::forward(const struct link_udp& dgram)
+{
+	if (dgram.reply)
+		forward_to_client(dgram);
+	else
+		forward_to_server(dgram);
+}
+
+// A datagram from a server on the far end, going back to our client.  It
+// goes out from the port the client sent to, so it looks like it came
+// straight from the server.
+void Udp_ports::forward_to_client(const struct link_udp& dgram)
+{
+	auto search = ports_.find(dgram.sport);
+	if (search == ports_.end())
+		return;
+	asio::ip::udp::endpoint client(asio::ip::address_v4(dgram.caddr), dgram.cport);
+	system::error_code ec;
+	search->second->send_to(asio::buffer(dgram.data, dgram.len), client, 0, ec);
+	if (ec)
+		LOG(debug) << "UDP send to " << client.address().to_string() << ":" << client.port()
+			<< ": " << ec.message();
+}
+
+// A datagram from a client on the near end, for a server on this end.
+void Udp_ports::forward_to_server(const struct link_udp& dgram)
+{
+	struct flow_key key = flow_key_make(dgram.caddr, dgram.cport, dgram.saddr, dgram.sport);
+	uint32_t handle = sessions_.find(key);
+	if (handle == FLOW_NIL)
+	{
+		if (sessions_.full())
+			close_session(sessions_.lru());
 
-		// Add the newly opened port to the hash table.
-		port_map[p.first] = sock;
+		asio::ip::udp::endpoint server(asio::ip::address_v4(dgram.saddr), dgram.sport);
+		auto sock = std::make_shared<asio::ip::udp::socket>(service_);
+		system::error_code ec;
+		sock->open(asio::ip::udp::v4(), ec);
+		if (!ec)
+			sock->non_blocking(true, ec);
+		if (!ec)
+			sock->connect(server, ec);
+		if (ec)
+		{
+			LOG(error) << "UDP session to " << server.address().to_string() << ":" << server.port()
+				<< ": " << ec.message();
+			return;
+		}
+		LOG(debug) << "New UDP session "
+			<< asio::ip::address_v4(dgram.caddr).to_string() << ":" << dgram.cport
+			<< " -> " << server.address().to_string() << ":" << server.port()
+			<< " from local port " << sock->local_endpoint().port();
+		handle = sessions_.insert(key, Session{ sock }, idle_ticks_, now_tick());
+		receive_session(sock, key, handle);
 	}
+	else
+		sessions_.touch(handle, now_tick());
+
+	Session& session = sessions_.at(handle);
+	session.counts.count(METRIC_RX, dgram.len);
+	system::error_code ec;
+	session.socket->send(asio::buffer(dgram.data, dgram.len), 0, ec);
+	if (ec)
+		LOG(debug) << "UDP send: " << ec.message();
 }
 
-void Udp_ports::send_packet(udp_packet & P)
+void Udp_ports::receive_session(Socket_ptr sock, struct flow_key key, uint32_t handle)
 {
-	// Hopefully, this packet comes from a known port.
-	auto search = port_map.find(P.source_port);
-	if (search != port_map.end())
+#ifdef U2S_HAVE_IO_URING
+	if (uring_)
 	{
-		static sockaddr_in addr;
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(P.dest_port);
-		//addr.sin_addr.s_addr = inet_addr(localIP);
-		std::vector<uint8_t> bytes = P.to_bytes();
-		sendto(search->second, (const char*)bytes.data(), bytes.size(), 0, (const sockaddr *)&addr, sizeof(sockaddr_in));
+		auto r = std::make_shared<Ring_receiver>(shared_from_this(), sock, 0, key, true);
+		sessions_.at(handle).receiver = r;
+		r->start();
+		return;
 	}
+#endif
+	wait_session(sock, key);
 }
 
+void Udp_ports::wait_session(Socket_ptr sock, struct flow_key key)
+{
+	sock->async_wait(asio::ip::udp::socket::wait_read,
+		std::bind(&Udp_ports::session_readable, shared_from_this(), sock, key, std::placeholders::_1));
+}
 
-std::vector<uint8_t> Udp_ports::recv_bytes()
+void Udp_ports::session_readable(Socket_ptr sock, struct flow_key key, system::error_code const & error)
 {
-	char buf[1500];
-	struct sockaddr_in inaddr;
-	int addrlen = sizeof(inaddr);
-	SSIZE_T bytes_received;
-	std::vector<uint8_t> output;
+	if (error || !sock->is_open())
+		return;
 
-	for (auto P : port_map)
-	{
-		u_long count = 0;
+	uint32_t handle = sessions_.find(key);
+	if (handle != FLOW_NIL)
+		sessions_.touch(handle, now_tick());
 
-		int ret = ioctlsocket(P.second, FIONREAD, &count);
-		if (count > 0)
+	for (int i = 0; i < READS_PER_WAKEUP; i++)
+	{
+		system::error_code ec;
+		size_t len = sock->receive(asio::buffer(recv_buffer_), 0, ec);
+		if (ec == asio::error::would_block)
+			break;
+		if (ec)
 		{
-			bytes_received = recvfrom(P.second, buf, 1500, 0 /* = read */,
-				(struct sockaddr *)&inaddr, &addrlen);
-
-			if (bytes_received > 0)
-			{
-				std::vector<uint8_t> data;
-				for (size_t i = 0; i < bytes_received; i++)
-				{
-					data.push_back(buf[i]);
-				}
-				std::vector<uint8_t> pkt_bytes = udp_packet(inaddr.sin_port, P.first, data).to_bytes();
-				output.insert(output.end(), pkt_bytes.begin(), pkt_bytes.end());
-
-			}
-			else if (bytes_received < 0)
-				throw_win32_sock_error("Reading from udp port");
+			// Most likely an ICMP port unreachable from an earlier send.
+			LOG(debug) << "UDP session: " << ec.message();
+			continue;
 		}
+		session_received(key, handle, recv_buffer_.data(), len);
 	}
-	return output;
+	wait_session(sock, key);
+}
+
+// A server has replied on a session's ephemeral socket.  HANDLE is the
+// session's, or FLOW_NIL if it has already gone.
+void Udp_ports::session_received(struct flow_key key, uint32_t handle, const uint8_t *data, size_t len)
+{
+	struct link_udp dgram {};
+	dgram.reply = true;
+	dgram.caddr = (uint32_t)(key.addrs >> 32);
+	dgram.cport = (uint16_t)(key.ports >> 16);
+	dgram.saddr = (uint32_t)key.addrs;
+	dgram.sport = (uint16_t)key.ports;
+	dgram.data = data;
+	dgram.len = len;
+	if (handle != FLOW_NIL)
+		sessions_.at(handle).counts.count(METRIC_TX, len);
+	send_frame(dgram);
+}
+
+void Udp_ports::flow_stats(std::vector<struct Flow_stats>& out) const
+{
+	for (uint32_t h = sessions_.mru(); h != FLOW_NIL; h = sessions_.older(h))
+		out.push_back(Flow_stats{ "udp", sessions_.key_at(h), sessions_.at(h).counts });
+}
+
+void Udp_ports::close_session(uint32_t handle)
+{
+	close_socket(sessions_.at(handle));
+	sessions_.erase(handle);
+}
+
+void Udp_ports::close_socket(Session& session)
+{
+#ifdef U2S_HAVE_IO_URING
+	if (session.receiver)
+		session.receiver->stop();
+#endif
+	system::error_code ec;
+	session.socket->close(ec);
+}
+
+void Udp_ports::expire_timer_handler(system::error_code const & error)
+{
+	if (error)
+		return;
+
+	std::vector<std::pair<struct flow_key, Session>> expired;
+	sessions_.expire(now_tick(), expired);
+	for (auto& e : expired)
+		close_socket(e.second);
+	if (!expired.empty())
+		LOG(debug) << expired.size() << " UDP sessions expired, " << sessions_.size() << " left";
+
+	expire_timer_.expires_from_now(EXPIRE_INTERVAL);
+	expire_timer_.async_wait(std::bind(&Udp_ports::expire_timer_handler, shared_from_this(), std::placeholders::_1));
 }
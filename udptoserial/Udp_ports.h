@@ -1,35 +1,146 @@
 #pragma once
+// UDP_PORTS - proxies UDP datagrams over the serial link.
+//
+// On the near end, a datagram that a client sends to one of the
+// configured ports goes over the link, addressed to the same port on
+// remote_ip.  On the far end, each (client address, client port, server
+// address, server port) gets a session with its own ephemeral socket,
+// connected to the server.  That way replies from the server can be
+// told apart and tunnelled back to the client they belong to, and
+// clients that happen to use the same port don't collide.
+//
+// Sessions are kept in a flow table, so lookup is O(1), the number of
+// sessions is bounded, the least recently used one is closed to make
+// room, and idle ones expire.  Sockets are watched with async_wait and
+// read into one shared buffer, so an idle session costs little more
+// than its socket.  A datagram is then copied into a pooled packet that
+// fits it to wait for the serial port.
+//
+// While the link is busy, small datagrams going the same way are packed
+// together into one UDP_BATCH frame, which goes when it is full or after
+// about as long as the frames ahead of it take to go out, up to the
+// configured delay.  On an idle link each datagram still goes at once.
+//
+// In io_uring mode each socket has a multishot receive on the ring
+// instead of a wait, and datagrams are taken from the ring's buffers.
+// A socket the kernel won't do that for falls back to waiting.
+
+#ifdef WIN32
+#include <sdkddkver.h>
+#endif
 #include <cstdint>
 #include <vector>
 #include <map>
-#ifdef WIN32
-#define WIN32_LEAN_AND_MEAN
-#define _WINSOCK_DEPRECATED_NO_WARNINGS
-#include <Windows.h>
-#include <WinSock2.h>
-#include <io.h>
-#else
-#include <unistd.h>
-#include <sys/socket.h>
-#endif
-#include "udp_packet.h"
+#include <memory>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "../libhorizr/link.h"
+#include "../libhorizr/flow_table.h"
+#include "../libhorizr/packet.h"
+#include "Serial_writer.h"
+#include "Metrics.h"
+#include "Uring_io.h"
+
+using namespace boost;
 
 class Udp_ports
+	: public std::enable_shared_from_this<Udp_ports>
 {
 public:
-	Udp_ports();
-	Udp_ports(std::string local_ip, std::string remote_ip, std::vector<uint16_t>);
+	// At most MAX_SESSIONS far-end sessions are kept, and a session is
+	// closed after IDLE_TIMEOUT seconds with no datagrams either way.
+	// Datagrams go out in packets from POOL, or from BIG_POOL if they
+	// don't fit.  Both need LINK_UDP_HEADER_LEN bytes of headroom.
+	// Batches are held for at most BATCH_DELAY milliseconds and are at
+	// most BATCH_BYTES long, or not made at all if BATCH_DELAY is zero.
+	Udp_ports(asio::io_service& service, std::shared_ptr<Serial_writer> writer,
+		packet_pool& pool, packet_pool& big_pool,
+		uint32_t remote_addr, std::vector<uint16_t> port_numbers,
+		size_t max_sessions, uint32_t idle_timeout,
+		uint32_t batch_delay = 0, size_t batch_bytes = 0);
 	~Udp_ports();
 
+#ifdef U2S_HAVE_IO_URING
+	// Receive on every socket through RING.  Call before open.
+	void use_uring(std::shared_ptr<Uring_io> ring);
+#endif
+
+	// Bind the configured ports and start forwarding.
 	void open();
 	void close();
-	void send_packet(udp_packet& P);
-	std::vector<uint8_t> recv_bytes();
-	//void read_and_forward(Serial_port& serial_port);
+
+	// The serial read handler passes every UDP and UDP_BATCH frame here.
+	void send_packet(const uint8_t *frame, size_t len);
+
+	// How many far-end sessions are open, and what each has carried.
+	size_t sessions() const { return sessions_.size(); }
+	void flow_stats(std::vector<struct Flow_stats>& out) const;
 
 private:
-	std::string default_local_ip;
-	std::string default_remote_ip;
-	std::map<uint16_t, SOCKET> port_map;
-};
+	typedef std::shared_ptr<asio::ip::udp::socket> Socket_ptr;
+#ifdef U2S_HAVE_IO_URING
+	class Ring_receiver;
+#endif
+
+	struct Session {
+		Socket_ptr socket;
+		struct Flow_counts counts;
+#ifdef U2S_HAVE_IO_URING
+		std::shared_ptr<Ring_receiver> receiver;
+#endif
+	};
+
+	void receive_port(Socket_ptr sock, uint16_t port);
+	void wait_port(Socket_ptr sock, uint16_t port);
+	void port_readable(Socket_ptr sock, uint16_t port, system::error_code const & error);
+	void port_received(uint16_t port, uint32_t caddr, uint16_t cport, const uint8_t *data, size_t len);
+	void receive_session(Socket_ptr sock, struct flow_key key, uint32_t handle);
+	void wait_session(Socket_ptr sock, struct flow_key key);
+	void session_readable(Socket_ptr sock, struct flow_key key, system::error_code const & error);
+	void session_received(struct flow_key key, uint32_t handle, const uint8_t *data, size_t len);
+	void forward_to_server(const struct link_udp& dgram);
+	void forward_to_client(const struct link_udp& dgram);
+	void forward(const struct link_udp& dgram);
+	void send_frame(const struct link_udp& dgram);
+	void send_single(const struct link_udp& dgram);
+	void send_batch();
+	void batch_timer_handler(system::error_code const & error);
+	void close_session(uint32_t handle);
+	void close_socket(Session& session);
+	void expire_timer_handler(system::error_code const & error);
+	uint32_t now_tick() const;
+
+	asio::io_service& service_;
+	std::shared_ptr<Serial_writer> serial_writer_;
+	packet_pool& pool_;
+	packet_pool& big_pool_;
+	uint32_t remote_addr_;
+	std::vector<uint16_t> port_numbers_;
+
+	// The near end's listening sockets, by port.
+	std::map<uint16_t, Socket_ptr> ports_;
 
+#ifdef U2S_HAVE_IO_URING
+	std::shared_ptr<Uring_io> uring_;
+	// The near end's sockets' receives on the ring.
+	std::vector<std::shared_ptr<Ring_receiver>> port_receivers_;
+#endif
+
+	// The far end's sessions.
+	flow_table<Session> sessions_;
+	uint32_t idle_ticks_;
+	asio::steady_timer expire_timer_;
+	std::chrono::steady_clock::time_point epoch_;
+
+	std::vector<uint8_t> recv_buffer_;
+
+	// The batch being filled, if there is one, and the last datagram
+	// put in it.
+	std::chrono::microseconds batch_delay_;
+	size_t batch_bytes_;
+	packet batch_;
+	struct link_udp batch_last_;
+	size_t batch_count_;
+	asio::steady_timer batch_timer_;
+	bool batch_waiting_;
+};
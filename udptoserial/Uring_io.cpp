@@ -0,0 +1,289 @@
+#include "Uring_io.h"
+
+#ifdef U2S_HAVE_IO_URING
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include "Log.h"
+
+// Room for this many requests to be queued before the ring is entered.
+// More than that just enters it early.
+const static unsigned RING_ENTRIES = 256;
+
+// The fixed buffer table has room for this many slabs from each of this
+// many pools.  Reads into any slabs past that go without.
+const static unsigned SLABS_PER_POOL = 16;
+const static unsigned POOLS_MAX = 4;
+
+Uring_io::Uring_io(asio::io_service& service)
+	: service_(service)
+	, ring_fd_(service)
+	, ring_()
+	, open_(false)
+	, fixed_(false)
+	, recv_buffers_(false)
+	, recv_msg_()
+	, handling_(false)
+	, submit_posted_(false)
+{
+	// Only the lengths matter to a multishot receive.
+	recv_msg_.msg_namelen = sizeof(struct sockaddr_in);
+}
+
+Uring_io::~Uring_io()
+{
+	close();
+}
+
+bool Uring_io::open()
+{
+	if (uring_init(&ring_, RING_ENTRIES) < 0)
+	{
+		LOG(warning) << "io_uring isn't available: " << strerror(errno);
+		return false;
+	}
+	open_ = true;
+	fixed_ = uring_register_sparse(&ring_, SLABS_PER_POOL * POOLS_MAX) == 0;
+	if (!fixed_)
+		LOG(info) << "io_uring can't register buffers, so reads go without: " << strerror(errno);
+	ring_fd_.assign(ring_.fd);
+	wait();
+	return true;
+}
+
+// Closing the ring cancels whatever is still on it, without a word to
+// the handlers.
+void Uring_io::close()
+{
+	if (!open_)
+		return;
+	open_ = false;
+	ring_fd_.release();
+	uring_free(&ring_);
+}
+
+void Uring_io::register_pool(const packet_pool& pool)
+{
+	if (!fixed_ || pools_.size() == POOLS_MAX)
+		return;
+	pools_.push_back(Pool_slots{ &pool, (unsigned)pools_.size() * SLABS_PER_POOL, 0, false });
+}
+
+bool Uring_io::provide_buffers(unsigned count, size_t size)
+{
+	if (recv_buffers_)
+		return true;
+	if (uring_provide_buffers(&ring_, count, size) < 0)
+	{
+		LOG(warning) << "io_uring can't take buffers for receives: " << strerror(errno);
+		return false;
+	}
+	recv_buffers_ = true;
+	return true;
+}
+
+// The fixed buffer that BUF is in, registering its slab, and any before
+// it, if this is the first read into them.  Returns -1 if BUF isn't in
+// a registered pool's slab, or the kernel won't have it.
+int Uring_io::fixed_index(const uint8_t *buf)
+{
+	for (auto& p : pools_)
+	{
+		size_t slabs = std::min<size_t>(p.pool->slabs(), SLABS_PER_POOL);
+		size_t bytes = p.pool->slab_bytes();
+		for (size_t i = 0; i < slabs; i++)
+		{
+			uint8_t *slab = p.pool->slab(i);
+			if (buf < slab || buf >= slab + bytes)
+				continue;
+			while (p.registered <= i && !p.failed)
+			{
+				if (uring_update_buffer(&ring_, p.base + (unsigned)p.registered,
+					p.pool->slab(p.registered), bytes) < 0)
+				{
+					LOG(info) << "io_uring can't register a buffer slab, so reads into it go without: "
+						<< strerror(errno);
+					p.failed = true;
+					break;
+				}
+				p.registered++;
+			}
+			return i < p.registered ? (int)(p.base + i) : -1;
+		}
+	}
+	return -1;
+}
+
+// Anything queued outside a completion handler goes in once the
+// io_service gets round to it, along with whatever else is queued by
+// then.
+struct io_uring_sqe *Uring_io::get_sqe()
+{
+	if (!handling_ && !submit_posted_)
+	{
+		submit_posted_ = true;
+		service_.post(make_custom_alloc_handler(handler_pool_, [me = shared_from_this()]()
+		{
+			me->submit_posted_ = false;
+			me->run();
+		}));
+	}
+	return uring_get_sqe(&ring_);
+}
+
+void Uring_io::read(int fd, uint8_t *buf, size_t len, Uring_handler *handler)
+{
+	int index = fixed_index(buf);
+	struct io_uring_sqe *sqe = get_sqe();
+	if (index >= 0)
+		uring_prep_read_fixed(sqe, fd, buf, len, (unsigned)index, (uint64_t)(uintptr_t)handler);
+	else
+		uring_prep_read(sqe, fd, buf, len, (uint64_t)(uintptr_t)handler);
+}
+
+// A tty write blocks once the port's buffer is full, even when it is
+// told not to, and it would hold up the whole io_service while the ring
+// is entered.  So writes go straight to the kernel's io_uring workers.
+void Uring_io::writev(int fd, const struct iovec *iov, unsigned count, Uring_handler *handler)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	uring_prep_writev(sqe, fd, iov, count, (uint64_t)(uintptr_t)handler);
+	sqe->flags |= IOSQE_ASYNC;
+}
+
+void Uring_io::recvmsg_multishot(int fd, Uring_handler *handler)
+{
+	uring_prep_recvmsg_multishot(get_sqe(), fd, &recv_msg_, (uint64_t)(uintptr_t)handler);
+}
+
+// The cancel's own completion has no handler.
+void Uring_io::cancel(Uring_handler *handler)
+{
+	uring_prep_cancel(get_sqe(), (uint64_t)(uintptr_t)handler, 0);
+}
+
+bool Uring_io::datagram(const struct io_uring_cqe& cqe, Datagram& d)
+{
+	if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+		return false;
+	auto out = reinterpret_cast<struct io_uring_recvmsg_out *>(
+		uring_buffer(&ring_, cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+	if (out->flags & MSG_TRUNC)
+		return false;
+	d.from = reinterpret_cast<const struct sockaddr_in *>(out + 1);
+	d.data = reinterpret_cast<const uint8_t *>(out + 1) + recv_msg_.msg_namelen;
+	d.len = out->payloadlen;
+	return true;
+}
+
+void Uring_io::recycle(const struct io_uring_cqe& cqe)
+{
+	if (cqe.flags & IORING_CQE_F_BUFFER)
+		uring_recycle_buffer(&ring_, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+void Uring_io::submit()
+{
+	if (!open_ || ring_.sqe_tail == *ring_.sq_tail)
+		return;
+	if (uring_submit_and_wait(&ring_, 0) < 0)
+		LOG(error) << "io_uring_enter: " << strerror(errno);
+}
+
+void Uring_io::wait()
+{
+	ring_fd_.async_wait(asio::posix::stream_descriptor::wait_read,
+		make_custom_alloc_handler(handler_pool_, [me = shared_from_this()](system::error_code const & error)
+	{
+		me->ring_readable(error);
+	}));
+}
+
+// Give the kernel everything queued, then hand every completion to its
+// handler, and go round again with whatever they queued.  A request that
+// is done as it is submitted completes without the ring's descriptor
+// ever being readable, so this goes on until a submit leaves nothing
+// behind.
+void Uring_io::run()
+{
+	for (;;)
+	{
+		submit();
+		if (!open_ || uring_peek_cqe(&ring_) == nullptr)
+			return;
+		handling_ = true;
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&ring_)) != nullptr)
+		{
+			// The entry goes back to the kernel first, since the handler may
+			// queue more.
+			struct io_uring_cqe c = *cqe;
+			uring_cqe_seen(&ring_);
+			Uring_handler *handler = reinterpret_cast<Uring_handler *>((uintptr_t)c.user_data);
+			if (handler != nullptr)
+				handler->completed(c);
+			if (!open_)
+				break;
+		}
+		handling_ = false;
+	}
+}
+
+void Uring_io::ring_readable(system::error_code const & error)
+{
+	if (error || !open_)
+		return;
+	run();
+	if (open_)
+		wait();
+}
+
+Uring_write::Uring_write(std::function<void(int)> done)
+	: done_(std::move(done))
+	, ring_(nullptr)
+	, fd_(-1)
+	, next_(0)
+	, written_(0)
+{
+}
+
+void Uring_write::start(Uring_io& ring, int fd, const std::vector<struct slip_segment>& segments)
+{
+	ring_ = &ring;
+	fd_ = fd;
+	iov_.clear();
+	for (auto& seg : segments)
+		iov_.push_back(iovec{ const_cast<uint8_t *>(seg.data), seg.len });
+	next_ = 0;
+	written_ = 0;
+	ring.writev(fd, iov_.data(), (unsigned)std::min<size_t>(iov_.size(), IOV_MAX), this);
+}
+
+// Skip past what went, and go again with the rest.
+void Uring_write::completed(const struct io_uring_cqe& cqe)
+{
+	size_t n = 0;
+	if (cqe.res > 0)
+		n = cqe.res;
+	else if (cqe.res != -EAGAIN && cqe.res != -EINTR)
+	{
+		done_(cqe.res < 0 ? cqe.res : -EIO);
+		return;
+	}
+	written_ += n;
+	while (next_ < iov_.size() && n >= iov_[next_].iov_len)
+	{
+		n -= iov_[next_].iov_len;
+		next_++;
+	}
+	if (next_ == iov_.size())
+	{
+		done_((int)written_);
+		return;
+	}
+	iov_[next_].iov_base = static_cast<uint8_t *>(iov_[next_].iov_base) + n;
+	iov_[next_].iov_len -= n;
+	ring_->writev(fd_, iov_.data() + next_, (unsigned)std::min<size_t>(iov_.size() - next_, IOV_MAX), this);
+}
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+// URING_IO - an io_uring that the io_service watches, for the serial port
+// and the UDP sockets.
+//
+// With io_uring on, reads from the serial port, writes to it and
+// receives on the UDP sockets are requests on this ring instead of waits
+// in the reactor followed by system calls of our own.  A serial read is
+// re-armed by queuing the next one, and each UDP socket has one
+// multishot receive outstanding that hands back every datagram, so a
+// frame costs no system call of its own.  Everything queued while
+// handling completions goes to the kernel in one io_uring_enter, which
+// is the only system call per wakeup besides the reactor's epoll_wait.
+//
+// The reactor watches the ring's descriptor, which is readable while
+// completions are waiting.  So the TCP connections, the timers and
+// everything else stay on Asio as they were, on the same thread.
+//
+// Buffers from a packet_pool can be read into as fixed buffers: each of
+// the pool's slabs is registered with the kernel the first time a read
+// lands in it, so the kernel doesn't pin and map its pages for every
+// read.  Datagrams are received into provided buffers that the ring owns
+// and that go back to the kernel as soon as they have been handled.
+//
+// It needs Linux 6.0, for multishot receives.  Where the kernel can't do
+// this, open fails and the caller stays with the reactor.  Otherwise it
+// is only used from the thread that runs the io_service.
+
+#include "uring.h"
+
+#ifdef U2S_HAVE_IO_URING
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <netinet/in.h>
+#include "../libhorizr/packet.h"
+#include "../libhorizr/slip.h"
+#include "Handler_pool.h"
+
+using namespace boost;
+
+// Something with requests on the ring.  It is handed each of their
+// completions, and must be around until the last of them.
+class Uring_handler
+{
+public:
+	virtual ~Uring_handler() {}
+
+	virtual void completed(const struct io_uring_cqe& cqe) = 0;
+};
+
+class Uring_io
+	: public std::enable_shared_from_this<Uring_io>
+{
+public:
+	Uring_io(asio::io_service& service);
+	~Uring_io();
+
+	// Set up the ring and start watching it.  Returns false, having
+	// logged why, if the kernel can't do it, and then nothing else here
+	// may be used.
+	bool open();
+	void close();
+
+	// Read into POOL's buffers as fixed buffers, where the kernel allows.
+	void register_pool(const packet_pool& pool);
+
+	// Give the kernel COUNT buffers of SIZE bytes, COUNT a power of two,
+	// for multishot receives to land in.  Returns false if it can't.
+	bool provide_buffers(unsigned count, size_t size);
+
+	// Read up to LEN bytes from FD into BUF.  BUF has to stay put until
+	// HANDLER hears how many bytes came.
+	void read(int fd, uint8_t *buf, size_t len, Uring_handler *handler);
+
+	// Write the COUNT pieces at IOV to FD, as much of them as the port
+	// takes in one go.  IOV and its bytes have to stay put until HANDLER
+	// hears how many bytes went.
+	void writev(int fd, const struct iovec *iov, unsigned count, Uring_handler *handler);
+
+	// Receive datagrams on FD until cancelled or failed.  Each completion
+	// with IORING_CQE_F_BUFFER set carries one, for datagram, and its
+	// buffer has to be handed back with recycle.  The last completion is
+	// the one without IORING_CQE_F_MORE.  One that ran out of buffers
+	// ends with -ENOBUFS and can be started again.
+	void recvmsg_multishot(int fd, Uring_handler *handler);
+
+	// Everything HANDLER has on the ring ends, with -ECANCELED if it
+	// hadn't already.
+	void cancel(Uring_handler *handler);
+
+	// What a multishot receive's completion CQE carried.
+	struct Datagram {
+		const struct sockaddr_in *from;
+		const uint8_t *data;
+		size_t len;
+	};
+	// Returns false if CQE carries no datagram, or only part of one.
+	bool datagram(const struct io_uring_cqe& cqe, Datagram& d);
+	void recycle(const struct io_uring_cqe& cqe);
+
+	// How many times the ring has been entered.
+	size_t enters() const { return ring_.enters; }
+
+private:
+	// One pool's slabs, from BASE on in the fixed buffer table.
+	// REGISTERED of them are in it.  If registering one failed, FAILED
+	// says so, and reads into the rest go without.
+	struct Pool_slots {
+		const packet_pool *pool;
+		unsigned base;
+		size_t registered;
+		bool failed;
+	};
+
+	struct io_uring_sqe *get_sqe();
+	int fixed_index(const uint8_t *buf);
+	void submit();
+	void run();
+	void wait();
+	void ring_readable(system::error_code const & error);
+
+	asio::io_service& service_;
+	asio::posix::stream_descriptor ring_fd_;
+	uring_t ring_;
+	bool open_;
+	bool fixed_;
+	std::vector<Pool_slots> pools_;
+	bool recv_buffers_;
+	struct msghdr recv_msg_;
+	// Set while completions are handled, since anything queued then goes
+	// in with the rest once they are done.
+	bool handling_;
+	bool submit_posted_;
+	Handler_pool handler_pool_;
+};
+
+// A gathered write that goes on until every byte is written, as
+// asio::async_write does, however short each of its writes comes up.
+class Uring_write
+	: public Uring_handler
+{
+public:
+	// DONE hears how many bytes went in all, or minus the errno of the
+	// write that failed.
+	Uring_write(std::function<void(int)> done);
+
+	// Write SEGMENTS to FD through RING.  Their bytes have to last until
+	// DONE is called.
+	void start(Uring_io& ring, int fd, const std::vector<struct slip_segment>& segments);
+
+	void completed(const struct io_uring_cqe& cqe) override;
+
+private:
+	std::function<void(int)> done_;
+	Uring_io *ring_;
+	int fd_;
+	std::vector<struct iovec> iov_;
+	size_t next_;
+	size_t written_;
+};
+#endif
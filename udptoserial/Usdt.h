@@ -0,0 +1,50 @@
+#pragma once
+// USDT - static probe points, for perf and bpftrace.
+//
+//   USDT(udptoserial, frame_enqueued, frame.data(), frame.size());
+//
+// marks a place in the code by name, so a tracer can attach to it without
+// caring what the compiler inlined.  Built with --enable-usdt, which
+// defines HAVE_USDT, it is systemtap's STAP_PROBEV: a single nop, plus a
+// note in the ELF file saying where the nop is and where each argument
+// can be found.  Until a tracer replaces the nop with a breakpoint, that
+// is all it costs.  Without HAVE_USDT it is nothing at all.
+//
+// There are no semaphores, so arguments are worked out whether anyone is
+// tracing or not.  Keep them to values that are at hand anyway.
+//
+// Every probe, and what its arguments are:
+//
+//   udptoserial:frame_decoded(type, len, frame)
+//     A SLIP frame from the serial port, with any STAMP taken off.  TYPE
+//     is its LINK_FRAME_XXX, or LINK_FRAME_UNKNOWN.
+//   udptoserial:frame_enqueued(frame, len)
+//     A data frame queued for the serial port.  FRAME is where its bytes
+//     start, which stays the same until it is dequeued.
+//   udptoserial:frame_dequeued(frame, len, class)
+//     The same frame, taken off the queue to go in a write.  CLASS is a
+//     Metric_flow_class: 0 for TCP, 1 for UDP, 2 for anything else.
+//   udptoserial:write_submitted(frames, bytes)
+//   udptoserial:write_completed(bytes, error)
+//     A gathered write to the serial port, and its end.  ERROR is the
+//     errno, or zero.
+//   udptoserial:tcp_accept(channel, addr, port, local_port)
+//     A client connected to the near end.  ADDR is in host byte order.
+//   udptoserial:tcp_connect(channel, addr, port, reason)
+//     The far end's connection to the server came up, if REASON is
+//     zero, or failed with that MUX_RST_XXX reason.
+//   udptoserial:tcp_close(channel, reply)
+//     A connection's channel was given up, at either end, whether it
+//     closed, was reset, or was evicted or expired.  REPLY is 1 at
+//     the end that connected to the server.
+//   halfduplex:change_state(from, to)
+//     The half-duplex link moved between Half_duplex::State values.
+//
+// hack/usdt has bpftrace scripts that use them.
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define USDT(provider, name, ...) STAP_PROBEV(provider, name, ##__VA_ARGS__)
+#else
+#define USDT(provider, name, ...) do { } while (0)
+#endif
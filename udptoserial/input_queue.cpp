@@ -1,42 +1,120 @@
 #include "input_queue.h"
+#include <algorithm>
+#include <cstring>
 
-
-
-input_queue::input_queue()
-	: raw{},
-	packets{}
+input_queue::input_queue(packet_pool& pool, size_t byte_capacity, size_t packet_capacity, Overflow policy)
+	: pool_(pool),
+	policy_(policy),
+	raw_(byte_capacity > 0 ? byte_capacity : 1),
+	byte_head_(0),
+	byte_count_(0),
+	packets_(packet_capacity),
+	packet_capacity_(packet_capacity > 0 ? packet_capacity : 1),
+	gap_pending_(false),
+	gap_at_(0),
+	resync_(false)
 {
+	start_packet();
 }
 
 input_queue::~input_queue()
 {
 }
 
-void input_queue::push_bytes(std::vector<uint8_t>& input)
+void input_queue::start_packet()
+{
+	rx_ = pool_.alloc();
+	slip_decoder_init(decoder_, rx_.tail(), rx_.tailroom());
+}
+
+// Append LEN bytes of INPUT onto the byte ring, making room first by
+// decoding whatever can be decoded.
+size_t input_queue::push_bytes(const uint8_t *input, size_t len)
 {
-	raw.insert(raw.end(), input.begin(), input.end());
-	move_bytes_to_packets();
+	counters_.bytes_in += len;
+	if (byte_count_ + len > raw_.size())
+		move_bytes_to_packets();
+
+	// Once bytes have been dropped, everything is dropped until the
+	// decoder has caught up to the gap, so that there is only one.
+	size_t n = gap_pending_ ? 0 : std::min(len, raw_.size() - byte_count_);
+	size_t tail = (byte_head_ + byte_count_) % raw_.size();
+	size_t first = std::min(n, raw_.size() - tail);
+	memcpy(&raw_[tail], input, first);
+	memcpy(&raw_[0], input + first, n - first);
+	byte_count_ += n;
+
+	if (n < len)
+	{
+		counters_.bytes_dropped += len - n;
+		if (!gap_pending_)
+		{
+			gap_pending_ = true;
+			gap_at_ = byte_count_;
+		}
+	}
+	return n;
 }
 
 // If the raw data queue contains any complete messages,
 // extract them into the packet queue.
 int input_queue::move_bytes_to_packets()
 {
-	size_t bytes_used;
 	int count = 0;
 
-	while (raw.size() > 0)
+	while (byte_count_ > 0)
 	{
-		udp_packet p;
-		bytes_used = p.from_bytes(raw);
-		raw.erase(raw.begin(), raw.begin() + bytes_used);
-		if (!p.is_empty())
+		if (packets_.size() >= packet_capacity_ && policy_ == Overflow::DROP_NEWEST)
+			break;
+
+		size_t span = std::min(byte_count_, raw_.size() - byte_head_);
+		if (gap_pending_)
+		{
+			if (gap_at_ == 0)
+			{
+				// The frame being decoded lost some of its bytes.
+				gap_pending_ = false;
+				resync_ = true;
+				continue;
+			}
+			span = std::min(span, gap_at_);
+		}
+
+		bool complete;
+		size_t used = slip_decoder_feed(decoder_, &raw_[byte_head_], span, complete);
+		byte_head_ = (byte_head_ + used) % raw_.size();
+		byte_count_ -= used;
+		if (gap_pending_)
+			gap_at_ -= used;
+		if (!complete)
+			continue;
+
+		if (resync_)
+			resync_ = false;
+		else if (decoder_.overflow)
+			counters_.packets_oversize++;
+		else if (decoder_.len > 0)
 		{
-			packets.push_back(p);
+			if (packets_.size() >= packet_capacity_)
+			{
+				packets_.pop_front();
+				counters_.packets_dropped++;
+			}
+			rx_.put(decoder_.len);
+			packets_.push_back(std::move(rx_));
+			counters_.packets_in++;
 			count++;
+			start_packet();
+			continue;
 		}
-		else
-			break;
+		slip_decoder_reset(decoder_);
+	}
+
+	// A gap right at the end of what was queued.
+	if (gap_pending_ && gap_at_ == 0 && byte_count_ == 0)
+	{
+		gap_pending_ = false;
+		resync_ = true;
 	}
 	return count;
 }
@@ -44,18 +122,18 @@ int input_queue::move_bytes_to_packets()
 // If there a packet ready to go?
 bool input_queue::is_packet_available()
 {
-	return packets.size() > 0;
+	if (packets_.empty())
+		move_bytes_to_packets();
+	return !packets_.empty();
 }
 
-// Return the first ready packet, removing it
-// from the queue.
-udp_packet input_queue::pop_packet()
+// Return the first ready packet, removing it from the queue, or an
+// empty packet if there isn't one.
+packet input_queue::pop_packet()
 {
-	if (packets.size() > 0)
-	{
-		udp_packet p = packets[0];
-		packets.erase(packets.begin(), packets.begin() + 1);
-		return p;
-	}
-	return udp_packet();
-}
\ No newline at end of file
+	if (!is_packet_available())
+		return packet();
+	packet p = std::move(packets_.front());
+	packets_.pop_front();
+	return p;
+}
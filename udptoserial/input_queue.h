@@ -1,23 +1,80 @@
 #pragma once
-// INPUT_QUEUE - A two-state FIFO queue.  Raw bytes are received and placed
-// at the end of a raw byte FIFO queue. Periodically raw bytes are popped off
-// and converted to UDP packets.
+// INPUT_QUEUE - A two-stage FIFO queue.  Raw bytes are received and placed
+// at the end of a byte ring.  Periodically raw bytes are taken off and
+// SLIP-decoded into packets, which wait in a packet ring to be popped.
+//
+// Both rings have a fixed capacity, so a burst costs no more memory than
+// the queue was built with, and every step is O(1) per byte or packet.
+// Packets are moved out, never copied.
+//
+// What happens when the packet ring is full depends on the policy.  With
+// DROP_NEWEST, decoding stops and bytes back up in the byte ring, and
+// once that is full too, new bytes are thrown away.  With DROP_OLDEST,
+// decoding carries on and the oldest waiting packet makes room.
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
-#include "udp_packet.h"
+#include "../libhorizr/packet.h"
+#include "../libhorizr/ring.h"
+#include "../libhorizr/slip.h"
+
 class input_queue
 {
 public:
-	input_queue();
+	enum class Overflow {
+		DROP_NEWEST,
+		DROP_OLDEST
+	};
+
+	struct Counters {
+		uint64_t bytes_in = 0;
+		uint64_t bytes_dropped = 0;
+		uint64_t packets_in = 0;
+		uint64_t packets_dropped = 0;
+		// Frames too big for a packet from the pool.
+		uint64_t packets_oversize = 0;
+	};
+
+	// Decoded frames go into packets from POOL.  At most BYTE_CAPACITY
+	// undecoded bytes and PACKET_CAPACITY packets are held.
+	input_queue(packet_pool& pool, size_t byte_capacity, size_t packet_capacity,
+		Overflow policy = Overflow::DROP_NEWEST);
 	~input_queue();
 
-	void push_bytes(std::vector<uint8_t>& input);
+	// Append LEN bytes of INPUT.  Returns how many were kept.
+	size_t push_bytes(const uint8_t *input, size_t len);
 	int move_bytes_to_packets();
 	bool is_packet_available();
-	udp_packet pop_packet();
+	packet pop_packet();
+
+	size_t bytes_queued() const { return byte_count_; }
+	size_t packets_queued() const { return packets_.size(); }
+	const Counters& counters() const { return counters_; }
 
 private:
-	std::vector<uint8_t> raw;
-	std::vector<udp_packet> packets;
-};
+	void start_packet();
+
+	packet_pool& pool_;
+	Overflow policy_;
 
+	std::vector<uint8_t> raw_;
+	size_t byte_head_;
+	size_t byte_count_;
+
+	ring<packet> packets_;
+	size_t packet_capacity_;
+
+	// Bytes were dropped after the first GAP_AT_ queued bytes, so the
+	// frame they belonged to is broken.
+	bool gap_pending_;
+	size_t gap_at_;
+
+	// The packet being decoded, and whether the rest of its frame is
+	// being skipped because bytes of it were dropped.
+	packet rx_;
+	struct slip_decoder decoder_;
+	bool resync_;
+
+	Counters counters_;
+};
@@ -4,117 +4,468 @@
 #include <stdbool.h>
 #include <stdlib.h>		/* exit */
 #include <string.h>
+#include <signal.h>
 
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #pragma comment(lib, "Ws2_32.lib")
 #else
+#include <errno.h>
 #include <termios.h>
 #include <unistd.h>		/* close */
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #endif
 
+#include "queue.h"
 #include "serial.h"
 #include "socket.h"
+#include "uring.h"
 
 #define UDP_PORT_COUNT (3)
 uint16_t ports[UDP_PORT_COUNT] = {4000, 42420, 42421};
 udp_socket_t sockets[UDP_PORT_COUNT];
 
-bool quitting = false;
+/* Latency settings for the serial port: reads return as soon as there
+   is a byte, and an FTDI adapter passes bytes on after 1 ms instead
+   of 16. */
+static const serial_tune_t serial_tune = {
+  .vmin = 1,
+  .vtime = 0,
+  .low_latency = 1,
+  .latency_timer = 1,
+};
 
-int main()
+/* Packets waiting for the serial port.  Past this, new ones are
+   dropped. */
+#define PKT_QUEUE_CAPACITY (256)
+
+volatile sig_atomic_t quitting = false;
+
+static void
+quit_handler (int sig)
 {
-  int actions;
+  quitting = true;
+}
+
+/* Move each UDP socket that isn't ready yet along through its states.
+   Sets *PENDING if any of them are waiting to try again later.  Returns
+   the number of sockets that got somewhere. */
+static int
+step_sockets (bool *pending)
+{
+  int actions = 0;
   int ret;
-  pkt_queue_t *queue = NULL;
-  serial_port_t *port = NULL;
-#ifdef WIN32
-  WSADATA wsaData;
-  int iResult;
-  u_long iMode = 0;
-#endif
+
+  *pending = false;
+  for (int i = 0; i < UDP_PORT_COUNT; i ++)
+    {
+      udp_socket_state_t state = sockets[i].state;
+
+      if (quitting)
+	state = UDP_SOCKET_CLOSING;
+
+      switch (state)
+	{
+	case UDP_SOCKET_UNINITIALIZED:
+	  udp_socket_assign_port (&sockets[i], ports[i]);
+	  ret = 0;
+	  break;
+	case UDP_SOCKET_ADDRESS_ASSIGNED:
+	case UDP_SOCKET_CREATING:
+	  ret = udp_socket_try_create(&sockets[i]);
+	  break;
+	case UDP_SOCKET_CREATED:
+	case UDP_SOCKET_BINDING:
+	  ret = udp_socket_try_bind(&sockets[i]);
+	  break;
+	case UDP_SOCKET_CLOSING:
+	  if (sockets[i].state >= UDP_SOCKET_CREATED
+	      && sockets[i].state <= UDP_SOCKET_CLOSING)
+	    ret = udp_socket_try_close(&sockets[i]);
+	  else
+	    ret = -1;
+	  break;
+	case UDP_SOCKET_READY:
+	case UDP_SOCKET_FAILED:
+	default:
+	  ret = -1;
+	  break;
+	}
+      if (ret == 0)
+	actions ++;
+      state = sockets[i].state;
+      if (state != UDP_SOCKET_READY && state != UDP_SOCKET_FAILED
+	  && state != UDP_SOCKET_CLOSED)
+	*pending = true;
+    }
+  return actions;
+}
 
 #ifdef WIN32
-  iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-  if (iResult != NO_ERROR)
-	  printf("Error at WSAStartup()\n");
-  port = serial_port_new("COM3");
+static void
+run (pkt_queue_t *queue, serial_port_t *port)
+{
+  int actions;
+  bool pending;
+
+  while (!quitting)
+    {
+      actions = step_sockets (&pending);
+      for (int i = 0; i < UDP_PORT_COUNT; i ++)
+	if (sockets[i].state == UDP_SOCKET_READY)
+	  udp_socket_msgrecv(&sockets[i], queue);
+      if (pkt_queue_send(queue, port, pkt_queue_now_usec()) != 0)
+	actions ++;
+
+      /* If nothing is happening, sleep for a bit. */
+      if (actions == 0)
+	Sleep(1);
+    }
+  step_sockets (&pending);
+}
 #else
-	port = serial_port_new("ttyS1");
-#endif
-	serial_port_info(port);
-	
-  memset (sockets, 0, sizeof(sockets));
+/* The epoll tags of things that aren't UDP sockets. */
+#define EPOLL_TAG_SERIAL (UDP_PORT_COUNT)
+#define EPOLL_TAG_PACING (UDP_PORT_COUNT + 1)
 
-  
-  while (true)
+static int
+epoll_watch (int epfd, int op, int fd, uint32_t events, uint32_t tag)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.u32 = tag;
+  if (epoll_ctl(epfd, op, fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      return -1;
+    }
+  return 0;
+}
+
+/* Sleep in epoll until a UDP socket has datagrams, the serial port can
+   take more, or the pacing timer says the next packet may go.  The
+   only other wakeups are once a second while a socket is waiting to
+   retry being created or bound. */
+static void
+run (pkt_queue_t *queue, serial_port_t *port)
+{
+  struct epoll_event events[UDP_PORT_COUNT + 2];
+  bool watched[UDP_PORT_COUNT];
+  bool pacing = false;		/* the pacing timer is armed */
+  bool blocked = false;		/* waiting for the serial port */
+  bool pending;
+  int epfd, timerfd, n;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epfd < 0 || timerfd < 0)
+    {
+      perror("epoll and timerfd");
+      exit(1);
+    }
+  if (epoll_watch (epfd, EPOLL_CTL_ADD, timerfd, EPOLLIN, EPOLL_TAG_PACING) < 0)
+    exit(1);
+
+  /* Writes to the serial port mustn't stall the loop. */
+  if (port)
+    fcntl(port->handle, F_SETFL, fcntl(port->handle, F_GETFL) | O_NONBLOCK);
+
+  memset (watched, 0, sizeof(watched));
+  while (!quitting)
     {
-      actions = 0;
-      /* Check in on each UDP socket. */
+      while (step_sockets (&pending) > 0)
+	;
       for (int i = 0; i < UDP_PORT_COUNT; i ++)
+	if (!watched[i] && sockets[i].state == UDP_SOCKET_READY)
+	  watched[i] = epoll_watch (epfd, EPOLL_CTL_ADD, sockets[i].handle, EPOLLIN, i) == 0;
+
+      n = epoll_wait(epfd, events, UDP_PORT_COUNT + 2, pending ? 1000 : -1);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror("epoll_wait");
+	  break;
+	}
+
+      for (int i = 0; i < n; i ++)
 	{
-	  udp_socket_state_t state = sockets[i].state;
-	  
-	  if (quitting)
-	    state = UDP_SOCKET_CLOSING;
+	  uint32_t tag = events[i].data.u32;
 
-	  switch (state)
+	  if (tag < UDP_PORT_COUNT)
+	    {
+	      if (sockets[tag].state == UDP_SOCKET_READY)
+		udp_socket_msgrecv(&sockets[tag], queue);
+	    }
+	  else if (tag == EPOLL_TAG_PACING)
+	    {
+	      uint64_t expirations;
+	      if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		perror("reading timerfd");
+	      pacing = false;
+	    }
+	  else if (tag == EPOLL_TAG_SERIAL)
 	    {
-	    case UDP_SOCKET_UNINITIALIZED:
-	      udp_socket_assign_port (&sockets[i], ports[i]);
-	      ret = 0;
-	      break;
-	    case UDP_SOCKET_ADDRESS_ASSIGNED:
-	    case UDP_SOCKET_CREATING:
-	      ret = udp_socket_try_create(&sockets[i]);
-	      break;
-	    case UDP_SOCKET_CREATED:
-	    case UDP_SOCKET_BINDING:
-	      ret = udp_socket_try_bind(&sockets[i]);
-	      break;
-	    case UDP_SOCKET_READY:
-	      ret = udp_socket_msgrecv(&sockets[i], &queue);
-	      break;
-	    case UDP_SOCKET_CLOSING:
-	      ret = udp_socket_try_close(&sockets[i]);
-	      break;
-	    case UDP_SOCKET_FAILED:
-	    default:
-	      break;
+	      epoll_watch (epfd, EPOLL_CTL_DEL, port->handle, 0, tag);
+	      blocked = false;
 	    }
-	  if (ret == 0)
-	    actions ++;
 	}
+
       /* Then check in on the message queue. */
-      if (queue)
+      if (!pacing && !blocked)
 	{
-	  queue = pkt_queue_send(queue, port);
-	  actions ++;
-#ifdef WIN32
-	  Sleep(1);
-#else
-	  usleep(1);
+	  int64_t wait = pkt_queue_send(queue, port, pkt_queue_now_usec());
+	  if (wait == PKT_QUEUE_SEND_BLOCKED)
+	    blocked = epoll_watch (epfd, EPOLL_CTL_ADD, port->handle, EPOLLOUT, EPOLL_TAG_SERIAL) == 0;
+	  else if (wait > 0)
+	    {
+	      struct itimerspec its;
+	      memset (&its, 0, sizeof(its));
+	      its.it_value.tv_sec = wait / 1000000;
+	      its.it_value.tv_nsec = (wait % 1000000) * 1000;
+	      pacing = timerfd_settime(timerfd, 0, &its, NULL) == 0;
+	    }
+	}
+
+      /* Input waiting on the serial port isn't read yet.  When it is,
+	 the serial port gets watched for EPOLLIN as well. */
+    }
+
+  step_sockets (&pending);
+  close (timerfd);
+  close (epfd);
+}
 #endif
+
+#ifdef U2S_HAVE_IO_URING
+/* The io_uring tags of things that aren't UDP sockets. */
+#define URING_TAG_WRITE (UDP_PORT_COUNT)
+#define URING_TAG_PACING (UDP_PORT_COUNT + 1)
+#define URING_TAG_RETRY (UDP_PORT_COUNT + 2)
+
+/* Received datagrams land in these, after the header the kernel puts
+   in front and the sender's address. */
+#define URING_RECV_BUFFERS (64)
+#define URING_RECV_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) \
+				+ sizeof(struct sockaddr_in) + PKT_QUEUE_PAYLOAD_MAX)
+
+/* Queue the datagram that completion CQE, on socket I, carried. */
+static void
+uring_recv_done (uring_t *ring, struct io_uring_cqe *cqe, int i,
+		 const struct msghdr *msg, pkt_queue_t *queue)
+{
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) uring_buffer (ring, bid);
+  struct sockaddr_in *from = (struct sockaddr_in *) (out + 1);
+  char *payload = (char *) (out + 1) + msg->msg_namelen + msg->msg_controllen;
+
+  if (cqe->res >= 0)
+    pkt_queue_append (queue, ntohs(from->sin_port),
+		      ntohs(sockets[i].name.sin_port), payload, out->payloadlen);
+  uring_recycle_buffer (ring, bid);
+}
+
+/* The same loop as run, through io_uring.  Each UDP socket has one
+   multishot receive outstanding, so datagrams arrive without a system
+   call apiece.  The serial port is written from the send buffer, which
+   is registered once, and pacing is done with ring timeouts.  Every
+   round of submissions and completions is one io_uring_enter.
+
+   Returns -1, having done nothing, if the kernel can't do this. */
+static int
+run_uring (pkt_queue_t *queue, serial_port_t *port)
+{
+  uring_t ring;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct msghdr msg;
+  struct __kernel_timespec pacing_ts, retry_ts;
+  bool armed[UDP_PORT_COUNT];
+  bool writing = false;		/* a serial write is in flight */
+  bool pacing = false;		/* a pacing timeout is in flight */
+  bool retrying = false;	/* a socket retry timeout is in flight */
+  bool pending;
+
+  if (port == NULL)
+    return -1;
+  if (uring_init (&ring, 64) < 0)
+    {
+      perror("io_uring_setup");
+      return -1;
+    }
+  if (uring_register_buffer (&ring, queue->sendbuf, PKT_QUEUE_SENDBUF_MAX) < 0
+      || uring_provide_buffers (&ring, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE) < 0)
+    {
+      perror("io_uring buffers");
+      uring_free (&ring);
+      return -1;
+    }
+
+  /* Only the lengths matter to a multishot receive. */
+  memset (&msg, 0, sizeof(msg));
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+
+  memset (armed, 0, sizeof(armed));
+  while (!quitting)
+    {
+      while (step_sockets (&pending) > 0)
+	;
+      for (int i = 0; i < UDP_PORT_COUNT; i ++)
+	if (!armed[i] && sockets[i].state == UDP_SOCKET_READY)
+	  {
+	    uring_prep_recvmsg_multishot (uring_get_sqe (&ring), sockets[i].handle, &msg, i);
+	    armed[i] = true;
+	  }
+      if (pending && !retrying)
+	{
+	  retry_ts.tv_sec = 1;
+	  retry_ts.tv_nsec = 0;
+	  uring_prep_timeout (uring_get_sqe (&ring), &retry_ts, URING_TAG_RETRY);
+	  retrying = true;
 	}
 
-	  /* Read all the input waiting on the serial port. */
-	  /* If there are no message delimiters in the input, but, the input
-	     is very large, dump the input. */
-	  /* If there are message delimiters in the input, try to parse a message from
-	     the input. */
-	  /* If the message is valid and it is addressed from a port we have open, send it
-	     out.*/
+      if (!writing && !pacing)
+	{
+	  int64_t wait = pkt_queue_pack (queue, port, pkt_queue_now_usec());
+	  if (queue->send_len > 0)
+	    {
+	      sqe = uring_get_sqe (&ring);
+	      uring_prep_write_fixed (sqe, port->handle, queue->sendbuf,
+				      queue->send_len, URING_TAG_WRITE);
+	      writing = true;
+	    }
+	  else if (wait > 0)
+	    {
+	      pacing_ts.tv_sec = wait / 1000000;
+	      pacing_ts.tv_nsec = (wait % 1000000) * 1000;
+	      uring_prep_timeout (uring_get_sqe (&ring), &pacing_ts, URING_TAG_PACING);
+	      pacing = true;
+	    }
+	}
+
+      if (uring_submit_and_wait (&ring, 1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror("io_uring_enter");
+	  break;
+	}
+
+      while ((cqe = uring_peek_cqe (&ring)) != NULL)
+	{
+	  uint64_t tag = cqe->user_data;
+
+	  if (tag < UDP_PORT_COUNT)
+	    {
+	      if (cqe->flags & IORING_CQE_F_BUFFER)
+		uring_recv_done (&ring, cqe, tag, &msg, queue);
+	      if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+		  /* The receive has ended.  If it ran out of buffers, it
+		     is started again; anything else, including a kernel
+		     too old for multishot, fails the socket. */
+		  armed[tag] = false;
+		  if (cqe->res < 0 && cqe->res != -ENOBUFS)
+		    {
+		      errno = -cqe->res;
+		      perror("receiving through io_uring");
+		      sockets[tag].state = UDP_SOCKET_FAILED;
+		      close (sockets[tag].handle);
+		    }
+		}
+	    }
+	  else if (tag == URING_TAG_WRITE)
+	    {
+	      writing = false;
+	      if (cqe->res < 0)
+		{
+		  /* The rest of this one is lost. */
+		  errno = -cqe->res;
+		  perror("writing to the serial port");
+		  queue->send_off = queue->send_len;
+		}
+	      else
+		queue->send_off += cqe->res;
+	      if (queue->send_off < queue->send_len)
+		{
+		  sqe = uring_get_sqe (&ring);
+		  uring_prep_write_fixed (sqe, port->handle, queue->sendbuf + queue->send_off,
+					  queue->send_len - queue->send_off, URING_TAG_WRITE);
+		  writing = true;
+		}
+	    }
+	  else if (tag == URING_TAG_PACING)
+	    pacing = false;
+	  else if (tag == URING_TAG_RETRY)
+	    retrying = false;
+	  uring_cqe_seen (&ring);
+	}
+    }
+
+  printf("%zu io_uring_enter calls\n", ring.enters);
+  step_sockets (&pending);
+  uring_free (&ring);
+  return 0;
+}
+#endif
+
+/* With -u, everything goes through io_uring, where the kernel can do
+   it, and through epoll otherwise. */
+int main(int argc, char *argv[])
+{
+  pkt_queue_t *queue = NULL;
+  serial_port_t *port = NULL;
+  bool use_uring = false;
+  bool ran = false;
+#ifdef WIN32
+  WSADATA wsaData;
+  int iResult;
+#endif
 
-      /* If nothing is happening, sleep for a bit. */
 #ifdef WIN32
-	  if (actions == 0)
-		  Sleep(1);
+  iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+  if (iResult != NO_ERROR)
+	  printf("Error at WSAStartup()\n");
+  port = serial_port_new("COM3");
 #else
-	  if (actions == 0)
-		  usleep(1000);
+	port = serial_port_new("ttyS1");
 #endif
+	serial_port_info(port);
+	serial_port_tune(port, &serial_tune);
+
+  queue = pkt_queue_new(PKT_QUEUE_CAPACITY);
+  if (queue == NULL)
+    {
+      fprintf(stderr, "Can't allocate the packet queue\n");
+      exit(1);
+    }
+  memset (sockets, 0, sizeof(sockets));
+  signal(SIGINT, quit_handler);
+  signal(SIGTERM, quit_handler);
+
+  for (int i = 1; i < argc; i ++)
+    if (strcmp(argv[i], "-u") == 0)
+      use_uring = true;
+#ifdef U2S_HAVE_IO_URING
+  if (use_uring && run_uring (queue, port) == 0)
+    ran = true;
+#endif
+  if (!ran)
+    {
+      if (use_uring)
+	printf("io_uring isn't available; using epoll\n");
+      run (queue, port);
     }
+
+  if (queue->writes > 0)
+    printf("%zu packets sent in %zu writes\n", queue->written, queue->writes);
+  if (queue->dropped > 0)
+    printf("%zu packets dropped because the queue was full\n", queue->dropped);
+  pkt_queue_free(queue);
   return 0;
 }
 
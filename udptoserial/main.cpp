@@ -10,6 +10,9 @@
 #include <Windows.h>
 #pragma comment(lib, "Ws2_32.lib")
 #else
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <termios.h>
 #include <unistd.h>		/* close */
 #endif
@@ -19,153 +22,464 @@
 #include <map>
 #include <list>
 #include <sstream>
-#include <boost/log/trivial.hpp>
+#include "Log.h"
 #include "../libhorizr/libhorizr.h"
 
 //#include "udp_packet.h"
 #include "input_queue.h"
 // #include "Serial_port.h"
 #include "Configuration.h"
-// #include "Udp_ports.h"
+#include "Udp_ports.h"
 // #include "IPv4.h"
-#include "Ip_endpoint_join.h"
 #include "Tcp_server_handler.h"
+#include "Serial_writer.h"
+#include "Handler_pool.h"
+#include "Stream_mux.h"
+#include "Serial_read_stats.h"
+#include "Link_negotiator.h"
+#include "Metrics.h"
+#include "Metrics_server.h"
+#include "Usdt.h"
+#include "Capture.h"
+#include "Uring_io.h"
+#include "serial_tune.h"
+#include "serial_baud.h"
+#include "realtime.h"
 #include <functional>
+#include <thread>
 using namespace std::placeholders;
 
 bool go = true;
 
+// Frames for the link are built in pooled packets, with room in front
+// for the link headers.  Most are small: TCP payloads and control
+// frames.  UDP datagrams too big for those get buffers of their own.
+// The pools are declared first so that they outlive any packets still
+// held by pending handlers when the io_service goes away.  The serial
+// port's reads take their handlers' memory from a pool too.
+const static size_t PACKET_HEADROOM = 32;
+const static size_t PACKET_SIZE = 2048;
+const static size_t BIG_PACKET_SIZE = PACKET_HEADROOM + 65536;
+packet_pool packet_pool_(PACKET_SIZE, PACKET_HEADROOM, 256);
+packet_pool big_packet_pool_(BIG_PACKET_SIZE, PACKET_HEADROOM, 4);
+Handler_pool serial_read_pool_;
+
 asio::io_service io_service_;
 std::map<uint16_t, std::shared_ptr<asio::ip::tcp::acceptor>> tcp_server_acceptor_map_;
-std::map<Ip_endpoint_join<asio::ip::tcp::endpoint>, std::shared_ptr<asio::ip::tcp::socket>> tcp_ephemeral_socket_map_;
 std::shared_ptr<asio::serial_port> serial_port_;
-std::list<std::shared_ptr<Tcp_server_handler>> tcp_server_handler_list_;
+std::shared_ptr<Serial_writer> serial_writer_;
+std::shared_ptr<Stream_mux> stream_mux_;
+std::shared_ptr<Udp_ports> udp_ports_;
+uint32_t remote_addr_;
+std::shared_ptr<Serial_read_stats> serial_read_stats_;
+std::shared_ptr<Link_negotiator> link_negotiator_;
+std::shared_ptr<Metrics_server> metrics_server_;
+std::string link_label_;
+asio::steady_timer serial_stats_timer_(io_service_);
+#ifdef U2S_HAVE_IO_URING
+// In io_uring mode, the ring that the serial port and the UDP sockets go
+// through, and how many times it had been entered when the serial
+// statistics were last logged.
+std::shared_ptr<Uring_io> uring_;
+size_t uring_enters_ = 0;
+#endif
 
-void tcp_server_accept_handler(std::shared_ptr<Tcp_server_handler> handler, const boost::system::error_code& ec)
-{
-	if (ec)
-	{ 
-		BOOST_LOG_TRIVIAL(error) << ec.message();
-		return;
-	}
-	BOOST_LOG_TRIVIAL(debug) << "Accepted connection on TCP port " << handler->socket().local_endpoint().port();	
+// How often the serial read statistics are logged and started over.
+const static auto SERIAL_STATS_INTERVAL = std::chrono::seconds(60);
+
+// A timer that is due this often.  How late its handler runs is how long
+// the loop takes to notice that something is ready, which is what busy
+// polling is meant to cut, so the two modes can be compared.
+const static auto WAKE_PROBE_INTERVAL = std::chrono::milliseconds(100);
+asio::steady_timer wake_timer_(io_service_);
+struct log2_histogram wake_latency_;
+
+// In busy-poll mode, how many times the loop went to sleep for want of
+// serial traffic.
+bool busy_poll_ = false;
+uint64_t busy_poll_sleeps_ = 0;
 
+// When we run out of file descriptors, the acceptor waits this long for
+// some to be freed before trying again.
+const static auto ACCEPT_RETRY = std::chrono::milliseconds(100);
 
-	// Start up the waiting handler.
-	BOOST_LOG_TRIVIAL(debug) << "Starting handler on TCP server " << handler->socket().remote_endpoint().port() << " -> " << handler->socket().local_endpoint().port();
-	handler->start();
+void tcp_server_accept_next(uint16_t port);
 
+void tcp_server_accept_handler(std::shared_ptr<Tcp_server_handler> handler, uint16_t port, const boost::system::error_code& ec)
+{
+	if (ec == asio::error::operation_aborted)
+		return;
+	if (ec == asio::error::no_descriptors || ec == asio::error::no_buffer_space)
+	{
+		LOG(warning) << "TCP port " << port << ": " << ec.message();
+		auto retry = std::make_shared<asio::steady_timer>(io_service_, ACCEPT_RETRY);
+		retry->async_wait([retry, port](const boost::system::error_code&)
+		{
+			tcp_server_accept_next(port);
+		});
+		return;
+	}
+	if (ec)
+		LOG(error) << "TCP port " << port << ": " << ec.message();
+	else
+		handler->start();
+	tcp_server_accept_next(port);
+}
 
-	// Queue up a new handler for the next connection..
-	uint16_t port = handler->socket().local_endpoint().port();
-	std::shared_ptr<Tcp_server_handler> handler2 = std::make_shared<Tcp_server_handler>(io_service_, serial_port_);
-	tcp_server_handler_list_.push_back(handler2);
-	auto func = std::bind(tcp_server_accept_handler, handler2, _1);
-	auto p_tcp_acptr = tcp_server_acceptor_map_.at(port);	
-	p_tcp_acptr->async_accept(handler2->socket(), func);	
+// Queue up a new handler for the next connection.
+void tcp_server_accept_next(uint16_t port)
+{
+	std::shared_ptr<Tcp_server_handler> handler = std::make_shared<Tcp_server_handler>(io_service_, stream_mux_, remote_addr_);
+	auto func = std::bind(tcp_server_accept_handler, handler, port, _1);
+	tcp_server_acceptor_map_.at(port)->async_accept(handler->socket(), func);
 }
 
 
 const static size_t SERIAL_READ_BUFFER_SIZE = 8*1024;
 unsigned char serial_read_buffer_raw_[SERIAL_READ_BUFFER_SIZE];
-std::vector<uint8_t> serial_read_buffer_unprocessed_;
 
+// Frames are decoded as their bytes arrive, into one buffer big enough
+// for the largest frame the far end sends.  Whoever a frame is handed
+// to must copy out anything they want to keep.
+const static size_t SERIAL_FRAME_MAX = LINK_UDP_HEADER_LEN + 65536;
+std::vector<uint8_t> serial_frame_(SERIAL_FRAME_MAX);
+struct slip_decoder serial_decoder_;
 
-void serial_read_handler(
-  const boost::system::error_code& error, // Result of operation.
-  std::size_t bytes_transferred           // Number of bytes read.
-)
+// Bytes read so far of the frame being decoded, escapes and all.
+size_t serial_frame_wire_ = 0;
+
+// Route one decoded frame.  Returns false if it made no sense, which
+// at a negotiated rate is a sign that the rate isn't working.
+bool serial_frame_handler(const uint8_t *frame, size_t len)
 {
-	serial_read_buffer_unprocessed_.insert(serial_read_buffer_unprocessed_.end(), (unsigned char *)&serial_read_buffer_raw_[0], serial_read_buffer_raw_ + bytes_transferred);
-	// BOOST_LOG_TRIVIAL(debug) << "serial port has " << serial_read_buffer_unprocessed_.size() << " bytes";
-
-	// See if this is a complete SLIP message
-	std::vector<uint8_t> slip_msg;
-	size_t bytes_decoded;
-	bytes_decoded = slip_decode(slip_msg, serial_read_buffer_unprocessed_, false);
-	if (bytes_decoded > 0)
+	// A stamped frame is handled like the frame inside it, once we know
+	// how long it took to get here.
+	uint32_t stamp;
+	bool stamped = link_frame_type(frame, len) == LINK_FRAME_STAMP;
+	if (stamped && !link_stamp_strip(frame, len, stamp))
 	{
-		serial_read_buffer_unprocessed_.erase(serial_read_buffer_unprocessed_.begin(), serial_read_buffer_unprocessed_.begin() + bytes_decoded);
-
-		bool ret = ip_bytevector_validate(slip_msg);
-		if (ret)
+		metric_add(link_metrics_.decode_errors + DECODE_UNKNOWN_FRAME);
+		return false;
+	}
+	uint8_t frame_type = link_frame_type(frame, len);
+	USDT(udptoserial, frame_decoded, frame_type, len, frame);
+	link_count_frame(METRIC_RX, frame, len);
+	const struct link_clock& far_clock = serial_writer_->far_clock();
+	if (stamped && far_clock.valid)
+		link_count_latency(LATENCY_LINK, link_flow_class(frame, len),
+			(int32_t)(link_now_usec() - link_clock_to_local(far_clock, stamp)));
+	if (frame_type == LINK_FRAME_RATE)
+	{
+		if (link_negotiator_)
+			link_negotiator_->handle_frame(frame, len);
+	}
+	else if (frame_type == LINK_FRAME_PROBE)
+		serial_writer_->handle_probe(frame, len);
+	else if (frame_type == LINK_FRAME_PROBE_ECHO)
+		serial_writer_->handle_probe_echo(frame, len);
+	else if (frame_type >= LINK_FRAME_MUX_OPEN && frame_type <= LINK_FRAME_MUX_CREDIT)
+		stream_mux_->dispatch(frame, len);
+	else if (frame_type == LINK_FRAME_UDP || frame_type == LINK_FRAME_UDP_BATCH)
+		udp_ports_->send_packet(frame, len);
+	else
+	{
+		std::vector<uint8_t> slip_msg(frame, frame + len);
+		if (ip_bytevector_validate(slip_msg))
 		{
 			if (ip_bytevector_is_udp(slip_msg))
-				BOOST_LOG_TRIVIAL(debug) << "Valid slip-decoded UDP message of " << bytes_decoded << " bytes";
-			else if (ip_bytevector_is_tcp(slip_msg))
-			{
-				struct ip_tcp_hdr *phdr = (struct ip_tcp_hdr*)slip_msg.data();
-
-				// Make sure that the data in the sin_port and sin_addr are
-				// in network byte order.
-				struct sockaddr_in saddr, daddr;
-				saddr.sin_family = AF_INET;
-				saddr.sin_addr.s_addr = phdr->_ip_hdr.saddr;
-				saddr.sin_port = phdr->_tcp_hdr.source_port;
-				daddr.sin_family = AF_INET;
-				daddr.sin_addr.s_addr = phdr->_ip_hdr.daddr;
-				daddr.sin_port = phdr->_tcp_hdr.destination_port;
-				BOOST_LOG_TRIVIAL(debug) << "Valid slip-decoded TCP message of " << bytes_decoded << " bytes";
-				BOOST_LOG_TRIVIAL(debug) << inet_ntoa(saddr.sin_addr) << ":"  << ntohs(saddr.sin_port)
-					<< " -> " << inet_ntoa(daddr.sin_addr) << ":"  << ntohs(daddr.sin_port);
-
-				// Check to see if we have an ephemeral TCP client port that is handling this
-				// particular connection
-				struct ephemeral_connection key;
-				key.saddr = ntohl(saddr.sin_addr.s_addr);
-				key.daddr = ntohl(daddr.sin_addr.s_addr);
-				key.sport = ntohs(saddr.sin_port);
-				key.dport = ntohs(daddr.sin_port);
-				auto search = tcp_ephemeral_socket_map_.find(key);
-				if (search == tcp_ephemeral_socket_map_.end())
-				{
-					// Make a new ephemeral socket to handle this connection pair
-					asio::ip::address ADDR = asio::ip::address_v4(key.daddr); 
-					asio::ip::tcp::endpoint ENDPOINT(ADDR, key.dport);
-					auto p_socket = std::make_shared<asio::ip::tcp::socket>(io_service_);
-					boost::system::error_code ec;
-					p_socket->connect(ENDPOINT, ec);
-					if (ec)
-					{
-						// A connection error occurred
-						BOOST_LOG_TRIVIAL(debug) << "Connection failure " 
-							<< inet_ntoa(saddr.sin_addr) << ":"  << ntohs(saddr.sin_port)
-							<< " -> " << inet_ntoa(daddr.sin_addr) << ":"  << ntohs(daddr.sin_port);
-						// FIXME: to avoid flooding connection attempts,
-						// there should be code here to avoid attempting a connection
-						// if such an attempt has occurred in the previous second or so.
-					}
-					else
-					{
-						tcp_ephemeral_socket_map_.insert(std::make_pair(key, p_socket));
-						p_socket->send(boost::asio::buffer(slip_msg.data() + ip_bytevector_data_start(slip_msg),
-							slip_msg.size() - ip_bytevector_data_start(slip_msg)));
-
-						// ADD read handler here.
-						
-						p_socket->async_read_some(MutableBuffer, Read Handler);
-						(asio::mutable_buffers_1(serial_read_buffer_raw_, SERIAL_READ_BUFFER_SIZE),
-						serial_read_handler);						
-					}
-				}
-				else
-				{
-					// Forward this message using an existing socket
-					search->second->send(boost::asio::buffer(slip_msg.data() + ip_bytevector_data_start(slip_msg),
-						slip_msg.size() - ip_bytevector_data_start(slip_msg)));
-				}
-			}
+				LOG_EVENT(debug, "Valid slip-decoded UDP message of {} bytes", len);
 			else
-				BOOST_LOG_TRIVIAL(debug) << "Valid slip-decoded message of " << bytes_decoded << " bytes";
+				LOG_EVENT(debug, "Valid slip-decoded message of {} bytes", len);
 		}
 		else
-			BOOST_LOG_TRIVIAL(debug) << "Invalid slip decoded message of " << bytes_decoded << " bytes";
+		{
+			LOG_EVENT(debug, "Invalid slip decoded message of {} bytes", len);
+			metric_add(link_metrics_.decode_errors + DECODE_UNKNOWN_FRAME);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Decode and route every complete frame in the BYTES_TRANSFERRED bytes
+// just read into BYTES.
+void serial_bytes_received(const uint8_t *bytes, std::size_t bytes_transferred)
+{
+	auto now = std::chrono::steady_clock::now();
+	serial_writer_->count_received(bytes_transferred);
+	serial_read_stats_->on_read(now, bytes_transferred);
+	metric_add(link_metrics_.bytes + METRIC_RX, bytes_transferred);
+	if (link_negotiator_)
+		link_negotiator_->count_received(bytes_transferred);
+
+	// Handle every complete SLIP message we have.
+	const uint8_t *p = bytes;
+	size_t left = bytes_transferred;
+	while (left > 0)
+	{
+		bool complete;
+		size_t used = slip_decoder_feed(serial_decoder_, p, left, complete);
+		p += used;
+		left -= used;
+		serial_frame_wire_ += used;
+		if (!complete)
+			break;
+		bool good = true;
+		if (serial_decoder_.overflow)
+		{
+			LOG_EVENT(debug, "Dropped a slip message longer than {} bytes", SERIAL_FRAME_MAX);
+			metric_add(link_metrics_.decode_errors + DECODE_SLIP_OVERFLOW);
+			capture_frame(CAPTURE_BAD, CAPTURE_IN, serial_decoder_.frame, serial_decoder_.len);
+			good = false;
+		}
+		else if (serial_decoder_.len > 0)
+		{
+			good = serial_frame_handler(serial_decoder_.frame, serial_decoder_.len);
+			serial_read_stats_->on_frame(std::chrono::steady_clock::now() - now);
+			if (good)
+				capture_link_frame(CAPTURE_IN, serial_decoder_.frame, serial_decoder_.len);
+			else
+				capture_frame(CAPTURE_BAD, CAPTURE_IN, serial_decoder_.frame, serial_decoder_.len);
+		}
+		if (good && link_negotiator_)
+			link_negotiator_->count_good(serial_frame_wire_);
+		serial_frame_wire_ = 0;
+		slip_decoder_reset(serial_decoder_);
 	}
+}
+
+void serial_read_handler(
+  const boost::system::error_code& error, // Result of operation.
+  std::size_t bytes_transferred           // Number of bytes read.
+)
+{
+	serial_bytes_received(serial_read_buffer_raw_, bytes_transferred);
+
 	// And queue up the next async read
 
 	serial_port_->async_read_some
 	(asio::mutable_buffers_1(serial_read_buffer_raw_, SERIAL_READ_BUFFER_SIZE),
-	serial_read_handler);
+	make_custom_alloc_handler(serial_read_pool_, serial_read_handler));
+}
+
+#ifdef U2S_HAVE_IO_URING
+// In io_uring mode the serial port is read through the ring instead,
+// into a pooled buffer that is registered with it, and each read queues
+// the next.
+packet serial_read_packet_;
+
+struct Serial_uring_reader : public Uring_handler
+{
+	void start()
+	{
+		uring_->read(serial_port_->native_handle(), serial_read_packet_.data(), SERIAL_READ_BUFFER_SIZE, this);
+	}
+
+	void completed(const struct io_uring_cqe& cqe) override
+	{
+		if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR)
+		{
+			LOG(error) << "serial read: " << strerror(-cqe.res);
+			return;
+		}
+		if (cqe.res > 0)
+			serial_bytes_received(serial_read_packet_.data(), cqe.res);
+		start();
+	}
+};
+Serial_uring_reader serial_uring_reader_;
+#endif
+
+void serial_stats_timer_handler(const boost::system::error_code& error)
+{
+	if (error)
+		return;
+	if (serial_read_stats_->reads() > 0)
+		LOG(info) << "serial reads: " << serial_read_stats_->summary();
+	serial_read_stats_->reset();
+	if (serial_writer_->frames_per_write().count > 0)
+		LOG(info) << "serial writes: " << serial_writer_->write_summary();
+	serial_writer_->reset_write_stats();
+	if (stream_mux_->ingress_bytes().count > 0)
+		LOG(info) << "tcp ingress: " << stream_mux_->ingress_summary();
+	stream_mux_->reset_ingress_stats();
+	if (wake_latency_.count > 0)
+	{
+		LOG(info) << (busy_poll_ ? "busy poll" : "event loop") << " wake latency p50 <"
+			<< log2_histogram_percentile(wake_latency_, 0.5) << " p99 <"
+			<< log2_histogram_percentile(wake_latency_, 0.99) << " us"
+			<< (busy_poll_ ? ", slept " + std::to_string(busy_poll_sleeps_) + " times" : "");
+	}
+	log2_histogram_reset(wake_latency_);
+	busy_poll_sleeps_ = 0;
+#ifdef U2S_HAVE_IO_URING
+	if (uring_)
+	{
+		LOG(info) << "io_uring entered " << uring_->enters() - uring_enters_ << " times";
+		uring_enters_ = uring_->enters();
+	}
+#endif
+	serial_stats_timer_.expires_from_now(SERIAL_STATS_INTERVAL);
+	serial_stats_timer_.async_wait(serial_stats_timer_handler);
+}
+
+void wake_timer_handler(const boost::system::error_code& error)
+{
+	if (error)
+		return;
+	auto late = std::chrono::steady_clock::now() - wake_timer_.expiry();
+	log2_histogram_add(wake_latency_, std::chrono::duration_cast<std::chrono::microseconds>(late).count());
+	wake_timer_.expires_at(wake_timer_.expiry() + WAKE_PROBE_INTERVAL);
+	wake_timer_.async_wait(wake_timer_handler);
+}
+
+#ifndef WIN32
+// Only made when there is a capture file, so that otherwise SIGUSR1 is
+// left alone.
+std::shared_ptr<asio::signal_set> capture_signals_;
+
+void capture_signal_handler(const boost::system::error_code& error, int)
+{
+	if (error)
+		return;
+	capture_set(!capture_is_on());
+	capture_signals_->async_wait(capture_signal_handler);
+}
+
+// The busy-poll loop, run in place of io_service_.run().  This thread
+// spins on the serial port with non-blocking reads, decoding and routing
+// frames as soon as they arrive, and runs whatever else the io_service
+// has ready in between.  Echoes and replies are written from here too,
+// since Asio tries an async write right away before involving the
+// reactor.  Once the serial port has been quiet for IDLE, the loop
+// sleeps in the reactor until it, or anything else, needs attention.
+void busy_poll_run(std::chrono::milliseconds idle)
+{
+	int fd = serial_port_->native_handle();
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	// Waiting on a duplicate of the descriptor means that cancelling the
+	// wait leaves the serial writer's operations alone.
+	asio::posix::stream_descriptor waiter(io_service_, dup(fd));
+	bool waiting = false;
+
+	auto last_read = std::chrono::steady_clock::now();
+	while (!io_service_.stopped())
+	{
+		ssize_t n = read(fd, serial_read_buffer_raw_, SERIAL_READ_BUFFER_SIZE);
+		if (n > 0)
+		{
+			serial_bytes_received(serial_read_buffer_raw_, n);
+			last_read = std::chrono::steady_clock::now();
+		}
+		else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			LOG(error) << "serial read: " << strerror(errno);
+			break;
+		}
+		io_service_.poll();
+		if (n > 0 || std::chrono::steady_clock::now() - last_read < idle)
+			continue;
+
+		busy_poll_sleeps_++;
+		bool readable = false;
+		waiting = true;
+		waiter.async_wait(asio::posix::stream_descriptor::wait_read,
+			[&](const boost::system::error_code& ec)
+		{
+			waiting = false;
+			readable = !ec;
+		});
+		io_service_.run_one();
+		if (waiting)
+		{
+			waiter.cancel();
+			while (waiting && io_service_.run_one() > 0)
+				;
+		}
+		if (readable)
+			last_read = std::chrono::steady_clock::now();
+	}
+}
+#endif
+
+// Apply the configured latency settings to the serial port, and log
+// what it ended up with, since drivers quietly ignore some of them.
+void serial_port_tune(const serial_tune_t& want)
+{
+	serial_tune_t got;
+	char buf[128];
+#ifdef WIN32
+	serial_tune_init(&got);
+	int missed = 0;
+#else
+	int missed = serial_tune_apply(serial_port_->native_handle(), &want, &got);
+#endif
+	serial_tune_describe(&got, buf, sizeof(buf));
+	LOG(info) << "serial port latency settings: " << buf;
+	if (missed > 0)
+	{
+		serial_tune_describe(&want, buf, sizeof(buf));
+		LOG(warning) << missed << " serial port latency settings didn't take; wanted " << buf;
+	}
+}
+
+// Set the serial port to BAUD, which needn't be one of the standard
+// rates where the driver can do it.  Returns false if it can't.
+bool serial_port_set_baud(uint32_t baud)
+{
+#ifndef WIN32
+	int fd = serial_port_->native_handle();
+	if (serial_set_baud(fd, baud) == 0)
+	{
+		unsigned got = serial_get_baud(fd);
+		if (got != 0 && got != baud)
+			LOG(info) << "serial port asked for " << baud << " baud, got " << got;
+		if (serial_read_stats_)
+			serial_read_stats_->set_baud_rate(baud);
+		return true;
+	}
+	if (errno != ENOSYS)
+	{
+		LOG(warning) << "serial port can't be set to " << baud << " baud: " << strerror(errno);
+		return false;
+	}
+#endif
+	// Only the standard rates, then.
+	boost::system::error_code ec;
+	serial_port_->set_option(asio::serial_port_base::baud_rate(baud), ec);
+	if (ec)
+	{
+		LOG(warning) << "serial port can't be set to " << baud << " baud: " << ec.message();
+		return false;
+	}
+	if (serial_read_stats_)
+		serial_read_stats_->set_baud_rate(baud);
+	return true;
+}
+
+// Everything for the metrics socket: the registered counters, then what
+// is read off the writer and the flows as it is asked for.
+void metrics_write_all(std::string& dest)
+{
+	metrics_write(dest);
+
+	std::string link;
+	metrics_add_label(link, "link", link_label_);
+	metrics_write_header(dest, "udptoserial_serial_queue_bytes",
+		"Bytes of data frames waiting for the serial port.", "gauge");
+	metrics_write_sample(dest, "udptoserial_serial_queue_bytes", link, (double)serial_writer_->queued_bytes());
+	metrics_write_header(dest, "udptoserial_pacing_rate_bytes",
+		"Bytes per second the serial writer is pacing output to, or zero if it isn't.", "gauge");
+	metrics_write_sample(dest, "udptoserial_pacing_rate_bytes", link, (double)serial_writer_->pacing_rate());
+	metrics_write_header(dest, "udptoserial_flows", "Open TCP connections and UDP sessions.", "gauge");
+	metrics_write_sample(dest, "udptoserial_flows", "proto=\"tcp\"", (double)stream_mux_->flows());
+	metrics_write_sample(dest, "udptoserial_flows", "proto=\"udp\"", (double)udp_ports_->sessions());
+
+	std::vector<struct Flow_stats> flows;
+	stream_mux_->flow_stats(flows);
+	udp_ports_->flow_stats(flows);
+	flow_metrics_write(dest, flows);
 }
 
 int main()
@@ -173,6 +487,7 @@ int main()
 	go = true;
 
 	Configuration config("udptoserial.ini");
+	log_start(config.log_level, config.event_file);
 #if 1
 	// ipv4_test();
 #endif
@@ -185,23 +500,125 @@ int main()
 		printf("Winsock initialization failure with error %d\n", ret);
 		return 1;
 	}
+#else
+	// Each proxied connection takes a descriptor, on each end, so take
+	// as many as we are allowed.
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max)
+	{
+		nofile.rlim_cur = nofile.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
 #endif
 
-	BOOST_LOG_TRIVIAL(debug) << "Adding new serial port port " << config.serial_port_name;
+	link_label_ = config.serial_port_name;
+	link_metrics_register(link_label_);
+
+	LOG(debug) << "Adding new serial port port " << config.serial_port_name;
 	serial_port_ = std::make_shared<asio::serial_port>(io_service_);
 	serial_port_->open(config.serial_port_name);
-	serial_port_->set_option(asio::serial_port_base::baud_rate(config.baud_rate));
+	if (config.cts_flow)
+		serial_port_->set_option(asio::serial_port_base::flow_control(asio::serial_port_base::flow_control::hardware));
+	serial_port_tune(config.serial_tune);
+	// The rate goes last, since setting the other termios options
+	// through the old interface can undo a non-standard rate.
+	if (!serial_port_set_baud(config.baud_rate))
+		return 1;
+	serial_read_stats_ = std::make_shared<Serial_read_stats>(config.baud_rate);
+	serial_stats_timer_.expires_from_now(SERIAL_STATS_INTERVAL);
+	serial_stats_timer_.async_wait(serial_stats_timer_handler);
+
+	// With io_uring on, the serial port and the UDP sockets go through a
+	// ring, if the kernel has what it takes.
+#ifdef U2S_HAVE_IO_URING
+	if (config.io_uring)
+	{
+		auto ring = std::make_shared<Uring_io>(io_service_);
+		if (ring->open())
+		{
+			uring_ = ring;
+			uring_->register_pool(big_packet_pool_);
+			LOG(info) << "serial port and UDP sockets going through io_uring";
+		}
+		else
+			LOG(warning) << "io_uring can't be used, so everything goes through epoll";
+	}
+#else
+	if (config.io_uring)
+		LOG(warning) << "io_uring isn't built in, so everything goes through the reactor";
+#endif
 
-	// Queue up an async read handler
+	// All output to the serial port is paced through the writer.  With
+	// auto pacing, it starts measuring the link right away.
+	serial_writer_ = std::make_shared<Serial_writer>(io_service_, serial_port_,
+		config.baud_rate, config.throttle_baud_rate, config.auto_pacing,
+		config.tty_queue, config.cts_flow, config.timestamps);
+#ifdef U2S_HAVE_IO_URING
+	if (uring_)
+		serial_writer_->use_uring(uring_);
+#endif
+	serial_writer_->start();
 
-	serial_port_->async_read_some
-	(asio::mutable_buffers_1(serial_read_buffer_raw_, SERIAL_READ_BUFFER_SIZE),
-	serial_read_handler);
+	// With negotiation on, the link moves up from the configured rate
+	// once the far end agrees to a faster one.
+	if (config.negotiate)
+	{
+		link_negotiator_ = std::make_shared<Link_negotiator>(io_service_, serial_writer_,
+			packet_pool_, config.baud_rate, config.rates, serial_port_set_baud);
+		link_negotiator_->start();
+	}
+
+	// Proxied TCP connections are multiplexed over the link.  Clients
+	// that connect here are forwarded to the far end's remote_ip.
+	remote_addr_ = asio::ip::address_v4::from_string(config.remote_ip).to_ulong();
+	stream_mux_ = std::make_shared<Stream_mux>(io_service_, serial_writer_, packet_pool_,
+		config.max_connections, config.idle_timeout,
+		config.coalesce_delay, config.coalesce_bytes);
+	stream_mux_->start();
+
+	// UDP datagrams to the same ports are proxied too.
+	udp_ports_ = std::make_shared<Udp_ports>(io_service_, serial_writer_,
+		packet_pool_, big_packet_pool_, remote_addr_,
+		config.port_numbers, config.udp_max_sessions, config.udp_idle_timeout,
+		config.udp_batch_delay, config.udp_batch_bytes);
+#ifdef U2S_HAVE_IO_URING
+	if (uring_)
+		udp_ports_->use_uring(uring_);
+#endif
+	udp_ports_->open();
+
+	// Queue up an async read handler, unless the busy-poll loop is going
+	// to read the port itself.
+	slip_decoder_init(serial_decoder_, serial_frame_.data(), serial_frame_.size());
+
+	busy_poll_ = config.busy_poll;
+#ifdef WIN32
+	if (busy_poll_)
+		LOG(warning) << "busy polling is Linux-only";
+	busy_poll_ = false;
+#endif
+	if (busy_poll_ && std::thread::hardware_concurrency() < 2)
+	{
+		LOG(warning) << "busy polling needs a CPU of its own, and there is only one";
+		busy_poll_ = false;
+	}
+#ifdef U2S_HAVE_IO_URING
+	if (!busy_poll_ && uring_)
+	{
+		serial_read_packet_ = big_packet_pool_.alloc();
+		serial_uring_reader_.start();
+	}
+	else
+#endif
+	if (!busy_poll_)
+		serial_port_->async_read_some
+		(asio::mutable_buffers_1(serial_read_buffer_raw_, SERIAL_READ_BUFFER_SIZE),
+		make_custom_alloc_handler(serial_read_pool_, serial_read_handler));
 
 	for (uint16_t port : config.port_numbers)
 	{
 
-		BOOST_LOG_TRIVIAL(debug) << "Adding new TCP server port " << port;
+		LOG(debug) << "Adding new TCP server port " << port;
 
 		// We start off making an acceptor that we will later use to join a handler
 		// to new connections on this port.
@@ -214,16 +631,46 @@ int main()
 		p_tcp_acptr->listen();
 
 		tcp_server_acceptor_map_.insert(std::make_pair(port, p_tcp_acptr));
+		tcp_server_accept_next(port);
+	}
+
 
-		// Queue up an async handler
-		std::shared_ptr<Tcp_server_handler> handler = std::make_shared<Tcp_server_handler>(io_service_, serial_port_);
-		tcp_server_handler_list_.push_back(handler);
-		auto func = std::bind(tcp_server_accept_handler, handler, _1);
-		p_tcp_acptr->async_accept(handler->socket(), func);
+	if (!config.metrics_socket.empty())
+	{
+		metrics_server_ = std::make_shared<Metrics_server>(io_service_, config.metrics_socket, metrics_write_all);
+		metrics_server_->open();
 	}
 
+	wake_timer_.expires_from_now(WAKE_PROBE_INTERVAL);
+	wake_timer_.async_wait(wake_timer_handler);
+
+	// SIGUSR1 turns capture on and off.
+	if (!config.capture_file.empty())
+	{
+		capture_start(config.capture_file, (uint64_t)config.capture_size << 20, config.capture_files,
+			config.capture_snaplen, config.capture_start);
+#ifndef WIN32
+		capture_signals_ = std::make_shared<asio::signal_set>(io_service_, SIGUSR1);
+		capture_signals_->async_wait(capture_signal_handler);
+#endif
+	}
 
-	io_service_.run();
+#ifndef WIN32
+	if (busy_poll_)
+	{
+		char buf[128];
+		int missed = realtime_enter(&config.realtime);
+		realtime_describe(&config.realtime, buf, sizeof(buf));
+		LOG(info) << "busy polling the serial port: " << buf;
+		if (missed > 0)
+			LOG(warning) << missed << " real-time settings didn't take";
+		busy_poll_run(std::chrono::milliseconds(config.busy_poll_idle));
+	}
+	else
+#endif
+		io_service_.run();
+	capture_stop();
+	log_stop();
 #if 0
 	asio_generic_server server;
 	server.add_tcp_server_port(8888);
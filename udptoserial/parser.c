@@ -228,9 +228,13 @@ size_t pack_message(unpacked_msg_t *msg, char *buf, size_t len)
 	/* OK, if we're here, there is a valid packed message in PACKED_MSG. */
 	size_t packed_len = strlen(packed_msg);
 	assert(packed_len < len);
-	strncpy(buf, packed_msg, packed_len);
+	memcpy(buf, packed_msg, packed_len + 1);
 	free(packed_msg);
 
-	unpack_message(msg, buf, strlen(buf));
+	/* Check that it unpacks again. */
+	unpacked_msg_t check;
+	unpack_message(&check, buf, packed_len);
+	if (check.valid)
+		free(check.data);
 	return packed_len;
 }
@@ -2,202 +2,237 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #else
-#include <sys/time.h>
+#include <errno.h>
 #endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "queue.h"
-#include "base64.h"
 #include "parser.h"
 
-static unsigned short crc16(const unsigned char* data_p, int length);
-
 /* This is a queue of packets to be sent down the serial pipe. */
 
-static int64_t get_time_now_usec()
+/* Under pacing, a packet can join a write this far ahead of its slot. */
+#define PKT_QUEUE_PACE_BURST_USEC (5000)
+
+/* The time in microseconds, from a clock that never steps backwards. */
+int64_t pkt_queue_now_usec()
 {
 #ifdef WIN32
-	SYSTEMTIME tval;
-	FILETIME ftval;
-	ULARGE_INTEGER uftval;
+  return (int64_t)GetTickCount64() * 1000LL;
 #else
-	struct timeval tval;
-#endif
+  struct timespec ts;
 
-#ifdef WIN32
-	GetSystemTime(&tval);
-	SystemTimeToFileTime(&tval, &ftval);
-	uftval.HighPart = ftval.dwHighDateTime;
-	uftval.LowPart = ftval.dwLowDateTime;
-	/* Convert to microseconds. */
-	return (int64_t) uftval.QuadPart / 10LL;
-#else
-	if (gettimeofday(&tval, NULL) < 0)
-	{
-		perror("gettimeofday");
-		return -1;
-	}
-	else
-		return (int64_t)tval.tv_sec * 1000000LL + (int64_t)tval.tv_usec;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    {
+      perror("clock_gettime");
+      return -1;
+    }
+  else
+    return (int64_t)ts.tv_sec * 1000000LL + (int64_t)ts.tv_nsec / 1000LL;
 #endif
-
 }
 
-/* Append new packet information to the end of the packet queue. */
-pkt_queue_t *pkt_queue_append(pkt_queue_t *queue,
-			      uint16_t source, uint16_t dest, char *payload, size_t len)
+/* Create a queue that holds up to CAPACITY packets, rounded up to a
+   power of two.  All of its memory is allocated here. */
+pkt_queue_t *pkt_queue_new(size_t capacity)
 {
-  pkt_queue_t *new_queue;
-  pkt_queue_t *last;
-  
-  new_queue = (pkt_queue_t *) malloc(sizeof(pkt_queue_t));
-  new_queue->timestamp = get_time_now_usec();
-  new_queue->source = source;
-  new_queue->dest = dest;
-  new_queue->data = (char *)malloc(len + 1);
-  memcpy(new_queue->data, payload, len);
-  new_queue->data[len] = '\0';
-  new_queue->len = len;
-  new_queue->next = NULL;
-
-  if (queue)
-    {
-      last = pkt_queue_last(queue);
-      last->next = new_queue;
-      new_queue->prev = last;
+  pkt_queue_t *queue;
+  size_t n = 1;
 
-      return queue;
-    }
-  else
+  while (n < capacity)
+    n *= 2;
+
+  queue = (pkt_queue_t *) calloc(1, sizeof(pkt_queue_t));
+  if (queue == NULL)
+    return NULL;
+  queue->slots = (pkt_t *) malloc(n * sizeof(pkt_t));
+  queue->sendbuf = (char *) malloc(PKT_QUEUE_SENDBUF_MAX);
+  if (queue->slots == NULL || queue->sendbuf == NULL)
     {
-      new_queue->prev = NULL;
-      return new_queue;
+      pkt_queue_free(queue);
+      return NULL;
     }
+  queue->capacity = n;
+  return queue;
 }
 
-pkt_queue_t *pkt_queue_last(pkt_queue_t *queue)
+void pkt_queue_free(pkt_queue_t *queue)
 {
   if (queue == NULL)
-    return NULL;
-
-  while (queue->next != NULL)
-    queue = queue->next;
-
-  return queue;
+    return;
+  free(queue->slots);
+  free(queue->sendbuf);
+  free(queue);
 }
 
-/* Append new packet information to the beginning of the packet queue. */
-pkt_queue_t *pkt_queue_prepend(pkt_queue_t *queue,
-			    uint16_t source, uint16_t dest, char *payload, size_t len)
+/* Return the free slot at the end of the queue, so that a packet can be
+   received straight into it, or NULL if the queue is full.  The packet
+   isn't queued until pkt_queue_commit is called. */
+pkt_t *pkt_queue_reserve(pkt_queue_t *queue)
 {
-  pkt_queue_t *new_queue;
-
-  new_queue = (pkt_queue_t *)malloc(sizeof(pkt_queue_t));
-  new_queue->timestamp = get_time_now_usec();
-  new_queue->source = source;
-  new_queue->dest = dest;
-  memcpy(new_queue->data, payload, len);
-  new_queue->len = len;
-  new_queue->next = queue;
-
-  if (queue)
-    queue->prev = new_queue;
-  else
-    new_queue->prev = NULL;
-
-  return new_queue;
+  if (queue->length == queue->capacity)
+    return NULL;
+  return &queue->slots[(queue->head + queue->length) & (queue->capacity - 1)];
 }
 
-size_t pkt_queue_length (pkt_queue_t *queue)
+/* Queue the packet in the slot from pkt_queue_reserve. */
+void pkt_queue_commit(pkt_queue_t *queue, uint16_t source, uint16_t dest, size_t len)
 {
-  if (queue == NULL)
-    return 0;
-  int i = 1;
-  while (queue->next == NULL)
-    {
-      queue = queue->next;
-      i++;
-    }
-  return i;
+  pkt_t *pkt = &queue->slots[(queue->head + queue->length) & (queue->capacity - 1)];
+
+  pkt->timestamp = pkt_queue_now_usec();
+  pkt->source = source;
+  pkt->dest = dest;
+  pkt->len = len;
+  queue->length++;
+  queue->bytes += len;
 }
 
-size_t pkt_queue_size (pkt_queue_t *queue)
+/* Append new packet information to the end of the packet queue.
+   Returns false, and drops the packet, if the queue is full. */
+bool pkt_queue_append(pkt_queue_t *queue,
+		      uint16_t source, uint16_t dest, const char *payload, size_t len)
 {
-  if (queue == NULL)
-    return 0;
-  size_t siz = sizeof(pkt_queue_t) + queue->len;
-  while (queue->next == NULL)
+  pkt_t *pkt = pkt_queue_reserve(queue);
+
+  if (pkt == NULL)
     {
-      queue = queue->next;
-      siz += sizeof(pkt_queue_t) + queue->len;
+      queue->dropped++;
+      return false;
     }
-  return siz;
+  if (len > PKT_QUEUE_PAYLOAD_MAX)
+    len = PKT_QUEUE_PAYLOAD_MAX;
+  memcpy(pkt->data, payload, len);
+  pkt_queue_commit(queue, source, dest, len);
+  return true;
 }
 
-
-pkt_queue_t *pkt_queue_remove_first(pkt_queue_t *queue)
+pkt_t *pkt_queue_first(pkt_queue_t *queue)
 {
-  pkt_queue_t *next;
-
-  if (queue == NULL)
+  if (queue->length == 0)
     return NULL;
-  
-  free (queue->data);
+  return &queue->slots[queue->head];
+}
 
-  if (queue->next == NULL)
-    return NULL;
+void pkt_queue_remove_first(pkt_queue_t *queue)
+{
+  if (queue->length == 0)
+    return;
+  queue->bytes -= queue->slots[queue->head].len;
+  queue->head = (queue->head + 1) & (queue->capacity - 1);
+  queue->length--;
+}
 
-  next = queue->next;
-  next->prev = NULL;
-  free(queue);
-  return next;
+size_t pkt_queue_length (const pkt_queue_t *queue)
+{
+  return queue->length;
 }
 
-void pkt_queue_free(pkt_queue_t *queue)
+size_t pkt_queue_size (const pkt_queue_t *queue)
 {
-  while ((queue = pkt_queue_remove_first (queue)) != NULL)
-    ;
+  return queue->bytes;
 }
 
-size_t pkt_estimated_string_length (pkt_queue_t *queue)
+/* How long, in microseconds, the serial port takes to send LEN
+   characters.  Each one has a start bit and its stop and parity bits
+   as well as its data bits. */
+static int64_t pkt_wire_usec (const serial_port_t *port, size_t len)
 {
-  return (4 			/* send port */
-	  + 4			/* recv port */
-	  + 4			/* separators */
-	  + 2			/* CRC16 */
-	  + queue->len * 4 / 3);	/* Base64 packed payload */
+  int bits;
+
+  if (port == NULL || port->baud_rate <= 0)
+    return 0;
+  bits = 1 + port->byte_size + port->stop_bits + (port->parity != SP_NOPARITY);
+  return (int64_t)len * bits * 1000000LL / port->baud_rate;
 }
 
-char sendbuf[70000];
+/* Pack the packets at the head of the queue that are due to go out on
+   PORT into the send buffer, back to back, and take them off the queue.
+   NOW is the time from pkt_queue_now_usec.  Whatever was left in the
+   send buffer is discarded, so only call this once it has been written.
 
-pkt_queue_t *pkt_queue_send (pkt_queue_t *queue, serial_port_t *port)
+   Returns 0 if the queue is empty or something was packed, or else the
+   number of microseconds until the next packet is due.  */
+int64_t pkt_queue_pack (pkt_queue_t *queue, const serial_port_t *port, int64_t now)
 {
-  if (queue == NULL)
-    return NULL;
+  pkt_t *pkt = pkt_queue_first(queue);
 
-  int64_t time_now = get_time_now_usec();
-
-  if (port)
-  {
-	  if (((time_now - queue->timestamp) * 1000000 * port->baud_rate) < (int64_t)pkt_estimated_string_length(queue))
-	  {
-		  /* Delay sending packet to avoid flooding the port. */
-		  return queue;
-	  }
-  }
-
-  unpacked_msg_t msg;
-  msg.protocol = MSG_PROTOCOL_UDP;
-  msg.input_port = queue->source;
-  msg.output_port = queue->dest;
-  msg.data = queue->data;
-  msg.len = queue->len;
-  msg.valid = true;
-
-  size_t ret = pack_message(&msg, sendbuf, 70000);
-  serial_port_send (port, sendbuf, strlen(sendbuf));
-  return pkt_queue_remove_first (queue);
+  queue->send_off = queue->send_len = 0;
+  if (pkt == NULL)
+    return 0;
+  if (now < queue->next_send_usec)
+    return queue->next_send_usec - now;
+
+  while (pkt != NULL && queue->send_len < PKT_QUEUE_WRITE_BUDGET
+	 && (queue->send_len == 0
+	     || queue->next_send_usec <= now + PKT_QUEUE_PACE_BURST_USEC))
+    {
+      unpacked_msg_t msg;
+      size_t n;
+
+      msg.protocol = MSG_PROTOCOL_UDP;
+      msg.input_port = pkt->source;
+      msg.output_port = pkt->dest;
+      msg.data = (unsigned char *)pkt->data;
+      msg.len = pkt->len;
+      msg.valid = true;
+      n = pack_message(&msg, queue->sendbuf + queue->send_len,
+		       PKT_QUEUE_SENDBUF_MAX - queue->send_len);
+      queue->send_len += n;
+      queue->written++;
+      pkt_queue_remove_first (queue);
+      pkt = pkt_queue_first(queue);
+
+      if (queue->next_send_usec < now)
+	queue->next_send_usec = now;
+      queue->next_send_usec += pkt_wire_usec(port, n);
+    }
+  queue->writes++;
+  return 0;
 }
 
+/* Write the packets at the head of the queue to PORT, pacing packets so
+   that each one starts only once the one before has had time to go out
+   at the port's baud rate.  NOW is the time from pkt_queue_now_usec.
+
+   Several packets that are due go in one write.
+
+   Returns 0 once the queue is empty, PKT_QUEUE_SEND_BLOCKED if PORT
+   won't take any more until it is writable, or else the number of
+   microseconds to wait before calling this again.
+
+   This is a variation on the leaky bucket timer.  The bucket drains at
+   the serial port's data rate, and a packet is only put in once the
+   one before it has drained out, or is within PKT_QUEUE_PACE_BURST_USEC
+   of doing so.  A write can take every packet that is due, up to about
+   PKT_QUEUE_WRITE_BUDGET bytes, so the kernel's tty buffer can hold
+   that much, several packets' worth, at once.  Sparse traffic is
+   delayed only as long as the packets ahead of it take on the wire.  */
+int64_t pkt_queue_send (pkt_queue_t *queue, serial_port_t *port, int64_t now)
+{
+  while (true)
+    {
+      /* Finish the write that the port only took part of. */
+      while (queue->send_off < queue->send_len)
+	{
+	  long n = serial_port_send (port, queue->sendbuf + queue->send_off,
+				     queue->send_len - queue->send_off);
+	  if (n < 0)
+	    {
+#ifndef WIN32
+	      if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return PKT_QUEUE_SEND_BLOCKED;
+#endif
+	      /* The rest of this one is lost. */
+	      break;
+	    }
+	  queue->send_off += n;
+	}
+
+      int64_t wait = pkt_queue_pack (queue, port, now);
+      if (queue->send_len == 0)
+	return wait;
+    }
+}
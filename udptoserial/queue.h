@@ -1,33 +1,79 @@
 #ifndef U2S_QUEUE_H
 #define U2S_QUEUE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 #include "serial.h"
 
-typedef struct _pkt_queue_t pkt_queue_t;
+/* The largest UDP payload that is carried.  Longer datagrams are
+   truncated when they are received. */
+#define PKT_QUEUE_PAYLOAD_MAX (1500)
 
-struct _pkt_queue_t
+/* Room for the packed form of the largest payload: base64 makes it 4/3
+   as long, plus the header, lengths, CRC and delimiters. */
+#define PKT_PACKED_MAX (PKT_QUEUE_PAYLOAD_MAX * 4 / 3 + 64)
+
+/* Packets are packed back to back and written together, until there
+   are this many bytes.  That is one write() for several packets, and
+   keeps the kernel's tty buffer topped up between writes. */
+#define PKT_QUEUE_WRITE_BUDGET (8 * 1024)
+#define PKT_QUEUE_SENDBUF_MAX (PKT_QUEUE_WRITE_BUDGET + PKT_PACKED_MAX)
+
+/* pkt_queue_send returns this when the serial port won't take any more
+   until it is writable again. */
+#define PKT_QUEUE_SEND_BLOCKED (-1)
+
+typedef struct _pkt_t pkt_t;
+
+/* A packet, with its payload stored in the slot itself. */
+struct _pkt_t
 {
   int64_t timestamp;
   uint16_t source;
   uint16_t dest;
-  char *data;
   size_t len;
-  pkt_queue_t *next;
-  pkt_queue_t *prev;
+  char data[PKT_QUEUE_PAYLOAD_MAX];
+};
+
+typedef struct _pkt_queue_t pkt_queue_t;
+
+/* A FIFO of packets to be sent down the serial pipe.  All its slots are
+   allocated up front, in a ring, so queueing a packet never calls
+   malloc, and the length and byte count are kept as it goes. */
+struct _pkt_queue_t
+{
+  pkt_t *slots;
+  size_t capacity;		/* a power of two */
+  size_t head;
+  size_t length;
+  size_t bytes;			/* payload bytes queued */
+  size_t dropped;		/* packets that didn't fit */
+  size_t written;		/* packets handed to the serial port */
+  size_t writes;		/* in this many writes */
+
+  /* The serial port is free again at this time, in microseconds. */
+  int64_t next_send_usec;
+
+  /* The packed form of the packets being written, and how much of it
+     the serial port has taken so far. */
+  char *sendbuf;
+  size_t send_len;
+  size_t send_off;
 };
 
-pkt_queue_t *pkt_queue_append(pkt_queue_t *queue,
-			      uint16_t source, uint16_t dest, char *payload, size_t len);
-pkt_queue_t *pkt_queue_last(pkt_queue_t *queue);
-pkt_queue_t *pkt_queue_prepend(pkt_queue_t *queue,
-			       uint16_t source, uint16_t dest, char *payload, size_t len);
-size_t pkt_queue_length (pkt_queue_t *queue);
-size_t pkt_queue_size (pkt_queue_t *queue);
-pkt_queue_t *pkt_queue_remove_first(pkt_queue_t *queue);
-void pkt_queue_free(pkt_queue_t *queue);
-pkt_queue_t *pkt_queue_send (pkt_queue_t *queue, serial_port_t *port);
-char *pkt_stringify (pkt_queue_t *queue);
+pkt_queue_t *pkt_queue_new (size_t capacity);
+void pkt_queue_free (pkt_queue_t *queue);
+pkt_t *pkt_queue_reserve (pkt_queue_t *queue);
+void pkt_queue_commit (pkt_queue_t *queue, uint16_t source, uint16_t dest, size_t len);
+bool pkt_queue_append (pkt_queue_t *queue,
+		       uint16_t source, uint16_t dest, const char *payload, size_t len);
+pkt_t *pkt_queue_first (pkt_queue_t *queue);
+void pkt_queue_remove_first (pkt_queue_t *queue);
+size_t pkt_queue_length (const pkt_queue_t *queue);
+size_t pkt_queue_size (const pkt_queue_t *queue);
+int64_t pkt_queue_pack (pkt_queue_t *queue, const serial_port_t *port, int64_t now);
+int64_t pkt_queue_send (pkt_queue_t *queue, serial_port_t *port, int64_t now);
+int64_t pkt_queue_now_usec (void);
 
 #endif
@@ -0,0 +1,76 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include "realtime.h"
+
+void realtime_init (realtime_t *rt)
+{
+  rt->cpu = -1;
+  rt->priority = -1;
+  rt->lock_memory = -1;
+}
+
+/* Apply RT to the calling thread.  Returns the number of settings that
+   didn't take. */
+int realtime_enter (const realtime_t *rt)
+{
+  int missed = 0;
+
+#ifdef __linux__
+  if (rt->cpu >= 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO (&set);
+      CPU_SET (rt->cpu, &set);
+      if (sched_setaffinity (0, sizeof(set), &set) < 0)
+	{
+	  perror ("pin to a CPU");
+	  missed ++;
+	}
+    }
+
+  if (rt->priority >= 0)
+    {
+      struct sched_param param;
+      memset (&param, 0, sizeof(param));
+      param.sched_priority = rt->priority;
+      if (sched_setscheduler (0, SCHED_FIFO, &param) < 0)
+	{
+	  perror ("set SCHED_FIFO");
+	  missed ++;
+	}
+    }
+
+  /* Pages allocated later, as pools grow, are locked too. */
+  if (rt->lock_memory > 0 && mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+      perror ("mlockall");
+      missed ++;
+    }
+#else
+  missed = (rt->cpu >= 0) + (rt->priority >= 0) + (rt->lock_memory > 0);
+#endif
+  return missed;
+}
+
+/* Write RT into BUF as text, for the logs. */
+void realtime_describe (const realtime_t *rt, char *buf, size_t len)
+{
+  char cpu[16], priority[24];
+
+  if (rt->cpu >= 0)
+    snprintf (cpu, sizeof(cpu), "%d", rt->cpu);
+  else
+    strcpy (cpu, "any");
+  if (rt->priority >= 0)
+    snprintf (priority, sizeof(priority), "SCHED_FIFO %d", rt->priority);
+  else
+    strcpy (priority, "SCHED_OTHER");
+  snprintf (buf, len, "CPU %s, %s, memory %s", cpu, priority,
+	    rt->lock_memory > 0 ? "locked" : "not locked");
+}
@@ -0,0 +1,36 @@
+#ifndef U2S_REALTIME_H
+#define U2S_REALTIME_H
+
+/* Settings for a thread that must answer within a few milliseconds
+   however busy the machine is: pinned to one CPU, scheduled SCHED_FIFO
+   ahead of ordinary work, and with every page locked in memory so that
+   it never waits on a page fault.
+
+   Most of this needs root or CAP_SYS_NICE and CAP_IPC_LOCK.  It is
+   Linux-only; elsewhere nothing takes. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _realtime_t realtime_t;
+
+/* A setting of -1 leaves it alone. */
+struct _realtime_t
+{
+  int cpu;			/* the one CPU to run on */
+  int priority;			/* SCHED_FIFO priority, 1 to 99 */
+  int lock_memory;		/* 1 to mlockall */
+};
+
+void realtime_init (realtime_t *rt);
+int realtime_enter (const realtime_t *rt);
+void realtime_describe (const realtime_t *rt, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
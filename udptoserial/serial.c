@@ -7,18 +7,45 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #else
+#include <errno.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 #endif
 #include "serial.h"
 
+/* Apply TUNE's latency settings to the port, and print what it ended
+   up with.  Returns the number of settings that didn't take. */
+int serial_port_tune(serial_port_t *sp, const serial_tune_t *tune)
+{
+	serial_tune_t got;
+	char buf[128];
+	int missed;
+
+	if (sp == NULL)
+		return 0;
+#ifdef WIN32
+	serial_tune_init(&got);
+	missed = 0;
+#else
+	missed = serial_tune_apply(sp->handle, tune, &got);
+#endif
+	serial_tune_describe(&got, buf, sizeof(buf));
+	printf("    Latency: %s\n", buf);
+	if (missed > 0)
+	{
+		serial_tune_describe(tune, buf, sizeof(buf));
+		printf("    %d latency settings didn't take; wanted %s\n", missed, buf);
+	}
+	return missed;
+}
+
 #ifdef WIN32
 static serial_port_t *serial_port_new_win32(const char *port_name);
 static void serial_perror(const char* str, int code);
 #else
 static serial_port_t *serial_port_new_linux(const char *port_name);
-static void serial_port_send_linux(const serial_port_t *sp, const char *buf, size_t len);
+static long serial_port_send_linux(const serial_port_t *sp, const char *buf, size_t len);
 #endif
 
 /* Open a serial port and find its output baud rate. */
@@ -331,7 +358,7 @@ int speed_to_bps(speed_t speed)
 #endif
 
 #ifdef WIN32
-static void serial_port_send_win32(const serial_port_t *sp, const char *buf, size_t len)
+static long serial_port_send_win32(const serial_port_t *sp, const char *buf, size_t len)
 {
 	DWORD  dNoOFBytestoWrite = len;              // No of bytes to write into the port
 	DWORD  dNoOfBytesWritten = 0;          // No of bytes written to the port
@@ -365,7 +392,7 @@ static void serial_port_send_win32(const serial_port_t *sp, const char *buf, siz
 			// Get and clear current errors on the port.
 			if (!ClearCommError(sp->handle, &dwErrors, &comStat))
 				// Report error in ClearCommError.
-				return;
+				return -1;
 
 			// Get error flags.
 			fDNS = dwErrors & CE_DNS;
@@ -379,7 +406,9 @@ static void serial_port_send_win32(const serial_port_t *sp, const char *buf, siz
 			fTXFULL = dwErrors & CE_TXFULL;
 			fOVERRUN = dwErrors & CE_OVERRUN;
 			fRXPARITY = dwErrors & CE_RXPARITY;
+			return -1;
 		}
+		len = dNoOfBytesWritten;
 	}
 
 #if 0
@@ -412,9 +441,12 @@ static void serial_port_send_win32(const serial_port_t *sp, const char *buf, siz
 									if (comStat.cbOutQue)
 										// comStat.cbOutQue bytes are awaiting transfer
 #endif
+	return (long)len;
 }
 #else
-static void serial_port_send_linux(const serial_port_t *sp, const char *buf, size_t len)
+/* Write up to LEN bytes to the serial port.  If the port is
+   non-blocking, it may take fewer, or none, with errno set to EAGAIN. */
+static long serial_port_send_linux(const serial_port_t *sp, const char *buf, size_t len)
 {
 	ssize_t bytes_written;
 
@@ -425,15 +457,13 @@ static void serial_port_send_linux(const serial_port_t *sp, const char *buf, siz
 		for (size_t i = 0; i < len; i ++)
 			putc(buf[i], stdout);
 		printf("\n");
+		return (long)len;
 	}
-	else
-	{
-		bytes_written = write (sp->handle, buf, len);
-		if (bytes_written < 0)
-		{
-			perror ("Writing to serial port");
-		}
-	}
+
+	bytes_written = write (sp->handle, buf, len);
+	if (bytes_written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		perror ("Writing to serial port");
+	return (long)bytes_written;
 }
 #endif
 
@@ -461,12 +491,13 @@ static void serial_perror(const char* str, int code)
 }
 #endif
 
-void serial_port_send(const serial_port_t *sp, const char *buf, size_t len)
+/* Returns the number of bytes written, or -1 on error. */
+long serial_port_send(const serial_port_t *sp, const char *buf, size_t len)
 {
 #ifdef WIN32
-	serial_port_send_win32(sp, buf, len);
+	return serial_port_send_win32(sp, buf, len);
 #else
-	serial_port_send_linux(sp, buf, len);
+	return serial_port_send_linux(sp, buf, len);
 #endif
 }
 
@@ -8,6 +8,7 @@
 #include <termios.h>
 #endif
 #include <stddef.h>
+#include "serial_tune.h"
 
 // ON 
 
@@ -45,6 +46,7 @@ int speed_to_bps(speed_t speed);
 
 serial_port_t *serial_port_new(const char *port_name);
 void serial_port_info(const serial_port_t *sp);
-void serial_port_send (const serial_port_t *port, const char *str, size_t len);
+int serial_port_tune(serial_port_t *sp, const serial_tune_t *tune);
+long serial_port_send (const serial_port_t *port, const char *str, size_t len);
 
 #endif
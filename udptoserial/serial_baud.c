@@ -0,0 +1,46 @@
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#endif
+
+#include "serial_baud.h"
+
+#if defined(__linux__) && defined(BOTHER)
+int serial_set_baud (int fd, unsigned baud)
+{
+  struct termios2 tio;
+
+  if (ioctl (fd, TCGETS2, &tio) < 0)
+    return -1;
+  tio.c_cflag &= ~CBAUD;
+  tio.c_cflag |= BOTHER;
+  tio.c_ospeed = baud;
+  /* Input at the same rate as output. */
+  tio.c_cflag &= ~(CBAUD << IBSHIFT);
+  tio.c_ispeed = baud;
+  return ioctl (fd, TCSETS2, &tio);
+}
+
+unsigned serial_get_baud (int fd)
+{
+  struct termios2 tio;
+
+  if (ioctl (fd, TCGETS2, &tio) < 0)
+    return 0;
+  return tio.c_ospeed;
+}
+#else
+int serial_set_baud (int fd, unsigned baud)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+unsigned serial_get_baud (int fd)
+{
+  errno = ENOSYS;
+  return 0;
+}
+#endif
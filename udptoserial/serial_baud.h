@@ -0,0 +1,30 @@
+#ifndef U2S_SERIAL_BAUD_H
+#define U2S_SERIAL_BAUD_H
+
+/* Baud rates for a serial port, any rate at all, not just the B9600
+   style constants that termios knows.  Many USB adapters, and most
+   UARTs with a fractional divider, can run at 250000 or 1000000 or
+   3000000, which is more than the standard rates offer.
+
+   On Linux this is done with termios2 and BOTHER, which lives in
+   <asm/termbits.h> and can't share a file with <termios.h>, so it has a
+   file of its own.  Elsewhere these fail with ENOSYS, and the caller
+   should fall back to the standard rates. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set FD's input and output rates to BAUD.  Returns 0, or -1 with errno
+   set.  The driver may round BAUD to what its divider can do; read it
+   back with serial_get_baud to see. */
+int serial_set_baud (int fd, unsigned baud);
+
+/* Return FD's output rate, or 0 with errno set if it can't be read. */
+unsigned serial_get_baud (int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#endif
+
+#include "serial_tune.h"
+
+void serial_tune_init (serial_tune_t *tune)
+{
+  tune->vmin = -1;
+  tune->vtime = -1;
+  tune->low_latency = -1;
+  tune->latency_timer = -1;
+}
+
+#ifdef __linux__
+/* FTDI adapters, and a few others, export their latency timer at
+   /sys/bus/usb-serial/devices/ttyUSBn/latency_timer.  Put the path for
+   FD's tty into BUF.  Returns 0, or -1 if FD isn't a tty. */
+static int latency_timer_path (int fd, char *buf, size_t len)
+{
+  char name[64];
+  const char *base;
+
+  if (ttyname_r (fd, name, sizeof(name)) != 0)
+    return -1;
+  base = strrchr (name, '/');
+  base = base ? base + 1 : name;
+  snprintf (buf, len, "/sys/bus/usb-serial/devices/%s/latency_timer", base);
+  return 0;
+}
+
+static int read_latency_timer (int fd)
+{
+  char path[128];
+  FILE *fp;
+  int val = -1;
+
+  if (latency_timer_path (fd, path, sizeof(path)) < 0)
+    return -1;
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return -1;
+  if (fscanf (fp, "%d", &val) != 1)
+    val = -1;
+  fclose (fp);
+  return val;
+}
+
+static int write_latency_timer (int fd, int msec)
+{
+  char path[128];
+  FILE *fp;
+  int ret;
+
+  if (latency_timer_path (fd, path, sizeof(path)) < 0)
+    return -1;
+  fp = fopen (path, "w");
+  if (fp == NULL)
+    return -1;
+  ret = fprintf (fp, "%d\n", msec);
+  if (fclose (fp) != 0)
+    ret = -1;
+  return ret < 0 ? -1 : 0;
+}
+#endif
+
+/* Read back what FD's port is actually using into GOT. */
+void serial_tune_query (int fd, serial_tune_t *got)
+{
+  serial_tune_init (got);
+#ifdef __linux__
+  struct termios tinfo;
+  struct serial_struct ss;
+
+  if (tcgetattr (fd, &tinfo) == 0)
+    {
+      got->vmin = tinfo.c_cc[VMIN];
+      got->vtime = tinfo.c_cc[VTIME];
+    }
+  /* USB serial drivers often don't do TIOCGSERIAL at all. */
+  if (ioctl (fd, TIOCGSERIAL, &ss) == 0)
+    got->low_latency = (ss.flags & ASYNC_LOW_LATENCY) != 0;
+  got->latency_timer = read_latency_timer (fd);
+#endif
+}
+
+/* Apply the settings in WANT to FD's port, and then read back what it
+   is using into GOT.  Returns the number of settings in WANT that
+   didn't take. */
+int serial_tune_apply (int fd, const serial_tune_t *want, serial_tune_t *got)
+{
+#ifdef __linux__
+  if (want->vmin >= 0 || want->vtime >= 0)
+    {
+      struct termios tinfo;
+      if (tcgetattr (fd, &tinfo) == 0)
+	{
+	  if (want->vmin >= 0)
+	    tinfo.c_cc[VMIN] = want->vmin;
+	  if (want->vtime >= 0)
+	    tinfo.c_cc[VTIME] = want->vtime;
+	  if (tcsetattr (fd, TCSANOW, &tinfo) < 0)
+	    perror ("set VMIN and VTIME");
+	}
+    }
+
+  if (want->low_latency >= 0)
+    {
+      struct serial_struct ss;
+      if (ioctl (fd, TIOCGSERIAL, &ss) == 0)
+	{
+	  if (want->low_latency)
+	    ss.flags |= ASYNC_LOW_LATENCY;
+	  else
+	    ss.flags &= ~ASYNC_LOW_LATENCY;
+	  if (ioctl (fd, TIOCSSERIAL, &ss) < 0)
+	    perror ("set ASYNC_LOW_LATENCY");
+	}
+    }
+
+  /* Only root, or a udev rule, can usually do this. */
+  if (want->latency_timer >= 0 && write_latency_timer (fd, want->latency_timer) < 0
+      && errno != ENOENT)
+    perror ("set latency_timer");
+#endif
+
+  serial_tune_query (fd, got);
+  return (want->vmin >= 0 && got->vmin != want->vmin)
+    + (want->vtime >= 0 && got->vtime != want->vtime)
+    + (want->low_latency >= 0 && got->low_latency != want->low_latency)
+    + (want->latency_timer >= 0 && got->latency_timer != want->latency_timer);
+}
+
+/* Write TUNE into BUF as text, for the logs. */
+void serial_tune_describe (const serial_tune_t *tune, char *buf, size_t len)
+{
+  char vmin[16], vtime[16], timer[16];
+
+  if (tune->vmin >= 0)
+    snprintf (vmin, sizeof(vmin), "%d", tune->vmin);
+  else
+    strcpy (vmin, "?");
+  if (tune->vtime >= 0)
+    snprintf (vtime, sizeof(vtime), "%d", tune->vtime);
+  else
+    strcpy (vtime, "?");
+  if (tune->latency_timer >= 0)
+    snprintf (timer, sizeof(timer), "%d ms", tune->latency_timer);
+  else
+    strcpy (timer, "n/a");
+  snprintf (buf, len, "VMIN %s, VTIME %s, low_latency %s, latency_timer %s",
+	    vmin, vtime,
+	    tune->low_latency < 0 ? "n/a" : tune->low_latency ? "on" : "off",
+	    timer);
+}
+
+/* Returns the number of bytes waiting in FD's tty output queue. */
+int serial_tty_outq (int fd)
+{
+#ifdef TIOCOUTQ
+  int n;
+  if (ioctl (fd, TIOCOUTQ, &n) == 0)
+    return n;
+#endif
+  return -1;
+}
+
+/* Returns 1 if the modem is asserting CTS on FD's port, 0 if not. */
+int serial_cts (int fd)
+{
+#ifdef TIOCMGET
+  int lines;
+  if (ioctl (fd, TIOCMGET, &lines) == 0)
+    return (lines & TIOCM_CTS) != 0;
+#endif
+  return -1;
+}
+
+/* Block until CTS changes on FD's port, then return it as serial_cts
+   does.  A signal or a close ends the wait early, with -1. */
+int serial_cts_wait (int fd)
+{
+#ifdef TIOCMIWAIT
+  if (ioctl (fd, TIOCMIWAIT, TIOCM_CTS) == 0)
+    return serial_cts (fd);
+#endif
+  return -1;
+}
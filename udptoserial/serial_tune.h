@@ -0,0 +1,53 @@
+#ifndef U2S_SERIAL_TUNE_H
+#define U2S_SERIAL_TUNE_H
+
+/* Latency settings for a serial port, applied when it is opened.
+
+   VMIN and VTIME decide when a blocking read returns.  ASYNC_LOW_LATENCY
+   asks the tty layer to push received bytes to readers right away
+   instead of from a worker.  USB adapters with an FTDI chip hold
+   received bytes for up to latency_timer milliseconds, 16 by default,
+   before sending a short packet to the host, and that is usually the
+   largest delay of all.
+
+   These are Linux-only.  Elsewhere they do nothing and read back as
+   unknown. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A setting of -1 leaves it alone when applying, and means unknown or
+   unsupported when reading back. */
+typedef struct _serial_tune_t serial_tune_t;
+
+struct _serial_tune_t
+{
+  int vmin;			/* characters */
+  int vtime;			/* tenths of a second */
+  int low_latency;		/* 1 on, 0 off */
+  int latency_timer;		/* milliseconds */
+};
+
+void serial_tune_init (serial_tune_t *tune);
+int serial_tune_apply (int fd, const serial_tune_t *want, serial_tune_t *got);
+void serial_tune_query (int fd, serial_tune_t *got);
+void serial_tune_describe (const serial_tune_t *tune, char *buf, size_t len);
+
+/* Once bytes are in the kernel's tty output queue they can't be
+   reordered or dropped, and with RTS/CTS flow control they can sit
+   there for as long as the modem holds CTS low.  These let a writer
+   see how deep that queue is and follow CTS, so that it only tops the
+   queue up a little at a time.  Each returns -1 where the port, or the
+   platform, can't say. */
+int serial_tty_outq (int fd);
+int serial_cts (int fd);
+int serial_cts_wait (int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
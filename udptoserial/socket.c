@@ -110,9 +110,15 @@ int udp_socket_try_bind(udp_socket_t *sock)
 	return 0;
 }
 
-int udp_socket_msgrecv(udp_socket_t *sock, pkt_queue_t **queue)
+/* Most datagrams read in one call, so that one busy port can't starve
+   the others. */
+#define UDP_SOCKET_RECV_BATCH (32)
+
+/* Read the datagrams waiting on SOCK straight into free slots of QUEUE.
+   If the queue is full, they are read and dropped.  */
+int udp_socket_msgrecv(udp_socket_t *sock, pkt_queue_t *queue)
 {
-	char buf[1500];
+	char scratch[PKT_QUEUE_PAYLOAD_MAX];
 	struct sockaddr_in inaddr;
 #ifdef WIN32
 	int addrlen;
@@ -122,53 +128,56 @@ int udp_socket_msgrecv(udp_socket_t *sock, pkt_queue_t **queue)
 	ssize_t bytes_received;
 #endif
 
-	buf[0] = '\0';
-	addrlen = sizeof(inaddr);
-#ifdef WIN32
-	u_long count = 0;
-	int ret = ioctlsocket(sock->handle, FIONREAD, &count);
-	if (count > 0)
+	for (int i = 0; i < UDP_SOCKET_RECV_BATCH; i++)
 	{
-		bytes_received = recvfrom(sock->handle, buf, 1500, 0 /* = read */,
+		pkt_t *pkt = pkt_queue_reserve(queue);
+		char *buf = pkt ? pkt->data : scratch;
+
+		addrlen = sizeof(inaddr);
+#ifdef WIN32
+		u_long count = 0;
+		int ret = ioctlsocket(sock->handle, FIONREAD, &count);
+		if (count == 0)
+			break;
+		bytes_received = recvfrom(sock->handle, buf, PKT_QUEUE_PAYLOAD_MAX, 0 /* = read */,
 			(struct sockaddr *)&inaddr, &addrlen);
-	}
-	else
-		bytes_received = 0;
 #else
-	bytes_received = recvfrom(sock->handle, (void *)buf, 1500, 0 /* = read */,
-		(struct sockaddr *)&inaddr, &addrlen);
+		bytes_received = recvfrom(sock->handle, (void *)buf, PKT_QUEUE_PAYLOAD_MAX, 0 /* = read */,
+			(struct sockaddr *)&inaddr, &addrlen);
 #endif
-	if (bytes_received < 0)
-	{
-#ifdef WIN32
-		int Errno = WSAGetLastError();
-		if (Errno != WSAEWOULDBLOCK)
+		if (bytes_received < 0)
 		{
-			wsock_perror("Reading socket", Errno);
-			sock->state = UDP_SOCKET_FAILED;
-			// _close(sock->handle);
-			return -1;
-		}
+#ifdef WIN32
+			int Errno = WSAGetLastError();
+			if (Errno != WSAEWOULDBLOCK)
+			{
+				wsock_perror("Reading socket", Errno);
+				sock->state = UDP_SOCKET_FAILED;
+				// _close(sock->handle);
+				return -1;
+			}
 #else
-		if (errno != EINTR && errno != EWOULDBLOCK)
+			if (errno != EINTR && errno != EWOULDBLOCK)
+			{
+				perror("reading socket");
+				sock->state = UDP_SOCKET_FAILED;
+				close(sock->handle);
+				return -1;
+			}
+#endif
+			break;
+		}
+		if (pkt == NULL)
 		{
-			perror("reading socket");
-			sock->state = UDP_SOCKET_FAILED;
-			close(sock->handle);
-			return -1;
+			queue->dropped++;
+			continue;
 		}
-#endif
-	}
-	else if (bytes_received > 0)
-	{
-		buf[bytes_received] = '\0';
 		/* Inaddr has the port of the source of the message.
-	   This socket is the port of the destination of the message.
-	   We package the ports and payload to the serial port queue. */
-		*queue = pkt_queue_append(*queue,
+		   This socket is the port of the destination of the message.
+		   We package the ports and payload to the serial port queue. */
+		pkt_queue_commit(queue,
 			ntohs(inaddr.sin_port),
 			ntohs(sock->name.sin_port),
-			buf,
 			bytes_received);
 	}
 	return 0;
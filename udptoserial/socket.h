@@ -42,7 +42,7 @@ struct _udp_socket_t
 void udp_socket_assign_port (udp_socket_t *sock, uint16_t port);
 int udp_socket_try_create (udp_socket_t *sock);
 int udp_socket_try_bind (udp_socket_t *sock);
-int udp_socket_msgrecv(udp_socket_t *sock, pkt_queue_t **queue);
+int udp_socket_msgrecv(udp_socket_t *sock, pkt_queue_t *queue);
 int udp_socket_try_close(udp_socket_t *sock);
 
 #endif
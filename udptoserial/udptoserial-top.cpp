@@ -0,0 +1,376 @@
+// UDPTOSERIAL-TOP - shows what udptoserial is doing, from its metrics
+// socket: rates on the link by direction and kind of frame, frames thrown
+// away, how long frames wait for the serial port, and the busiest flows.
+//
+// It reads the socket every INTERVAL seconds and shows the difference
+// from the time before, so everything is a rate over the last interval.
+// When the output isn't a terminal, each screen is just printed after
+// the last, which suits logging it to a file.
+//
+// usage: udptoserial-top [socket [interval]]
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How many flows are listed.
+const static size_t TOP_FLOWS = 10;
+
+struct Sample
+{
+	std::string name;
+	std::map<std::string, std::string> labels;
+	double value;
+};
+
+// Every sample in a scrape, by the text that names it, labels and all.
+typedef std::map<std::string, Sample> Scrape;
+
+// Read everything the socket at PATH has to say into TEXT.
+static bool fetch(const char *path, std::string& text)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return false;
+	}
+	text.clear();
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+		if (n > 0)
+			text.append(buf, n);
+	close(fd);
+	return n == 0;
+}
+
+// Given LINE, one sample in Prometheus's text format, fill in S and KEY.
+static bool parse_sample(const std::string& line, std::string& key, Sample& s)
+{
+	size_t space = line.rfind(' ');
+	if (space == std::string::npos || line.empty() || line[0] == '#')
+		return false;
+	key = line.substr(0, space);
+	s.value = strtod(line.c_str() + space + 1, NULL);
+	s.labels.clear();
+	size_t brace = key.find('{');
+	s.name = key.substr(0, brace);
+	if (brace == std::string::npos)
+		return true;
+
+	size_t i = brace + 1;
+	while (i < key.size() && key[i] != '}')
+	{
+		size_t eq = key.find('=', i);
+		if (eq == std::string::npos || eq + 1 >= key.size() || key[eq + 1] != '"')
+			return false;
+		std::string name = key.substr(i, eq - i);
+		std::string value;
+		for (i = eq + 2; i < key.size() && key[i] != '"'; i++)
+		{
+			if (key[i] == '\\' && i + 1 < key.size())
+			{
+				i++;
+				value.push_back(key[i] == 'n' ? '\n' : key[i]);
+			}
+			else
+				value.push_back(key[i]);
+		}
+		s.labels[name] = value;
+		i++;
+		if (i < key.size() && key[i] == ',')
+			i++;
+	}
+	return true;
+}
+
+static Scrape parse(const std::string& text)
+{
+	Scrape scrape;
+	size_t start = 0;
+	while (start < text.size())
+	{
+		size_t end = text.find('\n', start);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string key;
+		Sample s;
+		if (parse_sample(text.substr(start, end - start), key, s))
+			scrape[key] = s;
+		start = end + 1;
+	}
+	return scrape;
+}
+
+typedef std::map<std::string, std::string> Labels;
+
+// Whether S has every label in WANT, with the same value.
+static bool matches(const Sample& s, const Labels& want)
+{
+	for (auto& l : want)
+	{
+		auto have = s.labels.find(l.first);
+		if (have == s.labels.end() || have->second != l.second)
+			return false;
+	}
+	return true;
+}
+
+// How much every counter called NAME with the labels in WANT went up
+// between the two scrapes, added up, per second.
+static double rate(const Scrape& now, const Scrape& before, double secs,
+	const char *name, const Labels& want = Labels())
+{
+	double delta = 0;
+	for (auto& kv : now)
+	{
+		if (kv.second.name != name || !matches(kv.second, want))
+			continue;
+		auto old = before.find(kv.first);
+		delta += kv.second.value - (old == before.end() ? 0 : old->second.value);
+	}
+	return secs > 0 ? delta / secs : 0;
+}
+
+static double gauge(const Scrape& now, const char *name, const Labels& want = Labels())
+{
+	double total = 0;
+	for (auto& kv : now)
+		if (kv.second.name == name && matches(kv.second, want))
+			total += kv.second.value;
+	return total;
+}
+
+// The upper bounds of histogram NAME's buckets, in the series with the
+// labels in WANT, each with how many values it had counted, in total, up
+// to it.
+static std::vector<std::pair<double, double>> buckets(const Scrape& scrape, const std::string& name,
+	const Labels& want)
+{
+	std::vector<std::pair<double, double>> out;
+	std::string bucket = name + "_bucket";
+	for (auto& kv : scrape)
+	{
+		if (kv.second.name != bucket || !matches(kv.second, want))
+			continue;
+		auto le = kv.second.labels.find("le");
+		if (le == kv.second.labels.end() || le->second == "+Inf")
+			continue;
+		out.push_back(std::make_pair(strtod(le->second.c_str(), NULL), kv.second.value));
+	}
+	std::sort(out.begin(), out.end());
+	return out;
+}
+
+// The Pth fraction of what histogram NAME, with the labels in WANT,
+// counted between the two scrapes, as the upper bound of its bucket, or
+// -1 if it counted nothing.  Only buckets with something in are listed, so a bucket
+// missing from BEFORE had as many as the one below it.
+static double percentile(const Scrape& now, const Scrape& before, const std::string& name, double p,
+	const Labels& want = Labels())
+{
+	auto cur = buckets(now, name, want);
+	auto old = buckets(before, name, want);
+	std::vector<double> counts;
+	size_t j = 0;
+	double old_cum = 0;
+	for (auto& b : cur)
+	{
+		while (j < old.size() && old[j].first <= b.first)
+			old_cum = old[j++].second;
+		counts.push_back(b.second - old_cum);
+	}
+	if (counts.empty() || counts.back() <= 0)
+		return -1;
+	double rank = p * counts.back();
+	for (size_t i = 0; i < counts.size(); i++)
+		if (counts[i] >= rank)
+			return cur[i].first;
+	return cur.back().first;
+}
+
+static std::string human(double v)
+{
+	char buf[32];
+	if (v >= 1e9)
+		snprintf(buf, sizeof(buf), "%.1fG", v / 1e9);
+	else if (v >= 1e6)
+		snprintf(buf, sizeof(buf), "%.1fM", v / 1e6);
+	else if (v >= 1e3)
+		snprintf(buf, sizeof(buf), "%.1fk", v / 1e3);
+	else
+		snprintf(buf, sizeof(buf), "%.0f", v);
+	return buf;
+}
+
+static std::string msec(double secs)
+{
+	char buf[32];
+	if (secs < 0)
+		return "-";
+	snprintf(buf, sizeof(buf), "%.2f ms", secs * 1000);
+	return buf;
+}
+
+static void show(const Scrape& now, const Scrape& before, double secs)
+{
+	static const char *const KINDS[] = { "mux", "udp", "udp_batch", "control", "ipv4" };
+	static const char *const DIRS[] = { "tx", "rx" };
+
+	printf("link        bytes/s  frames/s");
+	for (auto kind : KINDS)
+		printf(" %9s", kind);
+	printf("\n");
+	for (auto dir : DIRS)
+	{
+		printf("  %-8s %8s  %8s", dir,
+			human(rate(now, before, secs, "udptoserial_link_bytes_total", { { "direction", dir } })).c_str(),
+			human(rate(now, before, secs, "udptoserial_link_frames_total", { { "direction", dir } })).c_str());
+		for (auto kind : KINDS)
+			printf(" %9s", human(rate(now, before, secs, "udptoserial_link_frames_total",
+				{ { "direction", dir }, { "kind", kind } })).c_str());
+		printf("\n");
+	}
+
+	printf("\nqueued %s bytes, pacing at %s bytes/s, %.0f TCP connections, %.0f UDP sessions\n",
+		human(gauge(now, "udptoserial_serial_queue_bytes")).c_str(),
+		human(gauge(now, "udptoserial_pacing_rate_bytes")).c_str(),
+		gauge(now, "udptoserial_flows", { { "proto", "tcp" } }),
+		gauge(now, "udptoserial_flows", { { "proto", "udp" } }));
+
+	const char *sojourn = "udptoserial_serial_queue_sojourn_seconds";
+	printf("queue wait  p50 %s  p90 %s  p99 %s  max %s\n",
+		msec(percentile(now, before, sojourn, 0.5)).c_str(),
+		msec(percentile(now, before, sojourn, 0.9)).c_str(),
+		msec(percentile(now, before, sojourn, 0.99)).c_str(),
+		msec(percentile(now, before, sojourn, 1.0)).c_str());
+
+	// Where the time goes for each class of flow.  The link stage is only
+	// there when the far end stamps its frames.
+	static const char *const STAGES[] = { "queue", "write", "link" };
+	for (auto cls : { "tcp", "udp" })
+	{
+		printf("%s latency", cls);
+		for (auto stage : STAGES)
+		{
+			const char *latency = "udptoserial_latency_seconds";
+			Labels want = { { "stage", stage }, { "class", cls } };
+			printf("  %s p50 %s p99 %s", stage,
+				msec(percentile(now, before, latency, 0.5, want)).c_str(),
+				msec(percentile(now, before, latency, 0.99, want)).c_str());
+		}
+		printf("\n");
+	}
+
+	printf("thrown away");
+	bool any = false;
+	for (auto& kv : now)
+	{
+		const Sample& s = kv.second;
+		if ((s.name != "udptoserial_link_decode_errors_total" && s.name != "halfduplex_decode_errors_total")
+			|| s.value == 0)
+			continue;
+		auto old = before.find(kv.first);
+		double delta = s.value - (old == before.end() ? 0 : old->second.value);
+		printf("  %s %.0f (+%.0f)", s.labels.count("kind") ? s.labels.at("kind").c_str() : "?", s.value, delta);
+		any = true;
+	}
+	printf(any ? "\n" : "  nothing\n");
+
+	// Half-duplex links only move between states.
+	bool header = false;
+	for (auto& kv : now)
+	{
+		const Sample& s = kv.second;
+		if (s.name != "halfduplex_state_transitions_total" || s.value == 0)
+			continue;
+		if (!header)
+			printf("\nstate transitions\n");
+		header = true;
+		auto old = before.find(kv.first);
+		printf("  %-26s -> %-26s %8.0f (+%.0f)\n", s.labels.count("from") ? s.labels.at("from").c_str() : "?",
+			s.labels.count("to") ? s.labels.at("to").c_str() : "?", s.value,
+			s.value - (old == before.end() ? 0 : old->second.value));
+	}
+
+	struct Flow_rate
+	{
+		std::string proto;
+		std::string flow;
+		double tx;
+		double rx;
+	};
+	std::map<std::string, Flow_rate> flows;
+	for (auto& kv : now)
+	{
+		const Sample& s = kv.second;
+		if (s.name != "udptoserial_flow_bytes_total" || !s.labels.count("flow") || !s.labels.count("direction"))
+			continue;
+		auto old = before.find(kv.first);
+		double r = (s.value - (old == before.end() ? 0 : old->second.value)) / secs;
+		Flow_rate& f = flows[s.labels.at("proto") + " " + s.labels.at("flow")];
+		f.proto = s.labels.at("proto");
+		f.flow = s.labels.at("flow");
+		(s.labels.at("direction") == "tx" ? f.tx : f.rx) = r;
+	}
+	std::vector<Flow_rate> top;
+	for (auto& kv : flows)
+		top.push_back(kv.second);
+	std::sort(top.begin(), top.end(), [](const Flow_rate& a, const Flow_rate& b) { return a.tx + a.rx > b.tx + b.rx; });
+	if (top.size() > TOP_FLOWS)
+		top.resize(TOP_FLOWS);
+	printf("\n%-5s %-44s %9s %9s\n", "proto", "flow", "tx B/s", "rx B/s");
+	for (auto& f : top)
+		printf("%-5s %-44s %9s %9s\n", f.proto.c_str(), f.flow.c_str(), human(f.tx).c_str(), human(f.rx).c_str());
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "udptoserial.metrics";
+	double interval = argc > 2 ? atof(argv[2]) : 1.0;
+	if (interval <= 0)
+		interval = 1.0;
+	bool tty = isatty(STDOUT_FILENO);
+
+	std::string text;
+	Scrape before;
+	auto last = std::chrono::steady_clock::now();
+	if (fetch(path, text))
+		before = parse(text);
+	for (;;)
+	{
+		std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+		if (!fetch(path, text))
+		{
+			fprintf(stderr, "can't read metrics from %s: %s\n", path, strerror(errno));
+			return 1;
+		}
+		auto now = std::chrono::steady_clock::now();
+		Scrape scrape = parse(text);
+		if (tty)
+			printf("\033[H\033[2J");
+		show(scrape, before, std::chrono::duration<double>(now - last).count());
+		if (!tty)
+			printf("\n");
+		fflush(stdout);
+		before.swap(scrape);
+		last = now;
+	}
+}
@@ -0,0 +1,325 @@
+#include "uring.h"
+
+#ifdef U2S_HAVE_IO_URING
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* There's no glibc wrapper for these. */
+static int
+io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Set up RING with room for ENTRIES submissions.  Returns 0, or -1 with
+   errno set if the kernel can't. */
+int uring_init (uring_t *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset (ring, 0, sizeof(*ring));
+  memset (&p, 0, sizeof(p));
+  ring->fd = io_uring_setup (entries, &p);
+  if (ring->fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+      close (ring->fd);
+      errno = ENOSYS;
+      return -1;
+    }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* With a single mmap, both rings share one mapping. */
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+      int err = errno;
+      if (ring->sq_ring != MAP_FAILED)
+	munmap (ring->sq_ring, ring->sq_ring_size);
+      if (ring->sqes != MAP_FAILED)
+	munmap (ring->sqes, ring->sqes_size);
+      close (ring->fd);
+      errno = err;
+      return -1;
+    }
+  ring->cq_ring = ring->sq_ring;
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->sqe_tail = *ring->sq_tail;
+
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+/* Closing the ring cancels whatever is still in flight. */
+void uring_free (uring_t *ring)
+{
+  if (ring->br != NULL)
+    munmap (ring->br, ring->br_size);
+  free (ring->bufs);
+  munmap (ring->sqes, ring->sqes_size);
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+}
+
+/* Register LEN bytes at BUF as fixed buffer 0, so that writes from it
+   skip pinning and mapping the pages every time. */
+int uring_register_buffer (uring_t *ring, void *buf, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return io_uring_register (ring->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+/* Make room for COUNT fixed buffers, all empty, to be filled in one at
+   a time with uring_update_buffer.  Needs Linux 5.19. */
+int uring_register_sparse (uring_t *ring, unsigned count)
+{
+  struct io_uring_rsrc_register reg;
+
+  memset (&reg, 0, sizeof(reg));
+  reg.nr = count;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  return io_uring_register (ring->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg));
+}
+
+/* Register LEN bytes at BUF as fixed buffer INDEX, in a table made by
+   uring_register_sparse. */
+int uring_update_buffer (uring_t *ring, unsigned index, void *buf, size_t len)
+{
+  struct io_uring_rsrc_update2 up;
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset (&up, 0, sizeof(up));
+  up.offset = index;
+  up.data = (uint64_t) (uintptr_t) &iov;
+  up.nr = 1;
+  return io_uring_register (ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+}
+
+/* Give the kernel COUNT buffers of SIZE bytes, a power of two of them,
+   as buffer group 0.  A multishot receive takes one per datagram, and
+   hands it back with its completion. */
+int uring_provide_buffers (uring_t *ring, unsigned count, size_t size)
+{
+  struct io_uring_buf_reg reg;
+
+  ring->br_size = count * sizeof(struct io_uring_buf);
+  ring->br = mmap (NULL, ring->br_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->bufs = malloc (count * size);
+  if (ring->br == MAP_FAILED || ring->bufs == NULL)
+    {
+      if (ring->br != MAP_FAILED)
+	munmap (ring->br, ring->br_size);
+      ring->br = NULL;
+      free (ring->bufs);
+      ring->bufs = NULL;
+      errno = ENOMEM;
+      return -1;
+    }
+  ring->br_mask = count - 1;
+  ring->buf_size = size;
+
+  memset (&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) ring->br;
+  reg.ring_entries = count;
+  reg.bgid = 0;
+  if (io_uring_register (ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+
+  for (unsigned i = 0; i < count; i ++)
+    uring_recycle_buffer (ring, i);
+  return 0;
+}
+
+char *uring_buffer (uring_t *ring, unsigned bid)
+{
+  return ring->bufs + (size_t) bid * ring->buf_size;
+}
+
+/* Hand provided buffer BID back to the kernel. */
+void uring_recycle_buffer (uring_t *ring, unsigned bid)
+{
+  unsigned short tail = ring->br->tail;
+  struct io_uring_buf *buf = &ring->br->bufs[tail & ring->br_mask];
+
+  buf->addr = (uint64_t) (uintptr_t) uring_buffer (ring, bid);
+  buf->len = ring->buf_size;
+  buf->bid = bid;
+  __atomic_store_n (&ring->br->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/* Return an empty submission entry, submitting what is queued first if
+   the ring is full. */
+struct io_uring_sqe *uring_get_sqe (uring_t *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  if (ring->sqe_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+    uring_submit_and_wait (ring, 0);
+  sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  memset (sqe, 0, sizeof(*sqe));
+  ring->sq_array[ring->sqe_tail & ring->sq_mask] = ring->sqe_tail & ring->sq_mask;
+  ring->sqe_tail ++;
+  return sqe;
+}
+
+/* Receive datagrams on FD into provided buffers, one completion each,
+   until it is cancelled or fails.  MSG only gives the lengths of the
+   name and control parts, and must outlive the request. */
+void uring_prep_recvmsg_multishot (struct io_uring_sqe *sqe, int fd,
+				   struct msghdr *msg, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = tag;
+}
+
+/* Write LEN bytes at BUF, which is inside the registered buffer. */
+void uring_prep_write_fixed (struct io_uring_sqe *sqe, int fd,
+			     const void *buf, size_t len, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = (uint64_t) -1;	/* the current position, as for a tty */
+  sqe->buf_index = 0;
+  sqe->user_data = tag;
+}
+
+/* Read up to LEN bytes into BUF, which is inside fixed buffer INDEX. */
+void uring_prep_read_fixed (struct io_uring_sqe *sqe, int fd, void *buf,
+			    size_t len, unsigned index, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = (uint64_t) -1;
+  sqe->buf_index = index;
+  sqe->user_data = tag;
+}
+
+/* Read up to LEN bytes into BUF, which needn't be registered. */
+void uring_prep_read (struct io_uring_sqe *sqe, int fd, void *buf,
+		      size_t len, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = (uint64_t) -1;
+  sqe->user_data = tag;
+}
+
+/* Write the COUNT pieces at IOV, in one go.  IOV only has to last until
+   the entry is submitted. */
+void uring_prep_writev (struct io_uring_sqe *sqe, int fd,
+			const struct iovec *iov, unsigned count, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) iov;
+  sqe->len = count;
+  sqe->off = (uint64_t) -1;
+  sqe->user_data = tag;
+}
+
+/* Cancel every request tagged TARGET.  Each still completes, with
+   -ECANCELED if it hadn't already. */
+void uring_prep_cancel (struct io_uring_sqe *sqe, uint64_t target, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = tag;
+}
+
+/* Complete, with -ETIME, once TS has passed. */
+void uring_prep_timeout (struct io_uring_sqe *sqe,
+			 struct __kernel_timespec *ts, uint64_t tag)
+{
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t) (uintptr_t) ts;
+  sqe->len = 1;
+  sqe->user_data = tag;
+}
+
+/* Submit everything prepared so far, and wait for at least WAIT_NR
+   completions, all in one system call.  Returns the number submitted,
+   or -1 with errno set; EINTR means a signal came first. */
+int uring_submit_and_wait (uring_t *ring, unsigned wait_nr)
+{
+  unsigned submit = ring->sqe_tail - *ring->sq_tail;
+  int ret;
+
+  __atomic_store_n (ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  ring->enters ++;
+  ret = io_uring_enter (ring->fd, submit, wait_nr,
+			wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  return ret;
+}
+
+/* Return the oldest completion not yet seen, or NULL. */
+struct io_uring_cqe *uring_peek_cqe (uring_t *ring)
+{
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen (uring_t *ring)
+{
+  __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+#endif
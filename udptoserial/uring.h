@@ -0,0 +1,104 @@
+#ifndef U2S_URING_H
+#define U2S_URING_H
+
+/* A small io_uring, driven by the raw system calls, for the io_uring
+   modes of the gateway and the daemon.  It does only what they need: a
+   submission and completion queue, registered buffers for serial reads
+   and writes, and a ring of provided buffers for multishot receives.
+
+   Multishot receives need Linux 6.0.  On anything older, or where the
+   header is missing, uring_init or the receive fails and the caller
+   stays with epoll.  Defining U2S_NO_IO_URING leaves it out. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__) && defined(__has_include) && !defined(U2S_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define U2S_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef U2S_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _uring_t uring_t;
+
+struct _uring_t
+{
+  int fd;
+
+  /* The submission queue.  SQE_TAIL runs ahead of *SQ_TAIL by the
+     entries that have been filled in but not yet submitted. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sqe_tail;
+  struct io_uring_sqe *sqes;
+
+  /* The completion queue. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  /* Provided buffers, in group 0. */
+  struct io_uring_buf_ring *br;
+  size_t br_size;
+  unsigned br_mask;
+  char *bufs;
+  size_t buf_size;
+
+  size_t enters;		/* io_uring_enter calls */
+};
+
+int uring_init (uring_t *ring, unsigned entries);
+void uring_free (uring_t *ring);
+int uring_register_buffer (uring_t *ring, void *buf, size_t len);
+int uring_register_sparse (uring_t *ring, unsigned count);
+int uring_update_buffer (uring_t *ring, unsigned index, void *buf, size_t len);
+int uring_provide_buffers (uring_t *ring, unsigned count, size_t size);
+char *uring_buffer (uring_t *ring, unsigned bid);
+void uring_recycle_buffer (uring_t *ring, unsigned bid);
+
+struct io_uring_sqe *uring_get_sqe (uring_t *ring);
+void uring_prep_recvmsg_multishot (struct io_uring_sqe *sqe, int fd,
+				   struct msghdr *msg, uint64_t tag);
+void uring_prep_write_fixed (struct io_uring_sqe *sqe, int fd,
+			     const void *buf, size_t len, uint64_t tag);
+void uring_prep_read_fixed (struct io_uring_sqe *sqe, int fd, void *buf,
+			    size_t len, unsigned index, uint64_t tag);
+void uring_prep_read (struct io_uring_sqe *sqe, int fd, void *buf,
+		      size_t len, uint64_t tag);
+void uring_prep_writev (struct io_uring_sqe *sqe, int fd,
+			const struct iovec *iov, unsigned count, uint64_t tag);
+void uring_prep_cancel (struct io_uring_sqe *sqe, uint64_t target, uint64_t tag);
+void uring_prep_timeout (struct io_uring_sqe *sqe,
+			 struct __kernel_timespec *ts, uint64_t tag);
+
+int uring_submit_and_wait (uring_t *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe (uring_t *ring);
+void uring_cqe_seen (uring_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif